@@ -87,6 +87,23 @@ struct fuse_operations
         unsigned int flags, void *data);
     int (*poll)(const char *path, struct fuse_file_info *fi,
         struct fuse_pollhandle *ph, unsigned *reventsp);
+    int (*write_buf)(const char *path, struct fuse_bufvec *buf, fuse_off_t off,
+        struct fuse_file_info *fi);
+    int (*read_buf)(const char *path, struct fuse_bufvec **bufp,
+        size_t size, fuse_off_t off, struct fuse_file_info *fi);
+    /* FUSE 2.9 members; present for layout compatibility, not used by WinFsp */
+    int (*flock)(const char *path, struct fuse_file_info *fi, int op);
+    int (*fallocate)(const char *path, int mode, fuse_off_t off, fuse_off_t len,
+        struct fuse_file_info *fi);
+    /*
+     * WinFsp extension (follows all upstream members): readdir that may skip non-matches.
+     * The pattern has Windows wildcard semantics and is matched case-insensitively: '*'
+     * matches any sequence of characters (including '.'), '?' matches one character.
+     * Patterns with the DOS wildcards '<', '>' or '"' are not passed; readdir is used instead.
+     * Returning entries that do not match is allowed; they are filtered again.
+     */
+    int (*readdir_pattern)(const char *path, const char *pattern,
+        void *buf, fuse_fill_dir_t filler, fuse_off_t off, struct fuse_file_info *fi);
 };
 
 struct fuse_context
@@ -86,6 +86,49 @@ struct fuse_session;
 struct fuse_chan;
 struct fuse_pollhandle;
 
+/*
+ * Generic data buffers (read_buf/write_buf).
+ *
+ * A buffer is either memory or a file descriptor. File descriptor buffers are
+ * accessed through the buf_pread/buf_pwrite functions of the FUSE environment;
+ * when the environment does not provide them (native Windows), only memory
+ * buffers are supported.
+ */
+enum fuse_buf_flags
+{
+    FUSE_BUF_IS_FD                      = (1 << 1),
+    FUSE_BUF_FD_SEEK                    = (1 << 2),
+    FUSE_BUF_FD_RETRY                   = (1 << 3),
+};
+
+enum fuse_buf_copy_flags
+{
+    FUSE_BUF_NO_SPLICE                  = (1 << 1),
+    FUSE_BUF_FORCE_SPLICE               = (1 << 2),
+    FUSE_BUF_SPLICE_MOVE                = (1 << 3),
+    FUSE_BUF_SPLICE_NONBLOCK            = (1 << 4),
+};
+
+struct fuse_buf
+{
+    size_t size;
+    enum fuse_buf_flags flags;
+    void *mem;
+    int fd;
+    fuse_off_t pos;
+};
+
+struct fuse_bufvec
+{
+    size_t count;
+    size_t idx;
+    size_t off;
+    struct fuse_buf buf[1];
+};
+
+#define FUSE_BUFVEC_INIT(size__)        \
+    ((struct fuse_bufvec){ 1, 0, 0, { { (size__), (enum fuse_buf_flags)0, 0, -1, 0 } } })
+
 FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_version)(struct fsp_fuse_env *env);
 FSP_FUSE_API struct fuse_chan *FSP_FUSE_API_NAME(fsp_fuse_mount)(struct fsp_fuse_env *env,
     const char *mountpoint, struct fuse_args *args);
@@ -96,6 +139,10 @@ FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_parse_cmdline)(struct fsp_fuse_env *
     char **mountpoint, int *multithreaded, int *foreground);
 FSP_FUSE_API int32_t FSP_FUSE_API_NAME(fsp_fuse_ntstatus_from_errno)(struct fsp_fuse_env *env,
     int err);
+FSP_FUSE_API size_t FSP_FUSE_API_NAME(fsp_fuse_buf_size)(struct fsp_fuse_env *env,
+    const struct fuse_bufvec *bufv);
+FSP_FUSE_API fuse_ssize_t FSP_FUSE_API_NAME(fsp_fuse_buf_copy)(struct fsp_fuse_env *env,
+    struct fuse_bufvec *dst, struct fuse_bufvec *src, enum fuse_buf_copy_flags flags);
 
 FSP_FUSE_SYM(
 int fuse_version(void),
@@ -126,6 +173,21 @@ int fuse_parse_cmdline(struct fuse_args *args,
         (fsp_fuse_env(), args, mountpoint, multithreaded, foreground);
 })
 
+FSP_FUSE_SYM(
+size_t fuse_buf_size(const struct fuse_bufvec *bufv),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_buf_size)
+        (fsp_fuse_env(), bufv);
+})
+
+FSP_FUSE_SYM(
+fuse_ssize_t fuse_buf_copy(struct fuse_bufvec *dst, struct fuse_bufvec *src,
+    enum fuse_buf_copy_flags flags),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_buf_copy)
+        (fsp_fuse_env(), dst, src, flags);
+})
+
 FSP_FUSE_SYM(
 void fuse_pollhandle_destroy(struct fuse_pollhandle *ph),
 {
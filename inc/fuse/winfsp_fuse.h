@@ -76,6 +76,7 @@ typedef uint64_t fuse_ino_t;
 typedef uint32_t fuse_mode_t;
 typedef uint16_t fuse_nlink_t;
 typedef int64_t fuse_off_t;
+typedef intptr_t fuse_ssize_t;
 
 #if defined(_WIN64)
 typedef uint64_t fuse_fsblkcnt_t;
@@ -178,6 +179,8 @@ struct fuse_flock
         fsp_fuse_daemonize,             \
         fsp_fuse_set_signal_handlers,   \
         0/*conv_to_win_path*/,          \
+        0/*buf_pread*/,                 \
+        0/*buf_pwrite*/,                \
     }
 #else
 #define FSP_FUSE_ENV_INIT               \
@@ -187,6 +190,8 @@ struct fuse_flock
         fsp_fuse_daemonize,             \
         fsp_fuse_set_signal_handlers,   \
         0/*conv_to_win_path*/,          \
+        0/*buf_pread*/,                 \
+        0/*buf_pwrite*/,                \
     }
 #endif
 
@@ -198,6 +203,7 @@ struct fuse_flock
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <utime.h>
 
 #define fuse_uid_t                      uid_t
@@ -209,6 +215,7 @@ struct fuse_flock
 #define fuse_mode_t                     mode_t
 #define fuse_nlink_t                    nlink_t
 #define fuse_off_t                      off_t
+#define fuse_ssize_t                    ssize_t
 
 #define fuse_fsblkcnt_t                 fsblkcnt_t
 #define fuse_fsfilcnt_t                 fsfilcnt_t
@@ -229,6 +236,8 @@ struct fuse_flock
         fsp_fuse_daemonize,             \
         fsp_fuse_set_signal_handlers,   \
         fsp_fuse_conv_to_win_path,      \
+        fsp_fuse_buf_pread,             \
+        fsp_fuse_buf_pwrite,            \
     }
 
 /*
@@ -248,7 +257,9 @@ struct fsp_fuse_env
     int (*daemonize)(int);
     int (*set_signal_handlers)(void *);
     char *(*conv_to_win_path)(const char *);
-    void (*reserved[3])();
+    fuse_ssize_t (*buf_pread)(int, void *, size_t, fuse_off_t);
+    fuse_ssize_t (*buf_pwrite)(int, const void *, size_t, fuse_off_t);
+    void (*reserved[1])();
 };
 
 FSP_FUSE_API void FSP_FUSE_API_NAME(fsp_fuse_signal_handler)(int sig);
@@ -359,6 +370,18 @@ static inline char *fsp_fuse_conv_to_win_path(const char *path)
         0/*CCP_POSIX_TO_WIN_A*/ | 0x100/*CCP_RELATIVE*/,
         path);
 }
+
+static inline fuse_ssize_t fsp_fuse_buf_pread(int fd, void *buf, size_t size, fuse_off_t off)
+{
+    ssize_t bytes = 0 <= off ? pread(fd, buf, size, off) : read(fd, buf, size);
+    return -1 != bytes ? bytes : -errno;
+}
+
+static inline fuse_ssize_t fsp_fuse_buf_pwrite(int fd, const void *buf, size_t size, fuse_off_t off)
+{
+    ssize_t bytes = 0 <= off ? pwrite(fd, buf, size, off) : write(fd, buf, size);
+    return -1 != bytes ? bytes : -errno;
+}
 #endif
 
 
@@ -119,6 +119,7 @@ enum
     FspFsctlIrpCapacityMinimum = 100,
     FspFsctlIrpCapacityMaximum = 1000,
     FspFsctlIrpCapacityDefault = 1000,
+    FspFsctlCacheCapacityMaximum = 1000,
 };
 typedef struct
 {
@@ -133,7 +134,7 @@ typedef struct
     UINT32 TransactTimeout;             /* FSP_FSCTL_TRANSACT timeout (millis; 1 sec - 10 sec) */
     UINT32 IrpTimeout;                  /* pending IRP timeout (millis; 1 min - 10 min) */
     UINT32 IrpCapacity;                 /* maximum number of pending IRP's (100 - 1000)*/
-    UINT32 FileInfoTimeout;             /* FileInfo/Security/VolumeInfo timeout (millis) */
+    UINT32 FileInfoTimeout;             /* FileInfo timeout; default for other caches (millis) */
     /* FILE_FS_ATTRIBUTE_INFORMATION::FileSystemAttributes */
     UINT32 CaseSensitiveSearch:1;       /* file system supports case-sensitive file names */
     UINT32 CasePreservedNames:1;        /* file system preserves the case of file names */
@@ -149,14 +150,41 @@ typedef struct
     UINT32 PostCleanupWhenModifiedOnly:1;   /* post Cleanup when a file was modified/deleted */
     UINT32 PassQueryDirectoryPattern:1;     /* pass Pattern during QueryDirectory operations */
     UINT32 AlwaysUseDoubleBuffering:1;
-    UINT32 KmReservedFlags:3;
+    UINT32 PrimeFileInfoFromDirInfo:1;      /* answer attribute queries of listed names from DirInfo */
+    UINT32 KmReservedFlags:2;
     /* user-mode flags */
     UINT32 UmFileContextIsUserContext2:1;   /* user mode: FileContext parameter is UserContext2 */
     UINT32 UmFileContextIsFullContext:1;    /* user mode: FileContext parameter is FullContext */
     UINT32 UmReservedFlags:14;
     WCHAR Prefix[FSP_FSCTL_VOLUME_PREFIX_SIZE / sizeof(WCHAR)]; /* UNC prefix (\Server\Share) */
     WCHAR FileSystemName[FSP_FSCTL_VOLUME_FSNAME_SIZE / sizeof(WCHAR)];
+    /* process buffers */
+    UINT32 ProcessBufferCapacity;       /* pooled I/O buffers per size class (0: default; max 1024) */
+    /* data ring */
+    UINT32 DataRingSize;                /* Read/Write payload ring size (0: off; max 16MB; SeLockMemoryPrivilege) */
+    /* per-class cache timeouts and capacities */
+    UINT32 VolumeInfoTimeoutValid:1;    /* use VolumeInfoTimeout instead of FileInfoTimeout */
+    UINT32 DirInfoTimeoutValid:1;       /* use DirInfoTimeout instead of FileInfoTimeout */
+    UINT32 SecurityTimeoutValid:1;      /* use SecurityTimeout instead of FileInfoTimeout */
+    UINT32 StreamInfoTimeoutValid:1;    /* use StreamInfoTimeout instead of FileInfoTimeout */
+    UINT32 CacheReservedFlags:28;
+    UINT32 VolumeInfoTimeout;           /* VolumeInfo timeout (millis) */
+    UINT32 DirInfoTimeout;              /* DirInfo and negative name timeout (millis) */
+    UINT32 SecurityTimeout;             /* Security timeout (millis) */
+    UINT32 StreamInfoTimeout;           /* StreamInfo timeout (millis) */
+    UINT32 FileInfoTimeoutMax;          /* adaptive FileInfo timeout limit (millis; 0: not adaptive) */
+    UINT32 SecurityCacheCapacity;       /* cached security descriptors (0: default; max 1000) */
+    UINT32 DirInfoCacheCapacity;        /* cached directory listings (0: default; max 1000) */
+    UINT32 StreamInfoCacheCapacity;     /* cached stream listings (0: default; max 1000) */
 } FSP_FSCTL_VOLUME_PARAMS;
+/*
+ * New VolumeParams fields are only ever appended. The FSD accepts any VolumeParams size
+ * from the V0 size (up to and including FileSystemName) to the current size and treats
+ * the missing fields as zero, so that older DLL's and statically linked file systems
+ * continue to work.
+ */
+#define FSP_FSCTL_VOLUME_PARAMS_V0_SIZE \
+    FIELD_OFFSET(FSP_FSCTL_VOLUME_PARAMS, ProcessBufferCapacity)
 typedef struct
 {
     UINT64 TotalSize;
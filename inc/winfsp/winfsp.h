@@ -95,6 +95,8 @@ typedef NTSTATUS FSP_FILE_SYSTEM_OPERATION_GUARD(FSP_FILE_SYSTEM *,
     FSP_FSCTL_TRANSACT_REQ *, FSP_FSCTL_TRANSACT_RSP *);
 typedef NTSTATUS FSP_FILE_SYSTEM_OPERATION(FSP_FILE_SYSTEM *,
     FSP_FSCTL_TRANSACT_REQ *, FSP_FSCTL_TRANSACT_RSP *);
+typedef NTSTATUS FSP_FILE_SYSTEM_TRANSACT(FSP_FILE_SYSTEM *,
+    PVOID, SIZE_T, PVOID, SIZE_T *, BOOLEAN);
 /**
  * User mode file system locking strategy.
  *
@@ -118,12 +120,34 @@ typedef NTSTATUS FSP_FILE_SYSTEM_OPERATION(FSP_FILE_SYSTEM *,
  * 2. A coarse-grained concurrency model where all file system accesses are
  * guarded by a mutually exclusive lock.
  *
+ * 3. An epoch-based concurrency model that guards the same operations as the
+ * fine-grained model, but where SHRD operations do not touch a shared lock.
+ * Instead every SHRD operation announces itself in a per-thread slot (on its
+ * own cache line) and EXCL operations wait for all announced operations to
+ * drain. SHRD operations are therefore very cheap, while EXCL operations are
+ * expensive. This model is intended for read-only or read-mostly volumes with
+ * many dispatcher threads, where the cache line of the exclusive-shared lock
+ * becomes a point of contention.
+ *
+ * 4. A striped concurrency model that guards the same operations as the
+ * fine-grained model, but uses a set of locks (stripes) selected by a hash of
+ * the affected directory paths instead of a single lock. An operation locks the
+ * directories above its path SHRD and the directory it reads or changes SHRD or
+ * EXCL as appropriate. Thus creates, deletes and renames in different directories
+ * can proceed concurrently, while an operation cannot overlap with a conflicting
+ * change of any of its directories. Operations that do not carry a path lock
+ * all stripes (ReadDirectory, GetVolumeInfo, SetVolumeLabel, Flush(Volume)) or
+ * the stripe of their file (Overwrite). The file system must be able to handle
+ * concurrent namespace operations on different directories.
+ *
  * @see FspFileSystemSetOperationGuardStrategy
  */
 typedef enum
 {
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE = 0,
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE,
+    FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_EPOCH,
+    FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED,
 } FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY;
 enum
 {
@@ -460,7 +484,8 @@ typedef struct _FSP_FILE_SYSTEM_INTERFACE
      *     from this call. This information includes file attributes, file times, etc. Used when
      *     flushing file (not volume).
      * @return
-     *     STATUS_SUCCESS or error code.
+     *     STATUS_SUCCESS or error code. STATUS_PENDING is supported allowing for asynchronous
+     *     operation.
      */
     NTSTATUS (*Flush)(FSP_FILE_SYSTEM *FileSystem,
         PVOID FileContext,
@@ -829,6 +854,14 @@ typedef struct _FSP_FILE_SYSTEM
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY OpGuardStrategy;
     SRWLOCK OpGuardLock;
     BOOLEAN UmFileContextIsUserContext2, UmFileContextIsFullContext;
+    ULONG DispatcherBatchCount;
+    FSP_FILE_SYSTEM_TRANSACT *Transact;
+    PVOID Latency;
+    ULONG DispatcherThreadCountMax, DispatcherIdleTimeout;
+    PVOID DispatcherPool;
+    PVOID TraverseCheckCache;
+    PVOID OpGuardEpoch;
+    PVOID OpGuardStripes;
 } FSP_FILE_SYSTEM;
 typedef struct _FSP_FILE_SYSTEM_OPERATION_CONTEXT
 {
@@ -912,6 +945,10 @@ FSP_API VOID FspFileSystemRemoveMountPoint(FSP_FILE_SYSTEM *FileSystem);
  * file system. Once this call starts executing the user mode file system will start receiving
  * file system requests from the kernel.
  *
+ * If a maximum thread count has been set with FspFileSystemSetDispatcherThreadCountMax, the
+ * dispatcher will grow beyond ThreadCount when all of its threads are busy processing requests
+ * and will shrink back to ThreadCount when the additional threads become idle.
+ *
  * @param FileSystem
  *     The file system object.
  * @param ThreadCount
@@ -919,6 +956,8 @@ FSP_API VOID FspFileSystemRemoveMountPoint(FSP_FILE_SYSTEM *FileSystem);
  *     number of threads and should be chosen in most cases.
  * @return
  *     STATUS_SUCCESS or error code.
+ * @see
+ *     FspFileSystemSetDispatcherThreadCountMax
  */
 FSP_API NTSTATUS FspFileSystemStartDispatcher(FSP_FILE_SYSTEM *FileSystem, ULONG ThreadCount);
 /**
@@ -928,6 +967,31 @@ FSP_API NTSTATUS FspFileSystemStartDispatcher(FSP_FILE_SYSTEM *FileSystem, ULONG
  *     The file system object.
  */
 FSP_API VOID FspFileSystemStopDispatcher(FSP_FILE_SYSTEM *FileSystem);
+typedef struct
+{
+    ULONG ThreadCount;                  /* current number of dispatcher threads */
+    ULONG BusyThreadCount;              /* threads currently processing requests */
+    ULONG ThreadCountMin;
+    ULONG ThreadCountMax;
+    ULONG ThreadCountPeak;
+    UINT64 ThreadCreateCount;           /* threads added because the dispatcher was saturated */
+    UINT64 ThreadCreateFailCount;
+    UINT64 ThreadExitCount;             /* threads removed because they were idle */
+    UINT64 SaturationCount;             /* times that all dispatcher threads became busy */
+} FSP_FILE_SYSTEM_DISPATCHER_STATISTICS;
+/**
+ * Get file system dispatcher statistics.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param Statistics [out]
+ *     Pointer to a structure that will receive the dispatcher statistics.
+ * @return
+ *     STATUS_SUCCESS or error code. STATUS_INVALID_DEVICE_STATE is returned if the dispatcher
+ *     has never been started.
+ */
+FSP_API NTSTATUS FspFileSystemGetDispatcherStatistics(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_STATISTICS *Statistics);
 /**
  * Send a response to the FSD.
  *
@@ -937,6 +1001,7 @@ FSP_API VOID FspFileSystemStopDispatcher(FSP_FILE_SYSTEM *FileSystem);
  * <ul>
  * <li>Read</li>
  * <li>Write</li>
+ * <li>Flush</li>
  * <li>ReadDirectory</li>
  * </ul>
  *
@@ -961,6 +1026,99 @@ FSP_API VOID FspFileSystemSendResponse(FSP_FILE_SYSTEM *FileSystem,
  *     The current operation context.
  */
 FSP_API FSP_FILE_SYSTEM_OPERATION_CONTEXT *FspFileSystemGetOperationContext(VOID);
+/*
+ * Latency histograms
+ *
+ * The dispatcher records the latency of every request, from the time it is received
+ * from the FSD until its response is ready (or the operation returns STATUS_PENDING).
+ * Latencies are kept in log-linear buckets with FSP_FILE_SYSTEM_LATENCY_SUBBUCKET_COUNT
+ * sub-buckets per power of two, which gives a relative error of at most 12.5%.
+ */
+#define FSP_FILE_SYSTEM_LATENCY_SUBBUCKET_COUNT 8
+#define FSP_FILE_SYSTEM_LATENCY_BUCKET_COUNT    (42 * FSP_FILE_SYSTEM_LATENCY_SUBBUCKET_COUNT)
+typedef struct
+{
+    UINT64 Count;
+    UINT64 Sum;                         /* nanoseconds */
+    UINT64 Max;                         /* nanoseconds */
+    UINT64 Buckets[FSP_FILE_SYSTEM_LATENCY_BUCKET_COUNT];
+} FSP_FILE_SYSTEM_LATENCY_HISTOGRAM;
+/**
+ * Get a snapshot of the latency histogram of a file system operation.
+ *
+ * The snapshot combines the histograms of all dispatcher threads. It is taken without
+ * stopping the dispatcher and may therefore be slightly inconsistent.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param Kind
+ *     The operation kind (FspFsctlTransact*Kind).
+ * @param Histogram [out]
+ *     Pointer to a histogram that will receive the snapshot.
+ * @return
+ *     STATUS_SUCCESS or error code.
+ */
+FSP_API NTSTATUS FspFileSystemGetLatencyHistogram(FSP_FILE_SYSTEM *FileSystem,
+    ULONG Kind, FSP_FILE_SYSTEM_LATENCY_HISTOGRAM *Histogram);
+/**
+ * Record a latency value in a histogram.
+ *
+ * @param Histogram
+ *     The histogram.
+ * @param Latency
+ *     The latency in nanoseconds.
+ */
+FSP_API VOID FspFileSystemLatencyHistogramRecord(FSP_FILE_SYSTEM_LATENCY_HISTOGRAM *Histogram,
+    UINT64 Latency);
+/**
+ * Compute a percentile of a latency histogram.
+ *
+ * @param Histogram
+ *     The histogram.
+ * @param Percentile
+ *     The percentile in hundredths of a percent (e.g. 9990 for p99.9).
+ * @return
+ *     The latency in nanoseconds below which Percentile of the recorded values lie.
+ *     This is the upper bound of the bucket that contains the percentile.
+ */
+FSP_API UINT64 FspFileSystemLatencyHistogramPercentile(FSP_FILE_SYSTEM_LATENCY_HISTOGRAM *Histogram,
+    ULONG Percentile);
+/**
+ * Enable or disable the traverse check cache.
+ *
+ * When traverse checking is required, FspAccessCheckEx checks every directory along the path
+ * of a file for FILE_TRAVERSE access, which requires a GetSecurityByName call per directory.
+ * The traverse check cache remembers the results of these checks per directory and caller
+ * identity, so that opening files in deep directory trees does not have to repeat them.
+ *
+ * Cached results are invalidated when a directory is renamed or deleted, or when security
+ * or reparse points are changed through the file system operations. File systems whose
+ * security may change by other means should call FspFileSystemInvalidateTraverseCheckCache
+ * or choose a short timeout.
+ *
+ * This function must be called prior to FspFileSystemStartDispatcher.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param Timeout
+ *     The time in milliseconds that a cached result remains valid. A value of 0 disables
+ *     the cache (the default).
+ * @return
+ *     STATUS_SUCCESS or error code.
+ */
+FSP_API NTSTATUS FspFileSystemSetTraverseCheckCacheTimeout(FSP_FILE_SYSTEM *FileSystem,
+    ULONG Timeout);
+/**
+ * Invalidate the traverse check cache.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param FileName
+ *     The name of a directory whose cached results (and those of all directories below it)
+ *     should be discarded. A value of NULL discards all cached results.
+ */
+FSP_API VOID FspFileSystemInvalidateTraverseCheckCache(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName);
 static inline
 PWSTR FspFileSystemMountPoint(FSP_FILE_SYSTEM *FileSystem)
 {
@@ -1008,6 +1166,96 @@ VOID FspFileSystemSetOperationGuardStrategy(FSP_FILE_SYSTEM *FileSystem,
 {
     FileSystem->OpGuardStrategy = GuardStrategy;
 }
+/**
+ * Set the dispatcher batch count.
+ *
+ * By default every dispatcher thread retrieves a single request from the FSD, processes it
+ * and sends its response back during the next FSP_FSCTL_TRANSACT round-trip. When the batch
+ * count is greater than 1, dispatcher threads use FSP_FSCTL_TRANSACT_BATCH instead: they retrieve
+ * multiple requests per round-trip and return all their responses in a single round-trip.
+ *
+ * The request buffer is sized to hold at least BatchCount maximum size requests. The FSD packs
+ * requests according to their actual size, so a batch may contain more than BatchCount small
+ * requests; responses that do not fit in the response buffer are sent to the FSD early.
+ *
+ * This function must be called prior to FspFileSystemStartDispatcher.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param BatchCount
+ *     The number of requests to retrieve per round-trip. A value of 0 or 1 disables batching.
+ */
+static inline
+VOID FspFileSystemSetDispatcherBatchCount(FSP_FILE_SYSTEM *FileSystem,
+    ULONG BatchCount)
+{
+    FileSystem->DispatcherBatchCount = BatchCount;
+}
+/**
+ * Set the maximum number of dispatcher threads.
+ *
+ * By default the dispatcher uses a fixed number of threads. When a maximum thread count is set
+ * the dispatcher becomes adaptive: whenever a thread starts processing requests and finds that
+ * no other dispatcher thread is waiting for requests, a new thread is added (up to the maximum).
+ * Added threads exit after they have not received any requests for the idle timeout, so that
+ * the dispatcher shrinks back to the thread count passed to FspFileSystemStartDispatcher.
+ *
+ * This is useful for file systems whose operations may block for long periods of time (for
+ * example network file systems), where a fixed number of threads forces a choice between many
+ * idle threads and head-of-line blocking.
+ *
+ * This function must be called prior to FspFileSystemStartDispatcher.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param ThreadCountMax
+ *     The maximum number of dispatcher threads. A value of 0 (or one that is not greater than
+ *     the thread count passed to FspFileSystemStartDispatcher) disables the adaptive dispatcher.
+ * @param IdleTimeout
+ *     The time in milliseconds that an added thread may remain idle before it exits. A value of
+ *     0 selects a default. Idle threads notice their idleness when their FSP_FSCTL_TRANSACT
+ *     times out, so the effective timeout is rounded up to FSP_FSCTL_VOLUME_PARAMS::TransactTimeout.
+ */
+static inline
+VOID FspFileSystemSetDispatcherThreadCountMax(FSP_FILE_SYSTEM *FileSystem,
+    ULONG ThreadCountMax, ULONG IdleTimeout)
+{
+    FileSystem->DispatcherThreadCountMax = ThreadCountMax;
+    FileSystem->DispatcherIdleTimeout = IdleTimeout;
+}
+/**
+ * Set the dispatcher transact function.
+ *
+ * The dispatcher exchanges requests and responses with the FSD through FspFsctlTransact.
+ * This function allows the exchange to be intercepted; for example, to record or replay
+ * request streams. The transact function has the same semantics as FspFsctlTransact.
+ *
+ * This function must be called prior to FspFileSystemStartDispatcher.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param Transact
+ *     The transact function. A value of NULL restores the default (FspFsctlTransact).
+ */
+static inline
+VOID FspFileSystemSetTransact(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_TRANSACT *Transact)
+{
+    FileSystem->Transact = Transact;
+}
+static inline
+NTSTATUS FspFileSystemTransact(FSP_FILE_SYSTEM *FileSystem,
+    PVOID ResponseBuf, SIZE_T ResponseBufSize,
+    PVOID RequestBuf, SIZE_T *PRequestBufSize,
+    BOOLEAN Batch)
+{
+    if (0 == FileSystem->Transact)
+        return FspFsctlTransact(FileSystem->VolumeHandle,
+            ResponseBuf, ResponseBufSize, RequestBuf, PRequestBufSize, Batch);
+
+    return FileSystem->Transact(FileSystem,
+        ResponseBuf, ResponseBufSize, RequestBuf, PRequestBufSize, Batch);
+}
 static inline
 VOID FspFileSystemSetOperation(FSP_FILE_SYSTEM *FileSystem,
     ULONG Index,
@@ -1310,6 +1558,100 @@ FSP_API VOID FspFileSystemReadDirectoryBuffer(PVOID *PDirBuffer,
     PWSTR Marker,
     PVOID Buffer, ULONG Length, PULONG PBytesTransferred);
 FSP_API VOID FspFileSystemDeleteDirectoryBuffer(PVOID *PDirBuffer);
+/**
+ * Acquire a directory buffer that only stores entries that match a pattern.
+ *
+ * This function is similar to FspFileSystemAcquireDirectoryBuffer, except that entries that
+ * do not match Pattern are dropped by FspFileSystemFillDirectoryBuffer; they are never sorted
+ * and never returned by FspFileSystemReadDirectoryBuffer. This allows a file system that sets
+ * PassQueryDirectoryPattern to pass the ReadDirectory Pattern through, so that a wildcard
+ * query of a large directory transfers only the matching entries.
+ *
+ * Matching follows the FSD's wildcard rules (including the DOS wildcards) and is always
+ * case-insensitive, so the directory buffer may return entries that the FSD will filter out
+ * for a case-sensitive query. A directory buffer that was filled with a different pattern
+ * is always reset.
+ *
+ * @param PDirBuffer
+ *     Pointer to the directory buffer.
+ * @param Reset
+ *     TRUE to reset the directory buffer.
+ * @param Pattern
+ *     The ReadDirectory pattern. A value of NULL or "*" matches all entries.
+ * @param PResult [out]
+ *     Pointer to a memory location that will receive the operation result.
+ * @return
+ *     TRUE if the directory buffer was acquired and must be filled; FALSE if the directory
+ *     buffer can already satisfy the ReadDirectory or on error.
+ * @see
+ *     FspFileSystemAcquireDirectoryBuffer
+ */
+FSP_API BOOLEAN FspFileSystemAcquireDirectoryBufferEx(PVOID *PDirBuffer,
+    BOOLEAN Reset, PWSTR Pattern, PNTSTATUS PResult);
+/**
+ * Acquire a streaming directory buffer.
+ *
+ * A streaming directory buffer holds a bounded window of unsorted directory entries,
+ * so that a ReadDirectory operation can return the first entries of a large directory
+ * without first enumerating and sorting the whole directory. Each entry is filled together
+ * with a cookie that allows the file system to resume enumeration after that entry.
+ *
+ * Streaming directory buffers are read using FspFileSystemReadDirectoryBuffer and
+ * released/deleted using FspFileSystemReleaseDirectoryBuffer/FspFileSystemDeleteDirectoryBuffer.
+ *
+ * @param PDirBuffer
+ *     Pointer to the directory buffer.
+ * @param Marker
+ *     The ReadDirectory marker.
+ * @param WindowSize
+ *     Maximum size of the window of buffered directory entries.
+ * @param PCookie [out]
+ *     Pointer to a memory location that will receive the cookie at which the file system
+ *     should start enumerating directory entries. A value of 0 means the start of the directory.
+ * @param PResult [out]
+ *     Pointer to a memory location that will receive the operation result.
+ * @return
+ *     TRUE if the directory buffer was acquired and must be filled starting at *PCookie;
+ *     FALSE if the directory buffer can already satisfy the ReadDirectory or on error.
+ * @see
+ *     FspFileSystemFillStreamingDirectoryBuffer
+ */
+FSP_API BOOLEAN FspFileSystemAcquireStreamingDirectoryBuffer(PVOID *PDirBuffer,
+    PWSTR Marker, ULONG WindowSize, PUINT64 PCookie, PNTSTATUS PResult);
+/**
+ * Acquire a streaming directory buffer that only stores entries that match a pattern.
+ *
+ * This function is similar to FspFileSystemAcquireStreamingDirectoryBuffer, except that
+ * entries are filtered as described in FspFileSystemAcquireDirectoryBufferEx. Filtered out
+ * entries do not count against the window.
+ *
+ * @see
+ *     FspFileSystemAcquireStreamingDirectoryBuffer
+ *     FspFileSystemAcquireDirectoryBufferEx
+ */
+FSP_API BOOLEAN FspFileSystemAcquireStreamingDirectoryBufferEx(PVOID *PDirBuffer,
+    PWSTR Marker, PWSTR Pattern, ULONG WindowSize, PUINT64 PCookie, PNTSTATUS PResult);
+/**
+ * Fill a streaming directory buffer.
+ *
+ * @param PDirBuffer
+ *     Pointer to the directory buffer.
+ * @param DirInfo
+ *     The directory information to add.
+ * @param NextCookie
+ *     The cookie at which enumeration resumes after this entry. A value of 0 means that
+ *     enumeration cannot be resumed after this entry; the window is then allowed to grow
+ *     until an entry with a non-zero cookie has been filled.
+ * @param PResult [out]
+ *     Pointer to a memory location that will receive the operation result.
+ * @return
+ *     TRUE if the file system should continue enumerating directory entries; FALSE if the
+ *     window is full (PResult receives STATUS_SUCCESS) or on error.
+ * @see
+ *     FspFileSystemAcquireStreamingDirectoryBuffer
+ */
+FSP_API BOOLEAN FspFileSystemFillStreamingDirectoryBuffer(PVOID *PDirBuffer,
+    FSP_FSCTL_DIR_INFO *DirInfo, UINT64 NextCookie, PNTSTATUS PResult);
 
 /*
  * Security
@@ -76,6 +76,103 @@ public:
         CleanupSetLastWriteTime         = FspCleanupSetLastWriteTime,
         CleanupSetChangeTime            = FspCleanupSetChangeTime,
     };
+    class Completion
+    {
+        /*
+         * A Completion is obtained by calling BeginAsync from within Read, Write, Flush or
+         * ReadDirectory, which then return STATUS_PENDING. The operation's response is sent
+         * to the FSD when one of the Complete methods is called; this may happen from any
+         * thread. A Completion can be moved but not copied; it must be completed exactly once.
+         */
+    public:
+        Completion() : _FileSystem(0), _Hint(0), _Kind(0)
+        {
+        }
+        Completion(Completion &&Other) :
+            _FileSystem(Other._FileSystem), _Hint(Other._Hint), _Kind(Other._Kind)
+        {
+            Other._FileSystem = 0;
+        }
+        Completion &operator=(Completion &&Other)
+        {
+            if (this != &Other)
+            {
+                _FileSystem = Other._FileSystem;
+                _Hint = Other._Hint;
+                _Kind = Other._Kind;
+                Other._FileSystem = 0;
+            }
+            return *this;
+        }
+        Completion(const Completion &) = delete;
+        Completion &operator=(const Completion &) = delete;
+        BOOLEAN IsPending() const
+        {
+            return 0 != _FileSystem;
+        }
+        VOID CompleteRead(NTSTATUS Status, ULONG BytesTransferred)
+        {
+            FSP_FSCTL_TRANSACT_RSP Response;
+            Prepare(&Response, Status);
+            if (NT_SUCCESS(Status))
+                Response.IoStatus.Information = BytesTransferred;
+            Send(&Response);
+        }
+        VOID CompleteWrite(NTSTATUS Status, ULONG BytesTransferred, const FILE_INFO *FileInfo)
+        {
+            FSP_FSCTL_TRANSACT_RSP Response;
+            Prepare(&Response, Status);
+            if (NT_SUCCESS(Status))
+            {
+                Response.IoStatus.Information = BytesTransferred;
+                RtlCopyMemory(&Response.Rsp.Write.FileInfo, FileInfo, sizeof *FileInfo);
+            }
+            Send(&Response);
+        }
+        VOID CompleteFlush(NTSTATUS Status, const FILE_INFO *FileInfo)
+        {
+            FSP_FSCTL_TRANSACT_RSP Response;
+            Prepare(&Response, Status);
+            if (NT_SUCCESS(Status) && 0 != FileInfo)
+                RtlCopyMemory(&Response.Rsp.FlushBuffers.FileInfo, FileInfo, sizeof *FileInfo);
+            Send(&Response);
+        }
+        VOID CompleteReadDirectory(NTSTATUS Status, ULONG BytesTransferred)
+        {
+            FSP_FSCTL_TRANSACT_RSP Response;
+            Prepare(&Response, Status);
+            if (NT_SUCCESS(Status))
+                Response.IoStatus.Information = BytesTransferred;
+            Send(&Response);
+        }
+
+    private:
+        friend class FileSystem;
+        Completion(FSP_FILE_SYSTEM *FileSystem, const FSP_FSCTL_TRANSACT_REQ *Request) :
+            _FileSystem(FileSystem), _Hint(Request->Hint), _Kind(Request->Kind)
+        {
+        }
+        VOID Prepare(FSP_FSCTL_TRANSACT_RSP *Response, NTSTATUS Status)
+        {
+            RtlZeroMemory(Response, sizeof *Response);
+            Response->Size = sizeof *Response;
+            Response->Kind = _Kind;
+            Response->Hint = _Hint;
+            Response->IoStatus.Status = Status;
+        }
+        VOID Send(FSP_FSCTL_TRANSACT_RSP *Response)
+        {
+            if (0 == _FileSystem)
+                return;
+            FspFileSystemSendResponse(_FileSystem, Response);
+            _FileSystem = 0;
+        }
+
+    private:
+        FSP_FILE_SYSTEM *_FileSystem;
+        UINT64 _Hint;
+        UINT32 _Kind;
+    };
 
 public:
     /* ctor/dtor */
@@ -119,6 +216,30 @@ public:
     {
         _VolumeParams.FileInfoTimeout = FileInfoTimeout;
     }
+    VOID SetFileInfoTimeoutMax(UINT32 FileInfoTimeoutMax)
+    {
+        _VolumeParams.FileInfoTimeoutMax = FileInfoTimeoutMax;
+    }
+    VOID SetVolumeInfoTimeout(UINT32 VolumeInfoTimeout)
+    {
+        _VolumeParams.VolumeInfoTimeout = VolumeInfoTimeout;
+        _VolumeParams.VolumeInfoTimeoutValid = 1;
+    }
+    VOID SetDirInfoTimeout(UINT32 DirInfoTimeout)
+    {
+        _VolumeParams.DirInfoTimeout = DirInfoTimeout;
+        _VolumeParams.DirInfoTimeoutValid = 1;
+    }
+    VOID SetSecurityTimeout(UINT32 SecurityTimeout)
+    {
+        _VolumeParams.SecurityTimeout = SecurityTimeout;
+        _VolumeParams.SecurityTimeoutValid = 1;
+    }
+    VOID SetStreamInfoTimeout(UINT32 StreamInfoTimeout)
+    {
+        _VolumeParams.StreamInfoTimeout = StreamInfoTimeout;
+        _VolumeParams.StreamInfoTimeoutValid = 1;
+    }
     VOID SetCaseSensitiveSearch(BOOLEAN CaseSensitiveSearch)
     {
         _VolumeParams.CaseSensitiveSearch = !!CaseSensitiveSearch;
@@ -155,6 +276,10 @@ public:
     {
         _VolumeParams.PassQueryDirectoryPattern = !!PassQueryDirectoryPattern;
     }
+    VOID SetPrimeFileInfoFromDirInfo(BOOLEAN PrimeFileInfoFromDirInfo)
+    {
+        _VolumeParams.PrimeFileInfoFromDirInfo = !!PrimeFileInfoFromDirInfo;
+    }
     VOID SetPrefix(PWSTR Prefix)
     {
         int Size = lstrlenW(Prefix) * sizeof(WCHAR);
@@ -221,12 +346,32 @@ public:
         return _FileSystem;
     }
 
+    /* helpers: asynchronous operations */
+    Completion BeginAsync()
+    {
+        /*
+         * Must be called from the dispatcher thread that is executing Read, Write, Flush
+         * or ReadDirectory. The operation must then return STATUS_PENDING and must not
+         * access its request parameters other than Buffer after it returns (for example,
+         * ReadDirectory must copy Pattern and Marker if it needs them later).
+         */
+        FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext = FspFileSystemGetOperationContext();
+        if (0 == OperationContext || 0 == OperationContext->Request)
+            return Completion();
+        return Completion(_FileSystem, OperationContext->Request);
+    }
+
     /* helpers: directories/streams */
     static BOOLEAN AcquireDirectoryBuffer(PVOID *PDirBuffer,
         BOOLEAN Reset, PNTSTATUS PResult)
     {
         return FspFileSystemAcquireDirectoryBuffer(PDirBuffer, Reset, PResult);
     }
+    static BOOLEAN AcquireDirectoryBuffer(PVOID *PDirBuffer,
+        BOOLEAN Reset, PWSTR Pattern, PNTSTATUS PResult)
+    {
+        return FspFileSystemAcquireDirectoryBufferEx(PDirBuffer, Reset, Pattern, PResult);
+    }
     static BOOLEAN FillDirectoryBuffer(PVOID *PDirBuffer,
         DIR_INFO *DirInfo, PNTSTATUS PResult)
     {
@@ -247,6 +392,23 @@ public:
     {
         FspFileSystemDeleteDirectoryBuffer(PDirBuffer);
     }
+    static BOOLEAN AcquireStreamingDirectoryBuffer(PVOID *PDirBuffer,
+        PWSTR Marker, ULONG WindowSize, PUINT64 PCookie, PNTSTATUS PResult)
+    {
+        return FspFileSystemAcquireStreamingDirectoryBuffer(PDirBuffer,
+            Marker, WindowSize, PCookie, PResult);
+    }
+    static BOOLEAN AcquireStreamingDirectoryBuffer(PVOID *PDirBuffer,
+        PWSTR Marker, PWSTR Pattern, ULONG WindowSize, PUINT64 PCookie, PNTSTATUS PResult)
+    {
+        return FspFileSystemAcquireStreamingDirectoryBufferEx(PDirBuffer,
+            Marker, Pattern, WindowSize, PCookie, PResult);
+    }
+    static BOOLEAN FillStreamingDirectoryBuffer(PVOID *PDirBuffer,
+        DIR_INFO *DirInfo, UINT64 NextCookie, PNTSTATUS PResult)
+    {
+        return FspFileSystemFillStreamingDirectoryBuffer(PDirBuffer, DirInfo, NextCookie, PResult);
+    }
     static BOOLEAN AddDirInfo(DIR_INFO *DirInfo,
         PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
     {
@@ -116,6 +116,8 @@ static void *cygfuse_init_winfsp()
     CYGFUSE_GET_API(h, fsp_fuse_unmount);
     CYGFUSE_GET_API(h, fsp_fuse_parse_cmdline);
     CYGFUSE_GET_API(h, fsp_fuse_ntstatus_from_errno);
+    CYGFUSE_GET_API(h, fsp_fuse_buf_size);
+    CYGFUSE_GET_API(h, fsp_fuse_buf_copy);
 
     /* fuse.h */
     CYGFUSE_GET_API(h, fsp_fuse_main_real);
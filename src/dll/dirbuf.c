@@ -16,6 +16,10 @@
  */
 
 #include <dll/library.h>
+#include <shared/pattern.h>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 #define RETURN(R, B)                    \
     do                                  \
@@ -30,8 +34,173 @@ typedef struct
     SRWLOCK Lock;
     ULONG Capacity, LoMark, HiMark;
     PUINT8 Buffer;
+    /* streaming mode */
+    ULONG WindowSize;                   /* 0 when not streaming */
+    BOOLEAN WindowFull;
+    UINT64 LastCookie;
+    PWSTR SkipMarker;
+    /* pattern filtering */
+    PWSTR Pattern;                      /* upcased copy; 0 when matching all */
+    BOOLEAN PatternIsCompiled;
+    FSP_PATTERN PatternCompiled;
 } FSP_FILE_SYSTEM_DIRECTORY_BUFFER;
 
+/*
+ * Streaming mode
+ *
+ * A streaming directory buffer holds a bounded window of directory entries in the
+ * order that the file system produced them; entries are not sorted. Every entry is
+ * stored together with a cookie that the file system can use to resume enumeration
+ * after that entry (for example a FUSE readdir offset).
+ *
+ * When a ReadDirectory marker falls within the current window, the remaining entries
+ * are served from the window. When the marker is the last entry of a full window, the
+ * window is refilled starting at that entry's cookie. When the marker cannot be found
+ * (e.g. because the window was reset by another enumeration), the window is refilled
+ * from the beginning of the directory, skipping all entries up to the marker. If the
+ * marker is no longer in the directory, the first window is served again instead.
+ */
+
+enum
+{
+    FspFileSystemDirectoryBufferWindowSizeMin = 4096,
+};
+
+/*
+ * Pattern filtering
+ *
+ * A directory buffer that is acquired with a pattern (usually the QueryDirectory
+ * Pattern that the FSD passes when PassQueryDirectoryPattern is set) only stores the
+ * entries that match it; other entries are dropped when filled and are never sorted
+ * or transferred to the FSD.
+ *
+ * The FSD filters the entries that it receives again, using the case sensitivity of
+ * the open handle. The directory buffer does not know this case sensitivity, so it
+ * always matches case insensitively, which returns a superset of the entries that the
+ * FSD will keep. Non-ASCII characters are upcased using RtlUpcaseUnicodeChar so that
+ * they fold the same way as in the FSD; if it is unavailable (or the pattern cannot be
+ * compiled) the directory buffer does not filter.
+ *
+ * The pattern is part of the directory buffer contents: acquiring the directory buffer
+ * with a different pattern than the one it was filled with always resets it.
+ */
+
+static INIT_ONCE FspFileSystemDirectoryBufferInitOnce = INIT_ONCE_STATIC_INIT;
+static WCHAR (NTAPI *FspRtlUpcaseUnicodeChar)(WCHAR C);
+
+static BOOL WINAPI FspFileSystemDirectoryBufferInitialize(
+    PINIT_ONCE InitOnce, PVOID Parameter, PVOID *Context)
+{
+    HANDLE Handle;
+
+    Handle = GetModuleHandleW(L"ntdll.dll");
+    if (0 != Handle)
+        FspRtlUpcaseUnicodeChar = (PVOID)GetProcAddress(Handle, "RtlUpcaseUnicodeChar");
+
+    return TRUE;
+}
+
+static WCHAR FspFileSystemDirectoryBufferUpcase(WCHAR C)
+{
+    if (L'a' <= C && C <= L'z')
+        return C - (L'a' - L'A');
+    if (0x80 > C || 0 == FspRtlUpcaseUnicodeChar)
+        return C;
+    return FspRtlUpcaseUnicodeChar(C);
+}
+
+static inline BOOLEAN FspFileSystemDirectoryBufferPatternIsMatchAll(PWSTR Pattern)
+{
+    return 0 == Pattern || (L'*' == Pattern[0] && L'\0' == Pattern[1]);
+}
+
+static BOOLEAN FspFileSystemDirectoryBufferPatternEqual(FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer,
+    PWSTR Pattern)
+{
+    PWSTR P, Q;
+
+    if (FspFileSystemDirectoryBufferPatternIsMatchAll(Pattern))
+        return 0 == DirBuffer->Pattern;
+    if (0 == DirBuffer->Pattern)
+        return FALSE;
+
+    for (P = Pattern, Q = DirBuffer->Pattern; L'\0' != *P; P++, Q++)
+        if (*Q != FspFileSystemDirectoryBufferUpcase(*P))
+            return FALSE;
+
+    return L'\0' == *Q;
+}
+
+static NTSTATUS FspFileSystemSetDirectoryBufferPattern(FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer,
+    PWSTR Pattern)
+{
+    /* assume that the directory buffer is acquired exclusive */
+
+    PWSTR NewPattern = 0;
+    ULONG Length = 0;
+
+    if (FspFileSystemDirectoryBufferPatternEqual(DirBuffer, Pattern))
+        return STATUS_SUCCESS;
+
+    if (!FspFileSystemDirectoryBufferPatternIsMatchAll(Pattern))
+    {
+        Length = lstrlenW(Pattern);
+        NewPattern = MemAlloc((Length + 1) * sizeof(WCHAR));
+        if (0 == NewPattern)
+            return STATUS_INSUFFICIENT_RESOURCES;
+        for (ULONG I = 0; Length > I; I++)
+            NewPattern[I] = FspFileSystemDirectoryBufferUpcase(Pattern[I]);
+        NewPattern[Length] = L'\0';
+    }
+
+    MemFree(DirBuffer->Pattern);
+    DirBuffer->Pattern = NewPattern;
+    DirBuffer->PatternIsCompiled = 0 != NewPattern && 0 != FspRtlUpcaseUnicodeChar &&
+        FspPatternCompile(&DirBuffer->PatternCompiled, NewPattern, Length, TRUE,
+            FspFileSystemDirectoryBufferUpcase);
+
+    return STATUS_SUCCESS;
+}
+
+static inline BOOLEAN FspFileSystemDirectoryBufferPatternMatch(
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer, FSP_FSCTL_DIR_INFO *DirInfo)
+{
+    return !DirBuffer->PatternIsCompiled ||
+        FspPatternMatch(&DirBuffer->PatternCompiled,
+            DirInfo->FileNameBuf, (DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR));
+}
+
+/*
+ * Compare UTF-16 code units; 8 code units at a time using SSE2 where available.
+ */
+static __forceinline
+int FspFileSystemDirectoryBufferWcsncmp(PWSTR a, PWSTR b, int len)
+{
+    int i = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    for (; len - i >= 8; i += 8)
+    {
+        __m128i va = _mm_loadu_si128((__m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((__m128i *)(b + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(va, vb));
+        if (0xffff != mask)
+        {
+            unsigned long bit;
+            _BitScanForward(&bit, ~mask & 0xffff);
+            i += bit / 2;
+            return (int)a[i] - (int)b[i];
+        }
+    }
+#endif
+
+    for (; i < len; i++)
+        if (a[i] != b[i])
+            return (int)a[i] - (int)b[i];
+
+    return 0;
+}
+
 static int FspFileSystemDirectoryBufferFileNameCmp(PWSTR a, int alen, PWSTR b, int blen)
 {
     int len, res;
@@ -69,7 +238,7 @@ static int FspFileSystemDirectoryBufferFileNameCmp(PWSTR a, int alen, PWSTR b, i
         break;
     }
 
-    res = invariant_wcsncmp(a, b, len);
+    res = FspFileSystemDirectoryBufferWcsncmp(a, b, len);
 
     if (0 == res)
         res = alen - blen;
@@ -114,6 +283,32 @@ static BOOLEAN FspFileSystemSearchDirectoryBuffer(FSP_FILE_SYSTEM_DIRECTORY_BUFF
     return FALSE;
 }
 
+/*
+ * Linear search; used in streaming mode where entries are in fill order
+ */
+static BOOLEAN FspFileSystemSearchStreamingDirectoryBuffer(FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer,
+    PWSTR Marker, int MarkerLen, PULONG PIndexNum)
+{
+    PULONG Index = (PULONG)(DirBuffer->Buffer + DirBuffer->HiMark);
+    ULONG Count = (DirBuffer->Capacity - DirBuffer->HiMark) / sizeof(ULONG);
+    FSP_FSCTL_DIR_INFO *DirInfo;
+
+    for (ULONG I = 0; Count > I; I++)
+    {
+        DirInfo = (PVOID)(DirBuffer->Buffer + Index[I]);
+        if (0 == FspFileSystemDirectoryBufferFileNameCmp(
+            DirInfo->FileNameBuf, (DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR),
+            Marker, MarkerLen))
+        {
+            *PIndexNum = I;
+            return TRUE;
+        }
+    }
+
+    *PIndexNum = Count;
+    return FALSE;
+}
+
 /*
  * Quick sort
  * "I wish I had the standard library!"
@@ -122,6 +317,8 @@ static BOOLEAN FspFileSystemSearchDirectoryBuffer(FSP_FILE_SYSTEM_DIRECTORY_BUFF
  *
  * Implements a non-recursive quicksort with tail-end recursion eliminated
  * and median-of-three partitioning.
+ *
+ * Only used when the merge sort below cannot allocate its entry array.
  */
 
 #define less(a, b)                      FspFileSystemDirectoryBufferLess(Buffer, a, b)
@@ -211,21 +408,171 @@ static VOID FspFileSystemQSortDirectoryBuffer(PUINT8 Buffer, PULONG Index, int l
 #undef compexch
 #undef exch
 
+/*
+ * Merge sort
+ *
+ * Sorts an array of (key, offset) entries. The key packs the first four UTF-16 code
+ * units of the file name (with "." and ".." mapped so that they order first); the
+ * full file names are only compared when the keys are equal. This keeps most of the
+ * comparisons within the entry array, rather than chasing offsets into the buffer.
+ *
+ * Implements a bottom-up merge sort, with small runs presorted by insertion sort.
+ */
+
+typedef struct
+{
+    UINT64 Key;
+    ULONG Offset;
+} FSP_FILE_SYSTEM_DIRECTORY_BUFFER_SORT_ENTRY;
+
+static __forceinline
+UINT64 FspFileSystemDirectoryBufferFileNameKey(PUINT8 Buffer, ULONG Offset)
+{
+    FSP_FSCTL_DIR_INFO *DirInfo = (FSP_FSCTL_DIR_INFO *)(Buffer + Offset);
+    int len = (DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR);
+    PWSTR a = DirInfo->FileNameBuf;
+    UINT64 Key = 0;
+
+    /* order "." and ".." first */
+    if (1 == len && L'.' == a[0])
+        return 0x0001000000000000ULL;
+    if (2 == len && L'.' == a[0] && L'.' == a[1])
+        return 0x0001000100000000ULL;
+
+    for (int i = 0; 4 > i; i++)
+        Key = (Key << 16) | (i < len ? a[i] : 0);
+
+    return Key;
+}
+
+static __forceinline
+int FspFileSystemDirectoryBufferSortEntryLess(PUINT8 Buffer,
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER_SORT_ENTRY *a, FSP_FILE_SYSTEM_DIRECTORY_BUFFER_SORT_ENTRY *b)
+{
+    if (a->Key != b->Key)
+        return a->Key < b->Key;
+    return FspFileSystemDirectoryBufferLess(Buffer, a->Offset, b->Offset);
+}
+
+static BOOLEAN FspFileSystemMSortDirectoryBuffer(PUINT8 Buffer, PULONG Index, ULONG Count)
+{
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER_SORT_ENTRY *Entries, *Src, *Dst, *Tmp, Entry;
+    ULONG Run = 16, Width, Lo, Mi, Hi, I, J, K;
+
+    Entries = MemAlloc(2 * Count * sizeof *Entries);
+    if (0 == Entries)
+        return FALSE;
+
+    Src = Entries;
+    Dst = Entries + Count;
+
+    for (I = 0; Count > I; I++)
+    {
+        Src[I].Key = FspFileSystemDirectoryBufferFileNameKey(Buffer, Index[I]);
+        Src[I].Offset = Index[I];
+    }
+
+    for (Lo = 0; Count > Lo; Lo += Run)
+    {
+        Hi = Lo + Run < Count ? Lo + Run : Count;
+        for (I = Lo + 1; Hi > I; I++)
+        {
+            Entry = Src[I];
+            for (J = I; Lo < J && FspFileSystemDirectoryBufferSortEntryLess(Buffer, &Entry, &Src[J - 1]); J--)
+                Src[J] = Src[J - 1];
+            Src[J] = Entry;
+        }
+    }
+
+    for (Width = Run; Count > Width; Width *= 2)
+    {
+        for (Lo = 0; Count > Lo; Lo += 2 * Width)
+        {
+            Mi = Lo + Width < Count ? Lo + Width : Count;
+            Hi = Lo + 2 * Width < Count ? Lo + 2 * Width : Count;
+
+            if (Mi == Hi ||
+                !FspFileSystemDirectoryBufferSortEntryLess(Buffer, &Src[Mi], &Src[Mi - 1]))
+            {
+                /* runs already in order */
+                memcpy(Dst + Lo, Src + Lo, (Hi - Lo) * sizeof *Src);
+                continue;
+            }
+
+            for (I = Lo, J = Mi, K = Lo; Mi > I && Hi > J; K++)
+                if (FspFileSystemDirectoryBufferSortEntryLess(Buffer, &Src[J], &Src[I]))
+                    Dst[K] = Src[J++];
+                else
+                    Dst[K] = Src[I++];
+            if (Mi > I)
+                memcpy(Dst + K, Src + I, (Mi - I) * sizeof *Src);
+            else if (Hi > J)
+                memcpy(Dst + K, Src + J, (Hi - J) * sizeof *Src);
+        }
+
+        Tmp = Src; Src = Dst; Dst = Tmp;
+    }
+
+    for (I = 0; Count > I; I++)
+        Index[I] = Src[I].Offset;
+
+    MemFree(Entries);
+
+    return TRUE;
+}
+
 static inline VOID FspFileSystemSortDirectoryBuffer(FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer)
 {
     PUINT8 Buffer = DirBuffer->Buffer;
     PULONG Index = (PULONG)(DirBuffer->Buffer + DirBuffer->HiMark);
     ULONG Count = (DirBuffer->Capacity - DirBuffer->HiMark) / sizeof(ULONG);
+    ULONG I;
+
+    if (2 > Count)
+        return;
 
-    FspFileSystemQSortDirectoryBuffer(Buffer, Index, 0, Count - 1);
+    /*
+     * Fast path for file systems that fill entries in order. The index is filled
+     * backwards, so entries that were filled in order result in a reversed index.
+     */
+    for (I = 1; Count > I; I++)
+        if (!FspFileSystemDirectoryBufferLess(Buffer, Index[I], Index[I - 1]))
+            break;
+    if (Count == I)
+    {
+        for (ULONG Lo = 0, Hi = Count - 1; Lo < Hi; Lo++, Hi--)
+        {
+            ULONG t = Index[Lo]; Index[Lo] = Index[Hi]; Index[Hi] = t;
+        }
+        return;
+    }
+    for (I = 1; Count > I; I++)
+        if (FspFileSystemDirectoryBufferLess(Buffer, Index[I], Index[I - 1]))
+            break;
+    if (Count == I)
+        return;
+
+    if (!FspFileSystemMSortDirectoryBuffer(Buffer, Index, Count))
+        FspFileSystemQSortDirectoryBuffer(Buffer, Index, 0, Count - 1);
 }
 
 FSP_API BOOLEAN FspFileSystemAcquireDirectoryBuffer(PVOID *PDirBuffer,
     BOOLEAN Reset, PNTSTATUS PResult)
+{
+    return FspFileSystemAcquireDirectoryBufferEx(PDirBuffer, Reset, 0, PResult);
+}
+
+FSP_API BOOLEAN FspFileSystemAcquireDirectoryBufferEx(PVOID *PDirBuffer,
+    BOOLEAN Reset, PWSTR Pattern, PNTSTATUS PResult)
 {
     FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = *PDirBuffer;
+    NTSTATUS Result;
+    BOOLEAN PatternEqual;
     MemoryBarrier();
 
+    InitOnceExecuteOnce(&FspFileSystemDirectoryBufferInitOnce,
+        FspFileSystemDirectoryBufferInitialize, 0, 0);
+
     if (0 == DirBuffer)
     {
         static SRWLOCK CreateLock = SRWLOCK_INIT;
@@ -246,18 +593,47 @@ FSP_API BOOLEAN FspFileSystemAcquireDirectoryBuffer(PVOID *PDirBuffer,
         ReleaseSRWLockExclusive(&CreateLock);
 
         if (DirBuffer == NewDirBuffer)
+        {
+            Result = FspFileSystemSetDirectoryBufferPattern(DirBuffer, Pattern);
+            if (!NT_SUCCESS(Result))
+            {
+                ReleaseSRWLockExclusive(&DirBuffer->Lock);
+                RETURN(Result, FALSE);
+            }
+
             RETURN(STATUS_SUCCESS, TRUE);
+        }
 
         ReleaseSRWLockExclusive(&NewDirBuffer->Lock);
         MemFree(NewDirBuffer);
     }
 
+    if (!Reset)
+    {
+        /* the directory buffer contents are only valid for the pattern they were filled with */
+        AcquireSRWLockShared(&DirBuffer->Lock);
+        PatternEqual = FspFileSystemDirectoryBufferPatternEqual(DirBuffer, Pattern);
+        ReleaseSRWLockShared(&DirBuffer->Lock);
+
+        Reset = !PatternEqual;
+    }
+
     if (Reset)
     {
         AcquireSRWLockExclusive(&DirBuffer->Lock);
 
+        Result = FspFileSystemSetDirectoryBufferPattern(DirBuffer, Pattern);
+        if (!NT_SUCCESS(Result))
+        {
+            ReleaseSRWLockExclusive(&DirBuffer->Lock);
+            RETURN(Result, FALSE);
+        }
+
         DirBuffer->LoMark = 0;
         DirBuffer->HiMark = DirBuffer->Capacity;
+        DirBuffer->WindowSize = 0;
+        DirBuffer->WindowFull = FALSE;
+        DirBuffer->LastCookie = 0;
 
         RETURN(STATUS_SUCCESS, TRUE);
     }
@@ -265,21 +641,16 @@ FSP_API BOOLEAN FspFileSystemAcquireDirectoryBuffer(PVOID *PDirBuffer,
     RETURN(STATUS_SUCCESS, FALSE);
 }
 
-FSP_API BOOLEAN FspFileSystemFillDirectoryBuffer(PVOID *PDirBuffer,
-    FSP_FSCTL_DIR_INFO *DirInfo, PNTSTATUS PResult)
+static BOOLEAN FspFileSystemAddDirectoryBufferEntry(FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer,
+    FSP_FSCTL_DIR_INFO *DirInfo, PUINT64 PCookie, PNTSTATUS PResult)
 {
-    /* assume that FspFileSystemAcquireDirectoryBuffer has been called */
-
-    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = *PDirBuffer;
+    ULONG CookieSize = 0 != PCookie ? sizeof(UINT64) : 0;
     ULONG Capacity, LoMark, HiMark;
     PUINT8 Buffer;
 
-    if (0 == DirInfo)
-        RETURN(STATUS_INVALID_PARAMETER, FALSE);
-
     for (;;)
     {
-        LoMark = DirBuffer->LoMark;
+        LoMark = DirBuffer->LoMark + CookieSize;
         HiMark = DirBuffer->HiMark;
         Buffer = DirBuffer->Buffer;
 
@@ -288,8 +659,11 @@ FSP_API BOOLEAN FspFileSystemFillDirectoryBuffer(PVOID *PDirBuffer,
             HiMark > sizeof(ULONG) ? HiMark - sizeof(ULONG)/*space for new index entry*/ : HiMark,
             &LoMark))
         {
+            if (0 != PCookie)
+                *(PUINT64)(Buffer + DirBuffer->LoMark) = *PCookie;
+
             HiMark -= sizeof(ULONG);
-            *(PULONG)(Buffer + HiMark) = DirBuffer->LoMark;
+            *(PULONG)(Buffer + HiMark) = DirBuffer->LoMark + CookieSize;
 
             DirBuffer->LoMark = LoMark;
             DirBuffer->HiMark = HiMark;
@@ -297,6 +671,8 @@ FSP_API BOOLEAN FspFileSystemFillDirectoryBuffer(PVOID *PDirBuffer,
             RETURN (STATUS_SUCCESS, TRUE);
         }
 
+        LoMark = DirBuffer->LoMark;
+
         if (0 == Buffer)
         {
             Buffer = MemAlloc(Capacity = 512);
@@ -325,13 +701,191 @@ FSP_API BOOLEAN FspFileSystemFillDirectoryBuffer(PVOID *PDirBuffer,
     }
 }
 
+FSP_API BOOLEAN FspFileSystemFillDirectoryBuffer(PVOID *PDirBuffer,
+    FSP_FSCTL_DIR_INFO *DirInfo, PNTSTATUS PResult)
+{
+    /* assume that FspFileSystemAcquireDirectoryBuffer has been called */
+
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = *PDirBuffer;
+
+    if (0 == DirInfo)
+        RETURN(STATUS_INVALID_PARAMETER, FALSE);
+
+    if (!FspFileSystemDirectoryBufferPatternMatch(DirBuffer, DirInfo))
+        RETURN(STATUS_SUCCESS, TRUE);
+
+    return FspFileSystemAddDirectoryBufferEntry(DirBuffer, DirInfo, 0, PResult);
+}
+
+FSP_API BOOLEAN FspFileSystemAcquireStreamingDirectoryBuffer(PVOID *PDirBuffer,
+    PWSTR Marker, ULONG WindowSize, PUINT64 PCookie, PNTSTATUS PResult)
+{
+    return FspFileSystemAcquireStreamingDirectoryBufferEx(PDirBuffer,
+        Marker, 0, WindowSize, PCookie, PResult);
+}
+
+FSP_API BOOLEAN FspFileSystemAcquireStreamingDirectoryBufferEx(PVOID *PDirBuffer,
+    PWSTR Marker, PWSTR Pattern, ULONG WindowSize, PUINT64 PCookie, PNTSTATUS PResult)
+{
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer;
+    BOOLEAN PatternEqual;
+    NTSTATUS Result;
+
+    *PCookie = 0;
+
+    if (!FspFileSystemAcquireDirectoryBufferEx(PDirBuffer, FALSE, Pattern, &Result))
+    {
+        if (!NT_SUCCESS(Result))
+            RETURN(Result, FALSE);
+
+        DirBuffer = *PDirBuffer;
+        AcquireSRWLockExclusive(&DirBuffer->Lock);
+    }
+    else
+        DirBuffer = *PDirBuffer;
+
+    /* a window filled with a different pattern cannot be used */
+    PatternEqual = FspFileSystemDirectoryBufferPatternEqual(DirBuffer, Pattern);
+    Result = FspFileSystemSetDirectoryBufferPattern(DirBuffer, Pattern);
+    if (!NT_SUCCESS(Result))
+    {
+        ReleaseSRWLockExclusive(&DirBuffer->Lock);
+        RETURN(Result, FALSE);
+    }
+
+    if (0 != Marker && 0 != DirBuffer->WindowSize && PatternEqual)
+    {
+        PULONG Index = (PULONG)(DirBuffer->Buffer + DirBuffer->HiMark);
+        ULONG Count = (DirBuffer->Capacity - DirBuffer->HiMark) / sizeof(ULONG);
+        ULONG IndexNum;
+
+        if (FspFileSystemSearchStreamingDirectoryBuffer(DirBuffer,
+            Marker, lstrlenW(Marker),
+            &IndexNum))
+        {
+            if (IndexNum + 1 < Count || !DirBuffer->WindowFull)
+            {
+                /* the rest of the window (or end of directory) follows the marker */
+                ReleaseSRWLockExclusive(&DirBuffer->Lock);
+                RETURN(STATUS_SUCCESS, FALSE);
+            }
+
+            /* marker is the last entry of a full window: resume after it */
+            *PCookie = *(PUINT64)(DirBuffer->Buffer + Index[IndexNum] - sizeof(UINT64));
+            Marker = 0;
+        }
+    }
+
+    MemFree(DirBuffer->SkipMarker);
+    DirBuffer->SkipMarker = 0;
+    if (0 != Marker)
+    {
+        /* marker not found: restart enumeration and skip entries up to the marker */
+        ULONG Size = (lstrlenW(Marker) + 1) * sizeof(WCHAR);
+        DirBuffer->SkipMarker = MemAlloc(Size);
+        if (0 == DirBuffer->SkipMarker)
+        {
+            ReleaseSRWLockExclusive(&DirBuffer->Lock);
+            RETURN(STATUS_INSUFFICIENT_RESOURCES, FALSE);
+        }
+        memcpy(DirBuffer->SkipMarker, Marker, Size);
+    }
+
+    DirBuffer->LoMark = 0;
+    DirBuffer->HiMark = DirBuffer->Capacity;
+    DirBuffer->WindowSize = FspFileSystemDirectoryBufferWindowSizeMin < WindowSize ?
+        WindowSize : FspFileSystemDirectoryBufferWindowSizeMin;
+    DirBuffer->WindowFull = FALSE;
+    DirBuffer->LastCookie = 0;
+
+    RETURN(STATUS_SUCCESS, TRUE);
+}
+
+FSP_API BOOLEAN FspFileSystemFillStreamingDirectoryBuffer(PVOID *PDirBuffer,
+    FSP_FSCTL_DIR_INFO *DirInfo, UINT64 NextCookie, PNTSTATUS PResult)
+{
+    /* assume that FspFileSystemAcquireStreamingDirectoryBuffer has been called */
+
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = *PDirBuffer;
+
+    if (0 == DirInfo)
+        RETURN(STATUS_INVALID_PARAMETER, FALSE);
+
+    if (0 != DirBuffer->SkipMarker)
+    {
+        if (0 == FspFileSystemDirectoryBufferFileNameCmp(
+            DirInfo->FileNameBuf, (DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR),
+            DirBuffer->SkipMarker, -1))
+        {
+            /* marker found: drop the entries buffered before it */
+            MemFree(DirBuffer->SkipMarker);
+            DirBuffer->SkipMarker = 0;
+
+            DirBuffer->LoMark = 0;
+            DirBuffer->HiMark = DirBuffer->Capacity;
+            DirBuffer->WindowFull = FALSE;
+            DirBuffer->LastCookie = 0;
+
+            RETURN(STATUS_SUCCESS, TRUE);
+        }
+
+        /*
+         * Until the marker is found, fill the window from the start of the directory,
+         * but keep enumerating when it is full. If the marker is never found (e.g. it
+         * was deleted), this window is returned: some entries are returned again, but
+         * the rest of the directory is not lost.
+         */
+        if (DirBuffer->WindowFull)
+            RETURN(STATUS_SUCCESS, TRUE);
+    }
+    else if (DirBuffer->WindowFull)
+        RETURN(STATUS_SUCCESS, FALSE);
+
+    if (!FspFileSystemDirectoryBufferPatternMatch(DirBuffer, DirInfo))
+        RETURN(STATUS_SUCCESS, TRUE);
+
+    /*
+     * The window is full when the new entry does not fit. The window can only end
+     * after an entry that has a cookie; otherwise enumeration could not be resumed.
+     */
+    if (0 != DirBuffer->LastCookie &&
+        DirBuffer->LoMark + sizeof(UINT64) + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size) +
+        (DirBuffer->Capacity - DirBuffer->HiMark) + sizeof(ULONG) > DirBuffer->WindowSize)
+    {
+        DirBuffer->WindowFull = TRUE;
+        RETURN(STATUS_SUCCESS, 0 != DirBuffer->SkipMarker);
+    }
+
+    if (!FspFileSystemAddDirectoryBufferEntry(DirBuffer, DirInfo, &NextCookie, PResult))
+        return FALSE;
+
+    DirBuffer->LastCookie = NextCookie;
+
+    return TRUE;
+}
+
 FSP_API VOID FspFileSystemReleaseDirectoryBuffer(PVOID *PDirBuffer)
 {
     /* assume that FspFileSystemAcquireDirectoryBuffer has been called */
 
     FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = *PDirBuffer;
 
-    FspFileSystemSortDirectoryBuffer(DirBuffer);
+    if (0 == DirBuffer->WindowSize)
+        FspFileSystemSortDirectoryBuffer(DirBuffer);
+    else
+    {
+        /* streaming: keep fill order; the index is filled backwards */
+        PULONG Index = (PULONG)(DirBuffer->Buffer + DirBuffer->HiMark);
+        ULONG Count = (DirBuffer->Capacity - DirBuffer->HiMark) / sizeof(ULONG);
+
+        for (ULONG Lo = 0, Hi = Count - 1; Count > 0 && Lo < Hi; Lo++, Hi--)
+        {
+            ULONG t = Index[Lo]; Index[Lo] = Index[Hi]; Index[Hi] = t;
+        }
+
+        MemFree(DirBuffer->SkipMarker);
+        DirBuffer->SkipMarker = 0;
+    }
 
     ReleaseSRWLockExclusive(&DirBuffer->Lock);
 }
@@ -354,13 +908,23 @@ FSP_API VOID FspFileSystemReadDirectoryBuffer(PVOID *PDirBuffer,
 
         if (0 == Marker)
             IndexNum = 0;
-        else
+        else if (0 == DirBuffer->WindowSize)
         {
             FspFileSystemSearchDirectoryBuffer(DirBuffer,
                 Marker, lstrlenW(Marker),
                 &IndexNum);
             IndexNum++;
         }
+        else
+        {
+            /* streaming: a window that does not contain the marker starts after it */
+            if (FspFileSystemSearchStreamingDirectoryBuffer(DirBuffer,
+                Marker, lstrlenW(Marker),
+                &IndexNum))
+                IndexNum++;
+            else
+                IndexNum = 0;
+        }
 
         for (; IndexNum < Count; IndexNum++)
         {
@@ -372,6 +936,13 @@ FSP_API VOID FspFileSystemReadDirectoryBuffer(PVOID *PDirBuffer,
             }
         }
 
+        if (DirBuffer->WindowFull)
+        {
+            /* streaming: more entries follow; do not signal end of directory */
+            ReleaseSRWLockShared(&DirBuffer->Lock);
+            return;
+        }
+
         ReleaseSRWLockShared(&DirBuffer->Lock);
     }
 
@@ -385,6 +956,8 @@ FSP_API VOID FspFileSystemDeleteDirectoryBuffer(PVOID *PDirBuffer)
 
     if (0 != DirBuffer)
     {
+        MemFree(DirBuffer->Pattern);
+        MemFree(DirBuffer->SkipMarker);
         MemFree(DirBuffer->Buffer);
         MemFree(DirBuffer);
         *PDirBuffer = 0;
@@ -20,8 +20,33 @@
 enum
 {
     FspFileSystemDispatcherThreadCountMin = 2,
+    FspFileSystemDispatcherIdleTimeoutDefault = 10000,
 };
 
+/*
+ * The dispatcher pool keeps track of dispatcher threads. The threads created by
+ * FspFileSystemStartDispatcher form a chain (every thread creates the next one and
+ * waits for it prior to exiting) and live as long as the dispatcher. When the pool is
+ * adaptive additional threads are created when all threads are busy; these threads
+ * are not part of the chain and exit when they have been idle for IdleTimeout.
+ *
+ * The handles of adaptive threads are kept in the pool, so that the chain threads can
+ * wait for them to exit. Adaptive threads never touch the pool after they have exited
+ * the dispatcher loop; the pool may be freed as soon as their handles are signaled.
+ */
+typedef struct
+{
+    LONG ThreadCountMin, ThreadCountMax;
+    ULONG IdleTimeout;
+    LONG ThreadCount, BusyThreadCount, ThreadCountPeak;
+    SRWLOCK AdaptiveThreadLock;
+    HANDLE *AdaptiveThreads;
+    ULONG AdaptiveThreadCount, AdaptiveThreadCapacity;
+    LONG64 ThreadCreateCount, ThreadCreateFailCount, ThreadExitCount, SaturationCount;
+} FSP_FILE_SYSTEM_DISPATCHER_POOL;
+
+static DWORD WINAPI FspFileSystemDispatcherAdaptiveThread(PVOID FileSystem0);
+
 static FSP_FILE_SYSTEM_INTERFACE FspFileSystemNullInterface;
 
 static INIT_ONCE FspFileSystemInitOnce = INIT_ONCE_STATIC_INIT;
@@ -184,6 +209,18 @@ FSP_API VOID FspFileSystemDelete(FSP_FILE_SYSTEM *FileSystem)
 {
     FspFileSystemRemoveMountPoint(FileSystem);
     CloseHandle(FileSystem->VolumeHandle);
+    FspFileSystemLatencyDelete(FileSystem);
+    FspTraverseCheckCacheDelete(FileSystem);
+    MemFree(FileSystem->OpGuardEpoch);
+    MemFree(FileSystem->OpGuardStripes);
+    if (0 != FileSystem->DispatcherPool)
+    {
+        FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool = FileSystem->DispatcherPool;
+        for (ULONG I = 0; Pool->AdaptiveThreadCount > I; I++)
+            CloseHandle(Pool->AdaptiveThreads[I]);
+        MemFree(Pool->AdaptiveThreads);
+        MemFree(Pool);
+    }
     MemFree(FileSystem);
 }
 
@@ -440,25 +477,219 @@ FSP_API VOID FspFileSystemRemoveMountPoint(FSP_FILE_SYSTEM *FileSystem)
     FileSystem->MountHandle = 0;
 }
 
-static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
+static SIZE_T FspFileSystemDispatchRequest(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    SIZE_T ResponseSize;
+
+    if (FileSystem->DebugLog)
+    {
+        if (FspFsctlTransactKindCount <= Request->Kind ||
+            (FileSystem->DebugLog & (1 << Request->Kind)))
+            FspDebugLogRequest(Request);
+    }
+
+    memset(Response, 0, sizeof *Response);
+    Response->Size = sizeof *Response;
+    Response->Kind = Request->Kind;
+    Response->Hint = Request->Hint;
+    if (FspFsctlTransactKindCount > Request->Kind && 0 != FileSystem->Operations[Request->Kind])
+    {
+        Response->IoStatus.Status =
+            FspFileSystemEnterOperation(FileSystem, Request, Response);
+        if (NT_SUCCESS(Response->IoStatus.Status))
+        {
+            Response->IoStatus.Status =
+                FileSystem->Operations[Request->Kind](FileSystem, Request, Response);
+            FspFileSystemLeaveOperation(FileSystem, Request, Response);
+        }
+    }
+    else
+        Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+
+    if (FileSystem->DebugLog)
+    {
+        if (FspFsctlTransactKindCount <= Response->Kind ||
+            (FileSystem->DebugLog & (1 << Response->Kind)))
+            FspDebugLogResponse(Response);
+    }
+
+    ResponseSize = FSP_FSCTL_DEFAULT_ALIGN_UP(Response->Size);
+    if (FSP_FSCTL_TRANSACT_RSP_SIZEMAX < ResponseSize/* should NOT happen */)
+    {
+        memset(Response, 0, sizeof *Response);
+        Response->Size = sizeof *Response;
+        Response->Kind = Request->Kind;
+        Response->Hint = Request->Hint;
+        Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+        ResponseSize = FSP_FSCTL_DEFAULT_ALIGN_UP(Response->Size);
+    }
+    else if (STATUS_PENDING == Response->IoStatus.Status)
+        /* response will be sent later through FspFileSystemSendResponse */
+        return 0;
+
+    memset((PUINT8)Response + Response->Size, 0, ResponseSize - Response->Size);
+    Response->Size = (UINT16)ResponseSize;
+
+    return ResponseSize;
+}
+
+static BOOLEAN FspFileSystemDispatcherPoolReserveThread(FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool)
+{
+    /* must be called with AdaptiveThreadLock held exclusive */
+    HANDLE *AdaptiveThreads;
+    ULONG Capacity;
+
+    /* reap the handles of adaptive threads that have already exited */
+    for (ULONG I = 0; Pool->AdaptiveThreadCount > I;)
+        if (WAIT_OBJECT_0 == WaitForSingleObject(Pool->AdaptiveThreads[I], 0))
+        {
+            CloseHandle(Pool->AdaptiveThreads[I]);
+            Pool->AdaptiveThreads[I] = Pool->AdaptiveThreads[--Pool->AdaptiveThreadCount];
+        }
+        else
+            I++;
+
+    if (Pool->AdaptiveThreadCapacity > Pool->AdaptiveThreadCount)
+        return TRUE;
+
+    Capacity = 0 != Pool->AdaptiveThreadCapacity ? Pool->AdaptiveThreadCapacity * 2 : 4;
+    AdaptiveThreads = MemAlloc(Capacity * sizeof(HANDLE));
+    if (0 == AdaptiveThreads)
+        return FALSE;
+    if (0 != Pool->AdaptiveThreadCount)
+        memcpy(AdaptiveThreads, Pool->AdaptiveThreads, Pool->AdaptiveThreadCount * sizeof(HANDLE));
+    MemFree(Pool->AdaptiveThreads);
+    Pool->AdaptiveThreads = AdaptiveThreads;
+    Pool->AdaptiveThreadCapacity = Capacity;
+
+    return TRUE;
+}
+
+static VOID FspFileSystemDispatcherPoolEnter(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool = FileSystem->DispatcherPool;
+    LONG BusyThreadCount, ThreadCount, ThreadCountPeak;
+    HANDLE Thread;
+
+    BusyThreadCount = InterlockedIncrement(&Pool->BusyThreadCount);
+    if (BusyThreadCount < Pool->ThreadCount)
+        return;
+
+    /* no other thread is waiting for requests; grow the pool if we can */
+    InterlockedIncrement64(&Pool->SaturationCount);
+    for (;;)
+    {
+        ThreadCount = Pool->ThreadCount;
+        if (BusyThreadCount < ThreadCount || Pool->ThreadCountMax <= ThreadCount)
+            return;
+        if (ThreadCount == InterlockedCompareExchange(&Pool->ThreadCount,
+            ThreadCount + 1, ThreadCount))
+            break;
+    }
+
+    for (;;)
+    {
+        ThreadCountPeak = Pool->ThreadCountPeak;
+        if (ThreadCountPeak > ThreadCount ||
+            ThreadCountPeak == InterlockedCompareExchange(&Pool->ThreadCountPeak,
+                ThreadCount + 1, ThreadCountPeak))
+            break;
+    }
+
+    AcquireSRWLockExclusive(&Pool->AdaptiveThreadLock);
+    Thread = FspFileSystemDispatcherPoolReserveThread(Pool) ?
+        CreateThread(0, 0, FspFileSystemDispatcherAdaptiveThread, FileSystem, 0, 0) : 0;
+    if (0 != Thread)
+        Pool->AdaptiveThreads[Pool->AdaptiveThreadCount++] = Thread;
+    ReleaseSRWLockExclusive(&Pool->AdaptiveThreadLock);
+
+    if (0 != Thread)
+        InterlockedIncrement64(&Pool->ThreadCreateCount);
+    else
+    {
+        InterlockedDecrement(&Pool->ThreadCount);
+        InterlockedIncrement64(&Pool->ThreadCreateFailCount);
+    }
+}
+
+static inline VOID FspFileSystemDispatcherPoolLeave(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool = FileSystem->DispatcherPool;
+
+    InterlockedDecrement(&Pool->BusyThreadCount);
+}
+
+static BOOLEAN FspFileSystemDispatcherPoolShrink(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool = FileSystem->DispatcherPool;
+    LONG ThreadCount;
+
+    for (;;)
+    {
+        ThreadCount = Pool->ThreadCount;
+        if (Pool->ThreadCountMin >= ThreadCount)
+            return FALSE;
+        if (ThreadCount == InterlockedCompareExchange(&Pool->ThreadCount,
+            ThreadCount - 1, ThreadCount))
+            break;
+    }
+
+    InterlockedIncrement64(&Pool->ThreadExitCount);
+
+    return TRUE;
+}
+
+static DWORD FspFileSystemDispatcherThreadMain(FSP_FILE_SYSTEM *FileSystem, BOOLEAN Adaptive)
 {
-    FSP_FILE_SYSTEM *FileSystem = FileSystem0;
+    FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool = FileSystem->DispatcherPool;
     NTSTATUS Result;
-    SIZE_T RequestSize, ResponseSize;
-    FSP_FSCTL_TRANSACT_REQ *Request = 0;
-    FSP_FSCTL_TRANSACT_RSP *Response = 0;
+    BOOLEAN Batch, Busy = FALSE, Retire = FALSE;
+    ULONGLONG IdleTime;
+    SIZE_T RequestBufSize, ResponseBufSize, RequestSize, ResponseSize;
+    PUINT8 RequestBuf = 0, ResponseBuf = 0, RequestBufEnd, ResponseBufEnd;
+    FSP_FSCTL_TRANSACT_REQ *Request, *NextRequest;
+    FSP_FSCTL_TRANSACT_RSP *Response;
     FSP_FILE_SYSTEM_OPERATION_CONTEXT OperationContext;
+    PVOID Latency = 0;
+    LARGE_INTEGER StartTime, EndTime;
+    UINT32 Kind;
+    SIZE_T DispatchSize;
     HANDLE DispatcherThread = 0;
 
-    Request = MemAlloc(FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN);
-    Response = MemAlloc(FSP_FSCTL_TRANSACT_RSP_SIZEMAX);
-    if (0 == Request || 0 == Response)
+    Batch = 1 < FileSystem->DispatcherBatchCount;
+    if (Batch)
+    {
+        RequestBufSize = FileSystem->DispatcherBatchCount * FSP_FSCTL_TRANSACT_REQ_SIZEMAX;
+        if (FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN > RequestBufSize)
+            RequestBufSize = FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN;
+        ResponseBufSize = FileSystem->DispatcherBatchCount * FSP_FSCTL_TRANSACT_RSP_SIZEMAX;
+    }
+    else
+    {
+        RequestBufSize = FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN;
+        ResponseBufSize = FSP_FSCTL_TRANSACT_RSP_SIZEMAX;
+    }
+
+    RequestBuf = MemAlloc(RequestBufSize);
+    ResponseBuf = MemAlloc(ResponseBufSize);
+    if (0 == RequestBuf || 0 == ResponseBuf)
     {
         Result = STATUS_INSUFFICIENT_RESOURCES;
+        if (Adaptive)
+        {
+            /* an adaptive thread that cannot start should not bring down the dispatcher */
+            InterlockedDecrement(&Pool->ThreadCount);
+            InterlockedIncrement64(&Pool->ThreadCreateFailCount);
+            Retire = TRUE;
+        }
         goto exit;
     }
 
-    if (1 < FileSystem->DispatcherThreadCount)
+    /* latency recording is best effort; if we cannot allocate our histograms do not record */
+    Latency = FspFileSystemLatencyCreate(FileSystem);
+
+    if (!Adaptive && 1 < FileSystem->DispatcherThreadCount)
     {
         FileSystem->DispatcherThreadCount--;
         DispatcherThread = CreateThread(0, 0, FspFileSystemDispatcherThread, FileSystem, 0, 0);
@@ -469,80 +700,99 @@ static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
         }
     }
 
-    OperationContext.Request = Request;
-    OperationContext.Response = Response;
+    OperationContext.Request = 0;
+    OperationContext.Response = 0;
     TlsSetValue(FspFileSystemTlsKey, &OperationContext);
 
-    memset(Response, 0, sizeof *Response);
+    ResponseBufEnd = ResponseBuf + ResponseBufSize;
+    ResponseSize = 0;
+    IdleTime = GetTickCount64();
     for (;;)
     {
-        RequestSize = FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN;
-        Result = FspFsctlTransact(FileSystem->VolumeHandle,
-            Response, Response->Size, Request, &RequestSize, FALSE);
+        RequestSize = RequestBufSize;
+        Result = FspFileSystemTransact(FileSystem,
+            ResponseBuf, ResponseSize, RequestBuf, &RequestSize, Batch);
         if (!NT_SUCCESS(Result))
             goto exit;
 
-        memset(Response, 0, sizeof *Response);
         if (0 == RequestSize)
-            continue;
-
-        if (FileSystem->DebugLog)
         {
-            if (FspFsctlTransactKindCount <= Request->Kind ||
-                (FileSystem->DebugLog & (1 << Request->Kind)))
-                FspDebugLogRequest(Request);
+            /* transact timed out; adaptive threads exit when idle for too long */
+            if (Adaptive && GetTickCount64() - IdleTime >= Pool->IdleTimeout &&
+                FspFileSystemDispatcherPoolShrink(FileSystem))
+            {
+                Retire = TRUE;
+                goto exit;
+            }
+
+            ResponseSize = 0;
+            continue;
         }
 
-        Response->Size = sizeof *Response;
-        Response->Kind = Request->Kind;
-        Response->Hint = Request->Hint;
-        if (FspFsctlTransactKindCount > Request->Kind && 0 != FileSystem->Operations[Request->Kind])
+        Busy = TRUE;
+        FspFileSystemDispatcherPoolEnter(FileSystem);
+
+        Request = (PVOID)RequestBuf;
+        RequestBufEnd = RequestBuf + RequestSize;
+        Response = (PVOID)ResponseBuf;
+        for (;;)
         {
-            Response->IoStatus.Status =
-                FspFileSystemEnterOperation(FileSystem, Request, Response);
-            if (NT_SUCCESS(Response->IoStatus.Status))
+            NextRequest = FspFsctlTransactConsumeRequest(Request, RequestBufEnd);
+            if (0 == NextRequest)
+                break;
+
+            if (!FspFsctlTransactCanProduceResponse(Response, ResponseBufEnd))
             {
-                Response->IoStatus.Status =
-                    FileSystem->Operations[Request->Kind](FileSystem, Request, Response);
-                FspFileSystemLeaveOperation(FileSystem, Request, Response);
+                /* response buffer is full; send the responses we have so far */
+                Result = FspFileSystemTransact(FileSystem,
+                    ResponseBuf, (PUINT8)Response - ResponseBuf, 0, 0, FALSE);
+                if (!NT_SUCCESS(Result))
+                    goto exit;
+
+                Response = (PVOID)ResponseBuf;
             }
-        }
-        else
-            Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
 
-        if (FileSystem->DebugLog)
-        {
-            if (FspFsctlTransactKindCount <= Response->Kind ||
-                (FileSystem->DebugLog & (1 << Response->Kind)))
-                FspDebugLogResponse(Response);
-        }
+            OperationContext.Request = Request;
+            OperationContext.Response = Response;
 
-        ResponseSize = FSP_FSCTL_DEFAULT_ALIGN_UP(Response->Size);
-        if (FSP_FSCTL_TRANSACT_RSP_SIZEMAX < ResponseSize/* should NOT happen */)
-        {
-            memset(Response, 0, sizeof *Response);
-            Response->Size = sizeof *Response;
-            Response->Kind = Request->Kind;
-            Response->Hint = Request->Hint;
-            Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
-        }
-        else if (STATUS_PENDING == Response->IoStatus.Status)
-            memset(Response, 0, sizeof *Response);
-        else
-        {
-            memset((PUINT8)Response + Response->Size, 0, ResponseSize - Response->Size);
-            Response->Size = (UINT16)ResponseSize;
+            Kind = Request->Kind;
+            QueryPerformanceCounter(&StartTime);
+            DispatchSize = FspFileSystemDispatchRequest(FileSystem, Request, Response);
+            QueryPerformanceCounter(&EndTime);
+            FspFileSystemLatencyRecord(Latency, Kind, EndTime.QuadPart - StartTime.QuadPart);
+
+            Response = FspFsctlTransactProduceResponse(Response, DispatchSize);
+
+            Request = NextRequest;
         }
+
+        OperationContext.Request = 0;
+        OperationContext.Response = 0;
+
+        Busy = FALSE;
+        FspFileSystemDispatcherPoolLeave(FileSystem);
+        IdleTime = GetTickCount64();
+
+        ResponseSize = (PUINT8)Response - ResponseBuf;
     }
 
 exit:
+    if (Busy)
+        FspFileSystemDispatcherPoolLeave(FileSystem);
+
     TlsSetValue(FspFileSystemTlsKey, 0);
-    MemFree(Response);
-    MemFree(Request);
+    FspFileSystemLatencyRelease(Latency);
+    MemFree(ResponseBuf);
+    MemFree(RequestBuf);
+
+    if (!Retire)
+    {
+        InterlockedDecrement(&Pool->ThreadCount);
 
-    FspFileSystemSetDispatcherResult(FileSystem, Result);
+        FspFileSystemSetDispatcherResult(FileSystem, Result);
 
-    FspFsctlStop(FileSystem->VolumeHandle);
+        FspFsctlStop(FileSystem->VolumeHandle);
+    }
 
     if (0 != DispatcherThread)
     {
@@ -550,11 +800,47 @@ exit:
         CloseHandle(DispatcherThread);
     }
 
+    if (!Adaptive)
+    {
+        /*
+         * The dispatcher has been stopped; wait for any adaptive threads to notice.
+         * An adaptive thread may create another one before it exits, but the new
+         * thread's handle is added to the pool before the creator's handle is signaled.
+         */
+        for (;;)
+        {
+            HANDLE AdaptiveThread = 0;
+
+            AcquireSRWLockExclusive(&Pool->AdaptiveThreadLock);
+            if (0 != Pool->AdaptiveThreadCount)
+                AdaptiveThread = Pool->AdaptiveThreads[--Pool->AdaptiveThreadCount];
+            ReleaseSRWLockExclusive(&Pool->AdaptiveThreadLock);
+
+            if (0 == AdaptiveThread)
+                break;
+
+            WaitForSingleObject(AdaptiveThread, INFINITE);
+            CloseHandle(AdaptiveThread);
+        }
+    }
+
     return Result;
 }
 
+static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
+{
+    return FspFileSystemDispatcherThreadMain(FileSystem0, FALSE);
+}
+
+static DWORD WINAPI FspFileSystemDispatcherAdaptiveThread(PVOID FileSystem0)
+{
+    return FspFileSystemDispatcherThreadMain(FileSystem0, TRUE);
+}
+
 FSP_API NTSTATUS FspFileSystemStartDispatcher(FSP_FILE_SYSTEM *FileSystem, ULONG ThreadCount)
 {
+    FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool;
+
     if (0 != FileSystem->DispatcherThread)
         return STATUS_INVALID_PARAMETER;
 
@@ -572,6 +858,31 @@ FSP_API NTSTATUS FspFileSystemStartDispatcher(FSP_FILE_SYSTEM *FileSystem, ULONG
     if (ThreadCount < FspFileSystemDispatcherThreadCountMin)
         ThreadCount = FspFileSystemDispatcherThreadCountMin;
 
+    Pool = FileSystem->DispatcherPool;
+    if (0 == Pool)
+    {
+        Pool = MemAlloc(sizeof *Pool);
+        if (0 == Pool)
+            return STATUS_INSUFFICIENT_RESOURCES;
+        memset(Pool, 0, sizeof *Pool);
+        InitializeSRWLock(&Pool->AdaptiveThreadLock);
+
+        FileSystem->DispatcherPool = Pool;
+    }
+
+    Pool->ThreadCountMin = ThreadCount;
+    Pool->ThreadCountMax = ThreadCount < FileSystem->DispatcherThreadCountMax ?
+        FileSystem->DispatcherThreadCountMax : ThreadCount;
+    Pool->IdleTimeout = 0 != FileSystem->DispatcherIdleTimeout ?
+        FileSystem->DispatcherIdleTimeout : FspFileSystemDispatcherIdleTimeoutDefault;
+    Pool->ThreadCount = ThreadCount;
+    Pool->BusyThreadCount = 0;
+    Pool->ThreadCountPeak = ThreadCount;
+    Pool->ThreadCreateCount = 0;
+    Pool->ThreadCreateFailCount = 0;
+    Pool->ThreadExitCount = 0;
+    Pool->SaturationCount = 0;
+
     FileSystem->DispatcherThreadCount = ThreadCount;
     FileSystem->DispatcherThread = CreateThread(0, 0,
         FspFileSystemDispatcherThread, FileSystem, 0, 0);
@@ -593,6 +904,29 @@ FSP_API VOID FspFileSystemStopDispatcher(FSP_FILE_SYSTEM *FileSystem)
     FileSystem->DispatcherThread = 0;
 }
 
+FSP_API NTSTATUS FspFileSystemGetDispatcherStatistics(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_STATISTICS *Statistics)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool = FileSystem->DispatcherPool;
+
+    memset(Statistics, 0, sizeof *Statistics);
+
+    if (0 == Pool)
+        return STATUS_INVALID_DEVICE_STATE;
+
+    Statistics->ThreadCount = Pool->ThreadCount;
+    Statistics->BusyThreadCount = Pool->BusyThreadCount;
+    Statistics->ThreadCountMin = Pool->ThreadCountMin;
+    Statistics->ThreadCountMax = Pool->ThreadCountMax;
+    Statistics->ThreadCountPeak = Pool->ThreadCountPeak;
+    Statistics->ThreadCreateCount = Pool->ThreadCreateCount;
+    Statistics->ThreadCreateFailCount = Pool->ThreadCreateFailCount;
+    Statistics->ThreadExitCount = Pool->ThreadExitCount;
+    Statistics->SaturationCount = Pool->SaturationCount;
+
+    return STATUS_SUCCESS;
+}
+
 FSP_API VOID FspFileSystemSendResponse(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_RSP *Response)
 {
@@ -605,7 +939,7 @@ FSP_API VOID FspFileSystemSendResponse(FSP_FILE_SYSTEM *FileSystem,
             FspDebugLogResponse(Response);
     }
 
-    Result = FspFsctlTransact(FileSystem->VolumeHandle,
+    Result = FspFileSystemTransact(FileSystem,
         Response, Response->Size, 0, 0, FALSE);
     if (!NT_SUCCESS(Result))
     {
@@ -16,6 +16,7 @@
  */
 
 #include <dll/library.h>
+#include <dll/opguard.h>
 
 #define AddrOfFileContext(s)            \
     (                                   \
@@ -40,12 +41,238 @@
             )                           \
     )
 
+/*
+ * Epoch operation guard
+ *
+ * SHRD operations increment a counter in a slot chosen by the current thread id and check
+ * that no EXCL operation is in progress; since every slot lives on its own cache line, SHRD
+ * operations on different threads do not contend. EXCL operations serialize on OpGuardLock,
+ * raise the Writer flag and then wait until all slot counters have drained. A SHRD operation
+ * that finds the Writer flag raised backs off and waits on OpGuardLock for the EXCL operation
+ * to complete.
+ *
+ * The slot must be the same in Enter and Leave; this holds because the dispatcher calls both
+ * on the same thread.
+ */
+#define FspFileSystemOpGuardEpochSlotShift  6
+#define FspFileSystemOpGuardEpochSlotCount  (1 << FspFileSystemOpGuardEpochSlotShift)
+
+typedef struct
+{
+    volatile LONG Count;
+    UINT8 Padding[64 - sizeof(LONG)];
+} FSP_FILE_SYSTEM_OPGUARD_EPOCH_SLOT;
+
+typedef struct
+{
+    volatile LONG Writer;
+    UINT8 Padding[64 - sizeof(LONG)];
+    FSP_FILE_SYSTEM_OPGUARD_EPOCH_SLOT Slots[FspFileSystemOpGuardEpochSlotCount];
+} FSP_FILE_SYSTEM_OPGUARD_EPOCH;
+
+static inline FSP_FILE_SYSTEM_OPGUARD_EPOCH_SLOT *FspFileSystemOpGuardEpochSlot(
+    FSP_FILE_SYSTEM_OPGUARD_EPOCH *Epoch)
+{
+    /* thread ids are multiples of 4; scramble them so that consecutive ids spread */
+    UINT32 Hash = (GetCurrentThreadId() >> 2) * 2654435761U;
+    return &Epoch->Slots[Hash >> (32 - FspFileSystemOpGuardEpochSlotShift)];
+}
+
+static FSP_FILE_SYSTEM_OPGUARD_EPOCH *FspFileSystemOpGuardEpochGet(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_OPGUARD_EPOCH *Epoch;
+
+    Epoch = InterlockedCompareExchangePointer(&FileSystem->OpGuardEpoch, 0, 0);
+    if (0 != Epoch)
+        return Epoch;
+
+    /*
+     * Allocate the epoch while excluding all EXCL operations. This guarantees that an EXCL
+     * operation that found no epoch at Enter time still finds none at Leave time.
+     */
+    AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
+    Epoch = FileSystem->OpGuardEpoch;
+    if (0 == Epoch)
+    {
+        Epoch = MemAlloc(sizeof *Epoch);
+        if (0 != Epoch)
+        {
+            memset(Epoch, 0, sizeof *Epoch);
+            InterlockedExchangePointer(&FileSystem->OpGuardEpoch, Epoch);
+        }
+    }
+    ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
+
+    return Epoch;
+}
+
+VOID FspFileSystemOpGuardEpochAcquireShared(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_OPGUARD_EPOCH *Epoch = FspFileSystemOpGuardEpochGet(FileSystem);
+    FSP_FILE_SYSTEM_OPGUARD_EPOCH_SLOT *Slot;
+
+    if (0 == Epoch)
+    {
+        /* out of memory: behave like the fine-grained strategy */
+        AcquireSRWLockShared(&FileSystem->OpGuardLock);
+        return;
+    }
+
+    Slot = FspFileSystemOpGuardEpochSlot(Epoch);
+    for (;;)
+    {
+        InterlockedIncrement(&Slot->Count);
+        if (0 == Epoch->Writer)
+            break;
+        InterlockedDecrement(&Slot->Count);
+
+        /* wait for the EXCL operation to complete */
+        AcquireSRWLockShared(&FileSystem->OpGuardLock);
+        ReleaseSRWLockShared(&FileSystem->OpGuardLock);
+    }
+}
+
+VOID FspFileSystemOpGuardEpochReleaseShared(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_OPGUARD_EPOCH *Epoch = FileSystem->OpGuardEpoch;
+
+    if (0 == Epoch)
+    {
+        ReleaseSRWLockShared(&FileSystem->OpGuardLock);
+        return;
+    }
+
+    InterlockedDecrement(&FspFileSystemOpGuardEpochSlot(Epoch)->Count);
+}
+
+VOID FspFileSystemOpGuardEpochAcquireExclusive(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_OPGUARD_EPOCH *Epoch;
+
+    AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
+
+    /* no epoch: no SHRD operations can be using it */
+    Epoch = FileSystem->OpGuardEpoch;
+    if (0 == Epoch)
+        return;
+
+    InterlockedExchange(&Epoch->Writer, 1);
+    for (ULONG I = 0; FspFileSystemOpGuardEpochSlotCount > I; I++)
+        for (ULONG SpinCount = 0; 0 != Epoch->Slots[I].Count; SpinCount++)
+        {
+            if (64 > SpinCount)
+                YieldProcessor();
+            else if (128 > SpinCount)
+                SwitchToThread();
+            else
+                Sleep(1);
+        }
+}
+
+VOID FspFileSystemOpGuardEpochReleaseExclusive(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_OPGUARD_EPOCH *Epoch = FileSystem->OpGuardEpoch;
+
+    if (0 != Epoch)
+        InterlockedExchange(&Epoch->Writer, 0);
+
+    ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
+}
+
+/*
+ * Striped operation guard
+ *
+ * See dll/opguard.h for the locking model. The stripes are allocated on first use. The
+ * stripe masks are recomputed from the request in Leave; this relies on the request file
+ * names being unchanged by the operation (they are restored if temporarily modified).
+ */
+typedef struct
+{
+    SRWLOCK Lock;
+    UINT8 Padding[64 - sizeof(SRWLOCK)];
+} FSP_FILE_SYSTEM_OPGUARD_STRIPE;
+
+static FSP_FILE_SYSTEM_OPGUARD_STRIPE *FspFileSystemOpGuardStripesGet(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_OPGUARD_STRIPE *Stripes, *PrevStripes;
+
+    Stripes = InterlockedCompareExchangePointer(&FileSystem->OpGuardStripes, 0, 0);
+    if (0 != Stripes)
+        return Stripes;
+
+    Stripes = MemAlloc(FSP_OPGUARD_STRIPE_COUNT * sizeof *Stripes);
+    if (0 == Stripes)
+        return 0;
+    memset(Stripes, 0, FSP_OPGUARD_STRIPE_COUNT * sizeof *Stripes);
+    for (ULONG I = 0; FSP_OPGUARD_STRIPE_COUNT > I; I++)
+        InitializeSRWLock(&Stripes[I].Lock);
+
+    PrevStripes = InterlockedCompareExchangePointer(&FileSystem->OpGuardStripes, Stripes, 0);
+    if (0 != PrevStripes)
+    {
+        MemFree(Stripes);
+        Stripes = PrevStripes;
+    }
+
+    return Stripes;
+}
+
+NTSTATUS FspFileSystemOpGuardStripedAcquire(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    FSP_FILE_SYSTEM_OPGUARD_STRIPE *Stripes;
+    FSP_OPGUARD_STRIPE_MASK Mask;
+    UINT64 Bit;
+
+    FspOpGuardStripeMaskFromRequest(&Mask, Request);
+    if (0 == (Mask.Shared | Mask.Exclusive))
+        return STATUS_SUCCESS;
+
+    Stripes = FspFileSystemOpGuardStripesGet(FileSystem);
+    if (0 == Stripes)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    /* acquire in ascending order to avoid deadlocks */
+    for (ULONG I = 0; FSP_OPGUARD_STRIPE_COUNT > I; I++)
+    {
+        Bit = (UINT64)1 << I;
+        if (Mask.Exclusive & Bit)
+            AcquireSRWLockExclusive(&Stripes[I].Lock);
+        else if (Mask.Shared & Bit)
+            AcquireSRWLockShared(&Stripes[I].Lock);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID FspFileSystemOpGuardStripedRelease(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    FSP_FILE_SYSTEM_OPGUARD_STRIPE *Stripes = FileSystem->OpGuardStripes;
+    FSP_OPGUARD_STRIPE_MASK Mask;
+    UINT64 Bit;
+
+    FspOpGuardStripeMaskFromRequest(&Mask, Request);
+    if (0 == (Mask.Shared | Mask.Exclusive))
+        return;
+
+    for (ULONG I = FSP_OPGUARD_STRIPE_COUNT; 0 < I; I--)
+    {
+        Bit = (UINT64)1 << (I - 1);
+        if (Mask.Exclusive & Bit)
+            ReleaseSRWLockExclusive(&Stripes[I - 1].Lock);
+        else if (Mask.Shared & Bit)
+            ReleaseSRWLockShared(&Stripes[I - 1].Lock);
+    }
+}
+
 FSP_API NTSTATUS FspFileSystemOpEnter(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
     switch (FileSystem->OpGuardStrategy)
     {
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE:
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_EPOCH:
         if ((FspFsctlTransactCreateKind == Request->Kind &&
                 FILE_OPEN != ((Request->Req.Create.CreateOptions >> 24) & 0xff)) ||
             FspFsctlTransactOverwriteKind == Request->Kind ||
@@ -58,7 +285,7 @@ FSP_API NTSTATUS FspFileSystemOpEnter(FSP_FILE_SYSTEM *FileSystem,
                 0 == Request->Req.FlushBuffers.UserContext &&
                 0 == Request->Req.FlushBuffers.UserContext2))
         {
-            AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
+            FspFileSystemOpGuardAcquireExclusive(FileSystem);
         }
         else
         if (FspFsctlTransactCreateKind == Request->Kind ||
@@ -67,13 +294,16 @@ FSP_API NTSTATUS FspFileSystemOpEnter(FSP_FILE_SYSTEM *FileSystem,
             FspFsctlTransactQueryDirectoryKind == Request->Kind ||
             FspFsctlTransactQueryVolumeInformationKind == Request->Kind)
         {
-            AcquireSRWLockShared(&FileSystem->OpGuardLock);
+            FspFileSystemOpGuardAcquireShared(FileSystem);
         }
         break;
 
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE:
         AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
         break;
+
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED:
+        return FspFileSystemOpGuardStripedAcquire(FileSystem, Request);
     }
 
     return STATUS_SUCCESS;
@@ -85,6 +315,7 @@ FSP_API NTSTATUS FspFileSystemOpLeave(FSP_FILE_SYSTEM *FileSystem,
     switch (FileSystem->OpGuardStrategy)
     {
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE:
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_EPOCH:
         if ((FspFsctlTransactCreateKind == Request->Kind &&
                 FILE_OPEN != ((Request->Req.Create.CreateOptions >> 24) & 0xff)) ||
             FspFsctlTransactOverwriteKind == Request->Kind ||
@@ -97,7 +328,7 @@ FSP_API NTSTATUS FspFileSystemOpLeave(FSP_FILE_SYSTEM *FileSystem,
                 0 == Request->Req.FlushBuffers.UserContext &&
                 0 == Request->Req.FlushBuffers.UserContext2))
         {
-            ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
+            FspFileSystemOpGuardReleaseExclusive(FileSystem);
         }
         else
         if (FspFsctlTransactCreateKind == Request->Kind ||
@@ -106,13 +337,17 @@ FSP_API NTSTATUS FspFileSystemOpLeave(FSP_FILE_SYSTEM *FileSystem,
             FspFsctlTransactQueryDirectoryKind == Request->Kind ||
             FspFsctlTransactQueryVolumeInformationKind == Request->Kind)
         {
-            ReleaseSRWLockShared(&FileSystem->OpGuardLock);
+            FspFileSystemOpGuardReleaseShared(FileSystem);
         }
         break;
 
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE:
         ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
         break;
+
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED:
+        FspFileSystemOpGuardStripedRelease(FileSystem, Request);
+        break;
     }
 
     return STATUS_SUCCESS;
@@ -888,6 +1123,10 @@ FSP_API NTSTATUS FspFileSystemOpCleanup(FSP_FILE_SYSTEM *FileSystem,
             (0 != Request->Req.Cleanup.SetLastWriteTime ? FspCleanupSetLastWriteTime : 0) |
             (0 != Request->Req.Cleanup.SetChangeTime ? FspCleanupSetChangeTime : 0));
 
+    if (0 != Request->Req.Cleanup.Delete)
+        FspFileSystemInvalidateTraverseCheckCache(FileSystem,
+            0 != Request->FileName.Size ? (PWSTR)Request->Buffer : 0);
+
     return STATUS_SUCCESS;
 }
 
@@ -974,6 +1213,9 @@ FSP_API NTSTATUS FspFileSystemOpFlushBuffers(FSP_FILE_SYSTEM *FileSystem,
     if (!NT_SUCCESS(Result))
         return Result;
 
+    if (STATUS_PENDING == Result)
+        return Result;
+
     memcpy(&Response->Rsp.FlushBuffers.FileInfo, &FileInfo, sizeof FileInfo);
     return STATUS_SUCCESS;
 }
@@ -1067,6 +1309,13 @@ FSP_API NTSTATUS FspFileSystemOpSetInformation(FSP_FILE_SYSTEM *FileSystem,
                 (PWSTR)Request->Buffer,
                 (PWSTR)(Request->Buffer + Request->Req.SetInformation.Info.Rename.NewFileName.Offset),
                 0 != Request->Req.SetInformation.Info.Rename.AccessToken);
+            if (NT_SUCCESS(Result))
+            {
+                FspFileSystemInvalidateTraverseCheckCache(FileSystem,
+                    (PWSTR)Request->Buffer);
+                FspFileSystemInvalidateTraverseCheckCache(FileSystem,
+                    (PWSTR)(Request->Buffer + Request->Req.SetInformation.Info.Rename.NewFileName.Offset));
+            }
         }
         break;
     }
@@ -1188,6 +1437,8 @@ FSP_API NTSTATUS FspFileSystemOpFileSystemControl(FSP_FILE_SYSTEM *FileSystem,
                 (PWSTR)Request->Buffer,
                 ReparseData,
                 Request->Req.FileSystemControl.Buffer.Size);
+            if (NT_SUCCESS(Result))
+                FspFileSystemInvalidateTraverseCheckCache(FileSystem, (PWSTR)Request->Buffer);
         }
         break;
     case FSCTL_DELETE_REPARSE_POINT:
@@ -1201,6 +1452,8 @@ FSP_API NTSTATUS FspFileSystemOpFileSystemControl(FSP_FILE_SYSTEM *FileSystem,
                 (PWSTR)Request->Buffer,
                 ReparseData,
                 Request->Req.FileSystemControl.Buffer.Size);
+            if (NT_SUCCESS(Result))
+                FspFileSystemInvalidateTraverseCheckCache(FileSystem, (PWSTR)Request->Buffer);
         }
         break;
     }
@@ -1233,13 +1486,21 @@ FSP_API NTSTATUS FspFileSystemOpQuerySecurity(FSP_FILE_SYSTEM *FileSystem,
 FSP_API NTSTATUS FspFileSystemOpSetSecurity(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
+    NTSTATUS Result;
+
     if (0 == FileSystem->Interface->SetSecurity)
         return STATUS_INVALID_DEVICE_REQUEST;
 
-    return FileSystem->Interface->SetSecurity(FileSystem,
+    Result = FileSystem->Interface->SetSecurity(FileSystem,
         (PVOID)ValOfFileContext(Request->Req.SetSecurity),
         Request->Req.SetSecurity.SecurityInformation,
         (PSECURITY_DESCRIPTOR)Request->Buffer);
+
+    /* the SetSecurity request does not carry a file name; discard everything */
+    if (NT_SUCCESS(Result))
+        FspFileSystemInvalidateTraverseCheckCache(FileSystem, 0);
+
+    return Result;
 }
 
 FSP_API NTSTATUS FspFileSystemOpQueryStreamInformation(FSP_FILE_SYSTEM *FileSystem,
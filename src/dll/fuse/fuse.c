@@ -36,9 +36,18 @@ struct fsp_fuse_core_opt_data
     int set_umask, umask,
         set_uid, uid,
         set_gid, gid,
+        set_entry_timeout, entry_timeout,
         set_attr_timeout, attr_timeout,
-        rellinks;
-    int set_FileInfoTimeout;
+        set_negative_timeout, negative_timeout,
+        AttrCache,
+        rellinks,
+        DirectoryWindow,
+        PassQueryDirectoryPattern;
+    int set_FileInfoTimeout,
+        set_VolumeInfoTimeout, VolumeInfoTimeout,
+        set_DirInfoTimeout, DirInfoTimeout,
+        set_SecurityTimeout, SecurityTimeout,
+        set_StreamInfoTimeout, StreamInfoTimeout;
     FSP_FSCTL_VOLUME_PARAMS VolumeParams;
     UINT16 VolumeLabelLength;
     WCHAR VolumeLabel[sizeof ((FSP_FSCTL_VOLUME_INFO *)0)->VolumeLabel / sizeof(WCHAR)];
@@ -73,11 +82,13 @@ static struct fuse_opt fsp_fuse_core_opts[] =
     FSP_FUSE_CORE_OPT("uid=%d", uid, 0),
     FSP_FUSE_CORE_OPT("gid=", set_gid, 1),
     FSP_FUSE_CORE_OPT("gid=%d", gid, 0),
-    FUSE_OPT_KEY("entry_timeout", FUSE_OPT_KEY_DISCARD),
+    FSP_FUSE_CORE_OPT("entry_timeout=", set_entry_timeout, 1),
+    FSP_FUSE_CORE_OPT("entry_timeout=%d", entry_timeout, 0),
     FSP_FUSE_CORE_OPT("attr_timeout=", set_attr_timeout, 1),
     FSP_FUSE_CORE_OPT("attr_timeout=%d", attr_timeout, 0),
     FUSE_OPT_KEY("ac_attr_timeout", FUSE_OPT_KEY_DISCARD),
-    FUSE_OPT_KEY("negative_timeout", FUSE_OPT_KEY_DISCARD),
+    FSP_FUSE_CORE_OPT("negative_timeout=", set_negative_timeout, 1),
+    FSP_FUSE_CORE_OPT("negative_timeout=%d", negative_timeout, 0),
     FUSE_OPT_KEY("noforget", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("intr", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("intr_signal=", FUSE_OPT_KEY_DISCARD),
@@ -96,6 +107,23 @@ static struct fuse_opt fsp_fuse_core_opts[] =
     FSP_FUSE_CORE_OPT("VolumeSerialNumber=%lx", VolumeParams.VolumeSerialNumber, 0),
     FSP_FUSE_CORE_OPT("FileInfoTimeout=", set_FileInfoTimeout, 1),
     FSP_FUSE_CORE_OPT("FileInfoTimeout=%d", VolumeParams.FileInfoTimeout, 0),
+    FSP_FUSE_CORE_OPT("FileInfoTimeoutMax=%d", VolumeParams.FileInfoTimeoutMax, 0),
+    FSP_FUSE_CORE_OPT("VolumeInfoTimeout=", set_VolumeInfoTimeout, 1),
+    FSP_FUSE_CORE_OPT("VolumeInfoTimeout=%d", VolumeInfoTimeout, 0),
+    FSP_FUSE_CORE_OPT("DirInfoTimeout=", set_DirInfoTimeout, 1),
+    FSP_FUSE_CORE_OPT("DirInfoTimeout=%d", DirInfoTimeout, 0),
+    FSP_FUSE_CORE_OPT("SecurityTimeout=", set_SecurityTimeout, 1),
+    FSP_FUSE_CORE_OPT("SecurityTimeout=%d", SecurityTimeout, 0),
+    FSP_FUSE_CORE_OPT("StreamInfoTimeout=", set_StreamInfoTimeout, 1),
+    FSP_FUSE_CORE_OPT("StreamInfoTimeout=%d", StreamInfoTimeout, 0),
+    FSP_FUSE_CORE_OPT("SecurityCacheCapacity=%u", VolumeParams.SecurityCacheCapacity, 0),
+    FSP_FUSE_CORE_OPT("DirInfoCacheCapacity=%u", VolumeParams.DirInfoCacheCapacity, 0),
+    FSP_FUSE_CORE_OPT("StreamInfoCacheCapacity=%u", VolumeParams.StreamInfoCacheCapacity, 0),
+    FSP_FUSE_CORE_OPT("DirectoryWindow=%d", DirectoryWindow, 0),
+    FSP_FUSE_CORE_OPT("PassQueryDirectoryPattern", PassQueryDirectoryPattern, 1),
+    FSP_FUSE_CORE_OPT("AttrCache", AttrCache, 1),
+    FSP_FUSE_CORE_OPT("ProcessBufferCapacity=%u", VolumeParams.ProcessBufferCapacity, 0),
+    FSP_FUSE_CORE_OPT("DataRingSize=%u", VolumeParams.DataRingSize, 0),
     FUSE_OPT_KEY("--UNC=", 'U'),
     FUSE_OPT_KEY("--VolumePrefix=", 'U'),
     FUSE_OPT_KEY("--FileSystemName=", 'F'),
@@ -301,6 +329,7 @@ static NTSTATUS fsp_fuse_svcstart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         context->private_data = f->data = f->ops.init(&conn);
         f->VolumeParams.ReadOnlyVolume = 0 != (conn.want & FSP_FUSE_CAP_READ_ONLY);
         f->VolumeParams.CaseSensitiveSearch = 0 == (conn.want & FSP_FUSE_CAP_CASE_INSENSITIVE);
+        f->VolumeParams.PrimeFileInfoFromDirInfo = 0 != (conn.want & FSP_FUSE_CAP_READDIR_PLUS);
         f->conn_want = conn.want;
     }
     f->fsinit = TRUE;
@@ -387,6 +416,10 @@ static NTSTATUS fsp_fuse_svcstart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
 
     f->FileSystem->UserContext = f;
     FspFileSystemSetOperationGuard(f->FileSystem, fsp_fuse_op_enter, fsp_fuse_op_leave);
+    /* a read-only volume has (almost) no EXCL operations; let SHRD operations avoid the lock */
+    if (f->VolumeParams.ReadOnlyVolume &&
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE == f->OpGuardStrategy)
+        f->OpGuardStrategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_EPOCH;
     FspFileSystemSetOperationGuardStrategy(f->FileSystem, f->OpGuardStrategy);
     FspFileSystemSetDebugLog(f->FileSystem, f->DebugLog);
 
@@ -424,6 +457,15 @@ static NTSTATUS fsp_fuse_svcstop(FSP_SERVICE *Service)
 
     FspFileSystemStopDispatcher(f->FileSystem);
 
+    if (0 != f->DebugLog)
+    {
+        FspDebugLog("FUSE: write getattr: %ld calls, %ld skipped\n",
+            f->WriteGetattrCount, f->WriteGetattrSkipCount);
+        if (fsp_fuse_cache_enabled(&f->AttrCache))
+            FspDebugLog("FUSE: attr cache: %ld hits, %ld negative hits, %ld misses\n",
+                f->AttrCache.HitCount, f->AttrCache.NegativeHitCount, f->AttrCache.MissCount);
+    }
+
     fsp_fuse_cleanup(f);
 
     return STATUS_SUCCESS;
@@ -465,7 +507,21 @@ static int fsp_fuse_core_opt_proc(void *opt_data0, const char *arg, int key,
             "    -o MaxComponentLength=N    max file name component length (deflt: 255)\n"
             "    -o VolumeCreationTime=T    volume creation time (FILETIME hex format)\n"
             "    -o VolumeSerialNumber=N    32-bit wide\n"
-            "    -o FileInfoTimeout=N       FileInfo/Security/VolumeInfo timeout (millisec)\n"
+            "    -o FileInfoTimeout=N       FileInfo timeout; default for other caches (millisec)\n"
+            "    -o FileInfoTimeoutMax=N    grow timeout of unchanging FileInfo up to N (millisec)\n"
+            "    -o VolumeInfoTimeout=N     VolumeInfo timeout (millisec)\n"
+            "    -o DirInfoTimeout=N        DirInfo timeout (millisec)\n"
+            "    -o SecurityTimeout=N       Security timeout (millisec)\n"
+            "    -o StreamInfoTimeout=N     StreamInfo timeout (millisec)\n"
+            "    -o SecurityCacheCapacity=N cached security descriptors (deflt: 0=auto; max 1000)\n"
+            "    -o DirInfoCacheCapacity=N  cached directory listings (deflt: 0=auto; max 1000)\n"
+            "    -o StreamInfoCacheCapacity=N  cached stream listings (deflt: 0=auto; max 1000)\n"
+            "    -o DirectoryWindow=N       stream directories through N byte window (deflt: 0=off)\n"
+            "    -o PassQueryDirectoryPattern  only return directory entries matching pattern\n"
+            "    -o AttrCache               cache getattr for entry/attr/negative_timeout\n"
+            "    -o ProcessBufferCapacity=N pooled I/O buffers per size class (deflt: 0=auto)\n"
+            "    -o DataRingSize=N          shared Read/Write payload ring bytes (deflt: 0=off)\n"
+            "                               (max 16MB; needs SeLockMemoryPrivilege)\n"
             "    --UNC=U --VolumePrefix=U   UNC prefix (\\Server\\Share)\n"
             "    --FileSystemName=FSN       Name of user mode file system\n");
         opt_data->help = 1;
@@ -528,6 +584,7 @@ FSP_FUSE_API struct fuse *fsp_fuse_new(struct fsp_fuse_env *env,
 {
     struct fuse *f = 0;
     struct fsp_fuse_core_opt_data opt_data;
+    UINT32 AttrCacheTimeout, NegativeCacheTimeout;
     ULONG Size;
     PWSTR ErrorMessage = L".";
     NTSTATUS Result;
@@ -578,7 +635,46 @@ FSP_FUSE_API struct fuse *fsp_fuse_new(struct fsp_fuse_env *env,
     }
 
     if (!opt_data.set_FileInfoTimeout && opt_data.set_attr_timeout)
-        opt_data.VolumeParams.FileInfoTimeout = opt_data.set_attr_timeout * 1000;
+        opt_data.VolumeParams.FileInfoTimeout = opt_data.attr_timeout * 1000;
+    if (opt_data.set_VolumeInfoTimeout)
+    {
+        opt_data.VolumeParams.VolumeInfoTimeoutValid = 1;
+        opt_data.VolumeParams.VolumeInfoTimeout = opt_data.VolumeInfoTimeout;
+    }
+    if (opt_data.set_DirInfoTimeout)
+    {
+        opt_data.VolumeParams.DirInfoTimeoutValid = 1;
+        opt_data.VolumeParams.DirInfoTimeout = opt_data.DirInfoTimeout;
+    }
+    if (opt_data.set_SecurityTimeout)
+    {
+        opt_data.VolumeParams.SecurityTimeoutValid = 1;
+        opt_data.VolumeParams.SecurityTimeout = opt_data.SecurityTimeout;
+    }
+    if (opt_data.set_StreamInfoTimeout)
+    {
+        opt_data.VolumeParams.StreamInfoTimeoutValid = 1;
+        opt_data.VolumeParams.StreamInfoTimeout = opt_data.StreamInfoTimeout;
+    }
+
+    /*
+     * The user mode attribute cache is only enabled with the AttrCache option, so that
+     * file systems that merely set attr_timeout (which sets FileInfoTimeout) see no change.
+     * Its timeouts come from the entry_timeout/attr_timeout and negative_timeout options;
+     * a positive entry lives for the shorter of the two timeouts.
+     */
+    AttrCacheTimeout = 0;
+    if (opt_data.AttrCache && (opt_data.set_entry_timeout || opt_data.set_attr_timeout))
+    {
+        int Timeout = opt_data.set_entry_timeout ? opt_data.entry_timeout : opt_data.attr_timeout;
+        if (opt_data.set_attr_timeout && opt_data.attr_timeout < Timeout)
+            Timeout = opt_data.attr_timeout;
+        AttrCacheTimeout = 0 < Timeout ? Timeout * 1000 : 0;
+    }
+    NegativeCacheTimeout = 0;
+    if (opt_data.AttrCache && opt_data.set_negative_timeout && 0 < opt_data.negative_timeout)
+        NegativeCacheTimeout = opt_data.negative_timeout * 1000;
+
     opt_data.VolumeParams.CaseSensitiveSearch = TRUE;
     opt_data.VolumeParams.PersistentAcls = TRUE;
     opt_data.VolumeParams.ReparsePoints = TRUE;
@@ -595,14 +691,22 @@ FSP_FUSE_API struct fuse *fsp_fuse_new(struct fsp_fuse_env *env,
         goto fail;
 
     f->env = env;
+    fsp_fuse_cache_initialize(&f->AttrCache, AttrCacheTimeout, NegativeCacheTimeout, 0);
     f->set_umask = opt_data.set_umask; f->umask = opt_data.umask;
     f->set_uid = opt_data.set_uid; f->uid = opt_data.uid;
     f->set_gid = opt_data.set_gid; f->gid = opt_data.gid;
     f->rellinks = opt_data.rellinks;
+    f->DirectoryWindow = opt_data.DirectoryWindow;
     memcpy(&f->ops, ops, opsize);
     f->data = data;
     f->DebugLog = opt_data.debug ? -1 : 0;
     memcpy(&f->VolumeParams, &opt_data.VolumeParams, sizeof opt_data.VolumeParams);
+    /*
+     * With the pattern passed, wildcard directory queries are filtered in user mode
+     * (and by readdir_pattern if present), but are no longer served from the DirInfo cache.
+     */
+    f->VolumeParams.PassQueryDirectoryPattern =
+        opt_data.PassQueryDirectoryPattern || 0 != f->ops.readdir_pattern;
     f->VolumeLabelLength = opt_data.VolumeLabelLength;
     memcpy(&f->VolumeLabel, &opt_data.VolumeLabel, opt_data.VolumeLabelLength);
 
@@ -661,6 +765,8 @@ FSP_FUSE_API void fsp_fuse_destroy(struct fsp_fuse_env *env,
 {
     fsp_fuse_cleanup(f);
 
+    fsp_fuse_cache_finalize(&f->AttrCache);
+
     fsp_fuse_obj_free(f->MountPoint);
 
     fsp_fuse_obj_free(f);
@@ -0,0 +1,180 @@
+/**
+ * @file dll/fuse/fuse_buf.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <dll/fuse/library.h>
+
+#define FSP_FUSE_BUF_BOUNCE_SIZE        (64 * 1024)
+
+#define fsp_fuse_buf_is_fd(buf)         (0 != ((buf)->flags & FUSE_BUF_IS_FD))
+
+FSP_FUSE_API size_t fsp_fuse_buf_size(struct fsp_fuse_env *env,
+    const struct fuse_bufvec *bufv)
+{
+    size_t i, size = 0;
+
+    for (i = 0; bufv->count > i; i++)
+    {
+        if ((size_t)-1 == bufv->buf[i].size)
+            return (size_t)-1;
+        size += bufv->buf[i].size;
+    }
+
+    return size;
+}
+
+static fuse_ssize_t fsp_fuse_buf_read(struct fsp_fuse_env *env,
+    const struct fuse_buf *buf, size_t off, void *mem, size_t size)
+{
+    size_t copied = 0;
+    fuse_ssize_t bytes;
+
+    if (0 == env->buf_pread)
+        return -EINVAL;
+
+    while (copied < size)
+    {
+        bytes = env->buf_pread(buf->fd, (PUINT8)mem + copied, size - copied,
+            (buf->flags & FUSE_BUF_FD_SEEK) ? buf->pos + (fuse_off_t)(off + copied) : -1);
+        if (0 > bytes)
+            return 0 == copied ? bytes : (fuse_ssize_t)copied;
+        if (0 == bytes)
+            break;
+
+        copied += bytes;
+
+        if (!(buf->flags & FUSE_BUF_FD_RETRY))
+            break;
+    }
+
+    return copied;
+}
+
+static fuse_ssize_t fsp_fuse_buf_write(struct fsp_fuse_env *env,
+    const struct fuse_buf *buf, size_t off, const void *mem, size_t size)
+{
+    size_t copied = 0;
+    fuse_ssize_t bytes;
+
+    if (0 == env->buf_pwrite)
+        return -EINVAL;
+
+    while (copied < size)
+    {
+        bytes = env->buf_pwrite(buf->fd, (PUINT8)mem + copied, size - copied,
+            (buf->flags & FUSE_BUF_FD_SEEK) ? buf->pos + (fuse_off_t)(off + copied) : -1);
+        if (0 > bytes)
+            return 0 == copied ? bytes : (fuse_ssize_t)copied;
+        if (0 == bytes)
+            break;
+
+        copied += bytes;
+
+        if (!(buf->flags & FUSE_BUF_FD_RETRY))
+            break;
+    }
+
+    return copied;
+}
+
+FSP_FUSE_API fuse_ssize_t fsp_fuse_buf_copy(struct fsp_fuse_env *env,
+    struct fuse_bufvec *dst, struct fuse_bufvec *src, enum fuse_buf_copy_flags flags)
+{
+    struct fuse_buf *dstbuf, *srcbuf;
+    PUINT8 bounce = 0;
+    size_t copied = 0, len;
+    fuse_ssize_t bytes;
+
+    for (;;)
+    {
+        if (dst->idx >= dst->count || src->idx >= src->count)
+            break;
+
+        dstbuf = &dst->buf[dst->idx];
+        srcbuf = &src->buf[src->idx];
+        if (dst->off >= dstbuf->size)
+        {
+            dst->idx++;
+            dst->off = 0;
+            continue;
+        }
+        if (src->off >= srcbuf->size)
+        {
+            src->idx++;
+            src->off = 0;
+            continue;
+        }
+
+        len = dstbuf->size - dst->off;
+        if (len > srcbuf->size - src->off)
+            len = srcbuf->size - src->off;
+
+        if (!fsp_fuse_buf_is_fd(dstbuf) && !fsp_fuse_buf_is_fd(srcbuf))
+        {
+            memcpy((PUINT8)dstbuf->mem + dst->off, (PUINT8)srcbuf->mem + src->off, len);
+            bytes = len;
+        }
+        else if (!fsp_fuse_buf_is_fd(dstbuf))
+            bytes = fsp_fuse_buf_read(env, srcbuf, src->off,
+                (PUINT8)dstbuf->mem + dst->off, len);
+        else if (!fsp_fuse_buf_is_fd(srcbuf))
+            bytes = fsp_fuse_buf_write(env, dstbuf, dst->off,
+                (PUINT8)srcbuf->mem + src->off, len);
+        else
+        {
+            /* fd to fd: go through a bounce buffer */
+            if (0 == bounce)
+            {
+                bounce = MemAlloc(FSP_FUSE_BUF_BOUNCE_SIZE);
+                if (0 == bounce)
+                {
+                    bytes = -ENOMEM;
+                    goto fail;
+                }
+            }
+
+            if (len > FSP_FUSE_BUF_BOUNCE_SIZE)
+                len = FSP_FUSE_BUF_BOUNCE_SIZE;
+
+            bytes = fsp_fuse_buf_read(env, srcbuf, src->off, bounce, len);
+            if (0 < bytes)
+            {
+                len = bytes;
+                bytes = fsp_fuse_buf_write(env, dstbuf, dst->off, bounce, len);
+            }
+        }
+
+        if (0 > bytes)
+            goto fail;
+
+        copied += bytes;
+        dst->off += bytes;
+        src->off += bytes;
+
+        /* short transfer: end of file or partial I/O */
+        if ((size_t)bytes < len)
+            break;
+    }
+
+    MemFree(bounce);
+
+    return copied;
+
+fail:
+    MemFree(bounce);
+
+    return 0 == copied ? bytes : (fuse_ssize_t)copied;
+}
@@ -0,0 +1,218 @@
+/**
+ * @file dll/fuse/fuse_cache.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <dll/fuse/fuse_cache.h>
+#include <shared/minimal.h>
+#include <errno.h>
+
+struct fsp_fuse_cache_entry
+{
+    struct fsp_fuse_cache_entry *next;
+    UINT64 ExpirationTime;
+    int err;
+    struct fuse_stat stbuf;
+    char PosixPath[];
+};
+
+static inline struct fsp_fuse_cache_entry **fsp_fuse_cache_bucket(struct fsp_fuse_cache *cache,
+    const char *PosixPath)
+{
+    return &cache->Buckets[fsp_fuse_cache_hash(PosixPath) % FSP_FUSE_CACHE_BUCKET_COUNT];
+}
+
+VOID fsp_fuse_cache_initialize(struct fsp_fuse_cache *cache,
+    UINT32 AttrTimeout, UINT32 NegativeTimeout, ULONG Capacity)
+{
+    memset(cache, 0, sizeof *cache);
+    InitializeSRWLock(&cache->Lock);
+    cache->AttrTimeout = AttrTimeout;
+    cache->NegativeTimeout = NegativeTimeout;
+    cache->Capacity = 0 != Capacity ? Capacity : FSP_FUSE_CACHE_CAPACITY;
+}
+
+VOID fsp_fuse_cache_finalize(struct fsp_fuse_cache *cache)
+{
+    fsp_fuse_cache_invalidate_all(cache);
+}
+
+static BOOLEAN fsp_fuse_cache_lookup(struct fsp_fuse_cache *cache,
+    const char *PosixPath, struct fuse_stat *stbuf, int *perr, UINT64 *PGeneration)
+{
+    struct fsp_fuse_cache_entry *entry;
+    UINT64 CurrentTime = GetTickCount64();
+    BOOLEAN Result = FALSE;
+
+    AcquireSRWLockShared(&cache->Lock);
+
+    *PGeneration = cache->Generation;
+
+    for (entry = *fsp_fuse_cache_bucket(cache, PosixPath); 0 != entry; entry = entry->next)
+        if (0 == invariant_strcmp(entry->PosixPath, PosixPath))
+        {
+            if (entry->ExpirationTime > CurrentTime)
+            {
+                *perr = entry->err;
+                if (0 == entry->err)
+                    memcpy(stbuf, &entry->stbuf, sizeof *stbuf);
+                Result = TRUE;
+            }
+            break;
+        }
+
+    ReleaseSRWLockShared(&cache->Lock);
+
+    return Result;
+}
+
+static VOID fsp_fuse_cache_insert(struct fsp_fuse_cache *cache,
+    const char *PosixPath, const struct fuse_stat *stbuf, int err, UINT64 Generation)
+{
+    struct fsp_fuse_cache_entry **pbucket, **pentry, *entry, *newentry;
+    UINT32 Timeout = 0 == err ? cache->AttrTimeout : cache->NegativeTimeout;
+    size_t PathSize;
+
+    if (0 == Timeout)
+        return;
+
+    PathSize = lstrlenA(PosixPath) + 1;
+    newentry = MemAlloc(sizeof *newentry + PathSize);
+    if (0 == newentry)
+        return;
+    newentry->ExpirationTime = GetTickCount64() + Timeout;
+    newentry->err = err;
+    if (0 == err)
+        memcpy(&newentry->stbuf, stbuf, sizeof *stbuf);
+    memcpy(newentry->PosixPath, PosixPath, PathSize);
+
+    AcquireSRWLockExclusive(&cache->Lock);
+
+    /* the path may have been invalidated while getattr was running; do not cache stale data */
+    if (Generation != cache->Generation)
+    {
+        ReleaseSRWLockExclusive(&cache->Lock);
+        MemFree(newentry);
+        return;
+    }
+
+    pbucket = fsp_fuse_cache_bucket(cache, PosixPath);
+
+    /* remove an existing entry for the same path */
+    for (pentry = pbucket; 0 != (entry = *pentry); pentry = &entry->next)
+        if (0 == invariant_strcmp(entry->PosixPath, PosixPath))
+        {
+            *pentry = entry->next;
+            cache->Count--;
+            MemFree(entry);
+            break;
+        }
+
+    /* when full evict the oldest entry in this bucket (entries are inserted at the head) */
+    if (cache->Count >= cache->Capacity)
+    {
+        for (pentry = pbucket; 0 != (entry = *pentry) && 0 != entry->next; pentry = &entry->next)
+            ;
+        if (0 == entry)
+        {
+            ReleaseSRWLockExclusive(&cache->Lock);
+            MemFree(newentry);
+            return;
+        }
+        *pentry = 0;
+        cache->Count--;
+        MemFree(entry);
+    }
+
+    newentry->next = *pbucket;
+    *pbucket = newentry;
+    cache->Count++;
+
+    ReleaseSRWLockExclusive(&cache->Lock);
+}
+
+int fsp_fuse_cache_getattr(struct fsp_fuse_cache *cache, const struct fuse_operations *ops,
+    const char *PosixPath, struct fuse_stat *stbuf)
+{
+    UINT64 Generation;
+    int err;
+
+    if (0 == ops->getattr)
+        return -ENOSYS;
+
+    if (!fsp_fuse_cache_enabled(cache))
+        return ops->getattr(PosixPath, stbuf);
+
+    if (fsp_fuse_cache_lookup(cache, PosixPath, stbuf, &err, &Generation))
+    {
+        InterlockedIncrement(0 == err ? &cache->HitCount : &cache->NegativeHitCount);
+        return err;
+    }
+
+    InterlockedIncrement(&cache->MissCount);
+
+    err = ops->getattr(PosixPath, stbuf);
+    if (0 == err || -ENOENT == err)
+        fsp_fuse_cache_insert(cache, PosixPath, stbuf, err, Generation);
+
+    return err;
+}
+
+VOID fsp_fuse_cache_invalidate(struct fsp_fuse_cache *cache, const char *PosixPath)
+{
+    struct fsp_fuse_cache_entry **pentry, *entry;
+
+    if (!fsp_fuse_cache_enabled(cache))
+        return;
+
+    AcquireSRWLockExclusive(&cache->Lock);
+
+    cache->Generation++;
+
+    for (pentry = fsp_fuse_cache_bucket(cache, PosixPath); 0 != (entry = *pentry);)
+        if (0 == invariant_stricmp(entry->PosixPath, PosixPath))
+        {
+            *pentry = entry->next;
+            cache->Count--;
+            MemFree(entry);
+        }
+        else
+            pentry = &entry->next;
+
+    ReleaseSRWLockExclusive(&cache->Lock);
+}
+
+VOID fsp_fuse_cache_invalidate_all(struct fsp_fuse_cache *cache)
+{
+    struct fsp_fuse_cache_entry *entry, *nextentry;
+    ULONG Index;
+
+    AcquireSRWLockExclusive(&cache->Lock);
+
+    cache->Generation++;
+
+    for (Index = 0; FSP_FUSE_CACHE_BUCKET_COUNT > Index; Index++)
+    {
+        for (entry = cache->Buckets[Index]; 0 != entry; entry = nextentry)
+        {
+            nextentry = entry->next;
+            MemFree(entry);
+        }
+        cache->Buckets[Index] = 0;
+    }
+    cache->Count = 0;
+
+    ReleaseSRWLockExclusive(&cache->Lock);
+}
@@ -0,0 +1,83 @@
+/**
+ * @file dll/fuse/fuse_cache.h
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_DLL_FUSE_CACHE_H_INCLUDED
+#define WINFSP_DLL_FUSE_CACHE_H_INCLUDED
+
+#include <winfsp/winfsp.h>
+#include <fuse/fuse.h>
+
+/*
+ * Path-keyed attribute cache
+ *
+ * The cache remembers the result of getattr for a path: either the returned stat buffer
+ * (a positive entry that lives for the attribute timeout) or -ENOENT (a negative entry that
+ * lives for the negative timeout). A zero timeout disables the respective kind of entry.
+ *
+ * Entries are kept in a hash table that is bucketed by an ASCII case-insensitive hash of
+ * the path. Lookups match paths exactly, but invalidations remove all entries whose path
+ * matches case-insensitively; this keeps the cache correct for both case-sensitive and
+ * case-insensitive file systems without knowing which one it is dealing with.
+ *
+ * The cache does not depend on the rest of the FUSE layer and can be exercised against a
+ * stub fuse_operations table.
+ */
+
+#define FSP_FUSE_CACHE_BUCKET_COUNT     1024
+#define FSP_FUSE_CACHE_CAPACITY         (4 * FSP_FUSE_CACHE_BUCKET_COUNT)
+
+struct fsp_fuse_cache_entry;
+
+struct fsp_fuse_cache
+{
+    SRWLOCK Lock;
+    UINT32 AttrTimeout, NegativeTimeout;
+    ULONG Count, Capacity;
+    UINT64 Generation;
+    LONG HitCount, NegativeHitCount, MissCount;
+    struct fsp_fuse_cache_entry *Buckets[FSP_FUSE_CACHE_BUCKET_COUNT];
+};
+
+static inline UINT32 fsp_fuse_cache_hash(const char *PosixPath)
+{
+    UINT32 h = 2166136261;
+
+    for (; *PosixPath; PosixPath++)
+    {
+        UINT8 c = *PosixPath;
+        if ('A' <= c && c <= 'Z')
+            c += 'a' - 'A';
+        h = (h ^ c) * 16777619;
+    }
+
+    return h;
+}
+
+static inline BOOLEAN fsp_fuse_cache_enabled(struct fsp_fuse_cache *cache)
+{
+    return 0 != cache->AttrTimeout || 0 != cache->NegativeTimeout;
+}
+
+VOID fsp_fuse_cache_initialize(struct fsp_fuse_cache *cache,
+    UINT32 AttrTimeout, UINT32 NegativeTimeout, ULONG Capacity);
+VOID fsp_fuse_cache_finalize(struct fsp_fuse_cache *cache);
+int fsp_fuse_cache_getattr(struct fsp_fuse_cache *cache, const struct fuse_operations *ops,
+    const char *PosixPath, struct fuse_stat *stbuf);
+VOID fsp_fuse_cache_invalidate(struct fsp_fuse_cache *cache, const char *PosixPath);
+VOID fsp_fuse_cache_invalidate_all(struct fsp_fuse_cache *cache);
+
+#endif
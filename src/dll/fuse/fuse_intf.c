@@ -18,12 +18,13 @@
 #include <dll/fuse/library.h>
 
 static inline
-VOID fsp_fuse_op_enter_lock(FSP_FILE_SYSTEM *FileSystem,
+NTSTATUS fsp_fuse_op_enter_lock(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
     switch (FileSystem->OpGuardStrategy)
     {
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE:
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_EPOCH:
         if ((FspFsctlTransactCreateKind == Request->Kind &&
                 FILE_OPEN != ((Request->Req.Create.CreateOptions >> 24) & 0xff)) ||
             FspFsctlTransactOverwriteKind == Request->Kind ||
@@ -39,7 +40,7 @@ VOID fsp_fuse_op_enter_lock(FSP_FILE_SYSTEM *FileSystem,
             (FspFsctlTransactFileSystemControlKind == Request->Kind &&
                 FSCTL_SET_REPARSE_POINT == Request->Req.FileSystemControl.FsControlCode))
         {
-            AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
+            FspFileSystemOpGuardAcquireExclusive(FileSystem);
         }
         else
         if (FspFsctlTransactCreateKind == Request->Kind ||
@@ -51,14 +52,19 @@ VOID fsp_fuse_op_enter_lock(FSP_FILE_SYSTEM *FileSystem,
             (FspFsctlTransactFileSystemControlKind == Request->Kind &&
                 FSCTL_GET_REPARSE_POINT == Request->Req.FileSystemControl.FsControlCode))
         {
-            AcquireSRWLockShared(&FileSystem->OpGuardLock);
+            FspFileSystemOpGuardAcquireShared(FileSystem);
         }
         break;
 
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE:
         AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
         break;
+
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED:
+        return FspFileSystemOpGuardStripedAcquire(FileSystem, Request);
     }
+
+    return STATUS_SUCCESS;
 }
 
 static inline
@@ -68,6 +74,7 @@ VOID fsp_fuse_op_leave_unlock(FSP_FILE_SYSTEM *FileSystem,
     switch (FileSystem->OpGuardStrategy)
     {
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE:
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_EPOCH:
         if ((FspFsctlTransactCreateKind == Request->Kind &&
                 FILE_OPEN != ((Request->Req.Create.CreateOptions >> 24) & 0xff)) ||
             FspFsctlTransactOverwriteKind == Request->Kind ||
@@ -83,7 +90,7 @@ VOID fsp_fuse_op_leave_unlock(FSP_FILE_SYSTEM *FileSystem,
             (FspFsctlTransactFileSystemControlKind == Request->Kind &&
                 FSCTL_SET_REPARSE_POINT == Request->Req.FileSystemControl.FsControlCode))
         {
-            ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
+            FspFileSystemOpGuardReleaseExclusive(FileSystem);
         }
         else
         if (FspFsctlTransactCreateKind == Request->Kind ||
@@ -95,13 +102,17 @@ VOID fsp_fuse_op_leave_unlock(FSP_FILE_SYSTEM *FileSystem,
             (FspFsctlTransactFileSystemControlKind == Request->Kind &&
                 FSCTL_GET_REPARSE_POINT == Request->Req.FileSystemControl.FsControlCode))
         {
-            ReleaseSRWLockShared(&FileSystem->OpGuardLock);
+            FspFileSystemOpGuardReleaseShared(FileSystem);
         }
         break;
 
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE:
         ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
         break;
+
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED:
+        FspFileSystemOpGuardStripedRelease(FileSystem, Request);
+        break;
     }
 }
 
@@ -156,7 +167,9 @@ NTSTATUS fsp_fuse_op_enter(FSP_FILE_SYSTEM *FileSystem,
         goto exit;
     }
 
-    fsp_fuse_op_enter_lock(FileSystem, Request, Response);
+    Result = fsp_fuse_op_enter_lock(FileSystem, Request, Response);
+    if (!NT_SUCCESS(Result))
+        goto exit;
 
     context->fuse = f;
     context->private_data = f->data;
@@ -310,6 +323,99 @@ static BOOLEAN fsp_fuse_intf_CheckSymlinkDirectory(FSP_FILE_SYSTEM *FileSystem,
     return Result;
 }
 
+/*
+ * Per-open-file FileInfo cache
+ *
+ * Write needs the current file size to handle WriteToEndOfFile and ConstrainedIo. Rather
+ * than issuing a getattr before every write, every open file remembers the FileInfo that
+ * it last saw. Every change to a file (through any open file) bumps a generation counter
+ * that is selected by hashing the file's path; a cached FileInfo is only used if its
+ * generation is still current and it has not outlived FileInfoTimeout, which bounds how
+ * long changes made behind our back go unnoticed. Hash collisions only cause spurious
+ * invalidations.
+ */
+static inline PLONG fsp_fuse_intf_FileInfoGenerationSlot(struct fuse *f, const char *PosixPath)
+{
+    /* case-insensitive so that all spellings of a name share a slot */
+    return &f->FileInfoGeneration[fsp_fuse_cache_hash(PosixPath) %
+        FSP_FUSE_FILEINFO_GENERATION_COUNT];
+}
+
+static inline LONG fsp_fuse_intf_InvalidateFileInfo(struct fuse *f, const char *PosixPath)
+{
+    fsp_fuse_cache_invalidate(&f->AttrCache, PosixPath);
+    return InterlockedIncrement(fsp_fuse_intf_FileInfoGenerationSlot(f, PosixPath));
+}
+
+/*
+ * A name was added to or removed from a directory: invalidate the path (including any
+ * negative entry for it) and the parent directory whose times have changed.
+ */
+static VOID fsp_fuse_intf_InvalidateEntry(struct fuse *f, const char *PosixPath)
+{
+    const char *Slash = 0, *p;
+    char *ParentPath;
+    size_t Length;
+
+    fsp_fuse_intf_InvalidateFileInfo(f, PosixPath);
+
+    if (!fsp_fuse_cache_enabled(&f->AttrCache))
+        return;
+
+    for (p = PosixPath; *p; p++)
+        if ('/' == *p)
+            Slash = p;
+    if (0 == Slash)
+        return;
+
+    Length = Slash != PosixPath ? Slash - PosixPath : 1;
+    ParentPath = MemAlloc(Length + 1);
+    if (0 == ParentPath)
+    {
+        fsp_fuse_cache_invalidate_all(&f->AttrCache);
+        return;
+    }
+    memcpy(ParentPath, PosixPath, Length);
+    ParentPath[Length] = '\0';
+
+    fsp_fuse_cache_invalidate(&f->AttrCache, ParentPath);
+
+    MemFree(ParentPath);
+}
+
+static inline VOID fsp_fuse_intf_SetCachedFileInfo(struct fuse *f,
+    struct fsp_fuse_file_desc *filedesc, LONG Generation, const FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    if (0 == f->VolumeParams.FileInfoTimeout)
+        return;
+
+    AcquireSRWLockExclusive(&filedesc->FileInfoLock);
+    filedesc->FileInfoGeneration = Generation;
+    filedesc->FileInfoExpirationTime = GetTickCount64() + f->VolumeParams.FileInfoTimeout;
+    memcpy(&filedesc->FileInfo, FileInfo, sizeof *FileInfo);
+    ReleaseSRWLockExclusive(&filedesc->FileInfoLock);
+}
+
+static inline BOOLEAN fsp_fuse_intf_GetCachedFileInfo(struct fuse *f,
+    struct fsp_fuse_file_desc *filedesc, PLONG PGeneration, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    BOOLEAN Valid;
+
+    AcquireSRWLockShared(&filedesc->FileInfoLock);
+    Valid = 0 != filedesc->FileInfoExpirationTime &&
+        filedesc->FileInfoGeneration ==
+            *fsp_fuse_intf_FileInfoGenerationSlot(f, filedesc->PosixPath) &&
+        filedesc->FileInfoExpirationTime > GetTickCount64();
+    if (Valid)
+    {
+        *PGeneration = filedesc->FileInfoGeneration;
+        memcpy(FileInfo, &filedesc->FileInfo, sizeof *FileInfo);
+    }
+    ReleaseSRWLockShared(&filedesc->FileInfoLock);
+
+    return Valid;
+}
+
 #define fsp_fuse_intf_GetFileInfoEx(FileSystem, PosixPath, fi, PUid, PGid, PMode, FileInfo)\
     fsp_fuse_intf_GetFileInfoFunnel(FileSystem, PosixPath, fi, 0, PUid, PGid, PMode, 0, FileInfo)
 static NTSTATUS fsp_fuse_intf_GetFileInfoFunnel(FSP_FILE_SYSTEM *FileSystem,
@@ -332,7 +438,7 @@ static NTSTATUS fsp_fuse_intf_GetFileInfoFunnel(FSP_FILE_SYSTEM *FileSystem,
         if (0 != f->ops.fgetattr && 0 != fi && -1 != fi->fh)
             err = f->ops.fgetattr(PosixPath, (void *)&stbuf, fi);
         else if (0 != f->ops.getattr)
-            err = f->ops.getattr(PosixPath, (void *)&stbuf);
+            err = fsp_fuse_cache_getattr(&f->AttrCache, &f->ops, PosixPath, (void *)&stbuf);
         else
             return STATUS_INVALID_DEVICE_REQUEST;
 
@@ -782,6 +888,7 @@ static NTSTATUS fsp_fuse_intf_Create(FSP_FILE_SYSTEM *FileSystem,
         else
             Result = STATUS_INVALID_DEVICE_REQUEST;
     }
+    fsp_fuse_intf_InvalidateEntry(f, contexthdr->PosixPath);
     if (!NT_SUCCESS(Result))
         goto exit;
 
@@ -821,6 +928,9 @@ static NTSTATUS fsp_fuse_intf_Create(FSP_FILE_SYSTEM *FileSystem,
     filedesc->OpenFlags = fi.flags;
     filedesc->FileHandle = fi.fh;
     filedesc->DirBuffer = 0;
+    InitializeSRWLock(&filedesc->FileInfoLock);
+    filedesc->FileInfoGeneration = 0;
+    filedesc->FileInfoExpirationTime = 0;
     contexthdr->PosixPath = 0;
 
     Result = STATUS_SUCCESS;
@@ -938,6 +1048,9 @@ static NTSTATUS fsp_fuse_intf_Open(FSP_FILE_SYSTEM *FileSystem,
     filedesc->OpenFlags = fi.flags;
     filedesc->FileHandle = fi.fh;
     filedesc->DirBuffer = 0;
+    InitializeSRWLock(&filedesc->FileInfoLock);
+    filedesc->FileInfoGeneration = 0;
+    filedesc->FileInfoExpirationTime = 0;
     contexthdr->PosixPath = 0;
 
     Result = STATUS_SUCCESS;
@@ -979,6 +1092,7 @@ static NTSTATUS fsp_fuse_intf_Overwrite(FSP_FILE_SYSTEM *FileSystem,
     }
     else
         Result = STATUS_INVALID_DEVICE_REQUEST;
+    fsp_fuse_intf_InvalidateFileInfo(f, filedesc->PosixPath);
     if (!NT_SUCCESS(Result))
         return Result;
 
@@ -1020,6 +1134,9 @@ static VOID fsp_fuse_intf_Cleanup(FSP_FILE_SYSTEM *FileSystem,
             if (0 != f->ops.unlink)
                 f->ops.unlink(filedesc->PosixPath);
         }
+
+    if (Flags & FspCleanupDelete)
+        fsp_fuse_intf_InvalidateEntry(f, filedesc->PosixPath);
 }
 
 static VOID fsp_fuse_intf_Close(FSP_FILE_SYSTEM *FileSystem,
@@ -1062,29 +1179,59 @@ static NTSTATUS fsp_fuse_intf_Read(FSP_FILE_SYSTEM *FileSystem,
     struct fuse *f = FileSystem->UserContext;
     struct fsp_fuse_file_desc *filedesc = FileNode;
     struct fuse_file_info fi;
-    int bytes;
+    fuse_ssize_t bytes;
     NTSTATUS Result;
 
     if (filedesc->IsDirectory || filedesc->IsReparsePoint)
         return STATUS_ACCESS_DENIED;
 
-    if (0 == f->ops.read)
+    if (0 == f->ops.read_buf && 0 == f->ops.read)
         return STATUS_INVALID_DEVICE_REQUEST;
 
     memset(&fi, 0, sizeof fi);
     fi.flags = filedesc->OpenFlags;
     fi.fh = filedesc->FileHandle;
 
-    bytes = f->ops.read(filedesc->PosixPath, Buffer, Length, Offset, &fi);
+    if (0 != f->ops.read_buf)
+    {
+        /*
+         * The file system returns a vector of memory and/or file descriptor buffers;
+         * copy it once into the transact buffer and free it as libfuse does.
+         */
+        struct fuse_bufvec *bufv = 0;
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(Length);
+        size_t i;
+        int err;
+
+        err = f->ops.read_buf(filedesc->PosixPath, &bufv, Length, Offset, &fi);
+        if (0 == err && 0 != bufv)
+        {
+            dst.buf[0].mem = Buffer;
+            bytes = fsp_fuse_buf_copy(f->env, &dst, bufv, 0);
+        }
+        else
+            bytes = 0 != err ? err : -EIO;
+
+        if (0 != bufv)
+        {
+            for (i = 0; bufv->count > i; i++)
+                if (!(bufv->buf[i].flags & FUSE_BUF_IS_FD))
+                    f->env->memfree(bufv->buf[i].mem);
+            f->env->memfree(bufv);
+        }
+    }
+    else
+        bytes = f->ops.read(filedesc->PosixPath, Buffer, Length, Offset, &fi);
+
     if (0 < bytes)
     {
-        *PBytesTransferred = bytes;
+        *PBytesTransferred = (ULONG)bytes;
         Result = STATUS_SUCCESS;
     }
     else if (0 == bytes)
         Result = STATUS_END_OF_FILE;
     else
-        Result = fsp_fuse_ntstatus_from_errno(f->env, bytes);
+        Result = fsp_fuse_ntstatus_from_errno(f->env, (int)bytes);
 
     return Result;
 }
@@ -1100,23 +1247,34 @@ static NTSTATUS fsp_fuse_intf_Write(FSP_FILE_SYSTEM *FileSystem,
     struct fuse_file_info fi;
     FSP_FSCTL_FILE_INFO FileInfoBuf;
     UINT64 EndOffset, AllocationUnit;
+    LONG Generation;
     int bytes;
     NTSTATUS Result;
 
     if (filedesc->IsDirectory || filedesc->IsReparsePoint)
         return STATUS_ACCESS_DENIED;
 
-    if (0 == f->ops.write)
+    if (0 == f->ops.write_buf && 0 == f->ops.write)
         return STATUS_INVALID_DEVICE_REQUEST;
 
     memset(&fi, 0, sizeof fi);
     fi.flags = filedesc->OpenFlags;
     fi.fh = filedesc->FileHandle;
 
-    Result = fsp_fuse_intf_GetFileInfoEx(FileSystem, filedesc->PosixPath, &fi,
-        &Uid, &Gid, &Mode, &FileInfoBuf);
-    if (!NT_SUCCESS(Result))
-        return Result;
+    if (fsp_fuse_intf_GetCachedFileInfo(f, filedesc, &Generation, &FileInfoBuf))
+    {
+        InterlockedIncrement(&f->WriteGetattrSkipCount);
+    }
+    else
+    {
+        Generation = *fsp_fuse_intf_FileInfoGenerationSlot(f, filedesc->PosixPath);
+        Result = fsp_fuse_intf_GetFileInfoEx(FileSystem, filedesc->PosixPath, &fi,
+            &Uid, &Gid, &Mode, &FileInfoBuf);
+        if (!NT_SUCCESS(Result))
+            return Result;
+        InterlockedIncrement(&f->WriteGetattrCount);
+        fsp_fuse_intf_SetCachedFileInfo(f, filedesc, Generation, &FileInfoBuf);
+    }
 
     if (ConstrainedIo)
     {
@@ -1133,17 +1291,38 @@ static NTSTATUS fsp_fuse_intf_Write(FSP_FILE_SYSTEM *FileSystem,
         EndOffset = Offset + Length;
     }
 
-    bytes = f->ops.write(filedesc->PosixPath, Buffer, (size_t)(EndOffset - Offset), Offset, &fi);
+    if (0 != f->ops.write_buf)
+    {
+        struct fuse_bufvec src = FUSE_BUFVEC_INIT((size_t)(EndOffset - Offset));
+
+        src.buf[0].mem = Buffer;
+        bytes = f->ops.write_buf(filedesc->PosixPath, &src, Offset, &fi);
+    }
+    else
+        bytes = f->ops.write(filedesc->PosixPath, Buffer, (size_t)(EndOffset - Offset), Offset, &fi);
     if (0 > bytes)
+    {
+        fsp_fuse_intf_InvalidateFileInfo(f, filedesc->PosixPath);
         return fsp_fuse_ntstatus_from_errno(f->env, bytes);
+    }
 
     *PBytesTransferred = bytes;
 
     AllocationUnit = (UINT64)f->VolumeParams.SectorSize *
         (UINT64)f->VolumeParams.SectorsPerAllocationUnit;
-    FileInfoBuf.FileSize = Offset + bytes;
-    FileInfoBuf.AllocationSize =
-        (FileInfoBuf.FileSize + AllocationUnit - 1) / AllocationUnit * AllocationUnit;
+    if (FileInfoBuf.FileSize < Offset + bytes)
+    {
+        FileInfoBuf.FileSize = Offset + bytes;
+        FileInfoBuf.AllocationSize =
+            (FileInfoBuf.FileSize + AllocationUnit - 1) / AllocationUnit * AllocationUnit;
+    }
+
+    /*
+     * Invalidate other open files. Keep our own view current, unless someone else changed
+     * the file between our getattr (or cache lookup) and our write.
+     */
+    if (Generation + 1 == fsp_fuse_intf_InvalidateFileInfo(f, filedesc->PosixPath))
+        fsp_fuse_intf_SetCachedFileInfo(f, filedesc, Generation + 1, &FileInfoBuf);
 
 success:
     memcpy(FileInfo, &FileInfoBuf, sizeof FileInfoBuf);
@@ -1289,6 +1468,7 @@ static NTSTATUS fsp_fuse_intf_SetBasicInfo(FSP_FILE_SYSTEM *FileSystem,
         err = f->ops.utime(filedesc->PosixPath, &timbuf);
         Result = fsp_fuse_ntstatus_from_errno(f->env, err);
     }
+    fsp_fuse_intf_InvalidateFileInfo(f, filedesc->PosixPath);
     if (!NT_SUCCESS(Result))
         return Result;
 
@@ -1342,6 +1522,7 @@ static NTSTATUS fsp_fuse_intf_SetFileSize(FSP_FILE_SYSTEM *FileSystem,
             err = f->ops.truncate(filedesc->PosixPath, NewSize);
             Result = fsp_fuse_ntstatus_from_errno(f->env, err);
         }
+        fsp_fuse_intf_InvalidateFileInfo(f, filedesc->PosixPath);
         if (!NT_SUCCESS(Result))
             return Result;
 
@@ -1450,6 +1631,11 @@ static NTSTATUS fsp_fuse_intf_Rename(FSP_FILE_SYSTEM *FileSystem,
     }
 
     err = f->ops.rename(filedesc->PosixPath, contexthdr->PosixPath);
+    fsp_fuse_intf_InvalidateEntry(f, filedesc->PosixPath);
+    fsp_fuse_intf_InvalidateEntry(f, contexthdr->PosixPath);
+    if (filedesc->IsDirectory)
+        /* every path below the directory has changed */
+        fsp_fuse_cache_invalidate_all(&f->AttrCache);
     return fsp_fuse_ntstatus_from_errno(f->env, err);
 }
 
@@ -1536,6 +1722,8 @@ static NTSTATUS fsp_fuse_intf_SetSecurity(FSP_FILE_SYSTEM *FileSystem,
     Result = STATUS_SUCCESS;
 
 exit:
+    fsp_fuse_intf_InvalidateFileInfo(f, filedesc->PosixPath);
+
     if (0 != NewSecurityDescriptor)
         FspDeleteSecurityDescriptor(NewSecurityDescriptor,
             FspSetSecurityDescriptor);
@@ -1593,6 +1781,25 @@ static int fsp_fuse_intf_AddDirInfo(void *buf, const char *name,
             DirInfo->Padding[0] = 1; /* HACK: remember that the FileInfo is valid */
     }
 
+    if (dh->Decode)
+    {
+        /*
+         * Decode now; the streaming buffer compares markers against the filled names
+         * and the pattern is matched against the filled names.
+         */
+        for (PWSTR P = DirInfo->FileNameBuf, EndP = P + SizeW; EndP > P; P++)
+        {
+            WCHAR C = *P;
+            FspPosixDecodeWindowsPath(P, 1);
+            if (C != *P)
+                DirInfo->Padding[1] = 1; /* HACK: remember that the name was changed */
+        }
+    }
+
+    if (dh->Streaming)
+        return !FspFileSystemFillStreamingDirectoryBuffer(&filedesc->DirBuffer, DirInfo,
+            (UINT64)off, &dh->Result);
+
     return !FspFileSystemFillDirectoryBuffer(&filedesc->DirBuffer, DirInfo, &dh->Result);
 }
 
@@ -1603,9 +1810,10 @@ static int fsp_fuse_intf_AddDirInfoOld(fuse_dirh_t dh, const char *name,
 }
 
 static NTSTATUS fsp_fuse_intf_FixDirInfo(FSP_FILE_SYSTEM *FileSystem,
-    struct fsp_fuse_file_desc *filedesc)
+    struct fsp_fuse_file_desc *filedesc, BOOLEAN Decoded)
 {
     char *PosixPath = 0, *PosixName, *PosixPathEnd, SavedPathChar;
+    WCHAR FileNameBuf[255];
     ULONG SizeA, SizeW;
     PUINT8 Buffer;
     PULONG Index, IndexEnd;
@@ -1664,7 +1872,27 @@ static NTSTATUS fsp_fuse_intf_FixDirInfo(FSP_FILE_SYSTEM *FileSystem,
             else
             {
                 PosixPathEnd = 0;
-                SizeA = WideCharToMultiByte(CP_UTF8, 0, DirInfo->FileNameBuf, SizeW, PosixName, 255, 0, 0);
+                if (Decoded && DirInfo->Padding[1])
+                {
+                    /*
+                     * Undo only the character mappings that decoding can produce; other
+                     * private use characters were in the original name and are kept.
+                     */
+                    for (ULONG I = 0; SizeW > I; I++)
+                    {
+                        WCHAR C = DirInfo->FileNameBuf[I], D = C & 0xff;
+                        if (0xf000 <= C && C <= 0xf07f)
+                        {
+                            FspPosixDecodeWindowsPath(&D, 1);
+                            if (C == D)
+                                C &= 0xff;
+                        }
+                        FileNameBuf[I] = C;
+                    }
+                }
+                SizeA = WideCharToMultiByte(CP_UTF8, 0,
+                    Decoded && DirInfo->Padding[1] ? FileNameBuf : DirInfo->FileNameBuf, SizeW,
+                    PosixName, 255, 0, 0);
                 if (0 == SizeA)
                 {
                     /* this should never happen because we just converted using MultiByteToWideChar */
@@ -1683,7 +1911,9 @@ static NTSTATUS fsp_fuse_intf_FixDirInfo(FSP_FILE_SYSTEM *FileSystem,
                 *PosixPathEnd = SavedPathChar;
         }
 
-        FspPosixDecodeWindowsPath(DirInfo->FileNameBuf, SizeW);
+        if (!Decoded)
+            FspPosixDecodeWindowsPath(DirInfo->FileNameBuf, SizeW);
+        DirInfo->Padding[1] = 0;
     }
 
     Result = STATUS_SUCCESS;
@@ -1694,6 +1924,18 @@ exit:
     return Result;
 }
 
+static BOOLEAN fsp_fuse_intf_HasDosWildcards(PWSTR Pattern)
+{
+    /* also check encoded characters; FspPosixEncodeWindowsPath turns them into wildcards */
+    for (PWSTR P = Pattern; L'\0' != *P; P++)
+    {
+        WCHAR C = 0xf000 <= *P && *P <= 0xf0ff ? *P & 0xff : *P;
+        if (L'<' == C || L'>' == C || L'"' == C)
+            return TRUE;
+    }
+    return FALSE;
+}
+
 static NTSTATUS fsp_fuse_intf_ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
     PVOID FileNode, PWSTR Pattern, PWSTR Marker,
     PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
@@ -1702,24 +1944,85 @@ static NTSTATUS fsp_fuse_intf_ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
     struct fsp_fuse_file_desc *filedesc = FileNode;
     struct fuse_dirhandle dh;
     struct fuse_file_info fi;
+    PWSTR PatternW = 0;
+    char *PatternA = 0;
+    ULONG SizeW, SizeA;
+    UINT64 Cookie = 0;
+    BOOLEAN Acquired;
     int err;
     NTSTATUS Result;
 
-    if (FspFileSystemAcquireDirectoryBuffer(&filedesc->DirBuffer, 0 == Marker, &Result))
+    if (0 != Pattern && L'*' == Pattern[0] && L'\0' == Pattern[1])
+        Pattern = 0;
+
+    if (0 != Pattern && 0 != f->ops.readdir_pattern &&
+        !fsp_fuse_intf_HasDosWildcards(Pattern))
+    {
+        /*
+         * Pass the pattern to readdir_pattern in POSIX form. A file system that matches
+         * the DOS wildcards differently would drop entries, so such patterns go through
+         * readdir. Encoding turns reserved characters back into wildcards, so the file
+         * system may return too many entries; the directory buffer filters them again.
+         */
+        SizeW = lstrlenW(Pattern) + 1;
+        PatternW = MemAlloc(SizeW * sizeof(WCHAR));
+        if (0 == PatternW)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+        memcpy(PatternW, Pattern, SizeW * sizeof(WCHAR));
+        FspPosixEncodeWindowsPath(PatternW, SizeW - 1);
+
+        SizeA = WideCharToMultiByte(CP_UTF8, 0, PatternW, SizeW, 0, 0, 0, 0);
+        PatternA = 0 != SizeA ? MemAlloc(SizeA) : 0;
+        if (0 == PatternA ||
+            0 == WideCharToMultiByte(CP_UTF8, 0, PatternW, SizeW, PatternA, SizeA, 0, 0))
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+    }
+
+    if (0 != f->DirectoryWindow)
+        /*
+         * Streaming directory buffer: requires a file system that passes non-zero offsets
+         * to the readdir filler; otherwise the whole directory is still buffered (unsorted).
+         */
+        Acquired = FspFileSystemAcquireStreamingDirectoryBufferEx(&filedesc->DirBuffer,
+            Marker, Pattern, f->DirectoryWindow, &Cookie, &Result);
+    else
+        Acquired = FspFileSystemAcquireDirectoryBufferEx(&filedesc->DirBuffer,
+            0 == Marker, Pattern, &Result);
+
+    if (Acquired)
     {
         memset(&dh, 0, sizeof dh);
         dh.filedesc = filedesc;
         dh.FileSystem = FileSystem;
         dh.ReaddirPlus = 0 != (f->conn_want & FSP_FUSE_CAP_READDIR_PLUS);
+        dh.Streaming = 0 != f->DirectoryWindow;
+        dh.Decode = dh.Streaming || 0 != Pattern;
         dh.Result = STATUS_SUCCESS;
 
-        if (0 != f->ops.readdir)
+        if (0 != PatternA)
+        {
+            memset(&fi, 0, sizeof fi);
+            fi.flags = filedesc->OpenFlags;
+            fi.fh = filedesc->FileHandle;
+
+            err = f->ops.readdir_pattern(filedesc->PosixPath, PatternA,
+                &dh, fsp_fuse_intf_AddDirInfo, (fuse_off_t)Cookie, &fi);
+            Result = fsp_fuse_ntstatus_from_errno(f->env, err);
+        }
+        else if (0 != f->ops.readdir)
         {
             memset(&fi, 0, sizeof fi);
             fi.flags = filedesc->OpenFlags;
             fi.fh = filedesc->FileHandle;
 
-            err = f->ops.readdir(filedesc->PosixPath, &dh, fsp_fuse_intf_AddDirInfo, 0, &fi);
+            err = f->ops.readdir(filedesc->PosixPath, &dh, fsp_fuse_intf_AddDirInfo,
+                (fuse_off_t)Cookie, &fi);
             Result = fsp_fuse_ntstatus_from_errno(f->env, err);
         }
         else if (0 != f->ops.getdir)
@@ -1734,19 +2037,25 @@ static NTSTATUS fsp_fuse_intf_ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
         {
             Result = dh.Result;
             if (NT_SUCCESS(Result))
-                Result = fsp_fuse_intf_FixDirInfo(FileSystem, filedesc);
+                Result = fsp_fuse_intf_FixDirInfo(FileSystem, filedesc, dh.Decode);
         }
 
         FspFileSystemReleaseDirectoryBuffer(&filedesc->DirBuffer);
     }
 
     if (!NT_SUCCESS(Result))
-        return Result;
+        goto exit;
 
     FspFileSystemReadDirectoryBuffer(&filedesc->DirBuffer,
         Marker, Buffer, Length, PBytesTransferred);
 
-    return STATUS_SUCCESS;
+    Result = STATUS_SUCCESS;
+
+exit:
+    MemFree(PatternA);
+    MemFree(PatternW);
+
+    return Result;
 }
 
 static NTSTATUS fsp_fuse_intf_ResolveReparsePoints(FSP_FILE_SYSTEM *FileSystem,
@@ -1977,6 +2286,7 @@ static NTSTATUS fsp_fuse_intf_SetReparsePoint(FSP_FILE_SYSTEM *FileSystem,
     }
 
     filedesc->IsReparsePoint = TRUE;
+    fsp_fuse_intf_InvalidateEntry(f, filedesc->PosixPath);
 
     Result = STATUS_SUCCESS;
 
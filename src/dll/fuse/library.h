@@ -19,6 +19,7 @@
 #define WINFSP_DLL_FUSE_LIBRARY_H_INCLUDED
 
 #include <dll/library.h>
+#include <dll/fuse/fuse_cache.h>
 #include <fuse/fuse.h>
 #include <fuse/fuse_opt.h>
 
@@ -31,6 +32,8 @@
 
 #define FSP_FUSE_HAS_SYMLINKS(f)        (0 != (f)->ops.readlink)
 
+#define FSP_FUSE_FILEINFO_GENERATION_COUNT 256
+
 struct fuse
 {
     struct fsp_fuse_env *env;
@@ -38,6 +41,7 @@ struct fuse
     int set_uid, uid;
     int set_gid, gid;
     int rellinks;
+    int DirectoryWindow;
     struct fuse_operations ops;
     void *data;
     unsigned conn_want;
@@ -50,6 +54,9 @@ struct fuse
     PWSTR MountPoint;
     FSP_FILE_SYSTEM *FileSystem;
     FSP_SERVICE *Service; /* weak */
+    LONG FileInfoGeneration[FSP_FUSE_FILEINFO_GENERATION_COUNT];
+    LONG WriteGetattrCount, WriteGetattrSkipCount;
+    struct fsp_fuse_cache AttrCache;
 };
 
 struct fsp_fuse_context_header
@@ -65,6 +72,11 @@ struct fsp_fuse_file_desc
     int OpenFlags;
     UINT64 FileHandle;
     PVOID DirBuffer;
+    /* cached FileInfo; valid while generation matches and not expired */
+    SRWLOCK FileInfoLock;               /* concurrent operations may use the same handle */
+    LONG FileInfoGeneration;
+    UINT64 FileInfoExpirationTime;
+    FSP_FSCTL_FILE_INFO FileInfo;
 };
 
 struct fuse_dirhandle
@@ -72,7 +84,7 @@ struct fuse_dirhandle
     /* ReadDirectory */
     struct fsp_fuse_file_desc *filedesc;
     FSP_FILE_SYSTEM *FileSystem;
-    BOOLEAN ReaddirPlus;
+    BOOLEAN ReaddirPlus, Streaming, Decode;
     NTSTATUS Result;
     /* CanDelete */
     BOOLEAN DotFiles, HasChild;
@@ -0,0 +1,243 @@
+/**
+ * @file dll/latency.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <dll/library.h>
+
+/*
+ * Every dispatcher thread owns an FSP_FILE_SYSTEM_LATENCY block with one histogram per
+ * operation kind. Only the owning thread writes to its block, so recording requires
+ * no locks (and on 64-bit platforms no interlocked operations). Blocks are pushed onto
+ * a lock-free list that hangs off the FSP_FILE_SYSTEM; they are never removed from the
+ * list until the file system is deleted, so snapshots can traverse the list without
+ * synchronization.
+ * When a dispatcher thread exits its block is released and may be reused (with its
+ * accumulated histograms) by a later dispatcher thread.
+ *
+ * Snapshots read the 64-bit counters while their owner may be updating them. This is
+ * safe on 64-bit platforms where aligned 64-bit loads and stores are atomic. On x86
+ * they are not, so there the owner updates and the snapshot reads the counters with
+ * interlocked operations.
+ */
+
+typedef struct _FSP_FILE_SYSTEM_LATENCY
+{
+    struct _FSP_FILE_SYSTEM_LATENCY *Next;
+    LONG InUse;
+    UINT64 Frequency;
+    FSP_FILE_SYSTEM_LATENCY_HISTOGRAM Histograms[FspFsctlTransactKindCount];
+} FSP_FILE_SYSTEM_LATENCY;
+
+#define SUBBUCKET_BITS                  3
+FSP_FSCTL_STATIC_ASSERT(FSP_FILE_SYSTEM_LATENCY_SUBBUCKET_COUNT == 1 << SUBBUCKET_BITS,
+    "FSP_FILE_SYSTEM_LATENCY_SUBBUCKET_COUNT must be 1 << SUBBUCKET_BITS");
+
+#if defined(_WIN64)
+static inline VOID FspFileSystemLatencyAdd(UINT64 *P, UINT64 Value)
+{
+    *P += Value;
+}
+static inline VOID FspFileSystemLatencyStore(UINT64 *P, UINT64 Value)
+{
+    *P = Value;
+}
+static inline UINT64 FspFileSystemLatencyLoad(UINT64 *P)
+{
+    return *(volatile UINT64 *)P;
+}
+#else
+static inline VOID FspFileSystemLatencyAdd(UINT64 *P, UINT64 Value)
+{
+    InterlockedExchangeAdd64((PLONG64)P, (LONG64)Value);
+}
+static inline VOID FspFileSystemLatencyStore(UINT64 *P, UINT64 Value)
+{
+    InterlockedExchange64((PLONG64)P, (LONG64)Value);
+}
+static inline UINT64 FspFileSystemLatencyLoad(UINT64 *P)
+{
+    return (UINT64)InterlockedCompareExchange64((PLONG64)P, 0, 0);
+}
+#endif
+
+static inline ULONG FspFileSystemLatencyBucketIndex(UINT64 Value)
+{
+    ULONG Msb, Index;
+
+    if (FSP_FILE_SYSTEM_LATENCY_SUBBUCKET_COUNT > Value)
+        return (ULONG)Value;
+
+#if defined(_WIN64)
+    _BitScanReverse64(&Msb, Value);
+#else
+    if (0 != (Value >> 32))
+    {
+        _BitScanReverse(&Msb, (ULONG)(Value >> 32));
+        Msb += 32;
+    }
+    else
+        _BitScanReverse(&Msb, (ULONG)Value);
+#endif
+
+    Index = (Msb - SUBBUCKET_BITS + 1) * FSP_FILE_SYSTEM_LATENCY_SUBBUCKET_COUNT +
+        (ULONG)((Value >> (Msb - SUBBUCKET_BITS)) & (FSP_FILE_SYSTEM_LATENCY_SUBBUCKET_COUNT - 1));
+
+    return FSP_FILE_SYSTEM_LATENCY_BUCKET_COUNT > Index ?
+        Index : FSP_FILE_SYSTEM_LATENCY_BUCKET_COUNT - 1;
+}
+
+static inline UINT64 FspFileSystemLatencyBucketLowerBound(ULONG Index)
+{
+    ULONG Shift;
+
+    if (FSP_FILE_SYSTEM_LATENCY_SUBBUCKET_COUNT > Index)
+        return Index;
+
+    Shift = Index / FSP_FILE_SYSTEM_LATENCY_SUBBUCKET_COUNT - 1;
+    return (UINT64)(FSP_FILE_SYSTEM_LATENCY_SUBBUCKET_COUNT +
+        Index % FSP_FILE_SYSTEM_LATENCY_SUBBUCKET_COUNT) << Shift;
+}
+
+FSP_API VOID FspFileSystemLatencyHistogramRecord(FSP_FILE_SYSTEM_LATENCY_HISTOGRAM *Histogram,
+    UINT64 Latency)
+{
+    FspFileSystemLatencyAdd(&Histogram->Count, 1);
+    FspFileSystemLatencyAdd(&Histogram->Sum, Latency);
+    if (Histogram->Max < Latency)
+        FspFileSystemLatencyStore(&Histogram->Max, Latency);
+    FspFileSystemLatencyAdd(&Histogram->Buckets[FspFileSystemLatencyBucketIndex(Latency)], 1);
+}
+
+FSP_API UINT64 FspFileSystemLatencyHistogramPercentile(FSP_FILE_SYSTEM_LATENCY_HISTOGRAM *Histogram,
+    ULONG Percentile)
+{
+    UINT64 Count, Target;
+
+    if (0 == Histogram->Count)
+        return 0;
+    if (10000 <= Percentile)
+        return Histogram->Max;
+
+    /* rank of the percentile value; round up so that p50 of 1 value is that value */
+    Target = (Histogram->Count * Percentile + 9999) / 10000;
+    if (0 == Target)
+        Target = 1;
+
+    Count = 0;
+    for (ULONG I = 0; FSP_FILE_SYSTEM_LATENCY_BUCKET_COUNT > I; I++)
+    {
+        Count += Histogram->Buckets[I];
+        if (Count >= Target)
+        {
+            UINT64 Value = FSP_FILE_SYSTEM_LATENCY_BUCKET_COUNT - 1 > I ?
+                FspFileSystemLatencyBucketLowerBound(I + 1) - 1 : Histogram->Max;
+            return Histogram->Max > Value ? Value : Histogram->Max;
+        }
+    }
+
+    return Histogram->Max;
+}
+
+PVOID FspFileSystemLatencyCreate(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_LATENCY *Latency;
+    LARGE_INTEGER Frequency;
+
+    for (Latency = FileSystem->Latency; 0 != Latency; Latency = Latency->Next)
+        if (0 == InterlockedCompareExchange(&Latency->InUse, 1, 0))
+            return Latency;
+
+    Latency = MemAlloc(sizeof *Latency);
+    if (0 == Latency)
+        return 0;
+
+    memset(Latency, 0, sizeof *Latency);
+    Latency->InUse = 1;
+    QueryPerformanceFrequency(&Frequency);
+    Latency->Frequency = Frequency.QuadPart;
+
+    do
+        Latency->Next = FileSystem->Latency;
+    while (Latency->Next != InterlockedCompareExchangePointer(
+        &FileSystem->Latency, Latency, Latency->Next));
+
+    return Latency;
+}
+
+VOID FspFileSystemLatencyRelease(PVOID Latency0)
+{
+    FSP_FILE_SYSTEM_LATENCY *Latency = Latency0;
+
+    if (0 == Latency)
+        return;
+
+    InterlockedExchange(&Latency->InUse, 0);
+}
+
+VOID FspFileSystemLatencyDelete(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_LATENCY *Latency, *NextLatency;
+
+    for (Latency = FileSystem->Latency; 0 != Latency; Latency = NextLatency)
+    {
+        NextLatency = Latency->Next;
+        MemFree(Latency);
+    }
+
+    FileSystem->Latency = 0;
+}
+
+VOID FspFileSystemLatencyRecord(PVOID Latency0, ULONG Kind, UINT64 Ticks)
+{
+    FSP_FILE_SYSTEM_LATENCY *Latency = Latency0;
+    UINT64 Frequency;
+
+    if (0 == Latency || FspFsctlTransactKindCount <= Kind)
+        return;
+
+    /* convert performance counter ticks to nanoseconds without overflowing */
+    Frequency = Latency->Frequency;
+    FspFileSystemLatencyHistogramRecord(&Latency->Histograms[Kind],
+        Ticks / Frequency * 1000000000 + Ticks % Frequency * 1000000000 / Frequency);
+}
+
+FSP_API NTSTATUS FspFileSystemGetLatencyHistogram(FSP_FILE_SYSTEM *FileSystem,
+    ULONG Kind, FSP_FILE_SYSTEM_LATENCY_HISTOGRAM *Histogram)
+{
+    FSP_FILE_SYSTEM_LATENCY *Latency;
+    FSP_FILE_SYSTEM_LATENCY_HISTOGRAM *ThreadHistogram;
+    UINT64 Max;
+
+    memset(Histogram, 0, sizeof *Histogram);
+
+    if (FspFsctlTransactKindCount <= Kind)
+        return STATUS_INVALID_PARAMETER;
+
+    MemoryBarrier();
+    for (Latency = FileSystem->Latency; 0 != Latency; Latency = Latency->Next)
+    {
+        ThreadHistogram = &Latency->Histograms[Kind];
+        Histogram->Count += FspFileSystemLatencyLoad(&ThreadHistogram->Count);
+        Histogram->Sum += FspFileSystemLatencyLoad(&ThreadHistogram->Sum);
+        Max = FspFileSystemLatencyLoad(&ThreadHistogram->Max);
+        if (Histogram->Max < Max)
+            Histogram->Max = Max;
+        for (ULONG I = 0; FSP_FILE_SYSTEM_LATENCY_BUCKET_COUNT > I; I++)
+            Histogram->Buckets[I] += FspFileSystemLatencyLoad(&ThreadHistogram->Buckets[I]);
+    }
+
+    return STATUS_SUCCESS;
+}
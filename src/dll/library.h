@@ -51,11 +51,65 @@ NTSTATUS FspEventLogUnregister(VOID);
 
 PWSTR FspDiagIdent(VOID);
 
+PVOID FspFileSystemLatencyCreate(FSP_FILE_SYSTEM *FileSystem);
+VOID FspFileSystemLatencyRelease(PVOID Latency);
+VOID FspFileSystemLatencyDelete(FSP_FILE_SYSTEM *FileSystem);
+VOID FspFileSystemLatencyRecord(PVOID Latency, ULONG Kind, UINT64 Ticks);
+
+VOID FspTraverseCheckCacheDelete(FSP_FILE_SYSTEM *FileSystem);
+UINT64 FspTraverseCheckCacheIdentity(FSP_FILE_SYSTEM *FileSystem, HANDLE Token,
+    PUINT64 PGeneration);
+BOOLEAN FspTraverseCheckCacheLookup(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, ULONG Length, UINT64 IdentityId, NTSTATUS *PResult);
+VOID FspTraverseCheckCacheInsert(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, ULONG Length, UINT64 IdentityId, UINT64 Generation, NTSTATUS Result);
+
+VOID FspFileSystemOpGuardEpochAcquireShared(FSP_FILE_SYSTEM *FileSystem);
+VOID FspFileSystemOpGuardEpochReleaseShared(FSP_FILE_SYSTEM *FileSystem);
+VOID FspFileSystemOpGuardEpochAcquireExclusive(FSP_FILE_SYSTEM *FileSystem);
+VOID FspFileSystemOpGuardEpochReleaseExclusive(FSP_FILE_SYSTEM *FileSystem);
+NTSTATUS FspFileSystemOpGuardStripedAcquire(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request);
+VOID FspFileSystemOpGuardStripedRelease(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request);
+
 VOID FspFileSystemPeekInDirectoryBuffer(PVOID *PDirBuffer,
     PUINT8 *PBuffer, PULONG *PIndex, PULONG PCount);
 
 BOOL WINAPI FspServiceConsoleCtrlHandler(DWORD CtrlType);
 
+static inline VOID FspFileSystemOpGuardAcquireShared(FSP_FILE_SYSTEM *FileSystem)
+{
+    if (FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_EPOCH == FileSystem->OpGuardStrategy)
+        FspFileSystemOpGuardEpochAcquireShared(FileSystem);
+    else
+        AcquireSRWLockShared(&FileSystem->OpGuardLock);
+}
+
+static inline VOID FspFileSystemOpGuardReleaseShared(FSP_FILE_SYSTEM *FileSystem)
+{
+    if (FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_EPOCH == FileSystem->OpGuardStrategy)
+        FspFileSystemOpGuardEpochReleaseShared(FileSystem);
+    else
+        ReleaseSRWLockShared(&FileSystem->OpGuardLock);
+}
+
+static inline VOID FspFileSystemOpGuardAcquireExclusive(FSP_FILE_SYSTEM *FileSystem)
+{
+    if (FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_EPOCH == FileSystem->OpGuardStrategy)
+        FspFileSystemOpGuardEpochAcquireExclusive(FileSystem);
+    else
+        AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
+}
+
+static inline VOID FspFileSystemOpGuardReleaseExclusive(FSP_FILE_SYSTEM *FileSystem)
+{
+    if (FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_EPOCH == FileSystem->OpGuardStrategy)
+        FspFileSystemOpGuardEpochReleaseExclusive(FileSystem);
+    else
+        ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
+}
+
 static inline ULONG FspPathSuffixIndex(PWSTR FileName)
 {
     WCHAR Root[2] = L"\\";
@@ -0,0 +1,204 @@
+/**
+ * @file dll/opguard.h
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_DLL_OPGUARD_H_INCLUDED
+#define WINFSP_DLL_OPGUARD_H_INCLUDED
+
+#include <winfsp/winfsp.h>
+#include <shared/minimal.h>
+
+/*
+ * Striped operation guard model
+ *
+ * The striped guard strategy replaces the single OpGuardLock with a fixed number of lock
+ * stripes. Every directory is mapped to a stripe by a case-insensitive hash of its path;
+ * an open file is mapped to a stripe by a hash of its (file node) UserContext.
+ *
+ * An operation on a path locks the stripes of all directories above it in shared mode, so
+ * that a directory cannot be renamed or deleted while an operation is in progress below it.
+ * The stripe of the parent directory is locked shared by operations that read the directory
+ * (Open) and exclusive by operations that change it (Create, Cleanup(Delete), Rename).
+ * Operations that remove or replace a name also lock the name itself exclusive. Operations
+ * that have no path and read a directory or the volume (ReadDirectory, GetVolumeInfo) lock
+ * all stripes shared; operations that change the volume (SetVolumeLabel, Flush(Volume))
+ * lock all stripes exclusive. Overwrite, which has no path, locks the stripe of its file.
+ *
+ * The set of stripes that an operation needs and their modes is computed up front as a pair
+ * of bit masks (exclusive wins when a stripe is needed in both modes). Stripes are always
+ * acquired in ascending index order and each stripe at most once, which makes the scheme
+ * deadlock free. Hash collisions can only cause extra serialization.
+ *
+ * The model is a pure function of the request and does not depend on the rest of the DLL.
+ */
+
+#define FSP_OPGUARD_STRIPE_COUNT        64
+#define FSP_OPGUARD_STRIPE_ALL          ((UINT64)-1)
+
+enum
+{
+    FspOpGuardStripeNone = 0,
+    FspOpGuardStripeShared,
+    FspOpGuardStripeExclusive,
+};
+
+typedef struct
+{
+    UINT64 Shared, Exclusive;
+} FSP_OPGUARD_STRIPE_MASK;
+
+static inline VOID FspOpGuardStripeMaskAdd(FSP_OPGUARD_STRIPE_MASK *Mask,
+    UINT32 Hash, ULONG Mode)
+{
+    UINT64 Bit = (UINT64)1 << ((Hash ^ (Hash >> 16)) % FSP_OPGUARD_STRIPE_COUNT);
+
+    if (FspOpGuardStripeExclusive == Mode)
+        Mask->Exclusive |= Bit;
+    else if (FspOpGuardStripeShared == Mode)
+        Mask->Shared |= Bit;
+}
+
+static inline VOID FspOpGuardStripeMaskAddPath(FSP_OPGUARD_STRIPE_MASK *Mask,
+    PWSTR FileName, ULONG ParentMode, ULONG SelfMode)
+{
+    UINT32 Hash = 2166136261, ParentHash = 2166136261;
+    BOOLEAN HasParent;
+    PWSTR P = FileName;
+
+    /*
+     * Paths are hashed without their leading backslash, so that the root is the empty path.
+     * A named stream is treated as its main file. The hash of every directory prefix is
+     * available when we reach the backslash that ends it.
+     */
+    if (L'\\' == *P)
+        P++;
+    HasParent = L'\0' != *P && L':' != *P;
+    for (; L'\0' != *P && L':' != *P; P++)
+    {
+        if (L'\\' == *P)
+        {
+            FspOpGuardStripeMaskAdd(Mask, ParentHash, FspOpGuardStripeShared);
+            ParentHash = Hash;
+        }
+        Hash = (Hash ^ invariant_toupper(*P)) * 16777619;
+    }
+
+    if (HasParent)
+        FspOpGuardStripeMaskAdd(Mask, ParentHash,
+            FspOpGuardStripeExclusive == ParentMode ?
+                FspOpGuardStripeExclusive : FspOpGuardStripeShared);
+    FspOpGuardStripeMaskAdd(Mask, Hash, SelfMode);
+}
+
+static inline VOID FspOpGuardStripeMaskAddContext(FSP_OPGUARD_STRIPE_MASK *Mask,
+    UINT64 UserContext, ULONG Mode)
+{
+    UINT64 Hash = UserContext * 0x9e3779b97f4a7c15ULL;
+    FspOpGuardStripeMaskAdd(Mask, (UINT32)(Hash >> 32), Mode);
+}
+
+static inline VOID FspOpGuardStripeMaskFromRequest(FSP_OPGUARD_STRIPE_MASK *Mask,
+    FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    PWSTR FileName = 0 != Request->FileName.Size ? (PWSTR)Request->Buffer : 0;
+
+    Mask->Shared = Mask->Exclusive = 0;
+
+    switch (Request->Kind)
+    {
+    case FspFsctlTransactCreateKind:
+        if (0 == FileName)
+            Mask->Exclusive = FSP_OPGUARD_STRIPE_ALL;
+        else if (FILE_OPEN == ((Request->Req.Create.CreateOptions >> 24) & 0xff))
+            FspOpGuardStripeMaskAddPath(Mask, FileName,
+                FspOpGuardStripeShared, FspOpGuardStripeNone);
+        else
+            FspOpGuardStripeMaskAddPath(Mask, FileName,
+                FspOpGuardStripeExclusive, FspOpGuardStripeNone);
+        break;
+
+    case FspFsctlTransactOverwriteKind:
+        FspOpGuardStripeMaskAddContext(Mask,
+            Request->Req.Overwrite.UserContext, FspOpGuardStripeExclusive);
+        break;
+
+    case FspFsctlTransactCleanupKind:
+        if (!Request->Req.Cleanup.Delete)
+            break;
+        if (0 == FileName)
+            Mask->Exclusive = FSP_OPGUARD_STRIPE_ALL;
+        else
+            FspOpGuardStripeMaskAddPath(Mask, FileName,
+                FspOpGuardStripeExclusive, FspOpGuardStripeExclusive);
+        break;
+
+    case FspFsctlTransactSetInformationKind:
+        switch (Request->Req.SetInformation.FileInformationClass)
+        {
+        case 10/*FileRenameInformation*/:
+            if (0 == FileName)
+                Mask->Exclusive = FSP_OPGUARD_STRIPE_ALL;
+            else
+            {
+                FspOpGuardStripeMaskAddPath(Mask, FileName,
+                    FspOpGuardStripeExclusive, FspOpGuardStripeExclusive);
+                FspOpGuardStripeMaskAddPath(Mask,
+                    (PWSTR)(Request->Buffer +
+                        Request->Req.SetInformation.Info.Rename.NewFileName.Offset),
+                    FspOpGuardStripeExclusive, FspOpGuardStripeExclusive);
+            }
+            break;
+        case 13/*FileDispositionInformation*/:
+            /* reads the directory to determine whether it is empty */
+            if (0 == FileName)
+                Mask->Shared = FSP_OPGUARD_STRIPE_ALL;
+            else
+                FspOpGuardStripeMaskAddPath(Mask, FileName,
+                    FspOpGuardStripeShared, FspOpGuardStripeShared);
+            break;
+        }
+        break;
+
+    case FspFsctlTransactQueryDirectoryKind:
+    case FspFsctlTransactQueryVolumeInformationKind:
+        Mask->Shared = FSP_OPGUARD_STRIPE_ALL;
+        break;
+
+    case FspFsctlTransactSetVolumeInformationKind:
+        Mask->Exclusive = FSP_OPGUARD_STRIPE_ALL;
+        break;
+
+    case FspFsctlTransactFlushBuffersKind:
+        if (0 == Request->Req.FlushBuffers.UserContext &&
+            0 == Request->Req.FlushBuffers.UserContext2)
+            Mask->Exclusive = FSP_OPGUARD_STRIPE_ALL;
+        break;
+
+    case FspFsctlTransactFileSystemControlKind:
+        if (0 == FileName)
+            break;
+        if (FSCTL_SET_REPARSE_POINT == Request->Req.FileSystemControl.FsControlCode ||
+            FSCTL_DELETE_REPARSE_POINT == Request->Req.FileSystemControl.FsControlCode)
+            FspOpGuardStripeMaskAddPath(Mask, FileName,
+                FspOpGuardStripeShared, FspOpGuardStripeExclusive);
+        else if (FSCTL_GET_REPARSE_POINT == Request->Req.FileSystemControl.FsControlCode)
+            FspOpGuardStripeMaskAddPath(Mask, FileName,
+                FspOpGuardStripeShared, FspOpGuardStripeShared);
+        break;
+    }
+}
+
+#endif
@@ -96,6 +96,8 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
     UINT32 TraverseAccess, ParentAccess, DesiredAccess2;
     UINT16 NamedStreamSave;
     BOOL AccessStatus;
+    UINT64 IdentityId = 0, Generation;
+    ULONG PrefixLength;
 
     if (CheckParentDirectory)
         FspPathSuffix((PWSTR)Request->Buffer, &FileName, &Suffix, Root);
@@ -119,6 +121,10 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
         AllowTraverseCheck && !Request->Req.Create.HasTraversePrivilege &&
         !(L'\\' == FileName[0] && L'\0' == FileName[1])/* no need to traverse check for root */)
     {
+        if (0 != FileSystem->TraverseCheckCache)
+            IdentityId = FspTraverseCheckCacheIdentity(FileSystem,
+                (HANDLE)Request->Req.Create.AccessToken, &Generation);
+
         Remain = FileName;
         for (;;)
         {
@@ -131,6 +137,21 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
 
             *Remain = L'\0';
             Prefix = Remain > FileName ? FileName : TraverseCheckRoot;
+            PrefixLength = Remain > FileName ? (ULONG)(Remain - FileName) : 1;
+
+            if (0 != IdentityId &&
+                FspTraverseCheckCacheLookup(FileSystem, Prefix, PrefixLength, IdentityId, &Result))
+            {
+                *Remain = L'\\';
+                do
+                {
+                    Remain++;
+                } while (L'\\' == *Remain);
+
+                if (!NT_SUCCESS(Result))
+                    goto exit;
+                continue;
+            }
 
             FileAttributes = 0;
             Result = FspGetSecurityByName(FileSystem, Prefix, &FileAttributes,
@@ -177,9 +198,17 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
                     Result = AccessStatus ? STATUS_SUCCESS : STATUS_ACCESS_DENIED;
                 else
                     Result = FspNtStatusFromWin32(GetLastError());
-                if (!NT_SUCCESS(Result))
-                    goto exit;
             }
+            else
+                Result = STATUS_SUCCESS;
+
+            /* only cache the traverse check outcome for existing, non-reparse directories */
+            if (0 != IdentityId && (NT_SUCCESS(Result) || STATUS_ACCESS_DENIED == Result))
+                FspTraverseCheckCacheInsert(FileSystem, Prefix, PrefixLength,
+                    IdentityId, Generation, Result);
+
+            if (!NT_SUCCESS(Result))
+                goto exit;
         }
     traverse_check_done:
         ;
@@ -0,0 +1,446 @@
+/**
+ * @file dll/travcache.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <dll/library.h>
+
+/*
+ * Traverse check cache
+ *
+ * When traverse checking is required FspAccessCheckEx retrieves the security descriptor of
+ * every directory along the path and checks it for FILE_TRAVERSE access. The traverse check
+ * cache remembers the outcome of these checks (granted or denied), keyed by the directory
+ * path and the identity of the caller's token.
+ *
+ * The FSD hands us a new impersonation token for every Create, so tokens cannot be compared
+ * by handle or by TokenId. Instead the identity of a token is the set of its group SIDs
+ * (including the user SID and the integrity label) with their attributes, and its restricted
+ * SIDs; these are all that an access check for FILE_TRAVERSE depends on. Identities are
+ * interned and given unique (never reused) ids, which are what cache entries are keyed by.
+ * AppContainer tokens are not cached, because their access checks also depend on their
+ * package SID and capabilities.
+ *
+ * Entries expire after a timeout, which bounds how long changes made behind our back go
+ * unnoticed. Renames, deletes and explicit invalidations remove the entries for a path and
+ * all paths below it; security changes and reparse point changes flush the cache.
+ */
+
+#define FspTraverseCheckCacheBucketCount 256
+#define FspTraverseCheckCacheCapacity   4096
+#define FspTraverseCheckIdentityCountMax 64
+
+typedef struct _FSP_TRAVERSE_CHECK_IDENTITY
+{
+    struct _FSP_TRAVERSE_CHECK_IDENTITY *Next;
+    UINT64 Id;
+    UINT32 Hash;
+    ULONG Size;
+    UINT8 Buffer[];
+} FSP_TRAVERSE_CHECK_IDENTITY;
+
+typedef struct _FSP_TRAVERSE_CHECK_ENTRY
+{
+    struct _FSP_TRAVERSE_CHECK_ENTRY *Next;
+    UINT64 IdentityId;
+    UINT64 ExpirationTime;
+    NTSTATUS Result;
+    ULONG Length;
+    WCHAR FileName[];
+} FSP_TRAVERSE_CHECK_ENTRY;
+
+typedef struct
+{
+    SRWLOCK Lock;
+    ULONG Timeout;
+    ULONG Count, IdentityCount;
+    UINT64 Generation, NextIdentityId;
+    FSP_TRAVERSE_CHECK_IDENTITY *Identities;
+    FSP_TRAVERSE_CHECK_ENTRY *Buckets[FspTraverseCheckCacheBucketCount];
+} FSP_TRAVERSE_CHECK_CACHE;
+
+static inline UINT32 FspTraverseCheckCacheHash(PUINT8 Buffer, SIZE_T Size)
+{
+    UINT32 h = 2166136261;
+
+    for (PUINT8 EndP = Buffer + Size; EndP > Buffer; Buffer++)
+        h = (h ^ *Buffer) * 16777619;
+
+    return h;
+}
+
+static inline UINT32 FspTraverseCheckCacheHashFileName(PWSTR FileName, ULONG Length)
+{
+    UINT32 h = 2166136261;
+
+    /* case-insensitive (ASCII), so that all spellings of a name share a bucket */
+    for (PWSTR EndP = FileName + Length; EndP > FileName; FileName++)
+        h = (h ^ invariant_toupper(*FileName)) * 16777619;
+
+    return h;
+}
+
+static inline BOOLEAN FspTraverseCheckCacheFileNameIsPrefix(PWSTR Prefix, ULONG PrefixLength,
+    PWSTR FileName, ULONG Length)
+{
+    /* Prefix is the same path as FileName or one of its ancestors (case-insensitive) */
+    if (PrefixLength > Length ||
+        0 != invariant_wcsnicmp(Prefix, FileName, PrefixLength))
+        return FALSE;
+    return
+        PrefixLength == Length ||
+        L'\\' == FileName[PrefixLength] ||
+        (1 == PrefixLength && L'\\' == Prefix[0]);
+}
+
+static VOID FspTraverseCheckCacheFlush(FSP_TRAVERSE_CHECK_CACHE *Cache, BOOLEAN Identities)
+{
+    FSP_TRAVERSE_CHECK_ENTRY *Entry, *NextEntry;
+    FSP_TRAVERSE_CHECK_IDENTITY *Identity, *NextIdentity;
+
+    for (ULONG I = 0; FspTraverseCheckCacheBucketCount > I; I++)
+    {
+        for (Entry = Cache->Buckets[I]; 0 != Entry; Entry = NextEntry)
+        {
+            NextEntry = Entry->Next;
+            MemFree(Entry);
+        }
+        Cache->Buckets[I] = 0;
+    }
+    Cache->Count = 0;
+
+    if (Identities)
+    {
+        for (Identity = Cache->Identities; 0 != Identity; Identity = NextIdentity)
+        {
+            NextIdentity = Identity->Next;
+            MemFree(Identity);
+        }
+        Cache->Identities = 0;
+        Cache->IdentityCount = 0;
+    }
+
+    Cache->Generation++;
+}
+
+FSP_API NTSTATUS FspFileSystemSetTraverseCheckCacheTimeout(FSP_FILE_SYSTEM *FileSystem,
+    ULONG Timeout)
+{
+    FSP_TRAVERSE_CHECK_CACHE *Cache = FileSystem->TraverseCheckCache;
+
+    if (0 == Timeout)
+    {
+        FspTraverseCheckCacheDelete(FileSystem);
+        return STATUS_SUCCESS;
+    }
+
+    if (0 == Cache)
+    {
+        Cache = MemAlloc(sizeof *Cache);
+        if (0 == Cache)
+            return STATUS_INSUFFICIENT_RESOURCES;
+        memset(Cache, 0, sizeof *Cache);
+        InitializeSRWLock(&Cache->Lock);
+        Cache->NextIdentityId = 1;
+        FileSystem->TraverseCheckCache = Cache;
+    }
+
+    Cache->Timeout = Timeout;
+
+    return STATUS_SUCCESS;
+}
+
+FSP_API VOID FspFileSystemInvalidateTraverseCheckCache(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName)
+{
+    FSP_TRAVERSE_CHECK_CACHE *Cache = FileSystem->TraverseCheckCache;
+    FSP_TRAVERSE_CHECK_ENTRY **PEntry, *Entry;
+    ULONG Length;
+
+    if (0 == Cache)
+        return;
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+
+    if (0 == FileName)
+        FspTraverseCheckCacheFlush(Cache, FALSE);
+    else
+    {
+        Length = lstrlenW(FileName);
+        while (1 < Length && L'\\' == FileName[Length - 1])
+            Length--;
+
+        for (ULONG I = 0; FspTraverseCheckCacheBucketCount > I; I++)
+            for (PEntry = &Cache->Buckets[I]; 0 != (Entry = *PEntry);)
+                if (FspTraverseCheckCacheFileNameIsPrefix(FileName, Length,
+                    Entry->FileName, Entry->Length))
+                {
+                    *PEntry = Entry->Next;
+                    Cache->Count--;
+                    MemFree(Entry);
+                }
+                else
+                    PEntry = &Entry->Next;
+
+        Cache->Generation++;
+    }
+
+    ReleaseSRWLockExclusive(&Cache->Lock);
+}
+
+VOID FspTraverseCheckCacheDelete(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_TRAVERSE_CHECK_CACHE *Cache = FileSystem->TraverseCheckCache;
+
+    if (0 == Cache)
+        return;
+
+    FspTraverseCheckCacheFlush(Cache, TRUE);
+    MemFree(Cache);
+    FileSystem->TraverseCheckCache = 0;
+}
+
+static NTSTATUS FspTraverseCheckCacheTokenIdentity(HANDLE Token,
+    PUINT8 *PBuffer, PULONG PSize)
+{
+    PTOKEN_GROUPS_AND_PRIVILEGES Info = 0;
+    DWORD InfoSize = 0, IsAppContainer = 0;
+    PUINT8 Buffer = 0, P;
+    ULONG Size;
+    NTSTATUS Result;
+
+    *PBuffer = 0;
+    *PSize = 0;
+
+    /* TokenIsAppContainer is not supported prior to Windows 8; treat failure as "no" */
+    if (GetTokenInformation(Token, TokenIsAppContainer, &IsAppContainer, sizeof IsAppContainer,
+        &InfoSize) && IsAppContainer)
+    {
+        Result = STATUS_NOT_SUPPORTED;
+        goto exit;
+    }
+
+    InfoSize = 0;
+    if (GetTokenInformation(Token, TokenGroupsAndPrivileges, 0, 0, &InfoSize) ||
+        ERROR_INSUFFICIENT_BUFFER != GetLastError())
+    {
+        Result = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    Info = MemAlloc(InfoSize);
+    if (0 == Info)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    if (!GetTokenInformation(Token, TokenGroupsAndPrivileges, Info, InfoSize, &InfoSize))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    /* serialize: count, then (attributes, SID) for every group; same for restricted SIDs */
+    Size = 2 * sizeof(ULONG);
+    for (ULONG I = 0; Info->SidCount > I; I++)
+        Size += sizeof(DWORD) + GetLengthSid(Info->Sids[I].Sid);
+    for (ULONG I = 0; Info->RestrictedSidCount > I; I++)
+        Size += sizeof(DWORD) + GetLengthSid(Info->RestrictedSids[I].Sid);
+    Buffer = MemAlloc(Size);
+    if (0 == Buffer)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    P = Buffer;
+    memcpy(P, &Info->SidCount, sizeof(ULONG)); P += sizeof(ULONG);
+    for (ULONG I = 0; Info->SidCount > I; I++)
+    {
+        DWORD SidLength = GetLengthSid(Info->Sids[I].Sid);
+        memcpy(P, &Info->Sids[I].Attributes, sizeof(DWORD)); P += sizeof(DWORD);
+        memcpy(P, Info->Sids[I].Sid, SidLength); P += SidLength;
+    }
+    memcpy(P, &Info->RestrictedSidCount, sizeof(ULONG)); P += sizeof(ULONG);
+    for (ULONG I = 0; Info->RestrictedSidCount > I; I++)
+    {
+        DWORD SidLength = GetLengthSid(Info->RestrictedSids[I].Sid);
+        memcpy(P, &Info->RestrictedSids[I].Attributes, sizeof(DWORD)); P += sizeof(DWORD);
+        memcpy(P, Info->RestrictedSids[I].Sid, SidLength); P += SidLength;
+    }
+
+    *PBuffer = Buffer;
+    *PSize = (ULONG)(P - Buffer);
+    Buffer = 0;
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    MemFree(Buffer);
+    MemFree(Info);
+
+    return Result;
+}
+
+UINT64 FspTraverseCheckCacheIdentity(FSP_FILE_SYSTEM *FileSystem, HANDLE Token,
+    PUINT64 PGeneration)
+{
+    FSP_TRAVERSE_CHECK_CACHE *Cache = FileSystem->TraverseCheckCache;
+    FSP_TRAVERSE_CHECK_IDENTITY *Identity;
+    PUINT8 Buffer;
+    ULONG Size;
+    UINT32 Hash;
+    UINT64 Id = 0;
+
+    *PGeneration = 0;
+
+    if (0 == Cache)
+        return 0;
+
+    if (!NT_SUCCESS(FspTraverseCheckCacheTokenIdentity(Token, &Buffer, &Size)))
+        return 0;
+    Hash = FspTraverseCheckCacheHash(Buffer, Size);
+
+    AcquireSRWLockShared(&Cache->Lock);
+    for (Identity = Cache->Identities; 0 != Identity; Identity = Identity->Next)
+        if (Hash == Identity->Hash && Size == Identity->Size &&
+            0 == memcmp(Buffer, Identity->Buffer, Size))
+        {
+            Id = Identity->Id;
+            break;
+        }
+    *PGeneration = Cache->Generation;
+    ReleaseSRWLockShared(&Cache->Lock);
+
+    if (0 != Id)
+        goto exit;
+
+    Identity = MemAlloc(sizeof *Identity + Size);
+    if (0 == Identity)
+        goto exit;
+    Identity->Hash = Hash;
+    Identity->Size = Size;
+    memcpy(Identity->Buffer, Buffer, Size);
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+    if (FspTraverseCheckIdentityCountMax <= Cache->IdentityCount)
+        FspTraverseCheckCacheFlush(Cache, TRUE);
+    Identity->Id = Cache->NextIdentityId++;
+    Identity->Next = Cache->Identities;
+    Cache->Identities = Identity;
+    Cache->IdentityCount++;
+    Id = Identity->Id;
+    *PGeneration = Cache->Generation;
+    ReleaseSRWLockExclusive(&Cache->Lock);
+
+    /*
+     * If another thread interned the same identity concurrently, the identity now appears
+     * twice with different ids. This only costs some cache misses.
+     */
+
+exit:
+    MemFree(Buffer);
+
+    return Id;
+}
+
+BOOLEAN FspTraverseCheckCacheLookup(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, ULONG Length, UINT64 IdentityId, NTSTATUS *PResult)
+{
+    FSP_TRAVERSE_CHECK_CACHE *Cache = FileSystem->TraverseCheckCache;
+    FSP_TRAVERSE_CHECK_ENTRY *Entry;
+    UINT32 Hash = FspTraverseCheckCacheHashFileName(FileName, Length);
+    UINT64 CurrentTime = GetTickCount64();
+    BOOLEAN Found = FALSE;
+
+    AcquireSRWLockShared(&Cache->Lock);
+    for (Entry = Cache->Buckets[Hash % FspTraverseCheckCacheBucketCount];
+        0 != Entry; Entry = Entry->Next)
+        if (IdentityId == Entry->IdentityId && Length == Entry->Length &&
+            0 == invariant_wcsncmp(FileName, Entry->FileName, Length))
+        {
+            if (Entry->ExpirationTime > CurrentTime)
+            {
+                *PResult = Entry->Result;
+                Found = TRUE;
+            }
+            break;
+        }
+    ReleaseSRWLockShared(&Cache->Lock);
+
+    return Found;
+}
+
+VOID FspTraverseCheckCacheInsert(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, ULONG Length, UINT64 IdentityId, UINT64 Generation, NTSTATUS Result)
+{
+    FSP_TRAVERSE_CHECK_CACHE *Cache = FileSystem->TraverseCheckCache;
+    FSP_TRAVERSE_CHECK_ENTRY **PBucket, **PEntry, *Entry, *NewEntry;
+
+    NewEntry = MemAlloc(sizeof *NewEntry + Length * sizeof(WCHAR));
+    if (0 == NewEntry)
+        return;
+    NewEntry->IdentityId = IdentityId;
+    NewEntry->ExpirationTime = GetTickCount64() + Cache->Timeout;
+    NewEntry->Result = Result;
+    NewEntry->Length = Length;
+    memcpy(NewEntry->FileName, FileName, Length * sizeof(WCHAR));
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+
+    /* the path may have been invalidated since our caller looked at it */
+    if (Generation != Cache->Generation)
+    {
+        ReleaseSRWLockExclusive(&Cache->Lock);
+        MemFree(NewEntry);
+        return;
+    }
+
+    PBucket = &Cache->Buckets[
+        FspTraverseCheckCacheHashFileName(FileName, Length) % FspTraverseCheckCacheBucketCount];
+
+    for (PEntry = PBucket; 0 != (Entry = *PEntry); PEntry = &Entry->Next)
+        if (IdentityId == Entry->IdentityId && Length == Entry->Length &&
+            0 == invariant_wcsncmp(FileName, Entry->FileName, Length))
+        {
+            *PEntry = Entry->Next;
+            Cache->Count--;
+            MemFree(Entry);
+            break;
+        }
+
+    /* when full evict the oldest entry in this bucket (entries are inserted at the head) */
+    if (FspTraverseCheckCacheCapacity <= Cache->Count)
+    {
+        for (PEntry = PBucket; 0 != (Entry = *PEntry) && 0 != Entry->Next; PEntry = &Entry->Next)
+            ;
+        if (0 == Entry)
+        {
+            ReleaseSRWLockExclusive(&Cache->Lock);
+            MemFree(NewEntry);
+            return;
+        }
+        *PEntry = 0;
+        Cache->Count--;
+        MemFree(Entry);
+    }
+
+    NewEntry->Next = *PBucket;
+    *PBucket = NewEntry;
+    Cache->Count++;
+
+    ReleaseSRWLockExclusive(&Cache->Lock);
+}
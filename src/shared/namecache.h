@@ -0,0 +1,337 @@
+/**
+ * @file shared/namecache.h
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_NAMECACHE_H_INCLUDED
+#define WINFSP_SHARED_NAMECACHE_H_INCLUDED
+
+/*
+ * Name cache
+ *
+ * The name cache remembers a fixed size payload for names of recently seen files. An
+ * entry consists of the hash of the parent directory path, the last path component
+ * (compared exactly), an owner, the payload and an expiration time. The negative name
+ * cache uses an empty payload to remember names that are known to be absent from their
+ * parent directory; the primed info cache uses a FileInfo payload to remember names that
+ * were returned by a directory listing.
+ *
+ * Only the owner of an entry can look it up. Owners are opaque to the cache; the caller
+ * uses them to ensure that a lookup is made by the same party that was allowed to see the
+ * name. Caches that are not owned use a zero owner throughout.
+ *
+ * The cache is a set associative table of SetCount * FSP_NAME_CACHE_WAYS entries of
+ * FSP_NAME_CACHE_ENTRY_SIZE(PayloadSize) bytes. The set of an entry is selected by its
+ * parent and name hashes; an insertion replaces a free or expired entry in the set or else
+ * the entry that expires first.
+ *
+ * Invalidation:
+ *
+ *     - FspNameCacheInvalidateName removes the entry of a single name. It is used when a
+ *     file that may have changed is closed.
+ *     - FspNameCacheInvalidateParent removes all entries of a parent directory. It is
+ *     used when a name is added to or changed in a directory.
+ *     - FspNameCacheInvalidateAll removes all entries. It is used when a directory is
+ *     removed or renamed, because the entries of its descendants cannot be found by their
+ *     parent hash.
+ *     - Every invalidation increments Generation. An insertion must present the
+ *     Generation that was current when the file system was asked about the name; this
+ *     prevents a lookup that raced with a change to the directory from inserting a stale
+ *     entry.
+ *
+ * Case insensitive caches fold ASCII characters only. Names that differ only in the case
+ * of a non-ASCII character are therefore different names to the cache, which can only cause
+ * cache misses. A parent path that contains non-ASCII characters may match other parent
+ * paths in the file system, but not in the cache; such parents are never cached and their
+ * invalidation invalidates the whole cache.
+ *
+ * The cache does no locking and does no allocation; the caller must serialize access and
+ * must supply the entry storage.
+ */
+
+#define FSP_NAME_CACHE_WAYS             4
+#define FSP_NAME_CACHE_NAME_MAX         60  /* in WCHAR's; longer names are not cached */
+
+typedef struct
+{
+    UINT64 Id[3];
+} FSP_NAME_CACHE_OWNER;
+
+typedef struct
+{
+    UINT64 ParentHash;
+    UINT64 ExpirationTime;              /* 0 marks a free entry */
+    FSP_NAME_CACHE_OWNER Owner;
+    UINT16 NameLength;                  /* in WCHAR's */
+    WCHAR Name[FSP_NAME_CACHE_NAME_MAX];
+    UINT64 Payload[];
+} FSP_NAME_CACHE_ENTRY;
+
+#define FSP_NAME_CACHE_ENTRY_SIZE(PayloadSize)\
+    (sizeof(FSP_NAME_CACHE_ENTRY) + ((PayloadSize) + sizeof(UINT64) - 1) / sizeof(UINT64) * sizeof(UINT64))
+
+typedef struct
+{
+    UINT32 SetCount;                    /* power of 2 */
+    UINT32 Generation;
+    UINT32 PayloadSize, EntrySize;
+    BOOLEAN CaseInsensitive;
+    PVOID Entries;                      /* SetCount * FSP_NAME_CACHE_WAYS entries */
+    UINT32 HitCount, MissCount, InsertCount, InvalidateCount;
+} FSP_NAME_CACHE;
+
+static inline
+FSP_NAME_CACHE_ENTRY *FspNameCacheEntry(FSP_NAME_CACHE *Cache, UINT32 Index)
+{
+    return (FSP_NAME_CACHE_ENTRY *)((PUINT8)Cache->Entries + (SIZE_T)Index * Cache->EntrySize);
+}
+
+static inline
+VOID FspNameCacheInitialize(FSP_NAME_CACHE *Cache, UINT32 SetCount, UINT32 PayloadSize,
+    BOOLEAN CaseInsensitive, PVOID Entries)
+{
+    Cache->SetCount = SetCount;
+    Cache->Generation = 0;
+    Cache->PayloadSize = PayloadSize;
+    Cache->EntrySize = (UINT32)FSP_NAME_CACHE_ENTRY_SIZE(PayloadSize);
+    Cache->CaseInsensitive = CaseInsensitive;
+    Cache->Entries = Entries;
+    Cache->HitCount = Cache->MissCount = Cache->InsertCount = Cache->InvalidateCount = 0;
+    for (UINT32 I = 0, N = SetCount * FSP_NAME_CACHE_WAYS; N > I; I++)
+        FspNameCacheEntry(Cache, I)->ExpirationTime = 0;
+}
+
+static inline
+WCHAR FspNameCacheFold(FSP_NAME_CACHE *Cache, WCHAR C)
+{
+    return Cache->CaseInsensitive && L'a' <= C && C <= L'z' ? C - (L'a' - L'A') : C;
+}
+
+static inline
+BOOLEAN FspNameCacheHash(FSP_NAME_CACHE *Cache,
+    PWSTR String, ULONG Length, PUINT64 PHash)
+{
+    /* FNV-1a; fails for strings that cannot be folded consistently with the file system */
+    UINT64 Hash = 14695981039346656037ULL;
+
+    for (ULONG I = 0; Length > I; I++)
+    {
+        if (Cache->CaseInsensitive && 0x80 <= String[I])
+            return FALSE;
+        Hash = (Hash ^ FspNameCacheFold(Cache, String[I])) * 1099511628211ULL;
+    }
+
+    *PHash = Hash;
+    return TRUE;
+}
+
+static inline
+BOOLEAN FspNameCacheOwnerEqual(const FSP_NAME_CACHE_OWNER *Owner0,
+    const FSP_NAME_CACHE_OWNER *Owner1)
+{
+    return
+        Owner0->Id[0] == Owner1->Id[0] &&
+        Owner0->Id[1] == Owner1->Id[1] &&
+        Owner0->Id[2] == Owner1->Id[2];
+}
+
+static inline
+FSP_NAME_CACHE_ENTRY *FspNameCacheFind(FSP_NAME_CACHE *Cache,
+    PWSTR Parent, ULONG ParentLength, PWSTR Name, ULONG NameLength,
+    PUINT64 PParentHash, UINT32 *PSetIndex)
+{
+    UINT64 ParentHash, NameHash;
+    FSP_NAME_CACHE_ENTRY *Entry;
+    UINT32 SetIndex;
+    ULONG I;
+
+    *PSetIndex = (UINT32)-1;
+
+    if (0 == Cache->SetCount ||
+        0 == NameLength || FSP_NAME_CACHE_NAME_MAX < NameLength ||
+        !FspNameCacheHash(Cache, Parent, ParentLength, &ParentHash))
+        return 0;
+
+    /* the name is compared exactly, so it need not be hashable */
+    NameHash = 14695981039346656037ULL;
+    for (I = 0; NameLength > I; I++)
+        NameHash = (NameHash ^ FspNameCacheFold(Cache, Name[I])) * 1099511628211ULL;
+
+    NameHash ^= ParentHash;
+    NameHash ^= NameHash >> 33;
+    NameHash *= 0xff51afd7ed558ccdULL;
+    NameHash ^= NameHash >> 33;
+    SetIndex = (UINT32)(NameHash & (Cache->SetCount - 1)) * FSP_NAME_CACHE_WAYS;
+
+    *PParentHash = ParentHash;
+    *PSetIndex = SetIndex;
+
+    for (UINT32 J = SetIndex; SetIndex + FSP_NAME_CACHE_WAYS > J; J++)
+    {
+        Entry = FspNameCacheEntry(Cache, J);
+        if (0 == Entry->ExpirationTime ||
+            Entry->ParentHash != ParentHash || Entry->NameLength != NameLength)
+            continue;
+        for (I = 0; NameLength > I; I++)
+            if (FspNameCacheFold(Cache, Entry->Name[I]) != FspNameCacheFold(Cache, Name[I]))
+                break;
+        if (NameLength == I)
+            return Entry;
+    }
+
+    return 0;
+}
+
+static inline
+BOOLEAN FspNameCacheLookup(FSP_NAME_CACHE *Cache,
+    PWSTR Parent, ULONG ParentLength, PWSTR Name, ULONG NameLength,
+    const FSP_NAME_CACHE_OWNER *Owner, UINT64 CurrentTime, PVOID Payload)
+{
+    FSP_NAME_CACHE_ENTRY *Entry;
+    UINT64 ParentHash;
+    UINT32 SetIndex;
+
+    Entry = FspNameCacheFind(Cache, Parent, ParentLength, Name, NameLength,
+        &ParentHash, &SetIndex);
+    if (0 != Entry && CurrentTime >= Entry->ExpirationTime)
+    {
+        Entry->ExpirationTime = 0;
+        Entry = 0;
+    }
+    if (0 != Entry && !FspNameCacheOwnerEqual(&Entry->Owner, Owner))
+        Entry = 0;
+
+    if (0 != Entry)
+    {
+        for (UINT32 I = 0; Cache->PayloadSize > I; I++)
+            ((PUINT8)Payload)[I] = ((PUINT8)Entry->Payload)[I];
+        Cache->HitCount++;
+    }
+    else
+        Cache->MissCount++;
+
+    return 0 != Entry;
+}
+
+static inline
+BOOLEAN FspNameCacheInsert(FSP_NAME_CACHE *Cache,
+    PWSTR Parent, ULONG ParentLength, PWSTR Name, ULONG NameLength,
+    const FSP_NAME_CACHE_OWNER *Owner, const VOID *Payload,
+    UINT64 CurrentTime, UINT64 ExpirationTime, UINT32 Generation)
+{
+    FSP_NAME_CACHE_ENTRY *Entry, *E;
+    UINT64 ParentHash;
+    UINT32 SetIndex;
+
+    if (Cache->Generation != Generation || CurrentTime >= ExpirationTime)
+        return FALSE;
+
+    Entry = FspNameCacheFind(Cache, Parent, ParentLength, Name, NameLength,
+        &ParentHash, &SetIndex);
+    if ((UINT32)-1 == SetIndex)
+        return FALSE;
+
+    if (0 == Entry)
+    {
+        Entry = FspNameCacheEntry(Cache, SetIndex);
+        for (UINT32 J = SetIndex; SetIndex + FSP_NAME_CACHE_WAYS > J; J++)
+        {
+            E = FspNameCacheEntry(Cache, J);
+            if (CurrentTime >= E->ExpirationTime)
+            {
+                Entry = E;
+                break;
+            }
+            if (Entry->ExpirationTime > E->ExpirationTime)
+                Entry = E;
+        }
+
+        Entry->ParentHash = ParentHash;
+        Entry->NameLength = (UINT16)NameLength;
+        for (ULONG I = 0; NameLength > I; I++)
+            Entry->Name[I] = Name[I];
+    }
+
+    Entry->Owner = *Owner;
+    for (UINT32 I = 0; Cache->PayloadSize > I; I++)
+        ((PUINT8)Entry->Payload)[I] = ((const UINT8 *)Payload)[I];
+    Entry->ExpirationTime = ExpirationTime;
+    Cache->InsertCount++;
+
+    return TRUE;
+}
+
+static inline
+VOID FspNameCacheInvalidateAll(FSP_NAME_CACHE *Cache)
+{
+    Cache->Generation++;
+    Cache->InvalidateCount++;
+    for (UINT32 I = 0, N = Cache->SetCount * FSP_NAME_CACHE_WAYS; N > I; I++)
+        FspNameCacheEntry(Cache, I)->ExpirationTime = 0;
+}
+
+static inline
+VOID FspNameCacheInvalidateParent(FSP_NAME_CACHE *Cache,
+    PWSTR Parent, ULONG ParentLength)
+{
+    FSP_NAME_CACHE_ENTRY *Entry;
+    UINT64 ParentHash;
+
+    if (!FspNameCacheHash(Cache, Parent, ParentLength, &ParentHash))
+    {
+        FspNameCacheInvalidateAll(Cache);
+        return;
+    }
+
+    Cache->Generation++;
+    Cache->InvalidateCount++;
+    for (UINT32 I = 0, N = Cache->SetCount * FSP_NAME_CACHE_WAYS; N > I; I++)
+    {
+        Entry = FspNameCacheEntry(Cache, I);
+        if (Entry->ParentHash == ParentHash)
+            Entry->ExpirationTime = 0;
+    }
+}
+
+static inline
+VOID FspNameCacheInvalidateName(FSP_NAME_CACHE *Cache,
+    PWSTR Parent, ULONG ParentLength, PWSTR Name, ULONG NameLength)
+{
+    FSP_NAME_CACHE_ENTRY *Entry;
+    UINT64 ParentHash, NameHash;
+    UINT32 SetIndex;
+
+    if (!FspNameCacheHash(Cache, Parent, ParentLength, &ParentHash))
+    {
+        FspNameCacheInvalidateAll(Cache);
+        return;
+    }
+
+    /* a name that cannot be folded may be cached under a different spelling */
+    if (!FspNameCacheHash(Cache, Name, NameLength, &NameHash))
+    {
+        FspNameCacheInvalidateParent(Cache, Parent, ParentLength);
+        return;
+    }
+
+    Cache->Generation++;
+    Cache->InvalidateCount++;
+    Entry = FspNameCacheFind(Cache, Parent, ParentLength, Name, NameLength,
+        &ParentHash, &SetIndex);
+    if (0 != Entry)
+        Entry->ExpirationTime = 0;
+}
+
+#endif
@@ -0,0 +1,265 @@
+/**
+ * @file shared/pattern.h
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_PATTERN_H_INCLUDED
+#define WINFSP_SHARED_PATTERN_H_INCLUDED
+
+/*
+ * Compiled file name patterns
+ *
+ * A pattern is a file name expression with the semantics of FsRtlIsNameInExpression:
+ *
+ *     - '*' matches zero or more characters.
+ *     - '?' matches exactly one character.
+ *     - '<' (DOS_STAR) matches zero or more characters, except the last '.' of the name.
+ *     - '>' (DOS_QM) matches one character; at a '.' or the end of the name it matches
+ *     zero characters.
+ *     - '"' (DOS_DOT) matches a '.'; at the end of the name it matches zero characters.
+ *     - Any other character matches itself.
+ *
+ * The expression is examined once by FspPatternCompile, which selects a matcher:
+ *
+ *     - Literal: the expression has no wildcards ("abc").
+ *     - Prefix: the only wildcard is a trailing '*' ("abc*", including "*").
+ *     - Suffix: the only wildcard is a leading '*' ("*.ext").
+ *     - General: anything else. The general matcher simulates the expression as a
+ *     nondeterministic automaton with one state per expression position; it does not
+ *     backtrack and its running time is bounded by the product of the name and expression
+ *     lengths. Expressions longer than FSP_PATTERN_LENGTH_MAX are not compiled.
+ *
+ * As with FsRtlIsNameInExpression a case insensitive expression must already be upcased.
+ * Names are upcased a character at a time: ASCII characters through a table and other
+ * characters through the Upcase function supplied at compilation.
+ *
+ * The pattern references the expression buffer, which must outlive it. The pattern does
+ * no allocation.
+ */
+
+#define FSP_PATTERN_LENGTH_MAX          256 /* in WCHAR's */
+
+enum
+{
+    FspPatternGeneral                   = 0,
+    FspPatternLiteral,
+    FspPatternPrefix,
+    FspPatternSuffix,
+};
+
+typedef WCHAR FSP_PATTERN_UPCASE(WCHAR C);
+
+typedef struct
+{
+    UINT32 Kind;
+    BOOLEAN CaseInsensitive;
+    FSP_PATTERN_UPCASE *Upcase;
+    PWSTR Expression;                   /* literal part for Literal/Prefix/Suffix */
+    ULONG Length;                       /* in WCHAR's */
+} FSP_PATTERN;
+
+static inline
+BOOLEAN FspPatternIsWild(WCHAR C)
+{
+    return L'*' == C || L'?' == C || L'<' == C || L'>' == C || L'"' == C;
+}
+
+static inline
+WCHAR FspPatternUpcase(const FSP_PATTERN *Pattern, WCHAR C)
+{
+    static const UINT8 AsciiUpcase[128] =
+    {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+        0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+        0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+        0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f,
+        0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+        0x60, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f,
+        0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+    };
+
+    if (!Pattern->CaseInsensitive)
+        return C;
+    if (0x80 > C)
+        return AsciiUpcase[C];
+    return 0 != Pattern->Upcase ? Pattern->Upcase(C) : C;
+}
+
+static inline
+BOOLEAN FspPatternEqual(const FSP_PATTERN *Pattern, PWSTR Name)
+{
+    for (ULONG I = 0; Pattern->Length > I; I++)
+        if (Pattern->Expression[I] != FspPatternUpcase(Pattern, Name[I]))
+            return FALSE;
+    return TRUE;
+}
+
+static inline
+BOOLEAN FspPatternCompile(FSP_PATTERN *Pattern,
+    PWSTR Expression, ULONG Length, BOOLEAN CaseInsensitive, FSP_PATTERN_UPCASE *Upcase)
+{
+    ULONG WildCount = 0;
+
+    for (ULONG I = 0; Length > I; I++)
+        WildCount += FspPatternIsWild(Expression[I]);
+
+    Pattern->CaseInsensitive = CaseInsensitive;
+    Pattern->Upcase = Upcase;
+    Pattern->Expression = Expression;
+    Pattern->Length = Length;
+
+    if (0 == WildCount)
+        Pattern->Kind = FspPatternLiteral;
+    else if (1 == WildCount && L'*' == Expression[Length - 1])
+    {
+        Pattern->Kind = FspPatternPrefix;
+        Pattern->Length = Length - 1;
+    }
+    else if (1 == WildCount && L'*' == Expression[0])
+    {
+        Pattern->Kind = FspPatternSuffix;
+        Pattern->Expression = Expression + 1;
+        Pattern->Length = Length - 1;
+    }
+    else if (FSP_PATTERN_LENGTH_MAX >= Length)
+        Pattern->Kind = FspPatternGeneral;
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+static inline
+BOOLEAN FspPatternMatchGeneral(const FSP_PATTERN *Pattern, PWSTR Name, ULONG NameLength)
+{
+    /*
+     * State I means that the first I expression characters have matched. For every name
+     * character we first follow the transitions that consume no characters (they always
+     * go from I to I + 1, so a single ascending pass suffices) and then the transitions
+     * that consume the character. Active states are bounded by [Lo, Hi].
+     */
+    PWSTR Expression = Pattern->Expression;
+    ULONG Length = Pattern->Length;
+    UINT8 StateBuf[2][FSP_PATTERN_LENGTH_MAX + 1];
+    UINT8 *State = StateBuf[0], *NextState = StateBuf[1], *Swap;
+    ULONG Lo, Hi, NextLo, NextHi, LastDot, I, J, T;
+    BOOLEAN End;
+    WCHAR C, E;
+
+    for (I = 0; Length >= I; I++)
+        State[I] = NextState[I] = 0;
+
+    for (LastDot = NameLength; 0 < LastDot && L'.' != Name[LastDot - 1]; LastDot--)
+        ;
+    LastDot = 0 < LastDot ? LastDot - 1 : (ULONG)-1;
+
+    State[0] = 1;
+    Lo = Hi = 0;
+    for (J = 0;; J++)
+    {
+        End = NameLength == J;
+        C = End ? 0 : FspPatternUpcase(Pattern, Name[J]);
+
+        for (I = Lo; Hi >= I && Length > I; I++)
+        {
+            if (!State[I])
+                continue;
+            E = Expression[I];
+            if (L'*' == E || L'<' == E ||
+                (L'>' == E && (End || L'.' == C)) ||
+                (L'"' == E && End))
+            {
+                State[I + 1] = 1;
+                if (Hi < I + 1)
+                    Hi = I + 1;
+            }
+        }
+
+        if (End)
+            return 0 != State[Length];
+
+        NextLo = (ULONG)-1;
+        NextHi = 0;
+        for (I = Lo; Hi >= I && Length > I; I++)
+        {
+            if (!State[I])
+                continue;
+            State[I] = 0;
+            E = Expression[I];
+            T = (ULONG)-1;
+            switch (E)
+            {
+            case L'*':
+                T = I;
+                break;
+            case L'<':
+                if (L'.' != C || J != LastDot)
+                    T = I;
+                break;
+            case L'?':
+                T = I + 1;
+                break;
+            case L'>':
+                if (L'.' != C)
+                    T = I + 1;
+                break;
+            case L'"':
+                if (L'.' == C)
+                    T = I + 1;
+                break;
+            default:
+                if (E == C)
+                    T = I + 1;
+                break;
+            }
+            if ((ULONG)-1 != T)
+            {
+                NextState[T] = 1;
+                if (NextLo > T)
+                    NextLo = T;
+                if (NextHi < T)
+                    NextHi = T;
+            }
+        }
+        State[Length] = 0;
+
+        if ((ULONG)-1 == NextLo)
+            return FALSE;
+
+        Swap = State; State = NextState; NextState = Swap;
+        Lo = NextLo;
+        Hi = NextHi;
+    }
+}
+
+static inline
+BOOLEAN FspPatternMatch(const FSP_PATTERN *Pattern, PWSTR Name, ULONG NameLength)
+{
+    switch (Pattern->Kind)
+    {
+    case FspPatternLiteral:
+        return Pattern->Length == NameLength && FspPatternEqual(Pattern, Name);
+    case FspPatternPrefix:
+        return Pattern->Length <= NameLength && FspPatternEqual(Pattern, Name);
+    case FspPatternSuffix:
+        return Pattern->Length <= NameLength &&
+            FspPatternEqual(Pattern, Name + NameLength - Pattern->Length);
+    default:
+        return FspPatternMatchGeneral(Pattern, Name, NameLength);
+    }
+}
+
+#endif
@@ -0,0 +1,137 @@
+/**
+ * @file shared/ring.h
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_RING_H_INCLUDED
+#define WINFSP_SHARED_RING_H_INCLUDED
+
+/*
+ * Data ring allocator
+ *
+ * The data ring is a long-lived region of memory that is shared between the FSD and the
+ * user mode file system and is used to transfer Read/Write payloads. The region is divided
+ * into BlockCount fixed size blocks; a payload occupies a run of contiguous blocks and is
+ * identified by the index of its first block. The user mode file system receives the
+ * payload address as an offset into the region and never sees the allocator state, which
+ * lives in a side table that is private to the allocating side.
+ *
+ * Allocations are carved from Head and retired at Tail:
+ *
+ *     - An allocation is placed at Head if it fits in the space before the next occupied
+ *     block (Tail when Head <= Tail, the end of the region otherwise).
+ *     - When Head > Tail and the allocation does not fit at the end of the region, but
+ *     fits at the beginning, the blocks at the end are turned into a "skip" allocation that
+ *     is already released, and the allocation is placed at block 0.
+ *     - Allocations may be released in any order. Releasing marks the allocation free; Tail
+ *     then advances over all consecutive free allocations. Out-of-order releases therefore
+ *     delay reuse of their blocks until all older allocations have been released.
+ *     - When the ring becomes empty Head and Tail are reset to 0, so that a drained ring
+ *     always has its full capacity available in one contiguous run.
+ *
+ * The ring does no locking; the caller must serialize access.
+ */
+
+#define FSP_RING_FREE                   0x80000000
+
+typedef struct
+{
+    UINT32 BlockCount;
+    UINT32 Head, Tail, Used;
+    UINT32 *BlockLength;                /* BlockCount entries; FSP_RING_FREE marks released */
+} FSP_RING;
+
+static inline
+VOID FspRingInitialize(FSP_RING *Ring, UINT32 BlockCount, UINT32 *BlockLength)
+{
+    Ring->BlockCount = BlockCount;
+    Ring->Head = Ring->Tail = Ring->Used = 0;
+    Ring->BlockLength = BlockLength;
+}
+
+static inline
+BOOLEAN FspRingAllocate(FSP_RING *Ring, UINT32 Blocks, PUINT32 PIndex)
+{
+    UINT32 Index;
+
+    *PIndex = 0;
+
+    if (0 == Blocks || Ring->BlockCount < Blocks)
+        return FALSE;
+
+    if (0 == Ring->Used)
+    {
+        Ring->Head = Ring->Tail = 0;
+        Index = 0;
+    }
+    else if (Ring->Head > Ring->Tail)
+    {
+        if (Ring->BlockCount - Ring->Head >= Blocks)
+            Index = Ring->Head;
+        else if (Ring->Tail >= Blocks)
+        {
+            /* wrap: turn the end of the ring into a released skip allocation */
+            if (Ring->BlockCount > Ring->Head)
+            {
+                Ring->BlockLength[Ring->Head] = (Ring->BlockCount - Ring->Head) | FSP_RING_FREE;
+                Ring->Used += Ring->BlockCount - Ring->Head;
+            }
+            Index = 0;
+        }
+        else
+            return FALSE;
+    }
+    else
+    {
+        /* Head <= Tail: the ring has wrapped (Head == Tail means that it is full) */
+        if (Ring->Tail - Ring->Head >= Blocks)
+            Index = Ring->Head;
+        else
+            return FALSE;
+    }
+
+    Ring->BlockLength[Index] = Blocks;
+    Ring->Used += Blocks;
+    Ring->Head = Index + Blocks;
+
+    *PIndex = Index;
+
+    return TRUE;
+}
+
+static inline
+VOID FspRingRelease(FSP_RING *Ring, UINT32 Index)
+{
+    UINT32 Blocks;
+
+    ASSERT(Index < Ring->BlockCount);
+    ASSERT(0 == (Ring->BlockLength[Index] & FSP_RING_FREE));
+
+    Ring->BlockLength[Index] |= FSP_RING_FREE;
+
+    while (0 != Ring->Used && (Ring->BlockLength[Ring->Tail] & FSP_RING_FREE))
+    {
+        Blocks = Ring->BlockLength[Ring->Tail] & ~FSP_RING_FREE;
+        Ring->Used -= Blocks;
+        Ring->Tail += Blocks;
+        if (Ring->BlockCount <= Ring->Tail)
+            Ring->Tail = 0;
+    }
+
+    if (0 == Ring->Used)
+        Ring->Head = Ring->Tail = 0;
+}
+
+#endif
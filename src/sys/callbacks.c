@@ -19,6 +19,7 @@
 #include <sys/driver.h>
 
 FAST_IO_CHECK_IF_POSSIBLE FspFastIoCheckIfPossible;
+FAST_IO_QUERY_OPEN FspFastIoQueryOpen;
 FAST_IO_ACQUIRE_FILE FspAcquireFileForNtCreateSection;
 FAST_IO_RELEASE_FILE FspReleaseFileForNtCreateSection;
 FAST_IO_ACQUIRE_FOR_MOD_WRITE FspAcquireForModWrite;
@@ -39,6 +40,7 @@ VOID FspPropagateTopFlags(PIRP Irp, PIRP TopLevelFlags);
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, FspFastIoCheckIfPossible)
+#pragma alloc_text(PAGE, FspFastIoQueryOpen)
 #pragma alloc_text(PAGE, FspAcquireFileForNtCreateSection)
 #pragma alloc_text(PAGE, FspReleaseFileForNtCreateSection)
 #pragma alloc_text(PAGE, FspAcquireForModWrite)
@@ -69,6 +71,28 @@ BOOLEAN FspFastIoCheckIfPossible(
     FSP_LEAVE_BOOL("FileObject=%p", FileObject);
 }
 
+BOOLEAN FspFastIoQueryOpen(
+    PIRP Irp,
+    PFILE_NETWORK_OPEN_INFORMATION NetworkInformation,
+    PDEVICE_OBJECT DeviceObject)
+{
+    FSP_ENTER_BOOL(PAGED_CODE());
+
+    Result = FALSE;
+
+    /* the volume may be torn down concurrently; see FSP_ENTER_MJ */
+    if (FspFsvolDeviceExtensionKind == FspDeviceExtension(DeviceObject)->Kind &&
+        FspDeviceReference(DeviceObject))
+    {
+        if (!FspIoqStopped(FspFsvolDeviceExtension(DeviceObject)->Ioq))
+            Result = FspFsvolQueryOpen(DeviceObject, Irp, NetworkInformation);
+
+        FspDeviceDereference(DeviceObject);
+    }
+
+    FSP_LEAVE_BOOL("FileObject=%p", IoGetCurrentIrpStackLocation(Irp)->FileObject);
+}
+
 VOID FspAcquireFileForNtCreateSection(
     PFILE_OBJECT FileObject)
 {
@@ -44,6 +44,8 @@ static VOID FspFsvolCreateOpenOrOverwriteOplockPrepare(
     PVOID Context, PIRP Irp);
 static VOID FspFsvolCreateOpenOrOverwriteOplockComplete(
     PVOID Context, PIRP Irp);
+BOOLEAN FspFsvolQueryOpen(PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp,
+    PFILE_NETWORK_OPEN_INFORMATION NetworkInformation);
 FSP_DRIVER_DISPATCH FspCreate;
 
 #ifdef ALLOC_PRAGMA
@@ -62,6 +64,7 @@ FSP_DRIVER_DISPATCH FspCreate;
 #pragma alloc_text(PAGE, FspFsvolCreateOpenOrOverwriteOplock)
 #pragma alloc_text(PAGE, FspFsvolCreateOpenOrOverwriteOplockPrepare)
 #pragma alloc_text(PAGE, FspFsvolCreateOpenOrOverwriteOplockComplete)
+#pragma alloc_text(PAGE, FspFsvolQueryOpen)
 #pragma alloc_text(PAGE, FspCreate)
 #endif
 
@@ -398,6 +401,35 @@ static NTSTATUS FspFsvolCreateNoLock(
     if (CreateOptions & FILE_DIRECTORY_FILE)
         SetFlag(FileAttributes, FILE_ATTRIBUTE_DIRECTORY);
 
+    /* is the name known not to exist? */
+    if (0 != FsvolDeviceExtension->NegativeNameCache &&
+        0 == StreamPart.Buffer &&
+        sizeof(WCHAR) < FileNode->FileName.Length &&
+        (FILE_OPEN == CreateDisposition || FILE_OVERWRITE == CreateDisposition) &&
+        !FlagOn(Flags, SL_OPEN_TARGET_DIRECTORY))
+    {
+        BOOLEAN NameNotFound;
+
+        FileDesc->DidLookupNegativeNameCache = 1;
+        NameNotFound = FspFileNameCacheLookup(FsvolDeviceExtension->NegativeNameCache,
+            &FileNode->FileName, 0, 0, &FileDesc->NegativeNameCacheGeneration);
+        if (!NameNotFound &&
+            FspFileNodeParentDirInfoLacksName(FsvolDeviceObject, &FileNode->FileName, !CaseSensitive))
+        {
+            FspFileNameCacheInsert(FsvolDeviceExtension->NegativeNameCache,
+                &FileNode->FileName, 0, 0, FileDesc->NegativeNameCacheGeneration);
+            NameNotFound = TRUE;
+        }
+
+        /* without traverse privilege the file system must still check access to the parents */
+        if (NameNotFound && HasTraversePrivilege)
+        {
+            FspFileDescDelete(FileDesc);
+            FspFileNodeDereference(FileNode);
+            return STATUS_OBJECT_NAME_NOT_FOUND;
+        }
+    }
+
     /* if we have a non-empty stream part, open the main file */
     if (0 != StreamPart.Length)
     {
@@ -660,6 +692,11 @@ NTSTATUS FspFsvolCreateComplete(
         /* did the user-mode file system sent us a failure code? */
         if (!NT_SUCCESS(Response->IoStatus.Status))
         {
+            if (STATUS_OBJECT_NAME_NOT_FOUND == Response->IoStatus.Status &&
+                FileDesc->DidLookupNegativeNameCache)
+                FspFileNameCacheInsert(FsvolDeviceExtension->NegativeNameCache,
+                    &FileNode->FileName, 0, 0, FileDesc->NegativeNameCacheGeneration);
+
             Irp->IoStatus.Information = STATUS_SHARING_VIOLATION == Response->IoStatus.Status ?
                 Response->IoStatus.Information : 0;
             Result = Response->IoStatus.Status;
@@ -906,6 +943,15 @@ NTSTATUS FspFsvolCreateComplete(
         AccessState->PreviouslyGrantedAccess = Response->Rsp.Create.Opened.GrantedAccess;
         FileDesc->GrantedAccess = Response->Rsp.Create.Opened.GrantedAccess;
 
+        /*
+         * Names listed through a directory handle are primed in the info cache on behalf of
+         * the security context that was granted FILE_LIST_DIRECTORY; see FspFsvolQueryOpen.
+         */
+        if (0 != FsvolDeviceExtension->InfoNameCache && FileNode->IsDirectory &&
+            FlagOn(FileDesc->GrantedAccess, FILE_LIST_DIRECTORY))
+            FileDesc->HasInfoNameCacheOwner = NT_SUCCESS(FspFileNameCacheGetOwner(
+                &AccessState->SubjectSecurityContext, &FileDesc->InfoNameCacheOwner));
+
         /* set up the FileObject */
         if (0 != FsvolDeviceExtension->FsvrtDeviceObject)
 #pragma prefast(disable:28175, "We are a filesystem: ok to access Vpb")
@@ -1541,6 +1587,127 @@ static VOID FspFsvolCreateOpenOrOverwriteOplockComplete(
         ASSERT(0);
 }
 
+BOOLEAN FspFsvolQueryOpen(PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp,
+    PFILE_NETWORK_OPEN_INFORMATION NetworkInformation)
+{
+    /*
+     * Answer a query open (NtQueryAttributesFile, NtQueryFullAttributesFile) from the
+     * primed info cache. Returning FALSE makes the I/O manager send a regular Create,
+     * so we only answer when the result cannot differ from what the Create would find:
+     *
+     *   - The caller's effective token is the token that opened the directory for listing
+     *     (see FspFileNameCacheGetOwner) and it has traverse privilege. Listing a directory
+     *     grants the right to read the attributes of its entries; without traverse privilege
+     *     the file system must still check access to the parents. An identification level
+     *     impersonation token cannot open files and is therefore never answered.
+     *   - The name is an absolute path without a stream part that is not currently open.
+     *     Changes to a file go through an open FileNode and its last close removes the
+     *     name from the cache.
+     */
+
+    PAGED_CODE();
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    PFILE_OBJECT FileObject = IrpSp->FileObject;
+    UNICODE_STRING FileName = FileObject->FileName;
+    PACCESS_STATE AccessState = IrpSp->Parameters.Create.SecurityContext->AccessState;
+    ULONG CreateOptions = IrpSp->Parameters.Create.Options;
+    PSECURITY_SUBJECT_CONTEXT SubjectContext = &AccessState->SubjectSecurityContext;
+    FSP_NAME_CACHE_OWNER Owner;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    BOOLEAN Result;
+
+    if (0 == FsvolDeviceExtension->InfoNameCache ||
+        0 != FileObject->RelatedFileObject ||
+        !FlagOn(AccessState->Flags, TOKEN_HAS_TRAVERSE_PRIVILEGE) ||
+        (0 != SubjectContext->ClientToken &&
+            SecurityImpersonation > SubjectContext->ImpersonationLevel) ||
+        FlagOn(CreateOptions, FILE_OPEN_BY_FILE_ID) ||
+        FlagOn(IrpSp->Flags, SL_OPEN_TARGET_DIRECTORY) ||
+        FspMainFileOpenCheck(Irp))
+        return FALSE;
+
+    /* according to fastfat, filenames that begin with two backslashes are ok */
+    if (sizeof(WCHAR) * 2 <= FileName.Length &&
+        L'\\' == FileName.Buffer[1] && L'\\' == FileName.Buffer[0])
+    {
+        FileName.Length -= sizeof(WCHAR);
+        FileName.MaximumLength -= sizeof(WCHAR);
+        FileName.Buffer++;
+    }
+
+    /* no stream part */
+    if (!FspFileNameIsValid(&FileName, FsvolDeviceExtension->VolumeParams.MaxComponentLength, 0, 0))
+        return FALSE;
+
+    /* check and remove any volume prefix */
+    if (0 < FsvolDeviceExtension->VolumePrefix.Length)
+    {
+        if (!FspFsvolDeviceVolumePrefixInString(FsvolDeviceObject, &FileName) ||
+            FileName.Length <= FsvolDeviceExtension->VolumePrefix.Length ||
+            '\\' != FileName.Buffer[FsvolDeviceExtension->VolumePrefix.Length / sizeof(WCHAR)])
+            return FALSE;
+
+        FileName.Length -= FsvolDeviceExtension->VolumePrefix.Length;
+        FileName.MaximumLength -= FsvolDeviceExtension->VolumePrefix.Length;
+        FileName.Buffer += FsvolDeviceExtension->VolumePrefix.Length / sizeof(WCHAR);
+    }
+
+    if (sizeof(WCHAR) * 2 > FileName.Length ||
+        L'\\' != FileName.Buffer[0] ||
+        L'\\' == FileName.Buffer[FileName.Length / sizeof(WCHAR) - 1])
+        return FALSE;
+
+    if (!NT_SUCCESS(FspFileNameCacheGetOwner(SubjectContext, &Owner)))
+        return FALSE;
+
+    /* FileNode names cannot change while we hold the FileRenameResource */
+    FspFsvolDeviceFileRenameAcquireShared(FsvolDeviceObject);
+
+    FspFsvolDeviceLockContextTable(FsvolDeviceObject);
+    Result = 0 == FspFsvolDeviceLookupContextByName(FsvolDeviceObject, &FileName);
+    FspFsvolDeviceUnlockContextTable(FsvolDeviceObject);
+
+    if (Result)
+    {
+        Result = FspFileNameCacheLookup(FsvolDeviceExtension->InfoNameCache,
+            &FileName, &Owner, &FileInfo, 0);
+        if (Result)
+            FspStatisticsInc(FspFsvolDeviceStatistics(FsvolDeviceObject),
+                InfoCache.QueryOpenHitCount);
+        else
+            FspStatisticsInc(FspFsvolDeviceStatistics(FsvolDeviceObject),
+                InfoCache.QueryOpenMissCount);
+    }
+
+    FspFsvolDeviceFileRenameRelease(FsvolDeviceObject);
+
+    if (!Result)
+        return FALSE;
+
+    /* let the Create report directory mismatches */
+    if ((FlagOn(CreateOptions, FILE_DIRECTORY_FILE) &&
+            !FlagOn(FileInfo.FileAttributes, FILE_ATTRIBUTE_DIRECTORY)) ||
+        (FlagOn(CreateOptions, FILE_NON_DIRECTORY_FILE) &&
+            FlagOn(FileInfo.FileAttributes, FILE_ATTRIBUTE_DIRECTORY)))
+        return FALSE;
+
+    NetworkInformation->AllocationSize.QuadPart = FileInfo.AllocationSize;
+    NetworkInformation->EndOfFile.QuadPart = FileInfo.FileSize;
+    NetworkInformation->CreationTime.QuadPart = FileInfo.CreationTime;
+    NetworkInformation->LastAccessTime.QuadPart = FileInfo.LastAccessTime;
+    NetworkInformation->LastWriteTime.QuadPart = FileInfo.LastWriteTime;
+    NetworkInformation->ChangeTime.QuadPart = FileInfo.ChangeTime;
+    NetworkInformation->FileAttributes = 0 != FileInfo.FileAttributes ?
+        FileInfo.FileAttributes : FILE_ATTRIBUTE_NORMAL;
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = sizeof *NetworkInformation;
+
+    return TRUE;
+}
+
 NTSTATUS FspCreate(
     PDEVICE_OBJECT DeviceObject, PIRP Irp)
 {
@@ -0,0 +1,408 @@
+/**
+ * @file sys/dataring.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <sys/driver.h>
+#include <shared/ring.h>
+
+/*
+ * A data ring is a per-volume region of memory that is allocated once in the address space
+ * of the file system process and stays locked for the lifetime of the volume. Read/Write
+ * payloads are placed in the ring and the user mode file system is given their address
+ * in the region; this avoids mapping (and unmapping) an MDL into user mode for every
+ * request. The FSD accesses the region through a system address and copies payloads
+ * between the region and the IRP buffers.
+ *
+ * The allocator (see shared/ring.h) keeps its state in nonpaged memory, so that a
+ * misbehaving file system cannot corrupt it by writing into the region.
+ *
+ * Locking memory on behalf of a user mode process is a privileged operation: the creating
+ * process must hold SeLockMemoryPrivilege, a ring is at most FspDataRingSizeMax bytes and
+ * all rings together are at most FspDataRingTotalSizeMax bytes. A volume whose ring cannot
+ * be created under these rules works without one.
+ *
+ * The region must be unlocked before the address space of the file system process goes
+ * away. The volume handle may have been duplicated into or inherited by another process,
+ * so volume handle cleanup (which calls FspDataRingDetach early) may come too late. Every
+ * ring is therefore also kept in a driver-wide list and a process notify routine detaches
+ * the rings of an exiting process. Detaching is serialized by the list resource, so the
+ * process cannot complete its exit while another thread is detaching one of its rings.
+ * Outstanding allocations may still be released after the region has been detached.
+ *
+ * Copies through the system address are made outside the spin lock, so they are bracketed
+ * by a use reference: FspDataRingAcquire returns with one held and FspDataRingEnter takes
+ * one, both released by FspDataRingLeave. FspDataRingDetach marks the ring detached (no
+ * new references can be taken) and waits for existing references to drain before it
+ * unlocks the region. Copies only touch locked memory, so the wait is short.
+ */
+
+#define FspDataRingBlockSize            PAGE_SIZE
+
+typedef struct _FSP_DATA_RING
+{
+    LIST_ENTRY ListEntry;
+    KSPIN_LOCK SpinLock;
+    FSP_RING Ring;
+    PEPROCESS Process;
+    PMDL Mdl;
+    PUINT8 UserBase;
+    PUINT8 SystemBase;
+    SIZE_T RegionSize;
+    BOOLEAN Detached;
+    ULONG UseCount;
+    KEVENT DrainEvent;
+    UINT32 BlockLength[];
+} FSP_DATA_RING;
+
+NTSTATUS FspDataRingInitialize(VOID);
+VOID FspDataRingFinalize(VOID);
+NTSTATUS FspDataRingCreate(ULONG Size, FSP_DATA_RING **PDataRing);
+static VOID FspDataRingDetachLocked(FSP_DATA_RING *DataRing);
+VOID FspDataRingDetach(FSP_DATA_RING *DataRing);
+VOID FspDataRingDelete(FSP_DATA_RING *DataRing);
+BOOLEAN FspDataRingAcquire(FSP_DATA_RING *DataRing, ULONG Length,
+    PULONG PIndex, PVOID *PUserAddress, PVOID *PSystemAddress);
+VOID FspDataRingRelease(FSP_DATA_RING *DataRing, ULONG Index);
+BOOLEAN FspDataRingEnter(FSP_DATA_RING *DataRing);
+VOID FspDataRingLeave(FSP_DATA_RING *DataRing);
+
+static VOID FspDataRingNotifyRoutine(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, FspDataRingFinalize)
+#pragma alloc_text(PAGE, FspDataRingCreate)
+#pragma alloc_text(PAGE, FspDataRingDetachLocked)
+#pragma alloc_text(PAGE, FspDataRingDetach)
+#pragma alloc_text(PAGE, FspDataRingDelete)
+#pragma alloc_text(PAGE, FspDataRingNotifyRoutine)
+#endif
+
+static ERESOURCE DataRingResource;
+static LIST_ENTRY DataRingList;
+static SIZE_T DataRingTotalSize;
+
+static inline VOID FspDataRingListLock(VOID)
+{
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&DataRingResource, TRUE);
+}
+
+static inline VOID FspDataRingListUnlock(VOID)
+{
+    ExReleaseResourceLite(&DataRingResource);
+    KeLeaveCriticalRegion();
+}
+
+NTSTATUS FspDataRingInitialize(VOID)
+{
+    NTSTATUS Result;
+
+    ExInitializeResourceLite(&DataRingResource);
+    InitializeListHead(&DataRingList);
+    DataRingTotalSize = 0;
+
+    Result = PsSetCreateProcessNotifyRoutine(FspDataRingNotifyRoutine, FALSE);
+    if (!NT_SUCCESS(Result))
+        ExDeleteResourceLite(&DataRingResource);
+
+    return Result;
+}
+
+VOID FspDataRingFinalize(VOID)
+{
+    PAGED_CODE();
+
+    PsSetCreateProcessNotifyRoutine(FspDataRingNotifyRoutine, TRUE);
+
+    ASSERT(IsListEmpty(&DataRingList));
+    ExDeleteResourceLite(&DataRingResource);
+}
+
+static VOID FspDataRingNotifyRoutine(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create)
+{
+    PAGED_CODE();
+
+    if (Create)
+        return;
+
+    /* the ring references its process, so ProcessId cannot have been reused */
+    FspDataRingListLock();
+    for (PLIST_ENTRY ListEntry = DataRingList.Flink;
+        &DataRingList != ListEntry;
+        ListEntry = ListEntry->Flink)
+    {
+        FSP_DATA_RING *DataRing = CONTAINING_RECORD(ListEntry, FSP_DATA_RING, ListEntry);
+        if (PsGetProcessId(DataRing->Process) == ProcessId)
+            FspDataRingDetachLocked(DataRing);
+    }
+    FspDataRingListUnlock();
+}
+
+NTSTATUS FspDataRingCreate(ULONG Size, FSP_DATA_RING **PDataRing)
+{
+    PAGED_CODE();
+
+    NTSTATUS Result;
+    FSP_DATA_RING *DataRing = 0;
+    ULONG BlockCount;
+    PVOID UserBase = 0;
+    SIZE_T RegionSize;
+    PMDL Mdl = 0;
+    PVOID SystemBase;
+    BOOLEAN Reserved;
+
+    *PDataRing = 0;
+
+    if (FspDataRingSizeMax < Size)
+        Size = FspDataRingSizeMax;
+    BlockCount = Size / FspDataRingBlockSize;
+    if (0 == BlockCount)
+        return STATUS_INVALID_PARAMETER;
+    RegionSize = (SIZE_T)BlockCount * FspDataRingBlockSize;
+
+    if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_LOCK_MEMORY_PRIVILEGE), UserMode))
+        return STATUS_PRIVILEGE_NOT_HELD;
+
+    /* reserve the region against the driver-wide budget */
+    FspDataRingListLock();
+    Reserved = FspDataRingTotalSizeMax - DataRingTotalSize >= RegionSize;
+    if (Reserved)
+        DataRingTotalSize += RegionSize;
+    FspDataRingListUnlock();
+    if (!Reserved)
+        return STATUS_QUOTA_EXCEEDED;
+
+    DataRing = FspAllocNonPaged(
+        FIELD_OFFSET(FSP_DATA_RING, BlockLength) + BlockCount * sizeof(UINT32));
+    if (0 == DataRing)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto fail;
+    }
+    RtlZeroMemory(DataRing, FIELD_OFFSET(FSP_DATA_RING, BlockLength));
+
+    Result = ZwAllocateVirtualMemory(ZwCurrentProcess(),
+        &UserBase, 0, &RegionSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!NT_SUCCESS(Result))
+        goto fail;
+
+    Mdl = IoAllocateMdl(UserBase, (ULONG)RegionSize, FALSE, FALSE, 0);
+    if (0 == Mdl)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto fail;
+    }
+
+    try
+    {
+        MmProbeAndLockPages(Mdl, UserMode, IoWriteAccess);
+    }
+    except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        Result = GetExceptionCode();
+        IoFreeMdl(Mdl);
+        Mdl = 0;
+        goto fail;
+    }
+
+    SystemBase = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+    if (0 == SystemBase)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto fail;
+    }
+
+    KeInitializeSpinLock(&DataRing->SpinLock);
+    KeInitializeEvent(&DataRing->DrainEvent, NotificationEvent, FALSE);
+    FspRingInitialize(&DataRing->Ring, BlockCount, DataRing->BlockLength);
+    DataRing->Process = PsGetCurrentProcess();
+    ObReferenceObject(DataRing->Process);
+    DataRing->Mdl = Mdl;
+    DataRing->UserBase = UserBase;
+    DataRing->SystemBase = SystemBase;
+    DataRing->RegionSize = RegionSize;
+
+    FspDataRingListLock();
+    InsertTailList(&DataRingList, &DataRing->ListEntry);
+    FspDataRingListUnlock();
+
+    *PDataRing = DataRing;
+
+    return STATUS_SUCCESS;
+
+fail:
+    if (0 != Mdl)
+    {
+        MmUnlockPages(Mdl);
+        IoFreeMdl(Mdl);
+    }
+
+    if (0 != UserBase)
+    {
+        RegionSize = 0;
+        ZwFreeVirtualMemory(ZwCurrentProcess(), &UserBase, &RegionSize, MEM_RELEASE);
+    }
+
+    if (0 != DataRing)
+        FspFree(DataRing);
+
+    FspDataRingListLock();
+    DataRingTotalSize -= (SIZE_T)BlockCount * FspDataRingBlockSize;
+    FspDataRingListUnlock();
+
+    return Result;
+}
+
+static VOID FspDataRingDetachLocked(FSP_DATA_RING *DataRing)
+{
+    PAGED_CODE();
+
+    KIRQL Irql;
+    BOOLEAN Detached, Drain;
+    KAPC_STATE ApcState;
+    BOOLEAN Attach;
+    PVOID UserBase;
+    SIZE_T RegionSize;
+
+    KeAcquireSpinLock(&DataRing->SpinLock, &Irql);
+    Detached = DataRing->Detached;
+    DataRing->Detached = TRUE;
+    Drain = 0 != DataRing->UseCount;
+    KeReleaseSpinLock(&DataRing->SpinLock, Irql);
+
+    if (Detached)
+        return;
+
+    /* wait for copies through the system address to complete */
+    if (Drain)
+        KeWaitForSingleObject(&DataRing->DrainEvent, Executive, KernelMode, FALSE, 0);
+
+    MmUnlockPages(DataRing->Mdl);
+    IoFreeMdl(DataRing->Mdl);
+    DataRing->Mdl = 0;
+    DataRing->SystemBase = 0;
+
+    Attach = DataRing->Process != PsGetCurrentProcess();
+    if (Attach)
+        KeStackAttachProcess(DataRing->Process, &ApcState);
+    UserBase = DataRing->UserBase;
+    RegionSize = 0;
+    ZwFreeVirtualMemory(ZwCurrentProcess(), &UserBase, &RegionSize, MEM_RELEASE);
+    if (Attach)
+        KeUnstackDetachProcess(&ApcState);
+
+    DataRingTotalSize -= DataRing->RegionSize;
+}
+
+VOID FspDataRingDetach(FSP_DATA_RING *DataRing)
+{
+    PAGED_CODE();
+
+    FspDataRingListLock();
+    FspDataRingDetachLocked(DataRing);
+    FspDataRingListUnlock();
+}
+
+VOID FspDataRingDelete(FSP_DATA_RING *DataRing)
+{
+    PAGED_CODE();
+
+    FspDataRingListLock();
+    FspDataRingDetachLocked(DataRing);
+    RemoveEntryList(&DataRing->ListEntry);
+    FspDataRingListUnlock();
+
+    ObDereferenceObject(DataRing->Process);
+    FspFree(DataRing);
+}
+
+BOOLEAN FspDataRingAcquire(FSP_DATA_RING *DataRing, ULONG Length,
+    PULONG PIndex, PVOID *PUserAddress, PVOID *PSystemAddress)
+{
+    // !PAGED_CODE();
+
+    KIRQL Irql;
+    UINT32 Blocks, Index;
+    BOOLEAN Success;
+
+    *PIndex = 0;
+    *PUserAddress = 0;
+    *PSystemAddress = 0;
+
+    /* the ring is only addressable from the file system process */
+    if (DataRing->Process != PsGetCurrentProcess())
+        return FALSE;
+
+    Blocks = Length / FspDataRingBlockSize + (0 != Length % FspDataRingBlockSize);
+    if (0 == Blocks)
+        Blocks = 1;
+
+    KeAcquireSpinLock(&DataRing->SpinLock, &Irql);
+    Success = !DataRing->Detached && FspRingAllocate(&DataRing->Ring, Blocks, &Index);
+    if (Success)
+    {
+        DataRing->UseCount++;
+        *PIndex = Index;
+        *PUserAddress = DataRing->UserBase + (SIZE_T)Index * FspDataRingBlockSize;
+        *PSystemAddress = DataRing->SystemBase + (SIZE_T)Index * FspDataRingBlockSize;
+    }
+    KeReleaseSpinLock(&DataRing->SpinLock, Irql);
+
+    return Success;
+}
+
+VOID FspDataRingRelease(FSP_DATA_RING *DataRing, ULONG Index)
+{
+    // !PAGED_CODE();
+
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&DataRing->SpinLock, &Irql);
+    FspRingRelease(&DataRing->Ring, Index);
+    KeReleaseSpinLock(&DataRing->SpinLock, Irql);
+}
+
+BOOLEAN FspDataRingEnter(FSP_DATA_RING *DataRing)
+{
+    // !PAGED_CODE();
+
+    KIRQL Irql;
+    BOOLEAN Success;
+
+    KeAcquireSpinLock(&DataRing->SpinLock, &Irql);
+    Success = !DataRing->Detached;
+    if (Success)
+        DataRing->UseCount++;
+    KeReleaseSpinLock(&DataRing->SpinLock, Irql);
+
+    return Success;
+}
+
+VOID FspDataRingLeave(FSP_DATA_RING *DataRing)
+{
+    // !PAGED_CODE();
+
+    KIRQL Irql;
+    BOOLEAN Drained;
+
+    KeAcquireSpinLock(&DataRing->SpinLock, &Irql);
+    ASSERT(0 != DataRing->UseCount);
+    Drained = 0 == --DataRing->UseCount && DataRing->Detached;
+    KeReleaseSpinLock(&DataRing->SpinLock, Irql);
+
+    if (Drained)
+        KeSetEvent(&DataRing->DrainEvent, 1, FALSE);
+}
@@ -293,6 +293,17 @@ static VOID FspDeviceDereferenceFromDpcLevel(PDEVICE_OBJECT DeviceObject)
     ASSERT(!Delete);
 }
 
+static inline VOID FspFsvolDeviceMetaCacheSize(ULONG Capacity,
+    ULONG DefaultCapacity, ULONG DefaultBudget, PULONG PCapacity, PULONG PBudget)
+{
+    /* a larger capacity gets a proportionally larger budget; a smaller one keeps the default */
+    if (0 == Capacity)
+        Capacity = DefaultCapacity;
+    *PCapacity = Capacity;
+    *PBudget = DefaultCapacity < Capacity ?
+        (ULONG)((UINT64)DefaultBudget * Capacity / DefaultCapacity) : DefaultBudget;
+}
+
 static NTSTATUS FspFsvolDeviceInit(PDEVICE_OBJECT DeviceObject)
 {
     PAGED_CODE();
@@ -300,7 +311,8 @@ static NTSTATUS FspFsvolDeviceInit(PDEVICE_OBJECT DeviceObject)
     NTSTATUS Result;
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(DeviceObject);
     LARGE_INTEGER IrpTimeout;
-    LARGE_INTEGER SecurityTimeout, DirInfoTimeout, StreamInfoTimeout;
+    LARGE_INTEGER SecurityTimeout, DirInfoTimeout, StreamInfoTimeout, FileInfoTimeout;
+    ULONG MetaCapacity, MetaBudget;
 
     /*
      * Volume device initialization is a mess, because of the different ways of
@@ -333,35 +345,82 @@ static NTSTATUS FspFsvolDeviceInit(PDEVICE_OBJECT DeviceObject)
     FsvolDeviceExtension->InitDoneIoq = 1;
 
     /* create our security meta cache */
-    SecurityTimeout.QuadPart = FspTimeoutFromMillis(FsvolDeviceExtension->VolumeParams.FileInfoTimeout);
+    SecurityTimeout.QuadPart = FspTimeoutFromMillis(FsvolDeviceExtension->VolumeParams.SecurityTimeout);
         /* convert millis to nanos */
+    FspFsvolDeviceMetaCacheSize(FsvolDeviceExtension->VolumeParams.SecurityCacheCapacity,
+        FspFsvolDeviceSecurityCacheCapacity, FspFsvolDeviceSecurityCacheBudget,
+        &MetaCapacity, &MetaBudget);
     Result = FspMetaCacheCreate(
-        FspFsvolDeviceSecurityCacheCapacity, FspFsvolDeviceSecurityCacheItemSizeMax, &SecurityTimeout,
+        MetaCapacity, MetaBudget,
+        FspFsvolDeviceSecurityCacheItemSizeMax, &SecurityTimeout,
         &FsvolDeviceExtension->SecurityCache);
     if (!NT_SUCCESS(Result))
         return Result;
     FsvolDeviceExtension->InitDoneSec = 1;
 
     /* create our directory meta cache */
-    DirInfoTimeout.QuadPart = FspTimeoutFromMillis(FsvolDeviceExtension->VolumeParams.FileInfoTimeout);
+    DirInfoTimeout.QuadPart = FspTimeoutFromMillis(FsvolDeviceExtension->VolumeParams.DirInfoTimeout);
         /* convert millis to nanos */
+    FspFsvolDeviceMetaCacheSize(FsvolDeviceExtension->VolumeParams.DirInfoCacheCapacity,
+        FspFsvolDeviceDirInfoCacheCapacity, FspFsvolDeviceDirInfoCacheBudget,
+        &MetaCapacity, &MetaBudget);
     Result = FspMetaCacheCreate(
-        FspFsvolDeviceDirInfoCacheCapacity, FspFsvolDeviceDirInfoCacheItemSizeMax, &DirInfoTimeout,
+        MetaCapacity, MetaBudget,
+        FspFsvolDeviceDirInfoCacheItemSizeMax, &DirInfoTimeout,
         &FsvolDeviceExtension->DirInfoCache);
     if (!NT_SUCCESS(Result))
         return Result;
     FsvolDeviceExtension->InitDoneDir = 1;
 
     /* create our stream info meta cache */
-    StreamInfoTimeout.QuadPart = FspTimeoutFromMillis(FsvolDeviceExtension->VolumeParams.FileInfoTimeout);
+    StreamInfoTimeout.QuadPart = FspTimeoutFromMillis(FsvolDeviceExtension->VolumeParams.StreamInfoTimeout);
         /* convert millis to nanos */
+    FspFsvolDeviceMetaCacheSize(FsvolDeviceExtension->VolumeParams.StreamInfoCacheCapacity,
+        FspFsvolDeviceStreamInfoCacheCapacity, FspFsvolDeviceStreamInfoCacheBudget,
+        &MetaCapacity, &MetaBudget);
     Result = FspMetaCacheCreate(
-        FspFsvolDeviceStreamInfoCacheCapacity, FspFsvolDeviceStreamInfoCacheItemSizeMax, &StreamInfoTimeout,
+        MetaCapacity, MetaBudget,
+        FspFsvolDeviceStreamInfoCacheItemSizeMax, &StreamInfoTimeout,
         &FsvolDeviceExtension->StreamInfoCache);
     if (!NT_SUCCESS(Result))
         return Result;
     FsvolDeviceExtension->InitDoneStrm = 1;
 
+    /*
+     * Create our negative name cache. It shares the freshness contract of the DirInfo cache.
+     * It is not used with reparse points, because the file system resolves a name below a
+     * symbolic link in a different directory than its parent path names.
+     */
+    if (0 != FsvolDeviceExtension->VolumeParams.DirInfoTimeout &&
+        !FsvolDeviceExtension->VolumeParams.ReparsePoints)
+    {
+        Result = FspFileNameCacheCreate(
+            FspFsvolDeviceNegativeNameCacheSetCount, 0,
+            !FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch, &DirInfoTimeout,
+            &FsvolDeviceExtension->NegativeNameCache);
+        if (!NT_SUCCESS(Result))
+            return Result;
+        FsvolDeviceExtension->InitDoneNeg = 1;
+    }
+
+    /*
+     * Create our primed info cache. It holds the FileInfo of listed names for FileInfoTimeout,
+     * because it answers the same queries as the FileInfo of an open FileNode.
+     */
+    if (0 != FsvolDeviceExtension->VolumeParams.FileInfoTimeout &&
+        FsvolDeviceExtension->VolumeParams.PrimeFileInfoFromDirInfo)
+    {
+        FileInfoTimeout.QuadPart = FspTimeoutFromMillis(FsvolDeviceExtension->VolumeParams.FileInfoTimeout);
+            /* convert millis to nanos */
+        Result = FspFileNameCacheCreate(
+            FspFsvolDeviceInfoNameCacheSetCount, sizeof(FSP_FSCTL_FILE_INFO),
+            !FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch, &FileInfoTimeout,
+            &FsvolDeviceExtension->InfoNameCache);
+        if (!NT_SUCCESS(Result))
+            return Result;
+        FsvolDeviceExtension->InitDonePrime = 1;
+    }
+
     /* initialize the FSRTL Notify mechanism */
     Result = FspNotifyInitializeSync(&FsvolDeviceExtension->NotifySync);
     if (!NT_SUCCESS(Result))
@@ -375,6 +434,21 @@ static NTSTATUS FspFsvolDeviceInit(PDEVICE_OBJECT DeviceObject)
         return Result;
     FsvolDeviceExtension->InitDoneStat = 1;
 
+    /* create the data ring in the file system process (if requested) */
+    if (0 != FsvolDeviceExtension->VolumeParams.DataRingSize)
+    {
+        Result = FspDataRingCreate(FsvolDeviceExtension->VolumeParams.DataRingSize,
+            &FsvolDeviceExtension->DataRing);
+        if (NT_SUCCESS(Result))
+            FsvolDeviceExtension->InitDoneRing = 1;
+        else if (STATUS_PRIVILEGE_NOT_HELD == Result || STATUS_QUOTA_EXCEEDED == Result)
+            /* the data ring is an optimization; do without it */
+            DEBUGLOG("DataRingSize=%lu: %s",
+                FsvolDeviceExtension->VolumeParams.DataRingSize, NtStatusSym(Result));
+        else
+            return Result;
+    }
+
     /* initialize our context table */
     ExInitializeResourceLite(&FsvolDeviceExtension->FileRenameResource);
     ExInitializeResourceLite(&FsvolDeviceExtension->ContextTableResource);
@@ -420,6 +494,10 @@ static VOID FspFsvolDeviceFini(PDEVICE_OBJECT DeviceObject)
     if (FsvolDeviceExtension->InitDoneTimer)
         IoStopTimer(DeviceObject);
 
+    /* delete the data ring */
+    if (FsvolDeviceExtension->InitDoneRing)
+        FspDataRingDelete(FsvolDeviceExtension->DataRing);
+
     /* delete the file system statistics */
     if (FsvolDeviceExtension->InitDoneStat)
         FspStatisticsDelete(FsvolDeviceExtension->Statistics);
@@ -432,6 +510,14 @@ static VOID FspFsvolDeviceFini(PDEVICE_OBJECT DeviceObject)
         FspNotifyUninitializeSync(&FsvolDeviceExtension->NotifySync);
     }
 
+    /* delete the primed info cache */
+    if (FsvolDeviceExtension->InitDonePrime)
+        FspFileNameCacheDelete(FsvolDeviceExtension->InfoNameCache);
+
+    /* delete the negative name cache */
+    if (FsvolDeviceExtension->InitDoneNeg)
+        FspFileNameCacheDelete(FsvolDeviceExtension->NegativeNameCache);
+
     /* delete the stream info meta cache */
     if (FsvolDeviceExtension->InitDoneStrm)
         FspMetaCacheDelete(FsvolDeviceExtension->StreamInfoCache);
@@ -860,7 +946,7 @@ VOID FspFsvolDeviceSetVolumeInfo(PDEVICE_OBJECT DeviceObject, const FSP_FSCTL_VO
     KeAcquireSpinLock(&FsvolDeviceExtension->InfoSpinLock, &Irql);
     FsvolDeviceExtension->VolumeInfo = VolumeInfoNp;
     FsvolDeviceExtension->InfoExpirationTime = FspExpirationTimeFromMillis(
-        FsvolDeviceExtension->VolumeParams.FileInfoTimeout);
+        FsvolDeviceExtension->VolumeParams.VolumeInfoTimeout);
     KeReleaseSpinLock(&FsvolDeviceExtension->InfoSpinLock, Irql);
 }
 
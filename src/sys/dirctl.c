@@ -27,7 +27,8 @@
  */
 
 static NTSTATUS FspFsvolQueryDirectoryCopy(
-    PUNICODE_STRING DirectoryPattern, BOOLEAN CaseInsensitive,
+    PUNICODE_STRING DirectoryPattern, FSP_PATTERN *DirectoryPatternCompiled,
+    BOOLEAN CaseInsensitive,
     PUNICODE_STRING DirectoryMarker, PUNICODE_STRING DirectoryMarkerOut,
     FILE_INFORMATION_CLASS FileInformationClass, BOOLEAN ReturnSingleEntry,
     FSP_FSCTL_DIR_INFO **PDirInfo, ULONG DirInfoSize,
@@ -92,7 +93,8 @@ enum
 FSP_FSCTL_STATIC_ASSERT(RequestCookie == RequestMdl, "");
 
 static NTSTATUS FspFsvolQueryDirectoryCopy(
-    PUNICODE_STRING DirectoryPattern, BOOLEAN CaseInsensitive,
+    PUNICODE_STRING DirectoryPattern, FSP_PATTERN *DirectoryPatternCompiled,
+    BOOLEAN CaseInsensitive,
     PUNICODE_STRING DirectoryMarker, PUNICODE_STRING DirectoryMarkerOut,
     FILE_INFORMATION_CLASS FileInformationClass, BOOLEAN ReturnSingleEntry,
     FSP_FSCTL_DIR_INFO **PDirInfo, ULONG DirInfoSize,
@@ -193,7 +195,10 @@ static NTSTATUS FspFsvolQueryDirectoryCopy(
             CopyLength = FileName.Length;
 
             Match = MatchAll;
-            if (!Match)
+            if (!Match && 0 != DirectoryPatternCompiled)
+                Match = FspPatternMatch(DirectoryPatternCompiled,
+                    FileName.Buffer, FileName.Length / sizeof(WCHAR));
+            else if (!Match)
             {
                 Result = FspFileNameInExpression(DirectoryPattern, &FileName, CaseInsensitive, 0, &Match);
                 if (!NT_SUCCESS(Result))
@@ -325,7 +330,9 @@ static NTSTATUS FspFsvolQueryDirectoryCopyCache(
     DirInfo = (PVOID)(DirInfoBgn + FileDesc->DirInfoCacheHint);
     DirInfoSize = (ULONG)(DirInfoEnd - (PUINT8)DirInfo);
 
-    Result = FspFsvolQueryDirectoryCopy(DirectoryPattern, CaseInsensitive,
+    Result = FspFsvolQueryDirectoryCopy(DirectoryPattern,
+        FileDesc->DirectoryPatternIsCompiled ? &FileDesc->DirectoryPatternCompiled : 0,
+        CaseInsensitive,
         0 != FileDesc->DirInfoCacheHint ? 0 : &FileDesc->DirectoryMarker, &DirectoryMarker,
         FileInformationClass, ReturnSingleEntry,
         &DirInfo, DirInfoSize,
@@ -368,7 +375,9 @@ static NTSTATUS FspFsvolQueryDirectoryCopyInPlace(
         FIELD_OFFSET(FILE_ID_BOTH_DIR_INFORMATION, FileName),
         "FSP_FSCTL_DIR_INFO must be bigger than FILE_ID_BOTH_DIR_INFORMATION");
 
-    Result = FspFsvolQueryDirectoryCopy(DirectoryPattern, CaseInsensitive,
+    Result = FspFsvolQueryDirectoryCopy(DirectoryPattern,
+        FileDesc->DirectoryPatternIsCompiled ? &FileDesc->DirectoryPatternCompiled : 0,
+        CaseInsensitive,
         0, &DirectoryMarker,
         FileInformationClass, ReturnSingleEntry,
         &DirInfo, DirInfoSize,
@@ -432,7 +441,7 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
      * the size that we want the user mode file system to see and it may be
      * different from the requested length for the following reasons:
      *
-     *   - If the FileInfoTimeout is non-zero, then the directory maintains a
+     *   - If the DirInfoTimeout is non-zero, then the directory maintains a
      *     DirInfo meta cache that can be used to fulfill IRP requests without
      *     reaching out to user mode. In this case we want the SystemBufferLength
      *     to be FspFsvolDeviceDirInfoCacheItemSizeMax so that we read up to the
@@ -444,14 +453,14 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
      *     mode when doing file name matching. In this case we set again the
      *     SystemBufferLength to be FspFsvolDeviceDirInfoCacheItemSizeMax. This
      *     is an important optimization and without it QueryDirectory is *very*
-     *     slow without the DirInfo meta cache (i.e. when FileInfoTimeout is 0).
+     *     slow without the DirInfo meta cache (i.e. when DirInfoTimeout is 0).
      *
      *   - If the requsted DirectoryPattern is the MatchAll pattern then we set
      *     the SystemBufferLength to the requested (IRP) length as it is actually
      *     counter-productive to try to read more than we need.
      */
 #define GetSystemBufferLengthMaybeCached()\
-    (0 != FsvolDeviceExtension->VolumeParams.FileInfoTimeout && 0 == FileDesc->DirectoryMarker.Buffer) ||\
+    (0 != FsvolDeviceExtension->VolumeParams.DirInfoTimeout && 0 == FileDesc->DirectoryMarker.Buffer) ||\
     FspFileDescDirectoryPatternMatchAll != FileDesc->DirectoryPattern.Buffer ?\
         FspFsvolDeviceDirInfoCacheItemSizeMax : Length
 #define GetSystemBufferLengthNonCached()\
@@ -615,6 +624,11 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
             FileDesc->DirectoryMarker.Length) = L'\0';
     }
 
+    /* remember the primed info cache generation; see FspFsvolDirectoryControlComplete */
+    if (0 != FsvolDeviceExtension->InfoNameCache)
+        FileDesc->InfoNameCacheGeneration =
+            FspFileNameCacheGeneration(FsvolDeviceExtension->InfoNameCache);
+
     FspFileNodeSetOwner(FileNode, Full, Request);
     FspIopRequestContext(Request, RequestIrp) = Irp;
 
@@ -918,6 +932,8 @@ NTSTATUS FspFsvolDirectoryControlComplete(
     PFILE_OBJECT FileObject = IrpSp->FileObject;
     FSP_FILE_NODE *FileNode = FileObject->FsContext;
     FSP_FILE_DESC *FileDesc = FileObject->FsContext2;
+    PDEVICE_OBJECT FsvolDeviceObject = IrpSp->DeviceObject;
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
     BOOLEAN ReturnSingleEntry = BooleanFlagOn(IrpSp->Flags, SL_RETURN_SINGLE_ENTRY);
     FILE_INFORMATION_CLASS FileInformationClass = IrpSp->Parameters.QueryDirectory.FileInformationClass;
     PVOID Buffer = Irp->AssociatedIrp.SystemBuffer;
@@ -955,6 +971,21 @@ NTSTATUS FspFsvolDirectoryControlComplete(
             }
         }
 
+        /*
+         * Prime the info cache with the listed names (see FspFsvolQueryOpen). The request
+         * owns the FileNode shared, so its FileName cannot change. The entries are owned by
+         * the security context that opened the directory for listing (see FspFsvolCreateComplete).
+         */
+        if (0 != FsvolDeviceExtension->InfoNameCache && FileDesc->HasInfoNameCacheOwner)
+        {
+            ULONG PrimeCount = FspFileNameCacheInsertDirInfo(FsvolDeviceExtension->InfoNameCache,
+                &FileNode->FileName, &FileDesc->InfoNameCacheOwner,
+                FileDesc->InfoNameCacheGeneration,
+                Irp->AssociatedIrp.SystemBuffer, (ULONG)Response->IoStatus.Information);
+            FspStatisticsAdd(FspFsvolDeviceStatistics(FsvolDeviceObject),
+                InfoCache.PrimeCount, PrimeCount);
+        }
+
         DirInfoChangeNumber = FspFileNodeDirInfoChangeNumber(FileNode);
         Request->Kind = FspFsctlTransactReservedKind;
         FspIopResetRequest(Request, 0);
@@ -1002,10 +1033,6 @@ NTSTATUS FspFsvolDirectoryControlComplete(
          * Looks like we have to go back to user-mode!
          */
 
-        PDEVICE_OBJECT FsvolDeviceObject = IrpSp->DeviceObject;
-        FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
-            FspFsvolDeviceExtension(FsvolDeviceObject);
-
         FspFileNodeConvertExclusiveToShared(FileNode, Full);
 
         Request->Kind = FspFsctlTransactQueryDirectoryKind;
@@ -1031,6 +1058,10 @@ NTSTATUS FspFsvolDirectoryControlComplete(
                 FileDesc->DirectoryMarker.Length) = L'\0';
         }
 
+        if (0 != FsvolDeviceExtension->InfoNameCache)
+            FileDesc->InfoNameCacheGeneration =
+                FspFileNameCacheGeneration(FsvolDeviceExtension->InfoNameCache);
+
         FspFileNodeSetOwner(FileNode, Full, Request);
         FspIopRequestContext(Request, RequestIrp) = Irp;
 
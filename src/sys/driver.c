@@ -50,6 +50,13 @@ NTSTATUS DriverEntry(
     if (!NT_SUCCESS(Result))
         FSP_RETURN();
 
+    Result = FspDataRingInitialize();
+    if (!NT_SUCCESS(Result))
+    {
+        FspProcessBufferFinalize();
+        FSP_RETURN();
+    }
+
     FspDriverObject = DriverObject;
     ExInitializeResourceLite(&FspDeviceGlobalResource);
 
@@ -64,6 +71,7 @@ NTSTATUS DriverEntry(
         &FspFsctlDiskDeviceObject);
     if (!NT_SUCCESS(Result))
     {
+        FspDataRingFinalize();
         FspProcessBufferFinalize();
         FSP_RETURN();
     }
@@ -75,6 +83,7 @@ NTSTATUS DriverEntry(
     if (!NT_SUCCESS(Result))
     {
         FspDeviceDelete(FspFsctlDiskDeviceObject);
+        FspDataRingFinalize();
         FspProcessBufferFinalize();
         FSP_RETURN();
     }
@@ -158,7 +167,7 @@ NTSTATUS DriverEntry(
     //FspFastIoDispatch.FastIoWriteCompressed = 0;
     //FspFastIoDispatch.MdlReadCompleteCompressed = 0;
     //FspFastIoDispatch.MdlWriteCompleteCompressed = 0;
-    //FspFastIoDispatch.FastIoQueryOpen = 0;
+    FspFastIoDispatch.FastIoQueryOpen = FspFastIoQueryOpen;
     FspFastIoDispatch.ReleaseForModWrite = FspReleaseForModWrite;
     FspFastIoDispatch.AcquireForCcFlush = FspAcquireForCcFlush;
     FspFastIoDispatch.ReleaseForCcFlush = FspReleaseForCcFlush;
@@ -218,6 +227,7 @@ VOID FspUnload(
     ExDeleteResourceLite(&FspDeviceGlobalResource);
     FspDriverObject = 0;
 
+    FspDataRingFinalize();
     FspProcessBufferFinalize();
 
 #pragma prefast(suppress:28175, "We are in DriverUnload: ok to access DriverName")
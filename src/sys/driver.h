@@ -25,6 +25,8 @@
 #include <ntstrsafe.h>
 #include <wdmsec.h>
 #include <winfsp/fsctl.h>
+#include <shared/pattern.h>
+#include <shared/namecache.h>
 
 /* disable warnings */
 #pragma warning(disable:4100)           /* unreferenced formal parameter */
@@ -311,6 +313,8 @@ FSP_IOCMPL_DISPATCH FspFsvolCleanupComplete;
 FSP_IOCMPL_DISPATCH FspFsvolCloseComplete;
 FSP_IOPREP_DISPATCH FspFsvolCreatePrepare;
 FSP_IOCMPL_DISPATCH FspFsvolCreateComplete;
+BOOLEAN FspFsvolQueryOpen(PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp,
+    PFILE_NETWORK_OPEN_INFORMATION NetworkInformation);
 FSP_IOCMPL_DISPATCH FspFsvolDeviceControlComplete;
 FSP_IOPREP_DISPATCH FspFsvolDirectoryControlPrepare;
 FSP_IOCMPL_DISPATCH FspFsvolDirectoryControlComplete;
@@ -334,6 +338,7 @@ FSP_IOCMPL_DISPATCH FspFsvolWriteComplete;
 
 /* fast I/O and resource acquisition callbacks */
 FAST_IO_CHECK_IF_POSSIBLE FspFastIoCheckIfPossible;
+FAST_IO_QUERY_OPEN FspFastIoQueryOpen;
 FAST_IO_ACQUIRE_FILE FspAcquireFileForNtCreateSection;
 FAST_IO_RELEASE_FILE FspReleaseFileForNtCreateSection;
 FAST_IO_ACQUIRE_FOR_MOD_WRITE FspAcquireForModWrite;
@@ -355,6 +360,8 @@ VOID FspPropagateTopFlags(PIRP Irp, PIRP TopLevelIrp);
 /* memory allocation */
 #define FspAlloc(Size)                  ExAllocatePoolWithTag(PagedPool, Size, FSP_ALLOC_INTERNAL_TAG)
 #define FspAllocNonPaged(Size)          ExAllocatePoolWithTag(NonPagedPool, Size, FSP_ALLOC_INTERNAL_TAG)
+#define FspAllocNonPagedCacheAligned(Size)\
+    ExAllocatePoolWithTag(NonPagedPoolCacheAligned, Size, FSP_ALLOC_INTERNAL_TAG)
 #define FspAllocMustSucceed(Size)       FspAllocatePoolMustSucceed(PagedPool, Size, FSP_ALLOC_INTERNAL_TAG)
 #define FspFree(Pointer)                ExFreePoolWithTag(Pointer, FSP_ALLOC_INTERNAL_TAG)
 #define FspAllocExternal(Size)          ExAllocatePoolWithTag(PagedPool, Size, FSP_ALLOC_EXTERNAL_TAG)
@@ -470,6 +477,7 @@ NTSTATUS FspFileNameInExpression(
     BOOLEAN IgnoreCase,
     PWCH UpcaseTable,
     PBOOLEAN PResult);
+WCHAR FspFileNamePatternUpcase(WCHAR C);
 
 /* utility */
 PVOID FspAllocatePoolMustSucceed(POOL_TYPE PoolType, SIZE_T Size, ULONG Tag);
@@ -603,12 +611,52 @@ NTSTATUS FspIrpHookNext(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context);
 
 /* process buffers */
 #define FspProcessBufferSizeMax         (64 * 1024)
+#define FspProcessBufferCapacityMax     1024
 NTSTATUS FspProcessBufferInitialize(VOID);
 VOID FspProcessBufferFinalize(VOID);
 VOID FspProcessBufferCollect(HANDLE ProcessId);
+VOID FspProcessBufferSetCapacity(ULONG Capacity);
 NTSTATUS FspProcessBufferAcquire(SIZE_T BufferSize, PVOID *PBufferCookie, PVOID *PBuffer);
 VOID FspProcessBufferRelease(PVOID BufferCookie, PVOID Buffer);
 
+/* data rings */
+#define FspDataRingSizeMax              (16 * 1024 * 1024)
+#define FspDataRingTotalSizeMax         (256 * 1024 * 1024)
+typedef struct _FSP_DATA_RING FSP_DATA_RING;
+NTSTATUS FspDataRingInitialize(VOID);
+VOID FspDataRingFinalize(VOID);
+NTSTATUS FspDataRingCreate(ULONG Size, FSP_DATA_RING **PDataRing);
+VOID FspDataRingDetach(FSP_DATA_RING *DataRing);
+VOID FspDataRingDelete(FSP_DATA_RING *DataRing);
+BOOLEAN FspDataRingAcquire(FSP_DATA_RING *DataRing, ULONG Length,
+    PULONG PIndex, PVOID *PUserAddress, PVOID *PSystemAddress);
+VOID FspDataRingRelease(FSP_DATA_RING *DataRing, ULONG Index);
+BOOLEAN FspDataRingEnter(FSP_DATA_RING *DataRing);
+VOID FspDataRingLeave(FSP_DATA_RING *DataRing);
+
+/* file name caches */
+typedef struct _FSP_FILE_NAME_CACHE FSP_FILE_NAME_CACHE;
+NTSTATUS FspFileNameCacheCreate(ULONG SetCount, ULONG PayloadSize, BOOLEAN CaseInsensitive,
+    PLARGE_INTEGER Timeout, FSP_FILE_NAME_CACHE **PFileNameCache);
+VOID FspFileNameCacheDelete(FSP_FILE_NAME_CACHE *FileNameCache);
+NTSTATUS FspFileNameCacheGetOwner(PSECURITY_SUBJECT_CONTEXT SubjectContext,
+    FSP_NAME_CACHE_OWNER *Owner);
+ULONG FspFileNameCacheGeneration(FSP_FILE_NAME_CACHE *FileNameCache);
+BOOLEAN FspFileNameCacheLookup(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING FileName, const FSP_NAME_CACHE_OWNER *Owner, PVOID Payload,
+    PULONG PGeneration);
+VOID FspFileNameCacheInsert(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING FileName, const FSP_NAME_CACHE_OWNER *Owner, const VOID *Payload,
+    ULONG Generation);
+ULONG FspFileNameCacheInsertDirInfo(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING Parent, const FSP_NAME_CACHE_OWNER *Owner, ULONG Generation,
+    PVOID DirInfoBuffer, ULONG DirInfoSize);
+VOID FspFileNameCacheInvalidateName(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING FileName);
+VOID FspFileNameCacheInvalidateParent(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING Parent);
+VOID FspFileNameCacheInvalidateAll(FSP_FILE_NAME_CACHE *FileNameCache);
+
 /* IRP context */
 #define FspIrpTimestampInfinity         ((ULONG)-1L)
 #define FspIrpTimestamp(Irp)            \
@@ -801,22 +849,46 @@ retry:
 #define FspIoqCancelled                 ((PIRP)2)
 #define FspIoqPostIrp(Q, I, R)          FspIoqPostIrpEx(Q, I, FALSE, R)
 #define FspIoqPostIrpBestEffort(Q, I, R)FspIoqPostIrpEx(Q, I, TRUE, R)
+enum
+{
+    FspIoqProcessStripeCount = 16,
+    FspIoqProcessStripeBucketCount = 61,
+};
+typedef struct _FSP_IOQ FSP_IOQ;
 typedef struct
 {
-    KSPIN_LOCK SpinLock;
+    __declspec(align(64)) KSPIN_LOCK SpinLock;
+    FSP_IOQ *Ioq;
+    LIST_ENTRY IrpList;
+    IO_CSQ IoCsq;
+    ULONG IrpCount;
+    ULONG CollisionCount, LockWaitCount;
+    PVOID IrpBuckets[FspIoqProcessStripeBucketCount];
+} FSP_IOQ_PROCESS_STRIPE;
+typedef struct _FSP_IOQ
+{
+    /* read-mostly fields */
     BOOLEAN Stopped;
+    ULONG IrpTimeout;
+    ULONG PendingIrpCapacity;
+    VOID (*CompleteCanceledIrp)(PIRP Irp);
+    /* Pending queue: accessed by MJ threads and dispatcher threads fetching IRP's */
+    __declspec(align(64)) KSPIN_LOCK PendingSpinLock;
 #if defined(FSP_IOQ_USE_QEVENT)
     FSP_QEVENT PendingIrpEvent;
 #else
     KEVENT PendingIrpEvent;
 #endif
-    LIST_ENTRY PendingIrpList, ProcessIrpList, RetriedIrpList;
-    IO_CSQ PendingIoCsq, ProcessIoCsq, RetriedIoCsq;
-    ULONG IrpTimeout;
-    ULONG PendingIrpCapacity, PendingIrpCount, ProcessIrpCount, RetriedIrpCount;
-    VOID (*CompleteCanceledIrp)(PIRP Irp);
-    ULONG ProcessIrpBucketCount;
-    PVOID ProcessIrpBuckets[];
+    LIST_ENTRY PendingIrpList;
+    IO_CSQ PendingIoCsq;
+    ULONG PendingIrpCount;
+    /* Retried queue: accessed by dispatcher threads retrying IRP completions */
+    __declspec(align(64)) KSPIN_LOCK RetriedSpinLock;
+    LIST_ENTRY RetriedIrpList;
+    IO_CSQ RetriedIoCsq;
+    ULONG RetriedIrpCount;
+    /* Process queue: accessed by dispatcher threads sending/completing IRP's */
+    FSP_IOQ_PROCESS_STRIPE ProcessStripes[FspIoqProcessStripeCount];
 } FSP_IOQ;
 NTSTATUS FspIoqCreate(
     ULONG IrpCapacity, PLARGE_INTEGER IrpTimeout, VOID (*CompleteCanceledIrp)(PIRP Irp),
@@ -832,24 +904,42 @@ ULONG FspIoqPendingIrpCount(FSP_IOQ *Ioq);
 BOOLEAN FspIoqStartProcessingIrp(FSP_IOQ *Ioq, PIRP Irp);
 PIRP FspIoqEndProcessingIrp(FSP_IOQ *Ioq, UINT_PTR IrpHint);
 ULONG FspIoqProcessIrpCount(FSP_IOQ *Ioq);
+VOID FspIoqProcessStatistics(FSP_IOQ *Ioq, PULONG PCollisionCount, PULONG PLockWaitCount);
 BOOLEAN FspIoqRetryCompleteIrp(FSP_IOQ *Ioq, PIRP Irp, NTSTATUS *PResult);
 PIRP FspIoqNextCompleteIrp(FSP_IOQ *Ioq, PIRP BoundaryIrp);
 ULONG FspIoqRetriedIrpCount(FSP_IOQ *Ioq);
 
 /* meta cache */
+enum
+{
+    FspMetaCacheShardCount = 4,
+    FspMetaCacheShardBucketCount = 61,
+};
+typedef struct
+{
+    __declspec(align(64)) KSPIN_LOCK SpinLock;
+    ULONG ItemCapacity, ItemCount;
+    ULONG ItemBudget, ItemSize;
+    LIST_ENTRY ItemList;                /* LRU order */
+    LIST_ENTRY ExpirationList;          /* expiration order */
+    ULONG HitCount, MissCount, EvictionCount, RejectCount, ShareCount;
+    PVOID ItemBuckets[FspMetaCacheShardBucketCount];
+    PVOID ContentBuckets[FspMetaCacheShardBucketCount];
+} FSP_META_CACHE_SHARD;
 typedef struct
 {
-    KSPIN_LOCK SpinLock;
     UINT64 MetaTimeout;
-    ULONG MetaCapacity, ItemCount;
     ULONG ItemSizeMax;
-    UINT64 ItemIndex;
-    LIST_ENTRY ItemList;
-    ULONG ItemBucketCount;
-    PVOID ItemBuckets[];
+    LONG64 ItemIndex;
+    FSP_META_CACHE_SHARD Shards[FspMetaCacheShardCount];
 } FSP_META_CACHE;
+typedef struct
+{
+    ULONG ItemCount, ItemSize;
+    ULONG HitCount, MissCount, EvictionCount, RejectCount, ShareCount;
+} FSP_META_CACHE_STATISTICS;
 NTSTATUS FspMetaCacheCreate(
-    ULONG MetaCapacity, ULONG ItemSizeMax, PLARGE_INTEGER MetaTimeout,
+    ULONG MetaCapacity, ULONG MetaBudget, ULONG ItemSizeMax, PLARGE_INTEGER MetaTimeout,
     FSP_META_CACHE **PMetaCache);
 VOID FspMetaCacheDelete(FSP_META_CACHE *MetaCache);
 VOID FspMetaCacheInvalidateExpired(FSP_META_CACHE *MetaCache, UINT64 ExpirationTime);
@@ -857,7 +947,9 @@ BOOLEAN FspMetaCacheReferenceItemBuffer(FSP_META_CACHE *MetaCache, UINT64 ItemIn
     PCVOID *PBuffer, PULONG PSize);
 VOID FspMetaCacheDereferenceItemBuffer(PCVOID Buffer);
 UINT64 FspMetaCacheAddItem(FSP_META_CACHE *MetaCache, PCVOID Buffer, ULONG Size);
+UINT64 FspMetaCacheAddSharedItem(FSP_META_CACHE *MetaCache, PCVOID Buffer, ULONG Size);
 VOID FspMetaCacheInvalidateItem(FSP_META_CACHE *MetaCache, UINT64 ItemIndex);
+VOID FspMetaCacheGetStatistics(FSP_META_CACHE *MetaCache, FSP_META_CACHE_STATISTICS *Statistics);
 
 /* I/O processing */
 #define FSP_FSCTL_WORK                  \
@@ -965,6 +1057,12 @@ typedef struct
 {
     FILESYSTEM_STATISTICS Base;
     FAT_STATISTICS Specific;            /* pretend that we are FAT when it comes to stats */
+    struct
+    {
+        ULONG PrimeCount;               /* names primed from QueryDirectory results */
+        ULONG QueryOpenHitCount;        /* query opens answered from primed FileInfo */
+        ULONG QueryOpenMissCount;       /* query opens passed on to the file system */
+    } InfoCache;                        /* WinFsp specific; follows the FAT statistics */
     /* align to 64 bytes */
     __declspec(align(64)) UINT8 EndOfStruct[];
 } FSP_STATISTICS;
@@ -979,11 +1077,16 @@ NTSTATUS FspStatisticsCopy(FSP_STATISTICS *Statistics, PVOID Buffer, PULONG PLen
 enum
 {
     FspFsvolDeviceSecurityCacheCapacity = 100,
+    FspFsvolDeviceSecurityCacheBudget = 256 * 1024,
     FspFsvolDeviceSecurityCacheItemSizeMax = 4096,
     FspFsvolDeviceDirInfoCacheCapacity = 100,
+    FspFsvolDeviceDirInfoCacheBudget = 1024 * 1024,
     FspFsvolDeviceDirInfoCacheItemSizeMax = FSP_FSCTL_ALIGN_UP(16384, PAGE_SIZE),
     FspFsvolDeviceStreamInfoCacheCapacity = 100,
+    FspFsvolDeviceStreamInfoCacheBudget = 256 * 1024,
     FspFsvolDeviceStreamInfoCacheItemSizeMax = FSP_FSCTL_ALIGN_UP(16384, PAGE_SIZE),
+    FspFsvolDeviceNegativeNameCacheSetCount = 64,
+    FspFsvolDeviceInfoNameCacheSetCount = 128,
 };
 typedef struct
 {
@@ -1016,7 +1119,8 @@ typedef struct
 {
     FSP_DEVICE_EXTENSION Base;
     UINT32 InitDoneFsvrt:1, InitDoneIoq:1, InitDoneSec:1, InitDoneDir:1, InitDoneStrm:1,
-        InitDoneCtxTab:1, InitDoneTimer:1, InitDoneInfo:1, InitDoneNotify:1, InitDoneStat:1;
+        InitDoneCtxTab:1, InitDoneTimer:1, InitDoneInfo:1, InitDoneNotify:1, InitDoneStat:1,
+        InitDoneRing:1, InitDoneNeg:1, InitDonePrime:1;
     PDEVICE_OBJECT FsctlDeviceObject;
     PDEVICE_OBJECT FsvrtDeviceObject;
     HANDLE MupHandle;
@@ -1028,6 +1132,8 @@ typedef struct
     FSP_META_CACHE *SecurityCache;
     FSP_META_CACHE *DirInfoCache;
     FSP_META_CACHE *StreamInfoCache;
+    FSP_FILE_NAME_CACHE *NegativeNameCache;
+    FSP_FILE_NAME_CACHE *InfoNameCache;
     KSPIN_LOCK ExpirationLock;
     WORK_QUEUE_ITEM ExpirationWorkItem;
     BOOLEAN ExpirationInProgress;
@@ -1044,6 +1150,7 @@ typedef struct
     PNOTIFY_SYNC NotifySync;
     LIST_ENTRY NotifyList;
     FSP_STATISTICS *Statistics;
+    FSP_DATA_RING *DataRing;
 } FSP_FSVOL_DEVICE_EXTENSION;
 static inline
 FSP_DEVICE_EXTENSION *FspDeviceExtension(PDEVICE_OBJECT DeviceObject)
@@ -1223,6 +1330,7 @@ typedef struct FSP_FILE_NODE
     PWSTR ExternalFileName;
     /* locked under Header.Resource */
     UINT64 FileInfoExpirationTime, BasicInfoExpirationTime;
+    UINT32 FileInfoTimeout;             /* adaptive FileInfo timeout (0: no FileInfo yet) */
     UINT32 FileAttributes;
     UINT32 ReparseTag;
     UINT64 CreationTime;
@@ -1267,8 +1375,13 @@ typedef struct
         DidSetMetadata:1,
         DidSetFileAttributes:1, DidSetReparsePoint:1, DidSetSecurity:1,
         DidSetCreationTime:1, DidSetLastAccessTime:1, DidSetLastWriteTime:1, DidSetChangeTime:1,
-        DirectoryHasSuchFile:1;
+        DirectoryHasSuchFile:1, DidLookupNegativeNameCache:1, DirectoryPatternIsCompiled:1,
+        HasInfoNameCacheOwner:1;
+    ULONG NegativeNameCacheGeneration;
+    ULONG InfoNameCacheGeneration;
+    FSP_NAME_CACHE_OWNER InfoNameCacheOwner;
     UNICODE_STRING DirectoryPattern;
+    FSP_PATTERN DirectoryPatternCompiled;
     UNICODE_STRING DirectoryMarker;
     UINT64 DirInfo;
     ULONG DirInfoCacheHint;
@@ -1383,6 +1496,8 @@ ULONG FspFileNodeDirInfoChangeNumber(FSP_FILE_NODE *FileNode)
     return FileNode->DirInfoChangeNumber;
 }
 VOID FspFileNodeInvalidateParentDirInfo(FSP_FILE_NODE *FileNode);
+BOOLEAN FspFileNodeParentDirInfoLacksName(PDEVICE_OBJECT FsvolDeviceObject,
+    PUNICODE_STRING FileName, BOOLEAN CaseInsensitive);
 BOOLEAN FspFileNodeReferenceStreamInfo(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PULONG PSize);
 VOID FspFileNodeSetStreamInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size);
 BOOLEAN FspFileNodeTrySetStreamInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size,
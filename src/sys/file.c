@@ -56,6 +56,8 @@ NTSTATUS FspFileNodeRenameCheck(PDEVICE_OBJECT FsvolDeviceObject, PIRP OplockIrp
 VOID FspFileNodeRename(FSP_FILE_NODE *FileNode, PUNICODE_STRING NewFileName);
 VOID FspFileNodeGetFileInfo(FSP_FILE_NODE *FileNode, FSP_FSCTL_FILE_INFO *FileInfo);
 BOOLEAN FspFileNodeTryGetFileInfo(FSP_FILE_NODE *FileNode, FSP_FSCTL_FILE_INFO *FileInfo);
+static UINT32 FspFileNodeAdaptFileInfoTimeout(FSP_FILE_NODE *FileNode,
+    const FSP_FSCTL_FILE_INFO *FileInfo, UINT64 AllocationSize);
 VOID FspFileNodeSetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileObject,
     const FSP_FSCTL_FILE_INFO *FileInfo, BOOLEAN TruncateOnClose);
 BOOLEAN FspFileNodeTrySetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileObject,
@@ -73,6 +75,8 @@ static VOID FspFileNodeInvalidateDirInfo(FSP_FILE_NODE *FileNode);
 static VOID FspFileNodeInvalidateDirInfoByName(PDEVICE_OBJECT FsvolDeviceObject,
     PUNICODE_STRING FileName);
 VOID FspFileNodeInvalidateParentDirInfo(FSP_FILE_NODE *FileNode);
+BOOLEAN FspFileNodeParentDirInfoLacksName(PDEVICE_OBJECT FsvolDeviceObject,
+    PUNICODE_STRING FileName, BOOLEAN CaseInsensitive);
 BOOLEAN FspFileNodeReferenceStreamInfo(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PULONG PSize);
 VOID FspFileNodeSetStreamInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size);
 BOOLEAN FspFileNodeTrySetStreamInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size,
@@ -128,6 +132,7 @@ VOID FspFileNodeOplockComplete(PVOID Context, PIRP Irp);
 #pragma alloc_text(PAGE, FspFileNodeRename)
 #pragma alloc_text(PAGE, FspFileNodeGetFileInfo)
 #pragma alloc_text(PAGE, FspFileNodeTryGetFileInfo)
+#pragma alloc_text(PAGE, FspFileNodeAdaptFileInfoTimeout)
 #pragma alloc_text(PAGE, FspFileNodeSetFileInfo)
 #pragma alloc_text(PAGE, FspFileNodeTrySetFileInfo)
 #pragma alloc_text(PAGE, FspFileNodeInvalidateFileInfo)
@@ -140,6 +145,7 @@ VOID FspFileNodeOplockComplete(PVOID Context, PIRP Irp);
 // !#pragma alloc_text(PAGE, FspFileNodeInvalidateDirInfo)
 #pragma alloc_text(PAGE, FspFileNodeInvalidateDirInfoByName)
 #pragma alloc_text(PAGE, FspFileNodeInvalidateParentDirInfo)
+#pragma alloc_text(PAGE, FspFileNodeParentDirInfoLacksName)
 // !#pragma alloc_text(PAGE, FspFileNodeReferenceStreamInfo)
 // !#pragma alloc_text(PAGE, FspFileNodeSetStreamInfo)
 // !#pragma alloc_text(PAGE, FspFileNodeTrySetStreamInfo)
@@ -908,6 +914,7 @@ VOID FspFileNodeClose(FSP_FILE_NODE *FileNode,
     PAGED_CODE();
 
     PDEVICE_OBJECT FsvolDeviceObject = FileNode->FsvolDeviceObject;
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
     BOOLEAN DeletedFromContextTable = FALSE;
 
     FspFsvolDeviceLockContextTable(FsvolDeviceObject);
@@ -955,7 +962,13 @@ VOID FspFileNodeClose(FSP_FILE_NODE *FileNode,
     FspFsvolDeviceUnlockContextTable(FsvolDeviceObject);
 
     if (DeletedFromContextTable)
+    {
+        /* the file may have changed while it was open; its primed FileInfo is stale */
+        if (0 != FsvolDeviceExtension->InfoNameCache)
+            FspFileNameCacheInvalidateName(FsvolDeviceExtension->InfoNameCache, &FileNode->FileName);
+
         FspFileNodeDereference(FileNode);
+    }
 }
 
 NTSTATUS FspFileNodeFlushAndPurgeCache(FSP_FILE_NODE *FileNode,
@@ -1550,6 +1563,45 @@ BOOLEAN FspFileNodeTryGetFileInfo(FSP_FILE_NODE *FileNode, FSP_FSCTL_FILE_INFO *
     return TRUE;
 }
 
+static UINT32 FspFileNodeAdaptFileInfoTimeout(FSP_FILE_NODE *FileNode,
+    const FSP_FSCTL_FILE_INFO *FileInfo, UINT64 AllocationSize)
+{
+    PAGED_CODE();
+
+    /*
+     * Adaptive FileInfo timeout. When the file system refreshes FileInfo that has not
+     * changed since we last saw it, the timeout of the file node is doubled up to the
+     * FileInfoTimeoutMax. Any change returns the timeout to FileInfoTimeout. Thus files
+     * that are queried often and never change are cached longer, whereas files that are
+     * being modified keep the shorter timeout.
+     */
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
+        FspFsvolDeviceExtension(FileNode->FsvolDeviceObject);
+    UINT32 FileInfoTimeout = FsvolDeviceExtension->VolumeParams.FileInfoTimeout;
+    UINT32 FileInfoTimeoutMax = FsvolDeviceExtension->VolumeParams.FileInfoTimeoutMax;
+    FSP_FSCTL_FILE_INFO OldFileInfo;
+    UINT32 FileAttributesMask;
+
+    if (0 == FileInfoTimeoutMax || 0 == FileNode->FileInfoTimeout)
+        return FileInfoTimeout;
+
+    FspFileNodeGetFileInfo(FileNode, &OldFileInfo);
+    FileAttributesMask = 0 != FileNode->MainFileNode ? ~(UINT32)FILE_ATTRIBUTE_DIRECTORY : ~(UINT32)0;
+    if (OldFileInfo.AllocationSize != AllocationSize ||
+        OldFileInfo.FileSize != FileInfo->FileSize ||
+        OldFileInfo.FileAttributes != (FileInfo->FileAttributes & FileAttributesMask) ||
+        OldFileInfo.ReparseTag != FileInfo->ReparseTag ||
+        OldFileInfo.CreationTime != FileInfo->CreationTime ||
+        OldFileInfo.LastAccessTime != FileInfo->LastAccessTime ||
+        OldFileInfo.LastWriteTime != FileInfo->LastWriteTime ||
+        OldFileInfo.ChangeTime != FileInfo->ChangeTime)
+        return FileInfoTimeout;
+
+    return FileNode->FileInfoTimeout < FileInfoTimeoutMax / 2 ?
+        FileNode->FileInfoTimeout * 2 : FileInfoTimeoutMax;
+}
+
 VOID FspFileNodeSetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileObject,
     const FSP_FSCTL_FILE_INFO *FileInfo, BOOLEAN TruncateOnClose)
 {
@@ -1580,8 +1632,9 @@ VOID FspFileNodeSetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileObject,
         FileNode->Header.FileSize.QuadPart = FileInfo->FileSize;
     }
 
+    FileNode->FileInfoTimeout = FspFileNodeAdaptFileInfoTimeout(FileNode, FileInfo, AllocationSize);
     FileNode->FileInfoExpirationTime = FileNode->BasicInfoExpirationTime =
-        FspExpirationTimeFromMillis(FsvolDeviceExtension->VolumeParams.FileInfoTimeout);
+        FspExpirationTimeFromMillis(FileNode->FileInfoTimeout);
     FileNode->FileInfoChangeNumber++;
 
     FSP_FILE_NODE *MainFileNode = FileNode;
@@ -1677,6 +1730,7 @@ VOID FspFileNodeInvalidateFileInfo(FSP_FILE_NODE *FileNode)
     PAGED_CODE();
 
     FileNode->FileInfoExpirationTime = FileNode->BasicInfoExpirationTime = 0;
+    FileNode->FileInfoTimeout = 0;
 
     if (0 != FileNode->MainFileNode)
         FileNode->MainFileNode->BasicInfoExpirationTime = 0;
@@ -1708,7 +1762,7 @@ VOID FspFileNodeSetSecurity(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size)
 
     FspMetaCacheInvalidateItem(FsvolDeviceExtension->SecurityCache, FileNode->Security);
     FileNode->Security = 0 != Buffer ?
-        FspMetaCacheAddItem(FsvolDeviceExtension->SecurityCache, Buffer, Size) : 0;
+        FspMetaCacheAddSharedItem(FsvolDeviceExtension->SecurityCache, Buffer, Size) : 0;
     FileNode->SecurityChangeNumber++;
 }
 
@@ -1799,6 +1853,7 @@ static VOID FspFileNodeInvalidateDirInfoByName(PDEVICE_OBJECT FsvolDeviceObject,
 {
     PAGED_CODE();
 
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
     FSP_FILE_NODE *FileNode;
 
     FspFsvolDeviceLockContextTable(FsvolDeviceObject);
@@ -1812,6 +1867,12 @@ static VOID FspFileNodeInvalidateDirInfoByName(PDEVICE_OBJECT FsvolDeviceObject,
         FspFileNodeInvalidateDirInfo(FileNode);
         FspFileNodeDereference(FileNode);
     }
+
+    /* the directory may have gained or changed a name; invalidate its name cache entries */
+    if (0 != FsvolDeviceExtension->NegativeNameCache)
+        FspFileNameCacheInvalidateParent(FsvolDeviceExtension->NegativeNameCache, FileName);
+    if (0 != FsvolDeviceExtension->InfoNameCache)
+        FspFileNameCacheInvalidateParent(FsvolDeviceExtension->InfoNameCache, FileName);
 }
 
 VOID FspFileNodeInvalidateParentDirInfo(FSP_FILE_NODE *FileNode)
@@ -1828,6 +1889,80 @@ VOID FspFileNodeInvalidateParentDirInfo(FSP_FILE_NODE *FileNode)
     FspFileNodeInvalidateDirInfoByName(FsvolDeviceObject, &Parent);
 }
 
+BOOLEAN FspFileNodeParentDirInfoLacksName(PDEVICE_OBJECT FsvolDeviceObject,
+    PUNICODE_STRING FileName, BOOLEAN CaseInsensitive)
+{
+    PAGED_CODE();
+
+    /*
+     * Determine whether the cached DirInfo of the parent directory is a complete listing
+     * that does not contain the name. A listing is complete when it ends with the zero
+     * size entry that the file system adds when it has no more entries.
+     */
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
+    FSP_FILE_NODE *FileNode;
+    FSP_FILE_NODE_NONPAGED *NonPaged;
+    UNICODE_STRING Parent, Suffix, Name;
+    FSP_FSCTL_DIR_INFO *DirInfo;
+    PCVOID DirInfoBuffer;
+    PUINT8 DirInfoEnd;
+    ULONG DirInfoSize;
+    UINT64 DirInfoIndex;
+    BOOLEAN Result = FALSE;
+    KIRQL Irql;
+
+    FspFileNameSuffix(FileName, &Parent, &Suffix);
+
+    FspFsvolDeviceLockContextTable(FsvolDeviceObject);
+    FileNode = FspFsvolDeviceLookupContextByName(FsvolDeviceObject, &Parent);
+    if (0 != FileNode)
+        FspFileNodeReference(FileNode);
+    FspFsvolDeviceUnlockContextTable(FsvolDeviceObject);
+
+    if (0 == FileNode)
+        return FALSE;
+
+    /* acquire the NpInfoSpinLock, because the FileNode is not acquired */
+    NonPaged = FileNode->NonPaged;
+    KeAcquireSpinLock(&NonPaged->NpInfoSpinLock, &Irql);
+    DirInfoIndex = NonPaged->DirInfo;
+    KeReleaseSpinLock(&NonPaged->NpInfoSpinLock, Irql);
+
+    if (FspMetaCacheReferenceItemBuffer(FsvolDeviceExtension->DirInfoCache,
+        DirInfoIndex, &DirInfoBuffer, &DirInfoSize))
+    {
+        DirInfo = (PVOID)DirInfoBuffer;
+        DirInfoEnd = (PUINT8)DirInfoBuffer + DirInfoSize;
+        for (;
+            (PUINT8)DirInfo + sizeof(DirInfo->Size) <= DirInfoEnd;
+            DirInfo = (PVOID)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfoSize)))
+        {
+            DirInfoSize = DirInfo->Size;
+
+            if (sizeof(FSP_FSCTL_DIR_INFO) > DirInfoSize)
+            {
+                Result = 0 == DirInfoSize;
+                break;
+            }
+
+            if ((PUINT8)DirInfo + DirInfoSize > DirInfoEnd)
+                break;
+
+            Name.Length = Name.MaximumLength = (USHORT)(DirInfoSize - sizeof(FSP_FSCTL_DIR_INFO));
+            Name.Buffer = DirInfo->FileNameBuf;
+            if (0 == FspFileNameCompare(&Name, &Suffix, CaseInsensitive, 0))
+                break;
+        }
+
+        FspFileNodeDereferenceDirInfo(DirInfoBuffer);
+    }
+
+    FspFileNodeDereference(FileNode);
+
+    return Result;
+}
+
 BOOLEAN FspFileNodeReferenceStreamInfo(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PULONG PSize)
 {
     // !PAGED_CODE();
@@ -1950,6 +2085,13 @@ VOID FspFileNodeNotifyChange(FSP_FILE_NODE *FileNode, ULONG Filter, ULONG Action
         if (InvalidateCaches)
         {
             FspFsvolDeviceInvalidateVolumeInfo(FsvolDeviceObject);
+            /* negative entries below a removed or renamed directory cannot be found by parent */
+            if (0 != FsvolDeviceExtension->NegativeNameCache && FileNode->IsDirectory &&
+                (FILE_ACTION_REMOVED == Action || FILE_ACTION_RENAMED_OLD_NAME == Action))
+                FspFileNameCacheInvalidateAll(FsvolDeviceExtension->NegativeNameCache);
+            if (0 != FsvolDeviceExtension->InfoNameCache && FileNode->IsDirectory &&
+                (FILE_ACTION_REMOVED == Action || FILE_ACTION_RENAMED_OLD_NAME == Action))
+                FspFileNameCacheInvalidateAll(FsvolDeviceExtension->InfoNameCache);
             if (0 == FileNode->MainFileNode)
             {
                 if (sizeof(WCHAR) == FileNode->FileName.Length && L'\\' == FileNode->FileName.Buffer[0])
@@ -2080,6 +2222,9 @@ NTSTATUS FspFileDescResetDirectory(FSP_FILE_DESC *FileDesc,
         }
 
         FileDesc->DirectoryPattern = DirectoryPattern;
+        FileDesc->DirectoryPatternIsCompiled = FspPatternCompile(&FileDesc->DirectoryPatternCompiled,
+            DirectoryPattern.Buffer, DirectoryPattern.Length / sizeof(WCHAR),
+            !FileDesc->CaseSensitive, FspFileNamePatternUpcase);
         FileDesc->DirectoryHasSuchFile = FALSE;
 
         if (0 != FileDesc->DirectoryMarker.Buffer)
@@ -17,13 +17,43 @@
 
 #include <sys/driver.h>
 
+/*
+ * The meta cache is split into FspMetaCacheShardCount shards, each with its own lock.
+ * An item is placed in the shard selected by its ItemIndex: an item index consists of a
+ * sequential counter multiplied by FspMetaCacheShardCount plus the shard index. Items
+ * are therefore spread evenly among shards and among the hash buckets of each shard;
+ * hash chains are very short.
+ *
+ * Each shard maintains two lists: the ItemList in LRU order and the ExpirationList in
+ * expiration order. Lookups move an item to the tail of the ItemList. Additions evict
+ * items from the head of the ItemList whenever the shard would exceed its capacity or
+ * its memory budget. Time based expiration continues to use the ExpirationList.
+ *
+ * Items that are too large for a shard's budget are not admitted at all, so that a
+ * single large item cannot flush the whole shard.
+ *
+ * Shared items are additionally indexed by a hash of their content, so that identical
+ * buffers (e.g. security descriptors shared by many files) are stored only once. A
+ * shared item is placed in the shard selected by its content hash and counts the
+ * number of its holders; FspMetaCacheInvalidateItem removes it only when its last
+ * holder invalidates it. Because item buffers are paged, content comparison happens
+ * outside the shard lock while holding a reference to the candidate item. Adding content
+ * that is already shared refreshes the expiration time of the shared item, so that items
+ * that keep being added do not expire early.
+ */
+
 typedef struct _FSP_META_CACHE_ITEM
 {
     LIST_ENTRY ListEntry;
+    LIST_ENTRY ExpirationEntry;
     struct _FSP_META_CACHE_ITEM *DictNext;
+    struct _FSP_META_CACHE_ITEM *ContentNext;
     PVOID ItemBuffer;
     UINT64 ItemIndex;
     UINT64 ExpirationTime;
+    ULONG ItemSize;
+    ULONG ContentHash;
+    ULONG ShareCount;                   /* 0 for items that are not shared */
     LONG RefCount;
 } FSP_META_CACHE_ITEM;
 
@@ -34,6 +64,22 @@ typedef struct
     __declspec(align(MEMORY_ALLOCATION_ALIGNMENT)) UINT8 Buffer[];
 } FSP_META_CACHE_ITEM_BUFFER;
 
+static inline FSP_META_CACHE_SHARD *FspMetaCacheShard(FSP_META_CACHE *MetaCache,
+    UINT64 ItemIndex, PULONG PHashIndex)
+{
+    *PHashIndex = (ULONG)((ItemIndex / FspMetaCacheShardCount) % FspMetaCacheShardBucketCount);
+    return &MetaCache->Shards[ItemIndex % FspMetaCacheShardCount];
+}
+
+static inline ULONG FspMetaCacheContentHash(PCVOID Buffer, ULONG Size)
+{
+    /* FNV-1a followed by a final mix */
+    UINT32 Hash = 2166136261;
+    for (PUINT8 P = (PUINT8)Buffer, EndP = P + Size; EndP > P; P++)
+        Hash = (Hash ^ *P) * 16777619;
+    return FspHashMix32(Hash);
+}
+
 static inline VOID FspMetaCacheDereferenceItem(FSP_META_CACHE_ITEM *Item)
 {
     LONG RefCount = InterlockedDecrement(&Item->RefCount);
@@ -45,12 +91,11 @@ static inline VOID FspMetaCacheDereferenceItem(FSP_META_CACHE_ITEM *Item)
     }
 }
 
-static inline FSP_META_CACHE_ITEM *FspMetaCacheLookupIndexedItemAtDpcLevel(FSP_META_CACHE *MetaCache,
-    UINT64 ItemIndex)
+static inline FSP_META_CACHE_ITEM *FspMetaCacheLookupIndexedItemAtDpcLevel(FSP_META_CACHE_SHARD *Shard,
+    ULONG HashIndex, UINT64 ItemIndex)
 {
     FSP_META_CACHE_ITEM *Item = 0;
-    ULONG HashIndex = ItemIndex % MetaCache->ItemBucketCount;
-    for (FSP_META_CACHE_ITEM *ItemX = MetaCache->ItemBuckets[HashIndex]; ItemX; ItemX = ItemX->DictNext)
+    for (FSP_META_CACHE_ITEM *ItemX = Shard->ItemBuckets[HashIndex]; ItemX; ItemX = ItemX->DictNext)
         if (ItemX->ItemIndex == ItemIndex)
         {
             Item = ItemX;
@@ -59,77 +104,144 @@ static inline FSP_META_CACHE_ITEM *FspMetaCacheLookupIndexedItemAtDpcLevel(FSP_M
     return Item;
 }
 
-static inline VOID FspMetaCacheAddItemAtDpcLevel(FSP_META_CACHE *MetaCache, FSP_META_CACHE_ITEM *Item)
+static inline VOID FspMetaCacheAddItemAtDpcLevel(FSP_META_CACHE_SHARD *Shard,
+    ULONG HashIndex, FSP_META_CACHE_ITEM *Item)
 {
-    ULONG HashIndex = Item->ItemIndex % MetaCache->ItemBucketCount;
 #if DBG
-    for (FSP_META_CACHE_ITEM *ItemX = MetaCache->ItemBuckets[HashIndex]; ItemX; ItemX = ItemX->DictNext)
+    for (FSP_META_CACHE_ITEM *ItemX = Shard->ItemBuckets[HashIndex]; ItemX; ItemX = ItemX->DictNext)
         ASSERT(ItemX->ItemIndex != Item->ItemIndex);
 #endif
-    Item->DictNext = MetaCache->ItemBuckets[HashIndex];
-    MetaCache->ItemBuckets[HashIndex] = Item;
-    InsertTailList(&MetaCache->ItemList, &Item->ListEntry);
-    MetaCache->ItemCount++;
+    Item->DictNext = Shard->ItemBuckets[HashIndex];
+    Shard->ItemBuckets[HashIndex] = Item;
+    InsertTailList(&Shard->ItemList, &Item->ListEntry);
+    InsertTailList(&Shard->ExpirationList, &Item->ExpirationEntry);
+    Shard->ItemCount++;
+    Shard->ItemSize += Item->ItemSize;
+    if (0 != Item->ShareCount)
+    {
+        ULONG ContentIndex = (Item->ContentHash / FspMetaCacheShardCount) %
+            FspMetaCacheShardBucketCount;
+        Item->ContentNext = Shard->ContentBuckets[ContentIndex];
+        Shard->ContentBuckets[ContentIndex] = Item;
+    }
 }
 
-static inline FSP_META_CACHE_ITEM *FspMetaCacheRemoveIndexedItemAtDpcLevel(FSP_META_CACHE *MetaCache,
-    UINT64 ItemIndex)
+static inline VOID FspMetaCacheRemoveItemAtDpcLevel(FSP_META_CACHE_SHARD *Shard,
+    FSP_META_CACHE_ITEM *Item)
 {
-    FSP_META_CACHE_ITEM *Item = 0;
-    ULONG HashIndex = ItemIndex % MetaCache->ItemBucketCount;
-    for (FSP_META_CACHE_ITEM **P = (PVOID)&MetaCache->ItemBuckets[HashIndex]; *P; P = &(*P)->DictNext)
-        if ((*P)->ItemIndex == ItemIndex)
+    ULONG HashIndex = (ULONG)((Item->ItemIndex / FspMetaCacheShardCount) %
+        FspMetaCacheShardBucketCount);
+    for (FSP_META_CACHE_ITEM **P = (PVOID)&Shard->ItemBuckets[HashIndex]; *P; P = &(*P)->DictNext)
+        if (*P == Item)
         {
-            Item = *P;
             *P = (*P)->DictNext;
-            RemoveEntryList(&Item->ListEntry);
-            MetaCache->ItemCount--;
             break;
         }
+    if (0 != Item->ShareCount)
+    {
+        ULONG ContentIndex = (Item->ContentHash / FspMetaCacheShardCount) %
+            FspMetaCacheShardBucketCount;
+        for (FSP_META_CACHE_ITEM **P = (PVOID)&Shard->ContentBuckets[ContentIndex]; *P;
+            P = &(*P)->ContentNext)
+            if (*P == Item)
+            {
+                *P = (*P)->ContentNext;
+                break;
+            }
+    }
+    RemoveEntryList(&Item->ListEntry);
+    RemoveEntryList(&Item->ExpirationEntry);
+    Shard->ItemCount--;
+    Shard->ItemSize -= Item->ItemSize;
+}
+
+static inline FSP_META_CACHE_ITEM *FspMetaCacheLookupContentItemAtDpcLevel(FSP_META_CACHE_SHARD *Shard,
+    ULONG ContentHash, ULONG ItemSize)
+{
+    ULONG ContentIndex = (ContentHash / FspMetaCacheShardCount) % FspMetaCacheShardBucketCount;
+    for (FSP_META_CACHE_ITEM *ItemX = Shard->ContentBuckets[ContentIndex]; ItemX; ItemX = ItemX->ContentNext)
+        if (ItemX->ContentHash == ContentHash && ItemX->ItemSize == ItemSize)
+            return ItemX;
+    return 0;
+}
+
+static inline FSP_META_CACHE_ITEM *FspMetaCacheRemoveIndexedItemAtDpcLevel(FSP_META_CACHE_SHARD *Shard,
+    ULONG HashIndex, UINT64 ItemIndex)
+{
+    FSP_META_CACHE_ITEM *Item = FspMetaCacheLookupIndexedItemAtDpcLevel(Shard, HashIndex, ItemIndex);
+    if (0 != Item)
+    {
+        if (1 < Item->ShareCount)
+        {
+            /* other holders remain; just drop this one */
+            Item->ShareCount--;
+            return 0;
+        }
+        FspMetaCacheRemoveItemAtDpcLevel(Shard, Item);
+    }
     return Item;
 }
 
-static inline FSP_META_CACHE_ITEM *FspMetaCacheRemoveExpiredItemAtDpcLevel(FSP_META_CACHE *MetaCache,
+static inline FSP_META_CACHE_ITEM *FspMetaCacheRemoveExpiredItemAtDpcLevel(FSP_META_CACHE_SHARD *Shard,
     UINT64 ExpirationTime)
 {
-    PLIST_ENTRY Head = &MetaCache->ItemList;
+    PLIST_ENTRY Head = &Shard->ExpirationList;
     PLIST_ENTRY Entry = Head->Flink;
     if (Head == Entry)
         return 0;
-    FSP_META_CACHE_ITEM *Item = CONTAINING_RECORD(Entry, FSP_META_CACHE_ITEM, ListEntry);
+    FSP_META_CACHE_ITEM *Item = CONTAINING_RECORD(Entry, FSP_META_CACHE_ITEM, ExpirationEntry);
     if (!FspExpirationTimeValid2(Item->ExpirationTime, ExpirationTime))
         return 0;
-    ULONG HashIndex = Item->ItemIndex % MetaCache->ItemBucketCount;
-    for (FSP_META_CACHE_ITEM **P = (PVOID)&MetaCache->ItemBuckets[HashIndex]; *P; P = &(*P)->DictNext)
-        if (*P == Item)
-        {
-            *P = (*P)->DictNext;
-            break;
-        }
-    RemoveEntryList(&Item->ListEntry);
-    MetaCache->ItemCount--;
+    FspMetaCacheRemoveItemAtDpcLevel(Shard, Item);
     return Item;
 }
 
+static inline FSP_META_CACHE_ITEM *FspMetaCacheEvictItemsAtDpcLevel(FSP_META_CACHE_SHARD *Shard,
+    ULONG ItemSize)
+{
+    /* evict LRU items until the new item fits; return them chained through DictNext */
+    FSP_META_CACHE_ITEM *EvictedItems = 0;
+    while (Shard->ItemCount >= Shard->ItemCapacity ||
+        Shard->ItemSize + ItemSize > Shard->ItemBudget)
+    {
+        PLIST_ENTRY Head = &Shard->ItemList;
+        PLIST_ENTRY Entry = Head->Flink;
+        if (Head == Entry)
+            break;
+        FSP_META_CACHE_ITEM *Item = CONTAINING_RECORD(Entry, FSP_META_CACHE_ITEM, ListEntry);
+        FspMetaCacheRemoveItemAtDpcLevel(Shard, Item);
+        Item->DictNext = EvictedItems;
+        EvictedItems = Item;
+        Shard->EvictionCount++;
+    }
+    return EvictedItems;
+}
+
 NTSTATUS FspMetaCacheCreate(
-    ULONG MetaCapacity, ULONG ItemSizeMax, PLARGE_INTEGER MetaTimeout,
+    ULONG MetaCapacity, ULONG MetaBudget, ULONG ItemSizeMax, PLARGE_INTEGER MetaTimeout,
     FSP_META_CACHE **PMetaCache)
 {
     *PMetaCache = 0;
-    if (0 == MetaCapacity || 0 == ItemSizeMax || 0 == MetaTimeout->QuadPart)
+    if (0 == MetaCapacity || 0 == MetaBudget || 0 == ItemSizeMax || 0 == MetaTimeout->QuadPart)
         return STATUS_SUCCESS;
     FSP_META_CACHE *MetaCache;
-    ULONG BucketCount = (PAGE_SIZE - sizeof *MetaCache) / sizeof MetaCache->ItemBuckets[0];
-    MetaCache = FspAllocNonPaged(PAGE_SIZE);
+    ULONG ShardCapacity = (MetaCapacity + FspMetaCacheShardCount - 1) / FspMetaCacheShardCount;
+    ULONG ShardBudget = (MetaBudget + FspMetaCacheShardCount - 1) / FspMetaCacheShardCount;
+    MetaCache = FspAllocNonPagedCacheAligned(sizeof *MetaCache);
     if (0 == MetaCache)
         return STATUS_INSUFFICIENT_RESOURCES;
-    RtlZeroMemory(MetaCache, PAGE_SIZE);
-    KeInitializeSpinLock(&MetaCache->SpinLock);
-    InitializeListHead(&MetaCache->ItemList);
-    MetaCache->MetaCapacity = MetaCapacity;
-    MetaCache->ItemSizeMax = ItemSizeMax;
+    RtlZeroMemory(MetaCache, sizeof *MetaCache);
     MetaCache->MetaTimeout = MetaTimeout->QuadPart;
-    MetaCache->ItemBucketCount = BucketCount;
+    MetaCache->ItemSizeMax = ItemSizeMax;
+    for (ULONG I = 0; FspMetaCacheShardCount > I; I++)
+    {
+        FSP_META_CACHE_SHARD *Shard = &MetaCache->Shards[I];
+        KeInitializeSpinLock(&Shard->SpinLock);
+        InitializeListHead(&Shard->ItemList);
+        InitializeListHead(&Shard->ExpirationList);
+        Shard->ItemCapacity = ShardCapacity;
+        Shard->ItemBudget = ShardBudget;
+    }
     *PMetaCache = MetaCache;
     return STATUS_SUCCESS;
 }
@@ -138,6 +250,13 @@ VOID FspMetaCacheDelete(FSP_META_CACHE *MetaCache)
 {
     if (0 == MetaCache)
         return;
+#if DBG
+    FSP_META_CACHE_STATISTICS Statistics;
+    FspMetaCacheGetStatistics(MetaCache, &Statistics);
+    DEBUGLOG("Hit=%lu, Miss=%lu, Eviction=%lu, Reject=%lu, Share=%lu",
+        Statistics.HitCount, Statistics.MissCount, Statistics.EvictionCount, Statistics.RejectCount,
+        Statistics.ShareCount);
+#endif
     FspMetaCacheInvalidateExpired(MetaCache, (UINT64)-1LL);
     FspFree(MetaCache);
 }
@@ -148,14 +267,18 @@ VOID FspMetaCacheInvalidateExpired(FSP_META_CACHE *MetaCache, UINT64 ExpirationT
         return;
     FSP_META_CACHE_ITEM *Item;
     KIRQL Irql;
-    for (;;)
+    for (ULONG I = 0; FspMetaCacheShardCount > I; I++)
     {
-        KeAcquireSpinLock(&MetaCache->SpinLock, &Irql);
-        Item = FspMetaCacheRemoveExpiredItemAtDpcLevel(MetaCache, ExpirationTime);
-        KeReleaseSpinLock(&MetaCache->SpinLock, Irql);
-        if (0 == Item)
-            break;
-        FspMetaCacheDereferenceItem(Item);
+        FSP_META_CACHE_SHARD *Shard = &MetaCache->Shards[I];
+        for (;;)
+        {
+            KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+            Item = FspMetaCacheRemoveExpiredItemAtDpcLevel(Shard, ExpirationTime);
+            KeReleaseSpinLock(&Shard->SpinLock, Irql);
+            if (0 == Item)
+                break;
+            FspMetaCacheDereferenceItem(Item);
+        }
     }
 }
 
@@ -167,18 +290,25 @@ BOOLEAN FspMetaCacheReferenceItemBuffer(FSP_META_CACHE *MetaCache, UINT64 ItemIn
         *PSize = 0;
     if (0 == MetaCache || 0 == ItemIndex)
         return FALSE;
+    FSP_META_CACHE_SHARD *Shard;
     FSP_META_CACHE_ITEM *Item = 0;
     FSP_META_CACHE_ITEM_BUFFER *ItemBuffer;
+    ULONG HashIndex;
     KIRQL Irql;
-    KeAcquireSpinLock(&MetaCache->SpinLock, &Irql);
-    Item = FspMetaCacheLookupIndexedItemAtDpcLevel(MetaCache, ItemIndex);
+    Shard = FspMetaCacheShard(MetaCache, ItemIndex, &HashIndex);
+    KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+    Item = FspMetaCacheLookupIndexedItemAtDpcLevel(Shard, HashIndex, ItemIndex);
     if (0 == Item)
     {
-        KeReleaseSpinLock(&MetaCache->SpinLock, Irql);
+        Shard->MissCount++;
+        KeReleaseSpinLock(&Shard->SpinLock, Irql);
         return FALSE;
     }
+    Shard->HitCount++;
+    RemoveEntryList(&Item->ListEntry);
+    InsertTailList(&Shard->ItemList, &Item->ListEntry);
     InterlockedIncrement(&Item->RefCount);
-    KeReleaseSpinLock(&MetaCache->SpinLock, Irql);
+    KeReleaseSpinLock(&Shard->SpinLock, Irql);
     ItemBuffer = Item->ItemBuffer;
     *PBuffer = ItemBuffer->Buffer;
     if (0 != PSize)
@@ -192,16 +322,66 @@ VOID FspMetaCacheDereferenceItemBuffer(PCVOID Buffer)
     FspMetaCacheDereferenceItem(ItemBuffer->Item);
 }
 
-UINT64 FspMetaCacheAddItem(FSP_META_CACHE *MetaCache, PCVOID Buffer, ULONG Size)
+static UINT64 FspMetaCacheAddItemEx(FSP_META_CACHE *MetaCache, PCVOID Buffer, ULONG Size,
+    BOOLEAN Shared)
 {
     if (0 == MetaCache)
         return 0;
-    FSP_META_CACHE_ITEM *Item;
+    FSP_META_CACHE_SHARD *Shard;
+    FSP_META_CACHE_ITEM *Item, *EvictedItems;
     FSP_META_CACHE_ITEM_BUFFER *ItemBuffer;
-    UINT64 ItemIndex = 0;
+    UINT64 Counter, ItemIndex = 0;
+    ULONG ShardIndex, HashIndex, ContentHash = 0, ItemSize;
     KIRQL Irql;
     if (sizeof *ItemBuffer + Size > MetaCache->ItemSizeMax)
         return 0;
+    ItemSize = sizeof *Item + sizeof *ItemBuffer + Size;
+    if (Shared)
+    {
+        ContentHash = FspMetaCacheContentHash(Buffer, Size);
+        Shard = &MetaCache->Shards[ContentHash % FspMetaCacheShardCount];
+        KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+        Item = FspMetaCacheLookupContentItemAtDpcLevel(Shard, ContentHash, ItemSize);
+        if (0 != Item)
+            InterlockedIncrement(&Item->RefCount);
+        KeReleaseSpinLock(&Shard->SpinLock, Irql);
+        if (0 != Item)
+        {
+            ItemBuffer = Item->ItemBuffer;
+            if (RtlEqualMemory(ItemBuffer->Buffer, Buffer, Size))
+            {
+                UINT64 ExpirationTime = FspExpirationTimeFromTimeout(MetaCache->MetaTimeout);
+                Shard = FspMetaCacheShard(MetaCache, Item->ItemIndex, &HashIndex);
+                KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+                if (Item == FspMetaCacheLookupIndexedItemAtDpcLevel(Shard, HashIndex, Item->ItemIndex))
+                {
+                    Item->ShareCount++;
+                    Shard->ShareCount++;
+                    RemoveEntryList(&Item->ListEntry);
+                    InsertTailList(&Shard->ItemList, &Item->ListEntry);
+                    /* the ExpirationList is in expiration order; a refreshed item goes last */
+                    Item->ExpirationTime = ExpirationTime;
+                    RemoveEntryList(&Item->ExpirationEntry);
+                    InsertTailList(&Shard->ExpirationList, &Item->ExpirationEntry);
+                    ItemIndex = Item->ItemIndex;
+                }
+                KeReleaseSpinLock(&Shard->SpinLock, Irql);
+            }
+            FspMetaCacheDereferenceItem(Item);
+            if (0 != ItemIndex)
+                return ItemIndex;
+        }
+    }
+    Counter = (UINT64)InterlockedIncrement64(&MetaCache->ItemIndex);
+    ShardIndex = (ULONG)((Shared ? ContentHash : Counter) % FspMetaCacheShardCount);
+    ItemIndex = Counter * FspMetaCacheShardCount + ShardIndex;
+    Shard = FspMetaCacheShard(MetaCache, ItemIndex, &HashIndex);
+    if (ItemSize > Shard->ItemBudget / 2)
+    {
+        /* size-aware admission: do not let one item flush the whole shard */
+        InterlockedIncrement((PLONG)&Shard->RejectCount);
+        return 0;
+    }
     Item = FspAllocNonPaged(sizeof *Item);
     if (0 == Item)
         return 0;
@@ -214,31 +394,71 @@ UINT64 FspMetaCacheAddItem(FSP_META_CACHE *MetaCache, PCVOID Buffer, ULONG Size)
     RtlZeroMemory(Item, sizeof *Item);
     RtlZeroMemory(ItemBuffer, sizeof *ItemBuffer);
     Item->ItemBuffer = ItemBuffer;
+    Item->ItemIndex = ItemIndex;
     Item->ExpirationTime = FspExpirationTimeFromTimeout(MetaCache->MetaTimeout);
+    Item->ItemSize = ItemSize;
+    Item->ContentHash = ContentHash;
+    Item->ShareCount = Shared ? 1 : 0;
     Item->RefCount = 1;
     ItemBuffer->Item = Item;
     ItemBuffer->Size = Size;
     RtlCopyMemory(ItemBuffer->Buffer, Buffer, Size);
-    KeAcquireSpinLock(&MetaCache->SpinLock, &Irql);
-    if (MetaCache->ItemCount >= MetaCache->MetaCapacity)
-        FspMetaCacheRemoveExpiredItemAtDpcLevel(MetaCache, (UINT64)-1LL);
-    ItemIndex = MetaCache->ItemIndex;
-    ItemIndex = (UINT64)-1LL == ItemIndex ? 1 : ItemIndex + 1;
-    MetaCache->ItemIndex = Item->ItemIndex = ItemIndex;
-    FspMetaCacheAddItemAtDpcLevel(MetaCache, Item);
-    KeReleaseSpinLock(&MetaCache->SpinLock, Irql);
+    KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+    EvictedItems = FspMetaCacheEvictItemsAtDpcLevel(Shard, ItemSize);
+    FspMetaCacheAddItemAtDpcLevel(Shard, HashIndex, Item);
+    KeReleaseSpinLock(&Shard->SpinLock, Irql);
+    while (0 != EvictedItems)
+    {
+        Item = EvictedItems;
+        EvictedItems = Item->DictNext;
+        FspMetaCacheDereferenceItem(Item);
+    }
     return ItemIndex;
 }
 
+UINT64 FspMetaCacheAddItem(FSP_META_CACHE *MetaCache, PCVOID Buffer, ULONG Size)
+{
+    return FspMetaCacheAddItemEx(MetaCache, Buffer, Size, FALSE);
+}
+
+UINT64 FspMetaCacheAddSharedItem(FSP_META_CACHE *MetaCache, PCVOID Buffer, ULONG Size)
+{
+    return FspMetaCacheAddItemEx(MetaCache, Buffer, Size, TRUE);
+}
+
 VOID FspMetaCacheInvalidateItem(FSP_META_CACHE *MetaCache, UINT64 ItemIndex)
 {
     if (0 == MetaCache || 0 == ItemIndex)
         return;
+    FSP_META_CACHE_SHARD *Shard;
     FSP_META_CACHE_ITEM *Item;
+    ULONG HashIndex;
     KIRQL Irql;
-    KeAcquireSpinLock(&MetaCache->SpinLock, &Irql);
-    Item = FspMetaCacheRemoveIndexedItemAtDpcLevel(MetaCache, ItemIndex);
-    KeReleaseSpinLock(&MetaCache->SpinLock, Irql);
+    Shard = FspMetaCacheShard(MetaCache, ItemIndex, &HashIndex);
+    KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+    Item = FspMetaCacheRemoveIndexedItemAtDpcLevel(Shard, HashIndex, ItemIndex);
+    KeReleaseSpinLock(&Shard->SpinLock, Irql);
     if (0 != Item)
         FspMetaCacheDereferenceItem(Item);
 }
+
+VOID FspMetaCacheGetStatistics(FSP_META_CACHE *MetaCache, FSP_META_CACHE_STATISTICS *Statistics)
+{
+    RtlZeroMemory(Statistics, sizeof *Statistics);
+    if (0 == MetaCache)
+        return;
+    KIRQL Irql;
+    for (ULONG I = 0; FspMetaCacheShardCount > I; I++)
+    {
+        FSP_META_CACHE_SHARD *Shard = &MetaCache->Shards[I];
+        KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+        Statistics->ItemCount += Shard->ItemCount;
+        Statistics->ItemSize += Shard->ItemSize;
+        Statistics->HitCount += Shard->HitCount;
+        Statistics->MissCount += Shard->MissCount;
+        Statistics->EvictionCount += Shard->EvictionCount;
+        Statistics->RejectCount += Shard->RejectCount;
+        Statistics->ShareCount += Shard->ShareCount;
+        KeReleaseSpinLock(&Shard->SpinLock, Irql);
+    }
+}
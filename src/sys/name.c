@@ -27,12 +27,14 @@ NTSTATUS FspFileNameInExpression(
     BOOLEAN IgnoreCase,
     PWCH UpcaseTable,
     PBOOLEAN PResult);
+WCHAR FspFileNamePatternUpcase(WCHAR C);
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, FspFileNameIsValid)
 #pragma alloc_text(PAGE, FspFileNameIsValidPattern)
 #pragma alloc_text(PAGE, FspFileNameSuffix)
 #pragma alloc_text(PAGE, FspFileNameInExpression)
+#pragma alloc_text(PAGE, FspFileNamePatternUpcase)
 #endif
 
 BOOLEAN FspFileNameIsValid(PUNICODE_STRING Path, ULONG MaxComponentLength,
@@ -241,3 +243,10 @@ NTSTATUS FspFileNameInExpression(
         return GetExceptionCode();
     }
 }
+
+WCHAR FspFileNamePatternUpcase(WCHAR C)
+{
+    PAGED_CODE();
+
+    return RtlUpcaseUnicodeChar(C);
+}
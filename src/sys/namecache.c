@@ -0,0 +1,310 @@
+/**
+ * @file sys/namecache.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <sys/driver.h>
+
+/*
+ * The file name caches remember recently seen names of a volume. There are two of them:
+ *
+ *     - The negative name cache answers opens of names that are known not to exist
+ *     without a round-trip to the user mode file system. Names are added when the file
+ *     system fails an open with STATUS_OBJECT_NAME_NOT_FOUND or when a complete cached
+ *     DirInfo listing of the parent directory does not contain them. They expire after
+ *     DirInfoTimeout.
+ *     - The primed info cache remembers the FileInfo that a directory listing returned
+ *     for each of its names, so that the attribute queries that usually follow a listing
+ *     (FastIoQueryOpen) can be answered without a Create/QueryInformation/Close round-trip
+ *     to the user mode file system. Names are added when the file system answers a
+ *     QueryDirectory and they expire after FileInfoTimeout. They are also removed when the
+ *     last open of a name is closed, because the file may have changed while it was open.
+ *
+ * Names are removed through the same paths that invalidate the DirInfo cache
+ * (FspFileNodeInvalidateParentDirInfo and FspFileNodeNotifyChange).
+ *
+ * Primed info cache entries are owned by the security context that opened the listed
+ * directory; see FspFileNameCacheGetOwner. Negative name cache entries are not owned,
+ * because the absence of a name is checked before any access check anyway.
+ *
+ * The cache logic lives in shared/namecache.h; this file adds locking and storage. Names
+ * are compared while the cache is locked and file names live in paged pool, so the cache
+ * is protected by an ERESOURCE rather than a spin lock. All callers run at PASSIVE_LEVEL
+ * inside the file system.
+ */
+
+typedef struct _FSP_FILE_NAME_CACHE
+{
+    ERESOURCE Resource;
+    UINT64 Timeout;
+    FSP_NAME_CACHE Cache;
+    UINT64 Entries[];
+} FSP_FILE_NAME_CACHE;
+
+NTSTATUS FspFileNameCacheCreate(ULONG SetCount, ULONG PayloadSize, BOOLEAN CaseInsensitive,
+    PLARGE_INTEGER Timeout, FSP_FILE_NAME_CACHE **PFileNameCache);
+VOID FspFileNameCacheDelete(FSP_FILE_NAME_CACHE *FileNameCache);
+NTSTATUS FspFileNameCacheGetOwner(PSECURITY_SUBJECT_CONTEXT SubjectContext,
+    FSP_NAME_CACHE_OWNER *Owner);
+ULONG FspFileNameCacheGeneration(FSP_FILE_NAME_CACHE *FileNameCache);
+BOOLEAN FspFileNameCacheLookup(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING FileName, const FSP_NAME_CACHE_OWNER *Owner, PVOID Payload,
+    PULONG PGeneration);
+VOID FspFileNameCacheInsert(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING FileName, const FSP_NAME_CACHE_OWNER *Owner, const VOID *Payload,
+    ULONG Generation);
+ULONG FspFileNameCacheInsertDirInfo(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING Parent, const FSP_NAME_CACHE_OWNER *Owner, ULONG Generation,
+    PVOID DirInfoBuffer, ULONG DirInfoSize);
+VOID FspFileNameCacheInvalidateName(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING FileName);
+VOID FspFileNameCacheInvalidateParent(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING Parent);
+VOID FspFileNameCacheInvalidateAll(FSP_FILE_NAME_CACHE *FileNameCache);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, FspFileNameCacheCreate)
+#pragma alloc_text(PAGE, FspFileNameCacheDelete)
+#pragma alloc_text(PAGE, FspFileNameCacheGetOwner)
+#pragma alloc_text(PAGE, FspFileNameCacheGeneration)
+#pragma alloc_text(PAGE, FspFileNameCacheLookup)
+#pragma alloc_text(PAGE, FspFileNameCacheInsert)
+#pragma alloc_text(PAGE, FspFileNameCacheInsertDirInfo)
+#pragma alloc_text(PAGE, FspFileNameCacheInvalidateName)
+#pragma alloc_text(PAGE, FspFileNameCacheInvalidateParent)
+#pragma alloc_text(PAGE, FspFileNameCacheInvalidateAll)
+#endif
+
+static const FSP_NAME_CACHE_OWNER FspFileNameCacheNoOwner;
+
+NTSTATUS FspFileNameCacheCreate(ULONG SetCount, ULONG PayloadSize, BOOLEAN CaseInsensitive,
+    PLARGE_INTEGER Timeout, FSP_FILE_NAME_CACHE **PFileNameCache)
+{
+    PAGED_CODE();
+
+    FSP_FILE_NAME_CACHE *FileNameCache;
+
+    *PFileNameCache = 0;
+
+    ASSERT(0 != SetCount && 0 == (SetCount & (SetCount - 1)));
+
+    FileNameCache = FspAllocNonPaged(FIELD_OFFSET(FSP_FILE_NAME_CACHE, Entries) +
+        SetCount * FSP_NAME_CACHE_WAYS * FSP_NAME_CACHE_ENTRY_SIZE(PayloadSize));
+    if (0 == FileNameCache)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    ExInitializeResourceLite(&FileNameCache->Resource);
+    FileNameCache->Timeout = Timeout->QuadPart;
+    FspNameCacheInitialize(&FileNameCache->Cache, SetCount, PayloadSize, CaseInsensitive,
+        FileNameCache->Entries);
+
+    *PFileNameCache = FileNameCache;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FspFileNameCacheDelete(FSP_FILE_NAME_CACHE *FileNameCache)
+{
+    PAGED_CODE();
+
+    DEBUGLOG("Hit=%lu, Miss=%lu, Insert=%lu, Invalidate=%lu",
+        FileNameCache->Cache.HitCount, FileNameCache->Cache.MissCount,
+        FileNameCache->Cache.InsertCount, FileNameCache->Cache.InvalidateCount);
+
+    ExDeleteResourceLite(&FileNameCache->Resource);
+    FspFree(FileNameCache);
+}
+
+NTSTATUS FspFileNameCacheGetOwner(PSECURITY_SUBJECT_CONTEXT SubjectContext,
+    FSP_NAME_CACHE_OWNER *Owner)
+{
+    PAGED_CODE();
+
+    /*
+     * The owner identifies the effective token of a subject context: its logon session
+     * (AuthenticationId), the token object itself (TokenId) and the state of its groups
+     * and privileges (ModifiedId). LUID's are not reused until reboot, so unlike process
+     * ID's they cannot be taken over by an unrelated party.
+     */
+
+    PACCESS_TOKEN AccessToken;
+    PTOKEN_STATISTICS Statistics;
+    NTSTATUS Result;
+
+    SeLockSubjectContext(SubjectContext);
+    AccessToken = SeQuerySubjectContextToken(SubjectContext);
+    Result = SeQueryInformationToken(AccessToken, TokenStatistics, (PVOID *)&Statistics);
+    SeUnlockSubjectContext(SubjectContext);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    Owner->Id[0] = *(PUINT64)&Statistics->AuthenticationId;
+    Owner->Id[1] = *(PUINT64)&Statistics->TokenId;
+    Owner->Id[2] = *(PUINT64)&Statistics->ModifiedId;
+
+    ExFreePool(Statistics);
+
+    return STATUS_SUCCESS;
+}
+
+ULONG FspFileNameCacheGeneration(FSP_FILE_NAME_CACHE *FileNameCache)
+{
+    PAGED_CODE();
+
+    ULONG Generation;
+
+    ExAcquireResourceSharedLite(&FileNameCache->Resource, TRUE);
+    Generation = FileNameCache->Cache.Generation;
+    ExReleaseResourceLite(&FileNameCache->Resource);
+
+    return Generation;
+}
+
+BOOLEAN FspFileNameCacheLookup(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING FileName, const FSP_NAME_CACHE_OWNER *Owner, PVOID Payload,
+    PULONG PGeneration)
+{
+    PAGED_CODE();
+
+    UNICODE_STRING Parent, Suffix;
+    UINT64 CurrentTime;
+    BOOLEAN Result;
+
+    FspFileNameSuffix(FileName, &Parent, &Suffix);
+    CurrentTime = KeQueryInterruptTime();
+
+    ExAcquireResourceExclusiveLite(&FileNameCache->Resource, TRUE);
+    Result = FspNameCacheLookup(&FileNameCache->Cache,
+        Parent.Buffer, Parent.Length / sizeof(WCHAR),
+        Suffix.Buffer, Suffix.Length / sizeof(WCHAR),
+        0 != Owner ? Owner : &FspFileNameCacheNoOwner, CurrentTime, Payload);
+    if (0 != PGeneration)
+        *PGeneration = FileNameCache->Cache.Generation;
+    ExReleaseResourceLite(&FileNameCache->Resource);
+
+    return Result;
+}
+
+VOID FspFileNameCacheInsert(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING FileName, const FSP_NAME_CACHE_OWNER *Owner, const VOID *Payload,
+    ULONG Generation)
+{
+    PAGED_CODE();
+
+    UNICODE_STRING Parent, Suffix;
+    UINT64 CurrentTime, ExpirationTime;
+
+    FspFileNameSuffix(FileName, &Parent, &Suffix);
+    CurrentTime = KeQueryInterruptTime();
+    ExpirationTime = FspExpirationTimeFromTimeout(FileNameCache->Timeout);
+
+    ExAcquireResourceExclusiveLite(&FileNameCache->Resource, TRUE);
+    FspNameCacheInsert(&FileNameCache->Cache,
+        Parent.Buffer, Parent.Length / sizeof(WCHAR),
+        Suffix.Buffer, Suffix.Length / sizeof(WCHAR),
+        0 != Owner ? Owner : &FspFileNameCacheNoOwner, Payload,
+        CurrentTime, ExpirationTime, Generation);
+    ExReleaseResourceLite(&FileNameCache->Resource);
+}
+
+ULONG FspFileNameCacheInsertDirInfo(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING Parent, const FSP_NAME_CACHE_OWNER *Owner, ULONG Generation,
+    PVOID DirInfoBuffer, ULONG DirInfoSize)
+{
+    PAGED_CODE();
+
+    /*
+     * The DirInfo buffer may be mapped into the user mode file system process,
+     * so we read every DirInfo->Size once and check it before use. We insert at
+     * most as many names as the cache can hold; further names would only evict
+     * names of the same listing.
+     */
+
+    FSP_FSCTL_DIR_INFO *DirInfo = DirInfoBuffer;
+    PUINT8 DirInfoEnd = (PUINT8)DirInfoBuffer + DirInfoSize;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    UINT64 CurrentTime, ExpirationTime;
+    ULONG Size, NameLength, Count = 0, CountMax;
+
+    ASSERT(sizeof(FSP_FSCTL_FILE_INFO) == FileNameCache->Cache.PayloadSize);
+
+    CurrentTime = KeQueryInterruptTime();
+    ExpirationTime = FspExpirationTimeFromTimeout(FileNameCache->Timeout);
+
+    ExAcquireResourceExclusiveLite(&FileNameCache->Resource, TRUE);
+    CountMax = FileNameCache->Cache.SetCount * FSP_NAME_CACHE_WAYS;
+    for (;
+        CountMax > Count && (PUINT8)DirInfo + sizeof(DirInfo->Size) <= DirInfoEnd;
+        DirInfo = (PVOID)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(Size)))
+    {
+        Size = DirInfo->Size;
+        if (sizeof(FSP_FSCTL_DIR_INFO) > Size || (PUINT8)DirInfo + Size > DirInfoEnd)
+            break;
+
+        NameLength = (Size - sizeof(FSP_FSCTL_DIR_INFO)) / sizeof(WCHAR);
+        FileInfo = DirInfo->FileInfo;
+
+        /* skip the dot entries and reparse points (which an open would follow) */
+        if ((1 == NameLength && L'.' == DirInfo->FileNameBuf[0]) ||
+            (2 == NameLength && L'.' == DirInfo->FileNameBuf[0] && L'.' == DirInfo->FileNameBuf[1]) ||
+            FlagOn(FileInfo.FileAttributes, FILE_ATTRIBUTE_REPARSE_POINT))
+            continue;
+
+        Count += FspNameCacheInsert(&FileNameCache->Cache,
+            Parent->Buffer, Parent->Length / sizeof(WCHAR),
+            DirInfo->FileNameBuf, NameLength,
+            Owner, &FileInfo,
+            CurrentTime, ExpirationTime, Generation);
+    }
+    ExReleaseResourceLite(&FileNameCache->Resource);
+
+    return Count;
+}
+
+VOID FspFileNameCacheInvalidateName(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING FileName)
+{
+    PAGED_CODE();
+
+    UNICODE_STRING Parent, Suffix;
+
+    FspFileNameSuffix(FileName, &Parent, &Suffix);
+
+    ExAcquireResourceExclusiveLite(&FileNameCache->Resource, TRUE);
+    FspNameCacheInvalidateName(&FileNameCache->Cache,
+        Parent.Buffer, Parent.Length / sizeof(WCHAR),
+        Suffix.Buffer, Suffix.Length / sizeof(WCHAR));
+    ExReleaseResourceLite(&FileNameCache->Resource);
+}
+
+VOID FspFileNameCacheInvalidateParent(FSP_FILE_NAME_CACHE *FileNameCache,
+    PUNICODE_STRING Parent)
+{
+    PAGED_CODE();
+
+    ExAcquireResourceExclusiveLite(&FileNameCache->Resource, TRUE);
+    FspNameCacheInvalidateParent(&FileNameCache->Cache,
+        Parent->Buffer, Parent->Length / sizeof(WCHAR));
+    ExReleaseResourceLite(&FileNameCache->Resource);
+}
+
+VOID FspFileNameCacheInvalidateAll(FSP_FILE_NAME_CACHE *FileNameCache)
+{
+    PAGED_CODE();
+
+    ExAcquireResourceExclusiveLite(&FileNameCache->Resource, TRUE);
+    FspNameCacheInvalidateAll(&FileNameCache->Cache);
+    ExReleaseResourceLite(&FileNameCache->Resource);
+}
@@ -17,16 +17,43 @@
 
 #include <sys/driver.h>
 
+/*
+ * Process buffers are user mode buffers allocated in the address space of a file system
+ * process and reused across requests. Buffers come in a few size classes, so that small
+ * reads/writes do not commit a full FspProcessBufferSizeMax buffer.
+ *
+ * Every process has a "depot" that holds its free buffers and counts the buffers that it
+ * owns. The depot is protected by the global ProcessBufferLock. To keep that lock out of
+ * the fast path every processor also has a small "magazine" that caches free buffers for
+ * a few processes. A magazine is only ever accessed from its own processor (at
+ * DISPATCH_LEVEL), except when a process exits and its buffers are collected; so the
+ * per-processor magazine lock is effectively uncontended.
+ */
+
 #define SafeGetCurrentProcessId()       (PsGetProcessId(PsGetCurrentProcess()))
 
-#define FspProcessBufferCountMax        (2 >= FspProcessorCount ? 2 : (8 <= FspProcessorCount ? 8 : FspProcessorCount))
+#define FspProcessBufferCapacityDefault (2 >= FspProcessorCount ? 2 : (32 <= FspProcessorCount ? 64 : 2 * FspProcessorCount))
 #define ProcessBufferBucketCount        61  /* are you going to have that many file systems? */
+#define ProcessBufferMagazineSlotCount  4
+#define ProcessBufferMagazineSize       4
+
+enum
+{
+    FspProcessBufferClassCount = 3,
+};
+static const ULONG FspProcessBufferClassSize[FspProcessBufferClassCount] =
+{
+    4 * 1024,
+    16 * 1024,
+    FspProcessBufferSizeMax,
+};
 
 typedef struct _FSP_PROCESS_BUFFER_ITEM
 {
     struct _FSP_PROCESS_BUFFER_ITEM *DictNext;
-    struct _FSP_PROCESS_BUFFER_LIST_ENTRY *BufferList;
-    ULONG BufferCount;
+    struct _FSP_PROCESS_BUFFER_LIST_ENTRY *BufferList[FspProcessBufferClassCount];
+    ULONG BufferCount[FspProcessBufferClassCount];
+    ULONG Capacity;
     HANDLE ProcessId;
 } FSP_PROCESS_BUFFER_ITEM;
 
@@ -34,13 +61,38 @@ typedef struct _FSP_PROCESS_BUFFER_LIST_ENTRY
 {
     struct _FSP_PROCESS_BUFFER_LIST_ENTRY *Next;
     PVOID Buffer;
+    ULONG Class;
 } FSP_PROCESS_BUFFER_LIST_ENTRY;
 
+typedef struct
+{
+    HANDLE ProcessId;
+    ULONG Count;
+    ULONG ClassCount[FspProcessBufferClassCount];
+    FSP_PROCESS_BUFFER_LIST_ENTRY *Entries[FspProcessBufferClassCount][ProcessBufferMagazineSize];
+} FSP_PROCESS_BUFFER_MAGAZINE_SLOT;
+
+typedef struct
+{
+    KSPIN_LOCK SpinLock;
+    FSP_PROCESS_BUFFER_MAGAZINE_SLOT Slots[ProcessBufferMagazineSlotCount];
+} FSP_PROCESS_BUFFER_MAGAZINE;
+
 static KSPIN_LOCK ProcessBufferLock;
 static FSP_PROCESS_BUFFER_ITEM *ProcessBufferBuckets[ProcessBufferBucketCount];
+static FSP_PROCESS_BUFFER_MAGAZINE *ProcessBufferMagazines;
 
 static VOID FspProcessBufferNotifyRoutine(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create);
 
+static inline ULONG FspProcessBufferClassIndex(SIZE_T BufferSize)
+{
+    ULONG Class;
+    for (Class = 0; FspProcessBufferClassCount - 1 > Class; Class++)
+        if (FspProcessBufferClassSize[Class] >= BufferSize)
+            break;
+    return Class;
+}
+
 static inline FSP_PROCESS_BUFFER_ITEM *FspProcessBufferLookupItemAtDpcLevel(HANDLE ProcessId)
 {
     FSP_PROCESS_BUFFER_ITEM *Item = 0;
@@ -79,6 +131,102 @@ static inline FSP_PROCESS_BUFFER_ITEM *FspProcessBufferRemoveItemAtDpcLevel(HAND
     return Item;
 }
 
+static inline FSP_PROCESS_BUFFER_MAGAZINE_SLOT *FspProcessBufferMagazineSlot(
+    FSP_PROCESS_BUFFER_MAGAZINE *Magazine, HANDLE ProcessId)
+{
+    return &Magazine->Slots[FspHashMixPointer(ProcessId) % ProcessBufferMagazineSlotCount];
+}
+
+static FSP_PROCESS_BUFFER_LIST_ENTRY *FspProcessBufferMagazinePop(HANDLE ProcessId, ULONG Class)
+{
+    KIRQL Irql;
+    FSP_PROCESS_BUFFER_MAGAZINE *Magazine;
+    FSP_PROCESS_BUFFER_MAGAZINE_SLOT *Slot;
+    FSP_PROCESS_BUFFER_LIST_ENTRY *BufferEntry = 0;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    Magazine = &ProcessBufferMagazines[KeGetCurrentProcessorNumber() % FspProcessorCount];
+    KeAcquireSpinLockAtDpcLevel(&Magazine->SpinLock);
+
+    Slot = FspProcessBufferMagazineSlot(Magazine, ProcessId);
+    if (Slot->ProcessId == ProcessId && 0 != Slot->ClassCount[Class])
+    {
+        BufferEntry = Slot->Entries[Class][--Slot->ClassCount[Class]];
+        if (0 == --Slot->Count)
+            Slot->ProcessId = 0;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Magazine->SpinLock);
+    KeLowerIrql(Irql);
+
+    return BufferEntry;
+}
+
+static BOOLEAN FspProcessBufferMagazinePush(HANDLE ProcessId,
+    FSP_PROCESS_BUFFER_LIST_ENTRY *BufferEntry)
+{
+    KIRQL Irql;
+    FSP_PROCESS_BUFFER_MAGAZINE *Magazine;
+    FSP_PROCESS_BUFFER_MAGAZINE_SLOT *Slot;
+    ULONG Class = BufferEntry->Class;
+    BOOLEAN Result = FALSE;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    Magazine = &ProcessBufferMagazines[KeGetCurrentProcessorNumber() % FspProcessorCount];
+    KeAcquireSpinLockAtDpcLevel(&Magazine->SpinLock);
+
+    Slot = FspProcessBufferMagazineSlot(Magazine, ProcessId);
+    if (0 == Slot->Count)
+        Slot->ProcessId = ProcessId;
+    if (Slot->ProcessId == ProcessId && ProcessBufferMagazineSize > Slot->ClassCount[Class])
+    {
+        Slot->Entries[Class][Slot->ClassCount[Class]++] = BufferEntry;
+        Slot->Count++;
+        Result = TRUE;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Magazine->SpinLock);
+    KeLowerIrql(Irql);
+
+    return Result;
+}
+
+static VOID FspProcessBufferMagazineCollect(HANDLE ProcessId)
+{
+    KIRQL Irql;
+    FSP_PROCESS_BUFFER_MAGAZINE *Magazine;
+    FSP_PROCESS_BUFFER_MAGAZINE_SLOT *Slot;
+    FSP_PROCESS_BUFFER_LIST_ENTRY *BufferList = 0;
+
+    for (ULONG Index = 0; FspProcessorCount > Index; Index++)
+    {
+        Magazine = &ProcessBufferMagazines[Index];
+
+        KeAcquireSpinLock(&Magazine->SpinLock, &Irql);
+
+        Slot = FspProcessBufferMagazineSlot(Magazine, ProcessId);
+        if (Slot->ProcessId == ProcessId)
+        {
+            for (ULONG Class = 0; FspProcessBufferClassCount > Class; Class++)
+                for (ULONG I = 0; Slot->ClassCount[Class] > I; I++)
+                {
+                    Slot->Entries[Class][I]->Next = BufferList;
+                    BufferList = Slot->Entries[Class][I];
+                }
+            RtlZeroMemory(Slot, sizeof *Slot);
+        }
+
+        KeReleaseSpinLock(&Magazine->SpinLock, Irql);
+    }
+
+    /* the process is gone; its virtual memory (and our buffers) went with it */
+    for (FSP_PROCESS_BUFFER_LIST_ENTRY *P = BufferList, *Next; P; P = Next)
+    {
+        Next = P->Next;
+        FspFree(P);
+    }
+}
+
 static inline VOID FspProcessBufferReuseEntry(HANDLE ProcessId,
     FSP_PROCESS_BUFFER_LIST_ENTRY *BufferEntry)
 {
@@ -91,8 +239,8 @@ static inline VOID FspProcessBufferReuseEntry(HANDLE ProcessId,
 
     if (0 != Item)
     {
-        BufferEntry->Next = Item->BufferList;
-        Item->BufferList = BufferEntry;
+        BufferEntry->Next = Item->BufferList[BufferEntry->Class];
+        Item->BufferList[BufferEntry->Class] = BufferEntry;
     }
 
     KeReleaseSpinLock(&ProcessBufferLock, Irql);
@@ -111,14 +259,33 @@ static inline VOID FspProcessBufferReuseEntry(HANDLE ProcessId,
 
 NTSTATUS FspProcessBufferInitialize(VOID)
 {
+    NTSTATUS Result;
+
     KeInitializeSpinLock(&ProcessBufferLock);
 
-    return PsSetCreateProcessNotifyRoutine(FspProcessBufferNotifyRoutine, FALSE);
+    ProcessBufferMagazines = FspAllocNonPaged(sizeof *ProcessBufferMagazines * FspProcessorCount);
+    if (0 == ProcessBufferMagazines)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory(ProcessBufferMagazines, sizeof *ProcessBufferMagazines * FspProcessorCount);
+    for (ULONG Index = 0; FspProcessorCount > Index; Index++)
+        KeInitializeSpinLock(&ProcessBufferMagazines[Index].SpinLock);
+
+    Result = PsSetCreateProcessNotifyRoutine(FspProcessBufferNotifyRoutine, FALSE);
+    if (!NT_SUCCESS(Result))
+    {
+        FspFree(ProcessBufferMagazines);
+        ProcessBufferMagazines = 0;
+    }
+
+    return Result;
 }
 
 VOID FspProcessBufferFinalize(VOID)
 {
     PsSetCreateProcessNotifyRoutine(FspProcessBufferNotifyRoutine, TRUE);
+
+    FspFree(ProcessBufferMagazines);
+    ProcessBufferMagazines = 0;
 }
 
 static VOID FspProcessBufferNotifyRoutine(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create)
@@ -142,40 +309,87 @@ VOID FspProcessBufferCollect(HANDLE ProcessId)
     {
         DEBUGLOG("pid=%ld", (ULONG)(UINT_PTR)ProcessId);
 
-        for (FSP_PROCESS_BUFFER_LIST_ENTRY *P = Item->BufferList, *Next; P; P = Next)
-        {
-            Next = P->Next;
-            FspFree(P);
-        }
+        FspProcessBufferMagazineCollect(ProcessId);
+
+        for (ULONG Class = 0; FspProcessBufferClassCount > Class; Class++)
+            for (FSP_PROCESS_BUFFER_LIST_ENTRY *P = Item->BufferList[Class], *Next; P; P = Next)
+            {
+                Next = P->Next;
+                FspFree(P);
+            }
 
         FspFree(Item);
     }
 }
 
+VOID FspProcessBufferSetCapacity(ULONG Capacity)
+{
+    HANDLE ProcessId = SafeGetCurrentProcessId();
+    KIRQL Irql;
+    FSP_PROCESS_BUFFER_ITEM *Item, *NewItem;
+
+    if (0 == Capacity)
+        return;
+    if (FspProcessBufferCapacityMax < Capacity)
+        Capacity = FspProcessBufferCapacityMax;
+
+    NewItem = FspAllocNonPaged(sizeof *NewItem);
+    if (0 == NewItem)
+        return;
+    RtlZeroMemory(NewItem, sizeof *NewItem);
+
+    KeAcquireSpinLock(&ProcessBufferLock, &Irql);
+
+    Item = FspProcessBufferLookupItemAtDpcLevel(ProcessId);
+
+    if (0 == Item)
+    {
+        Item = NewItem;
+        NewItem = 0;
+        Item->Capacity = Capacity;
+        Item->ProcessId = ProcessId;
+        FspProcessBufferAddItemAtDpcLevel(Item);
+    }
+    else if (Item->Capacity < Capacity)
+        /* multiple volumes in the same process: the largest capacity wins */
+        Item->Capacity = Capacity;
+
+    KeReleaseSpinLock(&ProcessBufferLock, Irql);
+
+    if (0 != NewItem)
+        FspFree(NewItem);
+}
+
 NTSTATUS FspProcessBufferAcquire(SIZE_T BufferSize, PVOID *PBufferCookie, PVOID *PBuffer)
 {
     if (FspProcessBufferSizeMax >= BufferSize)
     {
         HANDLE ProcessId = SafeGetCurrentProcessId();
+        ULONG Class = FspProcessBufferClassIndex(BufferSize);
         KIRQL Irql;
         FSP_PROCESS_BUFFER_ITEM *Item, *NewItem;
         FSP_PROCESS_BUFFER_LIST_ENTRY *BufferEntry = 0;
         BOOLEAN AllocNoReuse;
         NTSTATUS Result;
 
+        /* fast path: per-processor magazine */
+        BufferEntry = FspProcessBufferMagazinePop(ProcessId, Class);
+        if (0 != BufferEntry)
+            goto alloc_buffer;
+
         KeAcquireSpinLock(&ProcessBufferLock, &Irql);
 
         Item = FspProcessBufferLookupItemAtDpcLevel(ProcessId);
 
         if (0 != Item)
         {
-            BufferEntry = Item->BufferList;
+            BufferEntry = Item->BufferList[Class];
             if (0 != BufferEntry)
-                Item->BufferList = BufferEntry->Next;
+                Item->BufferList[Class] = BufferEntry->Next;
         }
 
         AllocNoReuse = 0 == BufferEntry &&
-            (0 != Item && FspProcessBufferCountMax <= Item->BufferCount);
+            (0 != Item && Item->Capacity <= Item->BufferCount[Class]);
 
         KeReleaseSpinLock(&ProcessBufferLock, Irql);
 
@@ -191,6 +405,7 @@ NTSTATUS FspProcessBufferAcquire(SIZE_T BufferSize, PVOID *PBufferCookie, PVOID
             if (0 == BufferEntry)
                 return STATUS_INSUFFICIENT_RESOURCES;
             RtlZeroMemory(BufferEntry, sizeof *BufferEntry);
+            BufferEntry->Class = Class;
 
             NewItem = FspAllocNonPaged(sizeof *NewItem);
             if (0 == NewItem)
@@ -208,12 +423,13 @@ NTSTATUS FspProcessBufferAcquire(SIZE_T BufferSize, PVOID *PBufferCookie, PVOID
             {
                 Item = NewItem;
                 NewItem = 0;
-                Item->BufferCount = 1;
+                Item->BufferCount[Class] = 1;
+                Item->Capacity = FspProcessBufferCapacityDefault;
                 Item->ProcessId = ProcessId;
                 FspProcessBufferAddItemAtDpcLevel(Item);
             }
-            else if (FspProcessBufferCountMax > Item->BufferCount)
-                Item->BufferCount++;
+            else if (Item->Capacity > Item->BufferCount[Class])
+                Item->BufferCount[Class]++;
             else
                 AllocNoReuse = TRUE;
 
@@ -229,9 +445,10 @@ NTSTATUS FspProcessBufferAcquire(SIZE_T BufferSize, PVOID *PBufferCookie, PVOID
             }
         }
 
+    alloc_buffer:
         if (0 == BufferEntry->Buffer)
         {
-            BufferSize = FspProcessBufferSizeMax;
+            BufferSize = FspProcessBufferClassSize[Class];
             Result = ZwAllocateVirtualMemory(ZwCurrentProcess(),
                 &BufferEntry->Buffer, 0, &BufferSize, MEM_COMMIT, PAGE_READWRITE);
             if (!NT_SUCCESS(Result))
@@ -267,7 +484,8 @@ VOID FspProcessBufferRelease(PVOID BufferCookie, PVOID Buffer)
 
         ASSERT(Buffer == BufferEntry->Buffer);
 
-        FspProcessBufferReuseEntry(ProcessId, BufferEntry);
+        if (!FspProcessBufferMagazinePush(ProcessId, BufferEntry))
+            FspProcessBufferReuseEntry(ProcessId, BufferEntry);
     }
     else
     {
@@ -48,8 +48,10 @@ enum
     RequestSafeMdl                      = 1,
     RequestAddress                      = 2,
     RequestProcess                      = 3,
+    RequestDataRing                     = 3,
 };
 FSP_FSCTL_STATIC_ASSERT(RequestCookie == RequestSafeMdl, "");
+FSP_FSCTL_STATIC_ASSERT(RequestProcess == RequestDataRing, "");
 
 static NTSTATUS FspFsvolRead(
     PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
@@ -348,7 +350,32 @@ NTSTATUS FspFsvolReadPrepare(
 {
     PAGED_CODE();
 
-    if (FspReadIrpShouldUseProcessBuffer(Irp, Request->Req.Read.Length))
+    FSP_DATA_RING *DataRing =
+        FspFsvolDeviceExtension(IoGetCurrentIrpStackLocation(Irp)->DeviceObject)->DataRing;
+    ULONG RingIndex;
+    PVOID RingAddress, RingSystemAddress;
+
+    if (0 != DataRing && FspDataRingAcquire(DataRing, Request->Req.Read.Length,
+        &RingIndex, &RingAddress, &RingSystemAddress))
+    {
+        /* the data is copied out of the ring in FspFsvolReadComplete */
+        FspDataRingLeave(DataRing);
+
+        if (0 == MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority))
+        {
+            FspDataRingRelease(DataRing, RingIndex);
+            return STATUS_INSUFFICIENT_RESOURCES; /* something is seriously screwy! */
+        }
+
+        Request->Req.Read.Address = (UINT64)(UINT_PTR)RingAddress;
+
+        FspIopRequestContext(Request, RequestCookie) = (PVOID)(((UINT_PTR)RingIndex << 2) | 2);
+        FspIopRequestContext(Request, RequestAddress) = RingSystemAddress;
+        FspIopRequestContext(Request, RequestDataRing) = DataRing;
+
+        return STATUS_SUCCESS;
+    }
+    else if (FspReadIrpShouldUseProcessBuffer(Irp, Request->Req.Read.Length))
     {
         NTSTATUS Result;
         PVOID Cookie;
@@ -431,7 +458,24 @@ NTSTATUS FspFsvolReadComplete(
     if (Response->IoStatus.Information > Request->Req.Read.Length)
         FSP_RETURN(Result = STATUS_INTERNAL_ERROR);
 
-    if ((UINT_PTR)FspIopRequestContext(Request, RequestCookie) & 1)
+    if ((UINT_PTR)FspIopRequestContext(Request, RequestCookie) & 2)
+    {
+        FSP_DATA_RING *DataRing = FspIopRequestContext(Request, RequestDataRing);
+        PVOID RingSystemAddress = FspIopRequestContext(Request, RequestAddress);
+        PVOID SystemAddress = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+
+        /* the volume may be going away; the ring is no longer mapped once detached */
+        if (!FspDataRingEnter(DataRing))
+        {
+            Irp->IoStatus.Information = 0;
+            FSP_RETURN(Result = STATUS_CANCELLED);
+        }
+
+        ASSERT(0 != RingSystemAddress);
+        RtlCopyMemory(SystemAddress, RingSystemAddress, Response->IoStatus.Information);
+        FspDataRingLeave(DataRing);
+    }
+    else if ((UINT_PTR)FspIopRequestContext(Request, RequestCookie) & 1)
     {
         PVOID Address = FspIopRequestContext(Request, RequestAddress);
         PVOID SystemAddress = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
@@ -495,7 +539,13 @@ static VOID FspFsvolReadNonCachedRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, PV
 
     PIRP Irp = Context[RequestIrp];
 
-    if ((UINT_PTR)Context[RequestCookie] & 1)
+    if ((UINT_PTR)Context[RequestCookie] & 2)
+    {
+        FSP_DATA_RING *DataRing = Context[RequestDataRing];
+
+        FspDataRingRelease(DataRing, (ULONG)((UINT_PTR)Context[RequestCookie] >> 2));
+    }
+    else if ((UINT_PTR)Context[RequestCookie] & 1)
     {
         PVOID Cookie = (PVOID)((UINT_PTR)Context[RequestCookie] & ~1);
         PVOID Address = Context[RequestAddress];
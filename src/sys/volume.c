@@ -102,6 +102,7 @@ static NTSTATUS FspVolumeCreateNoLock(
     NTSTATUS Result;
     PFILE_OBJECT FileObject = IrpSp->FileObject;
     FSP_FSCTL_VOLUME_PARAMS VolumeParams = { 0 };
+    USHORT VolumeParamsSize;
     USHORT PrefixLength = 0;
     GUID Guid;
     UNICODE_STRING DeviceSddl;
@@ -112,12 +113,15 @@ static NTSTATUS FspVolumeCreateNoLock(
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension;
     FSP_CREATE_VOLUME_REGISTER_MUP_WORK_ITEM RegisterMupWorkItem;
 
-    /* check parameters */
-    if (PREFIXW_SIZE + sizeof(FSP_FSCTL_VOLUME_PARAMS) * sizeof(WCHAR) > FileObject->FileName.Length)
+    /* check parameters; VolumeParams from older clients may be shorter than ours */
+    if (PREFIXW_SIZE + FSP_FSCTL_VOLUME_PARAMS_V0_SIZE * sizeof(WCHAR) > FileObject->FileName.Length)
         return STATUS_INVALID_PARAMETER;
+    VolumeParamsSize = (FileObject->FileName.Length - PREFIXW_SIZE) / sizeof(WCHAR);
+    if (sizeof(FSP_FSCTL_VOLUME_PARAMS) < VolumeParamsSize)
+        VolumeParamsSize = sizeof(FSP_FSCTL_VOLUME_PARAMS);
 
-    /* copy the VolumeParams */
-    for (USHORT Index = 0, Length = sizeof(FSP_FSCTL_VOLUME_PARAMS); Length > Index; Index++)
+    /* copy the VolumeParams; fields missing from older clients remain zero (default) */
+    for (USHORT Index = 0, Length = VolumeParamsSize; Length > Index; Index++)
     {
         WCHAR Value = FileObject->FileName.Buffer[PREFIXW_SIZE / sizeof(WCHAR) + Index];
         if (0xF000 != (Value & 0xFF00))
@@ -145,6 +149,26 @@ static NTSTATUS FspVolumeCreateNoLock(
     if (FspFsctlIrpCapacityMinimum > VolumeParams.IrpCapacity ||
         VolumeParams.IrpCapacity > FspFsctlIrpCapacityMaximum)
         VolumeParams.IrpCapacity = FspFsctlIrpCapacityDefault;
+    if (!VolumeParams.VolumeInfoTimeoutValid)
+        VolumeParams.VolumeInfoTimeout = VolumeParams.FileInfoTimeout;
+    if (!VolumeParams.DirInfoTimeoutValid)
+        VolumeParams.DirInfoTimeout = VolumeParams.FileInfoTimeout;
+    if (!VolumeParams.SecurityTimeoutValid)
+        VolumeParams.SecurityTimeout = VolumeParams.FileInfoTimeout;
+    if (!VolumeParams.StreamInfoTimeoutValid)
+        VolumeParams.StreamInfoTimeout = VolumeParams.FileInfoTimeout;
+    VolumeParams.VolumeInfoTimeoutValid = VolumeParams.DirInfoTimeoutValid =
+        VolumeParams.SecurityTimeoutValid = VolumeParams.StreamInfoTimeoutValid = 1;
+    if (0 == VolumeParams.FileInfoTimeout || FspTimeoutInfinity32 == VolumeParams.FileInfoTimeout ||
+        VolumeParams.FileInfoTimeout >= VolumeParams.FileInfoTimeoutMax)
+        /* adaptive FileInfo timeouts only make sense for finite non-zero timeouts */
+        VolumeParams.FileInfoTimeoutMax = 0;
+    if (FspFsctlCacheCapacityMaximum < VolumeParams.SecurityCacheCapacity)
+        VolumeParams.SecurityCacheCapacity = FspFsctlCacheCapacityMaximum;
+    if (FspFsctlCacheCapacityMaximum < VolumeParams.DirInfoCacheCapacity)
+        VolumeParams.DirInfoCacheCapacity = FspFsctlCacheCapacityMaximum;
+    if (FspFsctlCacheCapacityMaximum < VolumeParams.StreamInfoCacheCapacity)
+        VolumeParams.StreamInfoCacheCapacity = FspFsctlCacheCapacityMaximum;
     if (FILE_DEVICE_NETWORK_FILE_SYSTEM == FsctlDeviceObject->DeviceType)
     {
         VolumeParams.Prefix[sizeof VolumeParams.Prefix / sizeof(WCHAR) - 1] = L'\0';
@@ -181,6 +205,9 @@ static NTSTATUS FspVolumeCreateNoLock(
     VolumeParams.AlwaysUseDoubleBuffering = 1;
 #endif
 
+    /* size the process buffer pool of the file system process */
+    FspProcessBufferSetCapacity(VolumeParams.ProcessBufferCapacity);
+
     /* create volume guid */
     Result = FspCreateGuid(&Guid);
     if (!NT_SUCCESS(Result))
@@ -293,6 +320,7 @@ VOID FspVolumeDelete(
     // !PAGED_CODE();
 
     PDEVICE_OBJECT FsvolDeviceObject = IrpSp->FileObject->FsContext2;
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
     FSP_FILE_NODE **FileNodes;
     ULONG FileNodeCount, Index;
     NTSTATUS Result;
@@ -303,6 +331,13 @@ VOID FspVolumeDelete(
     FspVolumeDeleteNoLock(FsctlDeviceObject, Irp, IrpSp);
     FspDeviceGlobalUnlock();
 
+    /*
+     * Unlock the data ring early. If the volume handle was duplicated into another process,
+     * this may be too late; see FspDataRingNotifyRoutine.
+     */
+    if (FsvolDeviceExtension->InitDoneRing)
+        FspDataRingDetach(FsvolDeviceExtension->DataRing);
+
     /*
      * Call MmForceSectionClosed on active files to ensure that Mm removes them from Standby List.
      */
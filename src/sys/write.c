@@ -49,8 +49,10 @@ enum
     RequestSafeMdl                      = 1,
     RequestAddress                      = 2,
     RequestProcess                      = 3,
+    RequestDataRing                     = 3,
 };
 FSP_FSCTL_STATIC_ASSERT(RequestCookie == RequestSafeMdl, "");
+FSP_FSCTL_STATIC_ASSERT(RequestProcess == RequestDataRing, "");
 
 static NTSTATUS FspFsvolWrite(
     PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
@@ -418,7 +420,35 @@ NTSTATUS FspFsvolWritePrepare(
 {
     PAGED_CODE();
 
-    if (FspWriteIrpShouldUseProcessBuffer(Irp, Request->Req.Write.Length))
+    FSP_DATA_RING *DataRing =
+        FspFsvolDeviceExtension(IoGetCurrentIrpStackLocation(Irp)->DeviceObject)->DataRing;
+    ULONG RingIndex;
+    PVOID RingAddress, RingSystemAddress;
+
+    if (0 != DataRing && FspDataRingAcquire(DataRing, Request->Req.Write.Length,
+        &RingIndex, &RingAddress, &RingSystemAddress))
+    {
+        PVOID SystemAddress = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+
+        if (0 == SystemAddress)
+        {
+            FspDataRingLeave(DataRing);
+            FspDataRingRelease(DataRing, RingIndex);
+            return STATUS_INSUFFICIENT_RESOURCES; /* something is seriously screwy! */
+        }
+
+        RtlCopyMemory(RingSystemAddress, SystemAddress, Request->Req.Write.Length);
+        FspDataRingLeave(DataRing);
+
+        Request->Req.Write.Address = (UINT64)(UINT_PTR)RingAddress;
+
+        FspIopRequestContext(Request, RequestCookie) = (PVOID)(((UINT_PTR)RingIndex << 2) | 2);
+        FspIopRequestContext(Request, RequestAddress) = RingSystemAddress;
+        FspIopRequestContext(Request, RequestDataRing) = DataRing;
+
+        return STATUS_SUCCESS;
+    }
+    else if (FspWriteIrpShouldUseProcessBuffer(Irp, Request->Req.Write.Length))
     {
         NTSTATUS Result;
         PVOID Cookie;
@@ -572,7 +602,13 @@ static VOID FspFsvolWriteNonCachedRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, P
 
     PIRP Irp = Context[RequestIrp];
 
-    if ((UINT_PTR)Context[RequestCookie] & 1)
+    if ((UINT_PTR)Context[RequestCookie] & 2)
+    {
+        FSP_DATA_RING *DataRing = Context[RequestDataRing];
+
+        FspDataRingRelease(DataRing, (ULONG)((UINT_PTR)Context[RequestCookie] >> 2));
+    }
+    else if ((UINT_PTR)Context[RequestCookie] & 1)
     {
         PVOID Cookie = (PVOID)((UINT_PTR)Context[RequestCookie] & ~1);
         PVOID Address = Context[RequestAddress];
@@ -51,6 +51,13 @@ for %%a in (%OptMmap%) do (
     call :csv %%a "%fsbench% --mmap=%%a mmap_*"
 )
 
+rem append throughput against file size (MB); memfs has a default MaxFileSize of 16MB
+set OptAppend=1 2 4 8 16
+if X%2==Xbaseline set OptAppend=16
+for %%a in (%OptAppend%) do (
+    call :csv %%a "%fsbench% --append=%%a append_*"
+)
+
 popd
 rmdir fsbench
 
@@ -26,6 +26,8 @@ static ULONG OptRdwrCcCount = 100;
 static ULONG OptRdwrNcCount = 100;
 static ULONG OptMmapFileSize = 4096 * 1024;
 static ULONG OptMmapCount = 100;
+static ULONG OptAppendFileSize = 4096 * 1024;
+static ULONG OptAppendCount = 10;
 
 static void file_create_dotest(ULONG CreateDisposition)
 {
@@ -343,6 +345,79 @@ static void mmap_tests(void)
     TEST(mmap_read_test);
 }
 
+static void append_dotest(ULONG CreateFlags, ULONG FileSize, ULONG BufferSize, ULONG Count)
+{
+    WCHAR FileName[MAX_PATH];
+    HANDLE Handle;
+    BOOL Success;
+    PVOID Buffer;
+    DWORD BytesTransferred;
+
+    Buffer = _aligned_malloc(BufferSize, BufferSize);
+    ASSERT(0 != Buffer);
+    memset(Buffer, 0, BufferSize);
+
+    for (ULONG Index = 0; Count > Index; Index++)
+    {
+        StringCbPrintfW(FileName, sizeof FileName, L"fsbench-file");
+        Handle = CreateFileW(FileName,
+            FILE_APPEND_DATA | SYNCHRONIZE, 0,
+            0,
+            CREATE_NEW,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE | CreateFlags,
+            0);
+        ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+        /* every write extends the file; its cost should not depend on the size of the file */
+        for (ULONG I = 0, N = FileSize / BufferSize; N > I; I++)
+        {
+            Success = WriteFile(Handle, Buffer, BufferSize, &BytesTransferred, 0);
+            ASSERT(Success);
+            ASSERT(BufferSize == BytesTransferred);
+        }
+
+        Success = CloseHandle(Handle);
+        ASSERT(Success);
+    }
+
+    _aligned_free(Buffer);
+}
+static void append_cc_page_test(void)
+{
+    SYSTEM_INFO SystemInfo;
+    GetSystemInfo(&SystemInfo);
+    append_dotest(0,
+        OptAppendFileSize, SystemInfo.dwPageSize, OptAppendCount);
+}
+static void append_cc_large_test(void)
+{
+    SYSTEM_INFO SystemInfo;
+    GetSystemInfo(&SystemInfo);
+    append_dotest(0,
+        OptAppendFileSize, 16 * SystemInfo.dwPageSize, OptAppendCount);
+}
+static void append_nc_page_test(void)
+{
+    SYSTEM_INFO SystemInfo;
+    GetSystemInfo(&SystemInfo);
+    append_dotest(FILE_FLAG_NO_BUFFERING,
+        OptAppendFileSize, SystemInfo.dwPageSize, OptAppendCount);
+}
+static void append_nc_large_test(void)
+{
+    SYSTEM_INFO SystemInfo;
+    GetSystemInfo(&SystemInfo);
+    append_dotest(FILE_FLAG_NO_BUFFERING,
+        OptAppendFileSize, 16 * SystemInfo.dwPageSize, OptAppendCount);
+}
+static void append_tests(void)
+{
+    TEST(append_cc_page_test);
+    TEST(append_cc_large_test);
+    TEST(append_nc_page_test);
+    TEST(append_nc_large_test);
+}
+
 #define rmarg(argv, argc, argi)         \
     argc--,                             \
     memmove(argv + argi, argv + argi + 1, (argc - argi) * sizeof(char *)),\
@@ -353,6 +428,7 @@ int main(int argc, char *argv[])
     TESTSUITE(file_tests);
     TESTSUITE(rdwr_tests);
     TESTSUITE(mmap_tests);
+    TESTSUITE(append_tests);
 
     for (int argi = 1; argc > argi; argi++)
     {
@@ -384,6 +460,12 @@ int main(int argc, char *argv[])
                 OptMmapCount = strtoul(a + sizeof "--mmap=" - 1, 0, 10);
                 rmarg(argv, argc, argi);
             }
+            else if (0 == strncmp("--append=", a, sizeof "--append=" - 1))
+            {
+                /* file size in MB */
+                OptAppendFileSize = strtoul(a + sizeof "--append=" - 1, 0, 10) * 1024 * 1024;
+                rmarg(argv, argc, argi);
+            }
         }
     }
 
@@ -27,6 +27,8 @@
 #define argtos(v)                       if (arge > ++argp) v = *argp; else goto usage
 #define argtol(v)                       if (arge > ++argp) v = wcstol_deflt(*argp, v); else goto usage
 
+static BOOLEAN LatencyDump = FALSE;
+
 static ULONG wcstol_deflt(wchar_t *w, ULONG deflt)
 {
     wchar_t *endp;
@@ -72,6 +74,9 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         case L'i':
             CaseInsensitiveFlags = MemfsCaseInsensitive;
             break;
+        case L'L':
+            LatencyDump = TRUE;
+            break;
         case L'm':
             argtos(MountPoint);
             break;
@@ -186,6 +191,7 @@ usage:
         "    -d DebugFlags       [-1: enable all debug logs]\n"
         "    -D DebugLogFile     [file path; use - for stderr]\n"
         "    -i                  [case insensitive file system]\n"
+        "    -L                  [log operation latencies on stop]\n"
         "    -t FileInfoTimeout  [millis]\n"
         "    -n MaxFileNodes\n"
         "    -s MaxFileSize      [bytes]\n"
@@ -199,11 +205,59 @@ usage:
     return STATUS_UNSUCCESSFUL;
 }
 
+static VOID LatencyLog(FSP_FILE_SYSTEM *FileSystem)
+{
+    static PWSTR KindNames[] =
+    {
+        L"Reserved",
+        L"Create",
+        L"Overwrite",
+        L"Cleanup",
+        L"Close",
+        L"Read",
+        L"Write",
+        L"QueryInformation",
+        L"SetInformation",
+        L"QueryEa",
+        L"SetEa",
+        L"FlushBuffers",
+        L"QueryVolumeInformation",
+        L"SetVolumeInformation",
+        L"QueryDirectory",
+        L"FileSystemControl",
+        L"DeviceControl",
+        L"Shutdown",
+        L"LockControl",
+        L"QuerySecurity",
+        L"SetSecurity",
+        L"QueryStreamInformation",
+    };
+    static FSP_FILE_SYSTEM_LATENCY_HISTOGRAM Histogram;
+
+    for (ULONG Kind = 0; sizeof KindNames / sizeof KindNames[0] > Kind; Kind++)
+    {
+        if (!NT_SUCCESS(FspFileSystemGetLatencyHistogram(FileSystem, Kind, &Histogram)) ||
+            0 == Histogram.Count)
+            continue;
+
+        info(L"%s: count=%I64u mean=%I64uns p50=%I64uns p99=%I64uns p99.9=%I64uns max=%I64uns",
+            KindNames[Kind],
+            Histogram.Count,
+            Histogram.Sum / Histogram.Count,
+            FspFileSystemLatencyHistogramPercentile(&Histogram, 5000),
+            FspFileSystemLatencyHistogramPercentile(&Histogram, 9900),
+            FspFileSystemLatencyHistogramPercentile(&Histogram, 9990),
+            Histogram.Max);
+    }
+}
+
 NTSTATUS SvcStop(FSP_SERVICE *Service)
 {
     MEMFS *Memfs = Service->UserContext;
 
     MemfsStop(Memfs);
+    if (LatencyDump)
+        LatencyLog(MemfsFileSystem(Memfs));
     MemfsDelete(Memfs);
 
     return STATUS_SUCCESS;
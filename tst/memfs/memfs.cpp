@@ -20,8 +20,6 @@
 #include <sddl.h>
 #include <VersionHelpers.h>
 #include <cassert>
-#include <map>
-#include <unordered_map>
 
 #define MEMFS_MAX_PATH                  512
 FSP_FSCTL_STATIC_ASSERT(MEMFS_MAX_PATH > MAX_PATH,
@@ -160,34 +158,325 @@ int MemfsCompareString(PWSTR a, int alen, PWSTR b, int blen, BOOLEAN CaseInsensi
     return res;
 }
 
+/*
+ * Arena
+ *
+ * File nodes and names are carved out of large chunks rather than allocated one at a time
+ * from the CRT heap. Freed blocks are kept in per-size free lists and reused; chunks are
+ * only released when the arena is finalized.
+ */
+
+#define MEMFS_ARENA_CHUNK_SIZE          (64 * 1024)
+#define MEMFS_ARENA_GRANULARITY         16
+#define MEMFS_ARENA_MAX_SIZE            2048
+
+typedef struct _MEMFS_ARENA
+{
+    PVOID Chunks;
+    PUINT8 Next, End;
+    PVOID FreeList[MEMFS_ARENA_MAX_SIZE / MEMFS_ARENA_GRANULARITY];
+} MEMFS_ARENA;
+
+static inline
+PVOID MemfsArenaAlloc(MEMFS_ARENA *Arena, SIZE_T Size)
+{
+    PVOID Block;
+    ULONG Index;
+
+    Size = FSP_FSCTL_ALIGN_UP(Size, MEMFS_ARENA_GRANULARITY);
+    assert(0 < Size && MEMFS_ARENA_MAX_SIZE >= Size);
+    Index = (ULONG)(Size / MEMFS_ARENA_GRANULARITY - 1);
+
+    Block = Arena->FreeList[Index];
+    if (0 != Block)
+    {
+        Arena->FreeList[Index] = *(PVOID *)Block;
+        return Block;
+    }
+
+    if ((SIZE_T)(Arena->End - Arena->Next) < Size)
+    {
+        PUINT8 Chunk = (PUINT8)malloc(MEMFS_ARENA_CHUNK_SIZE);
+        if (0 == Chunk)
+            return 0;
+
+        *(PVOID *)Chunk = Arena->Chunks;
+        Arena->Chunks = Chunk;
+        Arena->Next = Chunk + MEMFS_ARENA_GRANULARITY;
+        Arena->End = Chunk + MEMFS_ARENA_CHUNK_SIZE;
+    }
+
+    Block = Arena->Next;
+    Arena->Next += Size;
+
+    return Block;
+}
+
 static inline
-int MemfsFileNameCompare(PWSTR a, PWSTR b, BOOLEAN CaseInsensitive)
+VOID MemfsArenaFree(MEMFS_ARENA *Arena, PVOID Block, SIZE_T Size)
 {
-    return MemfsCompareString(a, -1, b, -1, CaseInsensitive);
+    ULONG Index;
+
+    Size = FSP_FSCTL_ALIGN_UP(Size, MEMFS_ARENA_GRANULARITY);
+    Index = (ULONG)(Size / MEMFS_ARENA_GRANULARITY - 1);
+
+    *(PVOID *)Block = Arena->FreeList[Index];
+    Arena->FreeList[Index] = Block;
 }
 
 static inline
-BOOLEAN MemfsFileNameHasPrefix(PWSTR a, PWSTR b, BOOLEAN CaseInsensitive)
+VOID MemfsArenaFinalize(MEMFS_ARENA *Arena)
 {
-    int alen = (int)wcslen(a);
-    int blen = (int)wcslen(b);
+    for (PVOID Chunk = Arena->Chunks, NextChunk; 0 != Chunk; Chunk = NextChunk)
+    {
+        NextChunk = *(PVOID *)Chunk;
+        free(Chunk);
+    }
 
-    return alen >= blen && 0 == MemfsCompareString(a, blen, b, blen, CaseInsensitive) &&
-        (alen == blen || (1 == blen && L'\\' == b[0]) ||
-#if defined(MEMFS_NAMED_STREAMS)
-            (L'\\' == a[blen] || L':' == a[blen]));
-#else
-            (L'\\' == a[blen]));
-#endif
+    memset(Arena, 0, sizeof *Arena);
 }
 
+/*
+ * File data
+ *
+ * File data is kept in fixed size pages that are allocated from the large heap when they are
+ * first written. A page table maps a page index to its page; a page that has never been
+ * written (a hole) has no page and reads as zeroes. Extending a file only grows the page
+ * table and never copies file data, so that an append costs O(append) regardless of the size
+ * of the file, and memory tracks the bytes actually written rather than the file size.
+ *
+ * To keep small files small the first page is allocated with the size that is needed and
+ * is doubled as it grows, until it reaches the full page size. Such a head page comes from
+ * the CRT heap, because the large heap rounds every allocation up to its alignment (64K by
+ * default); it moves to the large heap once it reaches the full page size.
+ *
+ * The bytes of an allocated page that lie past the end of file are always zero, so that the
+ * file can be extended again without touching its data.
+ */
+
+#define MEMFS_DATA_PAGE_SHIFT           16
+#define MEMFS_DATA_PAGE_SIZE            (1UL << MEMFS_DATA_PAGE_SHIFT)
+#define MEMFS_DATA_HEAD_MIN_SIZE        (MEMFS_SECTOR_SIZE * MEMFS_SECTORS_PER_ALLOCATION_UNIT)
+
+typedef struct _MEMFS_FILE_DATA
+{
+    PUINT8 *Pages;
+    ULONG PageCount;                    /* page table entries */
+    ULONG HeadSize;                     /* allocated size of Pages[0] */
+    UINT64 AllocatedSize;               /* bytes allocated for data pages */
+} MEMFS_FILE_DATA;
+
+static inline
+ULONG MemfsFileDataPageSize(MEMFS_FILE_DATA *FileData, UINT64 PageIndex)
+{
+    if (FileData->PageCount <= PageIndex || 0 == FileData->Pages[PageIndex])
+        return 0;
+    return 0 == PageIndex ? FileData->HeadSize : MEMFS_DATA_PAGE_SIZE;
+}
+
+static inline
+VOID MemfsFileDataPageFree(MEMFS_FILE_DATA *FileData, UINT64 PageIndex)
+{
+    if (0 == PageIndex && MEMFS_DATA_PAGE_SIZE > FileData->HeadSize)
+        free(FileData->Pages[0]);
+    else
+        LargeHeapFree(FileData->Pages[PageIndex]);
+}
+
+static inline
+VOID MemfsFileDataRead(MEMFS_FILE_DATA *FileData, PVOID Buffer, UINT64 Offset, ULONG Length)
+{
+    PUINT8 P = (PUINT8)Buffer;
+
+    while (0 < Length)
+    {
+        UINT64 PageIndex = Offset >> MEMFS_DATA_PAGE_SHIFT;
+        ULONG PageOffset = (ULONG)(Offset & (MEMFS_DATA_PAGE_SIZE - 1));
+        ULONG ChunkLength = MEMFS_DATA_PAGE_SIZE - PageOffset;
+        ULONG PageSize = MemfsFileDataPageSize(FileData, PageIndex);
+        ULONG CopyLength;
+
+        if (ChunkLength > Length)
+            ChunkLength = Length;
+
+        CopyLength = PageSize > PageOffset ? PageSize - PageOffset : 0;
+        if (CopyLength > ChunkLength)
+            CopyLength = ChunkLength;
+
+        if (0 != CopyLength)
+            memcpy(P, FileData->Pages[PageIndex] + PageOffset, CopyLength);
+        memset(P + CopyLength, 0, ChunkLength - CopyLength);
+
+        P += ChunkLength;
+        Offset += ChunkLength;
+        Length -= ChunkLength;
+    }
+}
+
+static inline
+NTSTATUS MemfsFileDataWrite(MEMFS_FILE_DATA *FileData, PVOID Buffer, UINT64 Offset, ULONG Length)
+{
+    PUINT8 P = (PUINT8)Buffer;
+    UINT64 LastPageIndex;
+
+    if (0 == Length)
+        return STATUS_SUCCESS;
+
+    LastPageIndex = (Offset + Length - 1) >> MEMFS_DATA_PAGE_SHIFT;
+    if (FileData->PageCount <= LastPageIndex)
+    {
+        /* grow geometrically, so that appending page by page copies O(1) entries per page */
+        ULONG PageCount = 0 != FileData->PageCount ? FileData->PageCount : 1;
+        PUINT8 *Pages;
+
+        while (PageCount <= LastPageIndex)
+            PageCount *= 2;
+
+        Pages = (PUINT8 *)realloc(FileData->Pages, PageCount * sizeof Pages[0]);
+        if (0 == Pages)
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        memset(Pages + FileData->PageCount, 0,
+            (PageCount - FileData->PageCount) * sizeof Pages[0]);
+        FileData->Pages = Pages;
+        FileData->PageCount = PageCount;
+    }
+
+    while (0 < Length)
+    {
+        UINT64 PageIndex = Offset >> MEMFS_DATA_PAGE_SHIFT;
+        ULONG PageOffset = (ULONG)(Offset & (MEMFS_DATA_PAGE_SIZE - 1));
+        ULONG ChunkLength = MEMFS_DATA_PAGE_SIZE - PageOffset;
+        ULONG PageSize = MemfsFileDataPageSize(FileData, PageIndex);
+
+        if (ChunkLength > Length)
+            ChunkLength = Length;
+
+        if (PageOffset + ChunkLength > PageSize)
+        {
+            ULONG NewPageSize = MEMFS_DATA_PAGE_SIZE;
+            PUINT8 Page;
+
+            if (0 == PageIndex)
+            {
+                NewPageSize = 0 != PageSize ? PageSize : MEMFS_DATA_HEAD_MIN_SIZE;
+                while (PageOffset + ChunkLength > NewPageSize)
+                    NewPageSize *= 2;
+                if (NewPageSize > MEMFS_DATA_PAGE_SIZE)
+                    NewPageSize = MEMFS_DATA_PAGE_SIZE;
+            }
+
+            if (MEMFS_DATA_PAGE_SIZE > NewPageSize)
+                /* only a head page can be smaller than the full page size */
+                Page = (PUINT8)realloc(FileData->Pages[PageIndex], NewPageSize);
+            else if (0 != PageSize)
+            {
+                /* a head page that reaches the full page size moves to the large heap */
+                Page = (PUINT8)LargeHeapAlloc(NewPageSize);
+                if (0 != Page)
+                {
+                    memcpy(Page, FileData->Pages[PageIndex], PageSize);
+                    free(FileData->Pages[PageIndex]);
+                }
+            }
+            else
+                Page = (PUINT8)LargeHeapAlloc(NewPageSize);
+            if (0 == Page)
+                return STATUS_INSUFFICIENT_RESOURCES;
+
+            /* zero the new part of the page that we are not about to write */
+            if (PageSize < PageOffset)
+                memset(Page + PageSize, 0, PageOffset - PageSize);
+            memset(Page + PageOffset + ChunkLength, 0, NewPageSize - PageOffset - ChunkLength);
+
+            FileData->Pages[PageIndex] = Page;
+            if (0 == PageIndex)
+                FileData->HeadSize = NewPageSize;
+            FileData->AllocatedSize += NewPageSize - PageSize;
+        }
+
+        memcpy(FileData->Pages[PageIndex] + PageOffset, P, ChunkLength);
+
+        P += ChunkLength;
+        Offset += ChunkLength;
+        Length -= ChunkLength;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static inline
+VOID MemfsFileDataTruncate(MEMFS_FILE_DATA *FileData, UINT64 NewSize)
+{
+    UINT64 PageIndex = (NewSize + MEMFS_DATA_PAGE_SIZE - 1) >> MEMFS_DATA_PAGE_SHIFT;
+    ULONG PageOffset = (ULONG)(NewSize & (MEMFS_DATA_PAGE_SIZE - 1));
+    ULONG PageSize;
+
+    for (UINT64 I = PageIndex; FileData->PageCount > I; I++)
+    {
+        FileData->AllocatedSize -= MemfsFileDataPageSize(FileData, I);
+        MemfsFileDataPageFree(FileData, I);
+        FileData->Pages[I] = 0;
+    }
+    if (0 == PageIndex)
+        FileData->HeadSize = 0;
+
+    /* keep the invariant that bytes past the end of file are zero */
+    if (0 != PageOffset)
+    {
+        PageSize = MemfsFileDataPageSize(FileData, NewSize >> MEMFS_DATA_PAGE_SHIFT);
+        if (PageSize > PageOffset)
+            memset(FileData->Pages[NewSize >> MEMFS_DATA_PAGE_SHIFT] + PageOffset, 0,
+                PageSize - PageOffset);
+    }
+
+    if (0 == NewSize)
+    {
+        free(FileData->Pages);
+        FileData->Pages = 0;
+        FileData->PageCount = 0;
+    }
+}
+
+/*
+ * File node map
+ *
+ * A file node stores only its own name (the last path component, or the stream name of a
+ * named stream) and a pointer to its parent (the parent directory, or the main file of a
+ * named stream). Names are interned: equal names share a single reference counted copy.
+ *
+ * Exact lookups go through a hash index keyed by (parent, name); a path is looked up one
+ * component at a time. Every directory also keeps its children (and every file its named
+ * streams) in a treap ordered by name, which provides the ordered enumeration needed by
+ * ReadDirectory. Because a node is keyed by its parent rather than by its full path, a
+ * rename only moves the renamed node; its descendants are not touched.
+ *
+ * The map is modified only under the exclusive operation guard. However Close can delete
+ * nodes (and release their names) at any time, so the arena and the name index are
+ * protected by their own lock.
+ */
+
+#define MEMFS_FILE_NODE_MAP_INITIAL_BUCKET_COUNT 256
+
+typedef struct _MEMFS_NAME
+{
+    struct _MEMFS_NAME *HashNext;
+    ULONG RefCount;
+    UINT32 Hash;
+    UINT16 Length;
+    WCHAR Buffer[1];
+} MEMFS_NAME;
+#define MEMFS_NAME_SIZE(Length)         (sizeof(MEMFS_NAME) + (Length) * sizeof(WCHAR))
+FSP_FSCTL_STATIC_ASSERT(MEMFS_ARENA_MAX_SIZE >= MEMFS_NAME_SIZE(MEMFS_MAX_PATH),
+    "MEMFS_ARENA_MAX_SIZE must be large enough for MEMFS_MAX_PATH names.");
+
 typedef struct _MEMFS_FILE_NODE
 {
-    WCHAR FileName[MEMFS_MAX_PATH];
+    MEMFS_NAME *Name;
     FSP_FSCTL_FILE_INFO FileInfo;
     SIZE_T FileSecuritySize;
     PVOID FileSecurity;
-    PVOID FileData;
+    MEMFS_FILE_DATA FileData;
 #if defined(MEMFS_REPARSE_POINTS)
     SIZE_T ReparseDataSize;
     PVOID ReparseData;
@@ -196,20 +485,32 @@ typedef struct _MEMFS_FILE_NODE
 #if defined(MEMFS_NAMED_STREAMS)
     struct _MEMFS_FILE_NODE *MainFileNode;
 #endif
+    /* file node map */
+    struct _MEMFS_FILE_NODE *Parent;
+    struct _MEMFS_FILE_NODE *HashNext;
+    struct _MEMFS_FILE_NODE *Left, *Right;
+    struct _MEMFS_FILE_NODE *Children;
+#if defined(MEMFS_NAMED_STREAMS)
+    struct _MEMFS_FILE_NODE *Streams;
+#endif
+    UINT32 Hash;
+    BOOLEAN Linked;
 } MEMFS_FILE_NODE;
+FSP_FSCTL_STATIC_ASSERT(MEMFS_ARENA_MAX_SIZE >= sizeof(MEMFS_FILE_NODE),
+    "MEMFS_ARENA_MAX_SIZE must be large enough for MEMFS_FILE_NODE.");
 
-struct MEMFS_FILE_NODE_LESS
+typedef struct _MEMFS_FILE_NODE_MAP
 {
-    MEMFS_FILE_NODE_LESS(BOOLEAN CaseInsensitive) : CaseInsensitive(CaseInsensitive)
-    {
-    }
-    bool operator()(PWSTR a, PWSTR b) const
-    {
-        return 0 > MemfsFileNameCompare(a, b, CaseInsensitive);
-    }
     BOOLEAN CaseInsensitive;
-};
-typedef std::map<PWSTR, MEMFS_FILE_NODE *, MEMFS_FILE_NODE_LESS> MEMFS_FILE_NODE_MAP;
+    MEMFS_FILE_NODE *Root;
+    MEMFS_FILE_NODE **Buckets;
+    ULONG BucketCount;
+    SIZE_T Count;
+    SRWLOCK Lock;
+    MEMFS_ARENA Arena;
+    MEMFS_NAME **NameBuckets;
+    ULONG NameBucketCount, NameCount;
+} MEMFS_FILE_NODE_MAP;
 
 typedef struct _MEMFS
 {
@@ -222,19 +523,138 @@ typedef struct _MEMFS
 } MEMFS;
 
 static inline
-NTSTATUS MemfsFileNodeCreate(PWSTR FileName, MEMFS_FILE_NODE **PFileNode)
+UINT32 MemfsNameHash(PWSTR Name, ULONG Length, BOOLEAN CaseInsensitive)
+{
+    UINT32 Hash = 2166136261;
+    WCHAR C;
+
+    /* we should still be in the C locale; fold like MemfsCompareString */
+    for (ULONG I = 0; Length > I; I++)
+    {
+        C = Name[I];
+        if (CaseInsensitive && L'A' <= C && C <= L'Z')
+            C += L'a' - L'A';
+        Hash = (Hash ^ C) * 16777619;
+    }
+
+    return Hash;
+}
+
+static inline
+VOID MemfsNameIndexGrow(MEMFS_FILE_NODE_MAP *FileNodeMap)
+{
+    ULONG BucketCount = FileNodeMap->NameBucketCount * 2;
+    MEMFS_NAME **Buckets, *Name, *NextName;
+
+    Buckets = (MEMFS_NAME **)calloc(BucketCount, sizeof *Buckets);
+    if (0 == Buckets)
+        return; /* keep the current index; chains just get longer */
+
+    for (ULONG I = 0; FileNodeMap->NameBucketCount > I; I++)
+        for (Name = FileNodeMap->NameBuckets[I]; 0 != Name; Name = NextName)
+        {
+            NextName = Name->HashNext;
+            Name->HashNext = Buckets[Name->Hash & (BucketCount - 1)];
+            Buckets[Name->Hash & (BucketCount - 1)] = Name;
+        }
+
+    free(FileNodeMap->NameBuckets);
+    FileNodeMap->NameBuckets = Buckets;
+    FileNodeMap->NameBucketCount = BucketCount;
+}
+
+static inline
+NTSTATUS MemfsNameIntern(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR Buffer, ULONG Length,
+    MEMFS_NAME **PName)
+{
+    UINT32 Hash = MemfsNameHash(Buffer, Length, FileNodeMap->CaseInsensitive);
+    MEMFS_NAME *Name;
+
+    assert(MEMFS_MAX_PATH >= Length);
+
+    AcquireSRWLockExclusive(&FileNodeMap->Lock);
+
+    for (Name = FileNodeMap->NameBuckets[Hash & (FileNodeMap->NameBucketCount - 1)];
+        0 != Name; Name = Name->HashNext)
+        if (Hash == Name->Hash && Length == Name->Length &&
+            0 == memcmp(Buffer, Name->Buffer, Length * sizeof(WCHAR)))
+        {
+            Name->RefCount++;
+            goto exit;
+        }
+
+    if (FileNodeMap->NameCount >= FileNodeMap->NameBucketCount)
+        MemfsNameIndexGrow(FileNodeMap);
+
+    Name = (MEMFS_NAME *)MemfsArenaAlloc(&FileNodeMap->Arena, MEMFS_NAME_SIZE(Length));
+    if (0 == Name)
+        goto exit;
+
+    Name->RefCount = 1;
+    Name->Hash = Hash;
+    Name->Length = (UINT16)Length;
+    memcpy(Name->Buffer, Buffer, Length * sizeof(WCHAR));
+    Name->Buffer[Length] = L'\0';
+    Name->HashNext = FileNodeMap->NameBuckets[Hash & (FileNodeMap->NameBucketCount - 1)];
+    FileNodeMap->NameBuckets[Hash & (FileNodeMap->NameBucketCount - 1)] = Name;
+    FileNodeMap->NameCount++;
+
+exit:
+    ReleaseSRWLockExclusive(&FileNodeMap->Lock);
+
+    *PName = Name;
+
+    return 0 != Name ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+static inline
+VOID MemfsNameRelease(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_NAME *Name)
+{
+    MEMFS_NAME **PName;
+
+    AcquireSRWLockExclusive(&FileNodeMap->Lock);
+
+    if (0 == --Name->RefCount)
+    {
+        for (PName = &FileNodeMap->NameBuckets[Name->Hash & (FileNodeMap->NameBucketCount - 1)];
+            Name != *PName; PName = &(*PName)->HashNext)
+            ;
+        *PName = Name->HashNext;
+        FileNodeMap->NameCount--;
+
+        MemfsArenaFree(&FileNodeMap->Arena, Name, MEMFS_NAME_SIZE(Name->Length));
+    }
+
+    ReleaseSRWLockExclusive(&FileNodeMap->Lock);
+}
+
+static inline
+NTSTATUS MemfsFileNodeCreate(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR Name, ULONG NameLength,
+    MEMFS_FILE_NODE **PFileNode)
 {
     static UINT64 IndexNumber = 1;
     MEMFS_FILE_NODE *FileNode;
+    NTSTATUS Result;
 
     *PFileNode = 0;
 
-    FileNode = (MEMFS_FILE_NODE *)malloc(sizeof *FileNode);
+    AcquireSRWLockExclusive(&FileNodeMap->Lock);
+    FileNode = (MEMFS_FILE_NODE *)MemfsArenaAlloc(&FileNodeMap->Arena, sizeof *FileNode);
+    ReleaseSRWLockExclusive(&FileNodeMap->Lock);
     if (0 == FileNode)
         return STATUS_INSUFFICIENT_RESOURCES;
 
     memset(FileNode, 0, sizeof *FileNode);
-    wcscpy_s(FileNode->FileName, sizeof FileNode->FileName / sizeof(WCHAR), FileName);
+
+    Result = MemfsNameIntern(FileNodeMap, Name, NameLength, &FileNode->Name);
+    if (!NT_SUCCESS(Result))
+    {
+        AcquireSRWLockExclusive(&FileNodeMap->Lock);
+        MemfsArenaFree(&FileNodeMap->Arena, FileNode, sizeof *FileNode);
+        ReleaseSRWLockExclusive(&FileNodeMap->Lock);
+        return Result;
+    }
+
     FileNode->FileInfo.CreationTime =
     FileNode->FileInfo.LastAccessTime =
     FileNode->FileInfo.LastWriteTime =
@@ -247,14 +667,24 @@ NTSTATUS MemfsFileNodeCreate(PWSTR FileName, MEMFS_FILE_NODE **PFileNode)
 }
 
 static inline
-VOID MemfsFileNodeDelete(MEMFS_FILE_NODE *FileNode)
+VOID MemfsFileNodeDeleteData(MEMFS_FILE_NODE *FileNode)
 {
 #if defined(MEMFS_REPARSE_POINTS)
     free(FileNode->ReparseData);
 #endif
-    LargeHeapFree(FileNode->FileData);
+    MemfsFileDataTruncate(&FileNode->FileData, 0);
     free(FileNode->FileSecurity);
-    free(FileNode);
+}
+
+static inline
+VOID MemfsFileNodeDelete(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
+{
+    MemfsFileNodeDeleteData(FileNode);
+    MemfsNameRelease(FileNodeMap, FileNode->Name);
+
+    AcquireSRWLockExclusive(&FileNodeMap->Lock);
+    MemfsArenaFree(&FileNodeMap->Arena, FileNode, sizeof *FileNode);
+    ReleaseSRWLockExclusive(&FileNodeMap->Lock);
 }
 
 static inline
@@ -264,10 +694,10 @@ VOID MemfsFileNodeReference(MEMFS_FILE_NODE *FileNode)
 }
 
 static inline
-VOID MemfsFileNodeDereference(MEMFS_FILE_NODE *FileNode)
+VOID MemfsFileNodeDereference(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
 {
     if (0 == --FileNode->RefCount)
-        MemfsFileNodeDelete(FileNode);
+        MemfsFileNodeDelete(FileNodeMap, FileNode);
 }
 
 static inline
@@ -289,111 +719,401 @@ VOID MemfsFileNodeGetFileInfo(MEMFS_FILE_NODE *FileNode, FSP_FSCTL_FILE_INFO *Fi
 #endif
 }
 
+static inline
+BOOLEAN MemfsFileNodeIsStream(MEMFS_FILE_NODE *FileNode)
+{
+#if defined(MEMFS_NAMED_STREAMS)
+    return 0 != FileNode->MainFileNode;
+#else
+    return FALSE;
+#endif
+}
+
+static inline
+ULONG MemfsFileNodeGetFileName(MEMFS_FILE_NODE *FileNode, WCHAR FileName[MEMFS_MAX_PATH])
+{
+    MEMFS_FILE_NODE *Node;
+    ULONG Length = 0, Offset;
+
+    for (Node = FileNode; 0 != Node->Parent; Node = Node->Parent)
+        Length += 1 + Node->Name->Length;
+
+    if (0 == Length)
+    {
+        FileName[0] = L'\\';
+        FileName[1] = L'\0';
+        return 1;
+    }
+
+    assert(MEMFS_MAX_PATH > Length);
+    FileName[Length] = L'\0';
+    Offset = Length;
+    for (Node = FileNode; 0 != Node->Parent; Node = Node->Parent)
+    {
+        Offset -= Node->Name->Length;
+        memcpy(FileName + Offset, Node->Name->Buffer, Node->Name->Length * sizeof(WCHAR));
+        FileName[--Offset] = MemfsFileNodeIsStream(Node) ? L':' : L'\\';
+    }
+
+    return Length;
+}
+
+static inline
+int MemfsFileNodeNameCompare(MEMFS_FILE_NODE *FileNode, PWSTR Name, int Length,
+    BOOLEAN CaseInsensitive)
+{
+    return MemfsCompareString(FileNode->Name->Buffer, FileNode->Name->Length,
+        Name, Length, CaseInsensitive);
+}
+
+static inline
+UINT32 MemfsFileNodeKeyHash(MEMFS_FILE_NODE *Parent, BOOLEAN IsStream, UINT32 NameHash)
+{
+    /* file nodes are at least MEMFS_ARENA_GRANULARITY aligned, so the low bit is free */
+    UINT64 Key = ((UINT64)(UINT_PTR)Parent | !!IsStream) * 0x9e3779b97f4a7c15ULL;
+    return (UINT32)(Key >> 32) ^ NameHash;
+}
+
+/*
+ * Treap of children/streams. Ordered by name; heap ordered by a priority derived from the
+ * (already well mixed) key hash.
+ */
+
+static inline
+UINT32 MemfsFileNodeTreePriority(MEMFS_FILE_NODE *FileNode)
+{
+    UINT32 Priority = FileNode->Hash;
+    Priority ^= Priority >> 16;
+    Priority *= 0x85ebca6b;
+    Priority ^= Priority >> 13;
+    Priority *= 0xc2b2ae35;
+    Priority ^= Priority >> 16;
+    return Priority;
+}
+
+static inline
+VOID MemfsFileNodeTreeInsert(MEMFS_FILE_NODE **PTree, MEMFS_FILE_NODE *FileNode,
+    BOOLEAN CaseInsensitive)
+{
+    MEMFS_FILE_NODE *Tree = *PTree, *Pivot;
+
+    if (0 == Tree)
+    {
+        FileNode->Left = FileNode->Right = 0;
+        *PTree = FileNode;
+        return;
+    }
+
+    if (0 > MemfsFileNodeNameCompare(FileNode, Tree->Name->Buffer, Tree->Name->Length,
+        CaseInsensitive))
+    {
+        MemfsFileNodeTreeInsert(&Tree->Left, FileNode, CaseInsensitive);
+        if (MemfsFileNodeTreePriority(Tree->Left) > MemfsFileNodeTreePriority(Tree))
+        {
+            Pivot = Tree->Left;
+            Tree->Left = Pivot->Right;
+            Pivot->Right = Tree;
+            *PTree = Pivot;
+        }
+    }
+    else
+    {
+        MemfsFileNodeTreeInsert(&Tree->Right, FileNode, CaseInsensitive);
+        if (MemfsFileNodeTreePriority(Tree->Right) > MemfsFileNodeTreePriority(Tree))
+        {
+            Pivot = Tree->Right;
+            Tree->Right = Pivot->Left;
+            Pivot->Left = Tree;
+            *PTree = Pivot;
+        }
+    }
+}
+
+static inline
+MEMFS_FILE_NODE *MemfsFileNodeTreeMerge(MEMFS_FILE_NODE *Left, MEMFS_FILE_NODE *Right)
+{
+    if (0 == Left)
+        return Right;
+    if (0 == Right)
+        return Left;
+
+    if (MemfsFileNodeTreePriority(Left) > MemfsFileNodeTreePriority(Right))
+    {
+        Left->Right = MemfsFileNodeTreeMerge(Left->Right, Right);
+        return Left;
+    }
+    else
+    {
+        Right->Left = MemfsFileNodeTreeMerge(Left, Right->Left);
+        return Right;
+    }
+}
+
+static inline
+VOID MemfsFileNodeTreeRemove(MEMFS_FILE_NODE **PTree, MEMFS_FILE_NODE *FileNode,
+    BOOLEAN CaseInsensitive)
+{
+    MEMFS_FILE_NODE *Tree;
+
+    while (FileNode != (Tree = *PTree))
+    {
+        assert(0 != Tree);
+        PTree = 0 > MemfsFileNodeNameCompare(FileNode, Tree->Name->Buffer, Tree->Name->Length,
+            CaseInsensitive) ? &Tree->Left : &Tree->Right;
+    }
+
+    *PTree = MemfsFileNodeTreeMerge(FileNode->Left, FileNode->Right);
+    FileNode->Left = FileNode->Right = 0;
+}
+
+static inline
+BOOLEAN MemfsFileNodeTreeEnumerate(MEMFS_FILE_NODE *Tree, PWSTR Marker, BOOLEAN CaseInsensitive,
+    BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
+{
+    /* enumerate in order all nodes with names greater than Marker */
+    for (; 0 != Tree; Tree = Tree->Right)
+    {
+        if (0 == Marker || 0 < MemfsFileNodeNameCompare(Tree, Marker, -1, CaseInsensitive))
+        {
+            if (!MemfsFileNodeTreeEnumerate(Tree->Left, Marker, CaseInsensitive, EnumFn, Context))
+                return FALSE;
+            if (!EnumFn(Tree, Context))
+                return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static inline
+ULONG MemfsFileNodeTreeMaxLength(MEMFS_FILE_NODE *Tree)
+{
+    /* length of the longest path relative to the owner of the tree */
+    ULONG MaxLength = 0, Length;
+
+    for (; 0 != Tree; Tree = Tree->Right)
+    {
+        Length = MemfsFileNodeTreeMaxLength(Tree->Children);
+#if defined(MEMFS_NAMED_STREAMS)
+        if (Length < MemfsFileNodeTreeMaxLength(Tree->Streams))
+            Length = MemfsFileNodeTreeMaxLength(Tree->Streams);
+#endif
+        Length += 1 + Tree->Name->Length;
+        if (MaxLength < Length)
+            MaxLength = Length;
+
+        Length = MemfsFileNodeTreeMaxLength(Tree->Left);
+        if (MaxLength < Length)
+            MaxLength = Length;
+    }
+
+    return MaxLength;
+}
+
+static inline
+VOID MemfsFileNodeTreeDeleteData(MEMFS_FILE_NODE *Tree)
+{
+    for (; 0 != Tree; Tree = Tree->Right)
+    {
+        MemfsFileNodeTreeDeleteData(Tree->Left);
+        MemfsFileNodeTreeDeleteData(Tree->Children);
+#if defined(MEMFS_NAMED_STREAMS)
+        MemfsFileNodeTreeDeleteData(Tree->Streams);
+#endif
+        MemfsFileNodeDeleteData(Tree);
+    }
+}
+
+static inline
+BOOLEAN MemfsFileNodeMapDumpFn(MEMFS_FILE_NODE *FileNode, PVOID Context)
+{
+    WCHAR FileName[MEMFS_MAX_PATH];
+
+    MemfsFileNodeGetFileName(FileNode, FileName);
+    FspDebugLog("%c %04lx %6lu %S\n",
+        FILE_ATTRIBUTE_DIRECTORY & FileNode->FileInfo.FileAttributes ? 'd' : 'f',
+        (ULONG)FileNode->FileInfo.FileAttributes,
+        (ULONG)FileNode->FileInfo.FileSize,
+        FileName);
+
+#if defined(MEMFS_NAMED_STREAMS)
+    MemfsFileNodeTreeEnumerate(FileNode->Streams, 0, FALSE, MemfsFileNodeMapDumpFn, 0);
+#endif
+    MemfsFileNodeTreeEnumerate(FileNode->Children, 0, FALSE, MemfsFileNodeMapDumpFn, 0);
+
+    return TRUE;
+}
+
 static inline
 VOID MemfsFileNodeMapDump(MEMFS_FILE_NODE_MAP *FileNodeMap)
 {
-    for (MEMFS_FILE_NODE_MAP::iterator p = FileNodeMap->begin(), q = FileNodeMap->end(); p != q; ++p)
-        FspDebugLog("%c %04lx %6lu %S\n",
-            FILE_ATTRIBUTE_DIRECTORY & p->second->FileInfo.FileAttributes ? 'd' : 'f',
-            (ULONG)p->second->FileInfo.FileAttributes,
-            (ULONG)p->second->FileInfo.FileSize,
-            p->second->FileName);
+    if (0 != FileNodeMap->Root)
+        MemfsFileNodeMapDumpFn(FileNodeMap->Root, 0);
 }
 
 static inline
 BOOLEAN MemfsFileNodeMapIsCaseInsensitive(MEMFS_FILE_NODE_MAP *FileNodeMap)
 {
-    return FileNodeMap->key_comp().CaseInsensitive;
+    return FileNodeMap->CaseInsensitive;
 }
 
 static inline
 NTSTATUS MemfsFileNodeMapCreate(BOOLEAN CaseInsensitive, MEMFS_FILE_NODE_MAP **PFileNodeMap)
 {
+    MEMFS_FILE_NODE_MAP *FileNodeMap;
+
     *PFileNodeMap = 0;
-    try
-    {
-        *PFileNodeMap = new MEMFS_FILE_NODE_MAP(MEMFS_FILE_NODE_LESS(CaseInsensitive));
-        return STATUS_SUCCESS;
-    }
-    catch (...)
+
+    FileNodeMap = (MEMFS_FILE_NODE_MAP *)malloc(sizeof *FileNodeMap);
+    if (0 == FileNodeMap)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    memset(FileNodeMap, 0, sizeof *FileNodeMap);
+    FileNodeMap->CaseInsensitive = CaseInsensitive;
+    InitializeSRWLock(&FileNodeMap->Lock);
+    FileNodeMap->BucketCount = FileNodeMap->NameBucketCount =
+        MEMFS_FILE_NODE_MAP_INITIAL_BUCKET_COUNT;
+    FileNodeMap->Buckets = (MEMFS_FILE_NODE **)calloc(
+        FileNodeMap->BucketCount, sizeof FileNodeMap->Buckets[0]);
+    FileNodeMap->NameBuckets = (MEMFS_NAME **)calloc(
+        FileNodeMap->NameBucketCount, sizeof FileNodeMap->NameBuckets[0]);
+    if (0 == FileNodeMap->Buckets || 0 == FileNodeMap->NameBuckets)
     {
+        free(FileNodeMap->NameBuckets);
+        free(FileNodeMap->Buckets);
+        free(FileNodeMap);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
+
+    *PFileNodeMap = FileNodeMap;
+
+    return STATUS_SUCCESS;
 }
 
 static inline
 VOID MemfsFileNodeMapDelete(MEMFS_FILE_NODE_MAP *FileNodeMap)
 {
-    for (MEMFS_FILE_NODE_MAP::iterator p = FileNodeMap->begin(), q = FileNodeMap->end(); p != q; ++p)
-        MemfsFileNodeDelete(p->second);
+    /* nodes and names live in the arena; only their data needs to be freed */
+    MemfsFileNodeTreeDeleteData(FileNodeMap->Root);
 
-    delete FileNodeMap;
+    MemfsArenaFinalize(&FileNodeMap->Arena);
+    free(FileNodeMap->NameBuckets);
+    free(FileNodeMap->Buckets);
+    free(FileNodeMap);
 }
 
 static inline
 SIZE_T MemfsFileNodeMapCount(MEMFS_FILE_NODE_MAP *FileNodeMap)
 {
-    return FileNodeMap->size();
+    return FileNodeMap->Count;
+}
+
+static inline
+MEMFS_FILE_NODE *MemfsFileNodeMapGetChild(MEMFS_FILE_NODE_MAP *FileNodeMap,
+    MEMFS_FILE_NODE *Parent, BOOLEAN IsStream, PWSTR Name, ULONG Length)
+{
+    UINT32 Hash = MemfsFileNodeKeyHash(Parent, IsStream,
+        MemfsNameHash(Name, Length, FileNodeMap->CaseInsensitive));
+    MEMFS_FILE_NODE *FileNode;
+
+    for (FileNode = FileNodeMap->Buckets[Hash & (FileNodeMap->BucketCount - 1)];
+        0 != FileNode; FileNode = FileNode->HashNext)
+        if (Hash == FileNode->Hash && Parent == FileNode->Parent &&
+            !!IsStream == MemfsFileNodeIsStream(FileNode) &&
+            0 == MemfsFileNodeNameCompare(FileNode, Name, (int)Length, FileNodeMap->CaseInsensitive))
+            return FileNode;
+
+    return 0;
+}
+
+static inline
+MEMFS_FILE_NODE *MemfsFileNodeMapLookup(MEMFS_FILE_NODE_MAP *FileNodeMap,
+    PWSTR FileName, ULONG Length)
+{
+    MEMFS_FILE_NODE *FileNode = FileNodeMap->Root;
+    PWSTR P = FileName, EndP = FileName + Length, Q;
+
+    if (EndP > P && L'\\' == *P)
+        P++;
+    if (EndP == P)
+        return FileNode;
+
+    for (;;)
+    {
+        for (Q = P; EndP > Q && L'\\' != *Q; Q++)
+        {
+#if defined(MEMFS_NAMED_STREAMS)
+            if (L':' == *Q)
+                break;
+#endif
+        }
+
+        FileNode = MemfsFileNodeMapGetChild(FileNodeMap, FileNode, FALSE, P, (ULONG)(Q - P));
+        if (0 == FileNode || EndP == Q)
+            return FileNode;
+
+#if defined(MEMFS_NAMED_STREAMS)
+        if (L':' == *Q)
+            return MemfsFileNodeMapGetChild(FileNodeMap, FileNode, TRUE,
+                Q + 1, (ULONG)(EndP - Q - 1));
+#endif
+
+        P = Q + 1;
+    }
 }
 
 static inline
 MEMFS_FILE_NODE *MemfsFileNodeMapGet(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName)
 {
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->find(FileName);
-    if (iter == FileNodeMap->end())
-        return 0;
-    return iter->second;
+    return MemfsFileNodeMapLookup(FileNodeMap, FileName, (ULONG)wcslen(FileName));
 }
 
 #if defined(MEMFS_NAMED_STREAMS)
 static inline
-MEMFS_FILE_NODE *MemfsFileNodeMapGetMain(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName0)
+MEMFS_FILE_NODE *MemfsFileNodeMapGetMain(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName)
 {
-    WCHAR FileName[MEMFS_MAX_PATH];
-    wcscpy_s(FileName, sizeof FileName / sizeof(WCHAR), FileName0);
     PWSTR StreamName = wcschr(FileName, L':');
     if (0 == StreamName)
         return 0;
-    StreamName[0] = L'\0';
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->find(FileName);
-    if (iter == FileNodeMap->end())
-        return 0;
-    return iter->second;
+    return MemfsFileNodeMapLookup(FileNodeMap, FileName, (ULONG)(StreamName - FileName));
 }
 #endif
 
 static inline
-MEMFS_FILE_NODE *MemfsFileNodeMapGetParent(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName0,
+MEMFS_FILE_NODE *MemfsFileNodeMapGetParent(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName,
     PNTSTATUS PResult)
 {
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
-    WCHAR FileName[MEMFS_MAX_PATH];
-    wcscpy_s(FileName, sizeof FileName / sizeof(WCHAR), FileName0);
-    FspPathSuffix(FileName, &Remain, &Suffix, Root);
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->find(Remain);
-    FspPathCombine(FileName, Suffix);
-    if (iter == FileNodeMap->end())
+    MEMFS_FILE_NODE *Parent;
+    PWSTR Suffix = FileName + wcslen(FileName);
+    ULONG Length;
+
+    while (FileName < Suffix && L'\\' != Suffix[-1])
+        Suffix--;
+    Length = (ULONG)(Suffix - FileName);
+    if (1 < Length)
+        Length--;
+
+    Parent = MemfsFileNodeMapLookup(FileNodeMap, FileName, Length);
+    if (0 == Parent)
     {
         *PResult = STATUS_OBJECT_PATH_NOT_FOUND;
         return 0;
     }
-    if (0 == (iter->second->FileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    if (0 == (Parent->FileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
     {
         *PResult = STATUS_NOT_A_DIRECTORY;
         return 0;
     }
-    return iter->second;
+    return Parent;
 }
 
 static inline
 VOID MemfsFileNodeMapTouchParent(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
 {
-    NTSTATUS Result;
-    MEMFS_FILE_NODE *Parent;
-    if (L'\\' == FileNode->FileName[0] && L'\0' == FileNode->FileName[1])
-        return;
-    Parent = MemfsFileNodeMapGetParent(FileNodeMap, FileNode->FileName, &Result);
+    MEMFS_FILE_NODE *Parent = FileNode->Parent;
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->MainFileNode)
+        Parent = FileNode->MainFileNode->Parent;
+#endif
     if (0 == Parent)
         return;
     Parent->FileInfo.LastAccessTime =
@@ -402,100 +1122,137 @@ VOID MemfsFileNodeMapTouchParent(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NO
 }
 
 static inline
-NTSTATUS MemfsFileNodeMapInsert(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
-    PBOOLEAN PInserted)
+VOID MemfsFileNodeMapGrow(MEMFS_FILE_NODE_MAP *FileNodeMap)
 {
-    *PInserted = 0;
-    try
-    {
-        *PInserted = FileNodeMap->insert(MEMFS_FILE_NODE_MAP::value_type(FileNode->FileName, FileNode)).second;
-        if (*PInserted)
+    ULONG BucketCount = FileNodeMap->BucketCount * 2;
+    MEMFS_FILE_NODE **Buckets, *FileNode, *NextFileNode;
+
+    Buckets = (MEMFS_FILE_NODE **)calloc(BucketCount, sizeof *Buckets);
+    if (0 == Buckets)
+        return; /* keep the current index; chains just get longer */
+
+    for (ULONG I = 0; FileNodeMap->BucketCount > I; I++)
+        for (FileNode = FileNodeMap->Buckets[I]; 0 != FileNode; FileNode = NextFileNode)
         {
-            MemfsFileNodeReference(FileNode);
-            MemfsFileNodeMapTouchParent(FileNodeMap, FileNode);
+            NextFileNode = FileNode->HashNext;
+            FileNode->HashNext = Buckets[FileNode->Hash & (BucketCount - 1)];
+            Buckets[FileNode->Hash & (BucketCount - 1)] = FileNode;
         }
-        return STATUS_SUCCESS;
+
+    free(FileNodeMap->Buckets);
+    FileNodeMap->Buckets = Buckets;
+    FileNodeMap->BucketCount = BucketCount;
+}
+
+static inline
+NTSTATUS MemfsFileNodeMapInsert(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *Parent,
+    MEMFS_FILE_NODE *FileNode, PBOOLEAN PInserted)
+{
+    BOOLEAN IsStream = MemfsFileNodeIsStream(FileNode);
+    MEMFS_FILE_NODE **PBucket;
+
+    *PInserted = 0;
+
+    if (0 == Parent)
+    {
+        if (0 != FileNodeMap->Root)
+            return STATUS_SUCCESS;
+        FileNodeMap->Root = FileNode;
     }
-    catch (...)
+    else
     {
-        return STATUS_INSUFFICIENT_RESOURCES;
+        if (0 != MemfsFileNodeMapGetChild(FileNodeMap, Parent, IsStream,
+            FileNode->Name->Buffer, FileNode->Name->Length))
+            return STATUS_SUCCESS;
+
+        if (FileNodeMap->Count >= FileNodeMap->BucketCount)
+            MemfsFileNodeMapGrow(FileNodeMap);
+
+        FileNode->Parent = Parent;
+        FileNode->Hash = MemfsFileNodeKeyHash(Parent, IsStream, FileNode->Name->Hash);
+        PBucket = &FileNodeMap->Buckets[FileNode->Hash & (FileNodeMap->BucketCount - 1)];
+        FileNode->HashNext = *PBucket;
+        *PBucket = FileNode;
+
+        MemfsFileNodeTreeInsert(
+#if defined(MEMFS_NAMED_STREAMS)
+            IsStream ? &Parent->Streams :
+#endif
+            &Parent->Children, FileNode, FileNodeMap->CaseInsensitive);
     }
+
+    FileNode->Linked = TRUE;
+    FileNodeMap->Count++;
+    *PInserted = TRUE;
+
+    MemfsFileNodeReference(FileNode);
+    MemfsFileNodeMapTouchParent(FileNodeMap, FileNode);
+
+    return STATUS_SUCCESS;
 }
 
 static inline
 VOID MemfsFileNodeMapRemove(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
 {
-    if (FileNodeMap->erase(FileNode->FileName))
+    MEMFS_FILE_NODE *Parent = FileNode->Parent, **PBucket;
+
+    if (!FileNode->Linked)
+        return;
+
+    if (0 == Parent)
+        FileNodeMap->Root = 0;
+    else
     {
-        MemfsFileNodeMapTouchParent(FileNodeMap, FileNode);
-        MemfsFileNodeDereference(FileNode);
+        for (PBucket = &FileNodeMap->Buckets[FileNode->Hash & (FileNodeMap->BucketCount - 1)];
+            FileNode != *PBucket; PBucket = &(*PBucket)->HashNext)
+            ;
+        *PBucket = FileNode->HashNext;
+
+        MemfsFileNodeTreeRemove(
+#if defined(MEMFS_NAMED_STREAMS)
+            MemfsFileNodeIsStream(FileNode) ? &Parent->Streams :
+#endif
+            &Parent->Children, FileNode, FileNodeMap->CaseInsensitive);
     }
+
+    FileNodeMap->Count--;
+    MemfsFileNodeMapTouchParent(FileNodeMap, FileNode);
+
+    FileNode->Linked = FALSE;
+    FileNode->Parent = 0;
+    FileNode->HashNext = 0;
+
+    MemfsFileNodeDereference(FileNodeMap, FileNode);
+}
+
+static inline
+VOID MemfsFileNodeMapMove(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
+    MEMFS_FILE_NODE *NewParent, MEMFS_NAME *NewName)
+{
+    BOOLEAN Inserted;
+
+    /* descendants are keyed by their parent (this node) and need not be touched */
+    MemfsFileNodeReference(FileNode);
+    MemfsFileNodeMapRemove(FileNodeMap, FileNode);
+    MemfsNameRelease(FileNodeMap, FileNode->Name);
+    FileNode->Name = NewName;
+    MemfsFileNodeMapInsert(FileNodeMap, NewParent, FileNode, &Inserted);
+    assert(Inserted);
+    MemfsFileNodeDereference(FileNodeMap, FileNode);
 }
 
 static inline
 BOOLEAN MemfsFileNodeMapHasChild(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
 {
-    BOOLEAN Result = FALSE;
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->upper_bound(FileNode->FileName);
-    for (; FileNodeMap->end() != iter; ++iter)
-    {
-#if defined(MEMFS_NAMED_STREAMS)
-        if (0 != wcschr(iter->second->FileName, L':'))
-            continue;
-#endif
-        FspPathSuffix(iter->second->FileName, &Remain, &Suffix, Root);
-        Result = 0 == MemfsFileNameCompare(Remain, FileNode->FileName,
-            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap));
-        FspPathCombine(iter->second->FileName, Suffix);
-        break;
-    }
-    return Result;
+    return 0 != FileNode->Children;
 }
 
 static inline
 BOOLEAN MemfsFileNodeMapEnumerateChildren(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
     PWSTR PrevFileName0, BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
 {
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
-    MEMFS_FILE_NODE_MAP::iterator iter;
-    BOOLEAN IsDirectoryChild;
-    if (0 != PrevFileName0)
-    {
-        WCHAR PrevFileName[MEMFS_MAX_PATH + 256];
-        size_t Length0 = wcslen(FileNode->FileName);
-        size_t Length1 = 1 != Length0 || L'\\' != FileNode->FileName[0];
-        size_t Length2 = wcslen(PrevFileName0);
-        assert(MEMFS_MAX_PATH + 256 > Length0 + Length1 + Length2);
-        memcpy(PrevFileName, FileNode->FileName, Length0 * sizeof(WCHAR));
-        memcpy(PrevFileName + Length0, L"\\", Length1 * sizeof(WCHAR));
-        memcpy(PrevFileName + Length0 + Length1, PrevFileName0, Length2 * sizeof(WCHAR));
-        PrevFileName[Length0 + Length1 + Length2] = L'\0';
-        iter = FileNodeMap->upper_bound(PrevFileName);
-    }
-    else
-        iter = FileNodeMap->upper_bound(FileNode->FileName);
-    for (; FileNodeMap->end() != iter; ++iter)
-    {
-        if (!MemfsFileNameHasPrefix(iter->second->FileName, FileNode->FileName,
-            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap)))
-            break;
-        FspPathSuffix(iter->second->FileName, &Remain, &Suffix, Root);
-        IsDirectoryChild = 0 == MemfsFileNameCompare(Remain, FileNode->FileName,
-            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap));
-#if defined(MEMFS_NAMED_STREAMS)
-        IsDirectoryChild = IsDirectoryChild && 0 == wcschr(Suffix, L':');
-#endif
-        FspPathCombine(iter->second->FileName, Suffix);
-        if (IsDirectoryChild)
-        {
-            if (!EnumFn(iter->second, Context))
-                return FALSE;
-        }
-    }
-    return TRUE;
+    return MemfsFileNodeTreeEnumerate(FileNode->Children, PrevFileName0,
+        FileNodeMap->CaseInsensitive, EnumFn, Context);
 }
 
 #if defined(MEMFS_NAMED_STREAMS)
@@ -503,41 +1260,13 @@ static inline
 BOOLEAN MemfsFileNodeMapEnumerateNamedStreams(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
     BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
 {
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->upper_bound(FileNode->FileName);
-    for (; FileNodeMap->end() != iter; ++iter)
-    {
-        if (!MemfsFileNameHasPrefix(iter->second->FileName, FileNode->FileName,
-            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap)))
-            break;
-        if (L':' != iter->second->FileName[wcslen(FileNode->FileName)])
-            break;
-        if (!EnumFn(iter->second, Context))
-            return FALSE;
-    }
-    return TRUE;
+    return MemfsFileNodeTreeEnumerate(FileNode->Streams, 0,
+        FileNodeMap->CaseInsensitive, EnumFn, Context);
 }
 #endif
 
-static inline
-BOOLEAN MemfsFileNodeMapEnumerateDescendants(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
-    BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
-{
-    WCHAR Root[2] = L"\\";
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->lower_bound(FileNode->FileName);
-    for (; FileNodeMap->end() != iter; ++iter)
-    {
-        if (!MemfsFileNameHasPrefix(iter->second->FileName, FileNode->FileName,
-            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap)))
-            break;
-        if (!EnumFn(iter->second, Context))
-            return FALSE;
-    }
-    return TRUE;
-}
-
 typedef struct _MEMFS_FILE_NODE_MAP_ENUM_CONTEXT
 {
-    BOOLEAN Reference;
     MEMFS_FILE_NODE **FileNodes;
     ULONG Capacity, Count;
 } MEMFS_FILE_NODE_MAP_ENUM_CONTEXT;
@@ -562,8 +1291,6 @@ BOOLEAN MemfsFileNodeMapEnumerateFn(MEMFS_FILE_NODE *FileNode, PVOID Context0)
     }
 
     Context->FileNodes[Context->Count++] = FileNode;
-    if (Context->Reference)
-        MemfsFileNodeReference(FileNode);
 
     return TRUE;
 }
@@ -571,14 +1298,6 @@ BOOLEAN MemfsFileNodeMapEnumerateFn(MEMFS_FILE_NODE *FileNode, PVOID Context0)
 static inline
 VOID MemfsFileNodeMapEnumerateFree(MEMFS_FILE_NODE_MAP_ENUM_CONTEXT *Context)
 {
-    if (Context->Reference)
-    {
-        for (ULONG Index = 0; Context->Count > Index; Index++)
-        {
-            MEMFS_FILE_NODE *FileNode = Context->FileNodes[Index];
-            MemfsFileNodeDereference(FileNode);
-        }
-    }
     free(Context->FileNodes);
 }
 
@@ -690,11 +1409,12 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
     PVOID *PFileNode, FSP_FSCTL_FILE_INFO *FileInfo)
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-#if defined(MEMFS_NAME_NORMALIZATION)
-    WCHAR FileNameBuf[MEMFS_MAX_PATH];
-#endif
     MEMFS_FILE_NODE *FileNode;
     MEMFS_FILE_NODE *ParentNode;
+#if defined(MEMFS_NAMED_STREAMS)
+    MEMFS_FILE_NODE *MainFileNode;
+#endif
+    PWSTR Suffix;
     NTSTATUS Result;
     BOOLEAN Inserted;
 
@@ -718,37 +1438,27 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
     if (AllocationSize > Memfs->MaxFileSize)
         return STATUS_DISK_FULL;
 
-#if defined(MEMFS_NAME_NORMALIZATION)
-    if (MemfsFileNodeMapIsCaseInsensitive(Memfs->FileNodeMap))
-    {
-        WCHAR Root[2] = L"\\";
-        PWSTR Remain, Suffix;
-        size_t RemainLength, BSlashLength, SuffixLength;
-
-        FspPathSuffix(FileName, &Remain, &Suffix, Root);
-        assert(0 == MemfsCompareString(Remain, -1, ParentNode->FileName, -1, TRUE));
-        FspPathCombine(FileName, Suffix);
-
-        RemainLength = wcslen(ParentNode->FileName);
-        BSlashLength = 1 < RemainLength;
-        SuffixLength = wcslen(Suffix);
-        if (MEMFS_MAX_PATH <= RemainLength + BSlashLength + SuffixLength)
-            return STATUS_OBJECT_NAME_INVALID;
-
-        memcpy(FileNameBuf, ParentNode->FileName, RemainLength * sizeof(WCHAR));
-        memcpy(FileNameBuf + RemainLength, L"\\", BSlashLength * sizeof(WCHAR));
-        memcpy(FileNameBuf + RemainLength + BSlashLength, Suffix, (SuffixLength + 1) * sizeof(WCHAR));
-
-        FileName = FileNameBuf;
-    }
+    /*
+     * The file node stores only the last path component (or the stream name). Its full name
+     * is derived from its parent, which makes it normalized when case insensitive.
+     */
+    Suffix = FileName + wcslen(FileName);
+    while (FileName < Suffix && L'\\' != Suffix[-1])
+        Suffix--;
+#if defined(MEMFS_NAMED_STREAMS)
+    MainFileNode = MemfsFileNodeMapGetMain(Memfs->FileNodeMap, FileName);
+    if (0 != MainFileNode)
+        Suffix = wcschr(Suffix, L':') + 1;
+    else if (0 != wcschr(Suffix, L':'))
+        return STATUS_OBJECT_NAME_NOT_FOUND;
 #endif
 
-    Result = MemfsFileNodeCreate(FileName, &FileNode);
+    Result = MemfsFileNodeCreate(Memfs->FileNodeMap, Suffix, (ULONG)wcslen(Suffix), &FileNode);
     if (!NT_SUCCESS(Result))
         return Result;
 
 #if defined(MEMFS_NAMED_STREAMS)
-    FileNode->MainFileNode = MemfsFileNodeMapGetMain(Memfs->FileNodeMap, FileName);
+    FileNode->MainFileNode = MainFileNode;
 #endif
 
     FileNode->FileInfo.FileAttributes = (FileAttributes & FILE_ATTRIBUTE_DIRECTORY) ?
@@ -760,27 +1470,22 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
         FileNode->FileSecurity = (PSECURITY_DESCRIPTOR)malloc(FileNode->FileSecuritySize);
         if (0 == FileNode->FileSecurity)
         {
-            MemfsFileNodeDelete(FileNode);
+            MemfsFileNodeDelete(Memfs->FileNodeMap, FileNode);
             return STATUS_INSUFFICIENT_RESOURCES;
         }
         memcpy(FileNode->FileSecurity, SecurityDescriptor, FileNode->FileSecuritySize);
     }
 
     FileNode->FileInfo.AllocationSize = AllocationSize;
-    if (0 != FileNode->FileInfo.AllocationSize)
-    {
-        FileNode->FileData = LargeHeapAlloc((size_t)FileNode->FileInfo.AllocationSize);
-        if (0 == FileNode->FileData)
-        {
-            MemfsFileNodeDelete(FileNode);
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
-    }
 
-    Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, FileNode, &Inserted);
+    Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap,
+#if defined(MEMFS_NAMED_STREAMS)
+        0 != MainFileNode ? MainFileNode :
+#endif
+        ParentNode, FileNode, &Inserted);
     if (!NT_SUCCESS(Result) || !Inserted)
     {
-        MemfsFileNodeDelete(FileNode);
+        MemfsFileNodeDelete(Memfs->FileNodeMap, FileNode);
         if (NT_SUCCESS(Result))
             Result = STATUS_OBJECT_NAME_COLLISION; /* should not happen! */
         return Result;
@@ -794,10 +1499,12 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
     if (MemfsFileNodeMapIsCaseInsensitive(Memfs->FileNodeMap))
     {
         FSP_FSCTL_OPEN_FILE_INFO *OpenFileInfo = FspFileSystemGetOpenFileInfo(FileInfo);
+        WCHAR NormalizedName[MEMFS_MAX_PATH];
+        ULONG NormalizedNameLength = MemfsFileNodeGetFileName(FileNode, NormalizedName);
 
         wcscpy_s(OpenFileInfo->NormalizedName, OpenFileInfo->NormalizedNameSize / sizeof(WCHAR),
-            FileNode->FileName);
-        OpenFileInfo->NormalizedNameSize = (UINT16)(wcslen(FileNode->FileName) * sizeof(WCHAR));
+            NormalizedName);
+        OpenFileInfo->NormalizedNameSize = (UINT16)(NormalizedNameLength * sizeof(WCHAR));
     }
 #endif
 
@@ -831,10 +1538,12 @@ static NTSTATUS Open(FSP_FILE_SYSTEM *FileSystem,
     if (MemfsFileNodeMapIsCaseInsensitive(Memfs->FileNodeMap))
     {
         FSP_FSCTL_OPEN_FILE_INFO *OpenFileInfo = FspFileSystemGetOpenFileInfo(FileInfo);
+        WCHAR NormalizedName[MEMFS_MAX_PATH];
+        ULONG NormalizedNameLength = MemfsFileNodeGetFileName(FileNode, NormalizedName);
 
         wcscpy_s(OpenFileInfo->NormalizedName, OpenFileInfo->NormalizedNameSize / sizeof(WCHAR),
-            FileNode->FileName);
-        OpenFileInfo->NormalizedNameSize = (UINT16)(wcslen(FileNode->FileName) * sizeof(WCHAR));
+            NormalizedName);
+        OpenFileInfo->NormalizedNameSize = (UINT16)(NormalizedNameLength * sizeof(WCHAR));
     }
 #endif
 
@@ -850,7 +1559,7 @@ static NTSTATUS Overwrite(FSP_FILE_SYSTEM *FileSystem,
     NTSTATUS Result;
 
 #if defined(MEMFS_NAMED_STREAMS)
-    MEMFS_FILE_NODE_MAP_ENUM_CONTEXT Context = { FALSE };
+    MEMFS_FILE_NODE_MAP_ENUM_CONTEXT Context = { 0 };
     ULONG Index;
 
     MemfsFileNodeMapEnumerateNamedStreams(Memfs->FileNodeMap, FileNode,
@@ -870,6 +1579,7 @@ static NTSTATUS Overwrite(FSP_FILE_SYSTEM *FileSystem,
     else
         FileNode->FileInfo.FileAttributes |= FileAttributes | FILE_ATTRIBUTE_ARCHIVE;
 
+    MemfsFileDataTruncate(&FileNode->FileData, 0);
     FileNode->FileInfo.FileSize = 0;
     FileNode->FileInfo.LastAccessTime =
     FileNode->FileInfo.LastWriteTime =
@@ -924,7 +1634,7 @@ static VOID Cleanup(FSP_FILE_SYSTEM *FileSystem,
     if ((Flags & FspCleanupDelete) && !MemfsFileNodeMapHasChild(Memfs->FileNodeMap, FileNode))
     {
 #if defined(MEMFS_NAMED_STREAMS)
-        MEMFS_FILE_NODE_MAP_ENUM_CONTEXT Context = { FALSE };
+        MEMFS_FILE_NODE_MAP_ENUM_CONTEXT Context = { 0 };
         ULONG Index;
 
         MemfsFileNodeMapEnumerateNamedStreams(Memfs->FileNodeMap, FileNode,
@@ -944,7 +1654,7 @@ static VOID Close(FSP_FILE_SYSTEM *FileSystem,
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
 
-    MemfsFileNodeDereference(FileNode);
+    MemfsFileNodeDereference(Memfs->FileNodeMap, FileNode);
 }
 
 static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem,
@@ -961,7 +1671,7 @@ static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem,
     if (EndOffset > FileNode->FileInfo.FileSize)
         EndOffset = FileNode->FileInfo.FileSize;
 
-    memcpy(Buffer, (PUINT8)FileNode->FileData + Offset, (size_t)(EndOffset - Offset));
+    MemfsFileDataRead(&FileNode->FileData, Buffer, Offset, (ULONG)(EndOffset - Offset));
 
     *PBytesTransferred = (ULONG)(EndOffset - Offset);
 
@@ -990,6 +1700,7 @@ static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem,
 #endif
 
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
+    UINT64 FileSize = FileNode->FileInfo.FileSize;
     UINT64 EndOffset;
     NTSTATUS Result;
 
@@ -1014,7 +1725,13 @@ static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem,
         }
     }
 
-    memcpy((PUINT8)FileNode->FileData + Offset, Buffer, (size_t)(EndOffset - Offset));
+    Result = MemfsFileDataWrite(&FileNode->FileData, Buffer, Offset, (ULONG)(EndOffset - Offset));
+    if (!NT_SUCCESS(Result))
+    {
+        if (FileNode->FileInfo.FileSize > FileSize)
+            SetFileSizeInternal(FileSystem, FileNode, FileSize, FALSE);
+        return Result;
+    }
 
     *PBytesTransferred = (ULONG)(EndOffset - Offset);
     MemfsFileNodeGetFileInfo(FileNode, FileInfo);
@@ -1103,15 +1820,13 @@ static NTSTATUS SetFileSizeInternal(FSP_FILE_SYSTEM *FileSystem,
             if (NewSize > Memfs->MaxFileSize)
                 return STATUS_DISK_FULL;
 
-            PVOID FileData = LargeHeapRealloc(FileNode->FileData, (size_t)NewSize);
-            if (0 == FileData && 0 != NewSize)
-                return STATUS_INSUFFICIENT_RESOURCES;
-
-            FileNode->FileData = FileData;
-
-            FileNode->FileInfo.AllocationSize = NewSize;
+            /* no data is allocated here; pages are allocated as they are written */
             if (FileNode->FileInfo.FileSize > NewSize)
+            {
+                MemfsFileDataTruncate(&FileNode->FileData, NewSize);
                 FileNode->FileInfo.FileSize = NewSize;
+            }
+            FileNode->FileInfo.AllocationSize = NewSize;
         }
     }
     else
@@ -1128,9 +1843,9 @@ static NTSTATUS SetFileSizeInternal(FSP_FILE_SYSTEM *FileSystem,
                     return Result;
             }
 
-            if (FileNode->FileInfo.FileSize < NewSize)
-                memset((PUINT8)FileNode->FileData + FileNode->FileInfo.FileSize, 0,
-                    (size_t)(NewSize - FileNode->FileInfo.FileSize));
+            /* extending leaves a hole; truncating frees the pages past the new end of file */
+            if (FileNode->FileInfo.FileSize > NewSize)
+                MemfsFileDataTruncate(&FileNode->FileData, NewSize);
             FileNode->FileInfo.FileSize = NewSize;
         }
     }
@@ -1172,73 +1887,68 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem,
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
-    MEMFS_FILE_NODE *NewFileNode, *DescendantFileNode;
-    MEMFS_FILE_NODE_MAP_ENUM_CONTEXT Context = { TRUE };
-    ULONG Index, FileNameLen, NewFileNameLen;
-    BOOLEAN Inserted;
+    MEMFS_FILE_NODE *NewFileNode, *NewParentNode, *AncestorNode;
+    MEMFS_NAME *NewName;
+    PWSTR NewSuffix;
+    ULONG NewFileNameLen, DescendantLen;
     NTSTATUS Result;
 
     NewFileNode = MemfsFileNodeMapGet(Memfs->FileNodeMap, NewFileName);
     if (0 != NewFileNode && FileNode != NewFileNode)
     {
         if (!ReplaceIfExists)
-        {
-            Result = STATUS_OBJECT_NAME_COLLISION;
-            goto exit;
-        }
+            return STATUS_OBJECT_NAME_COLLISION;
 
         if (NewFileNode->FileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-        {
-            Result = STATUS_ACCESS_DENIED;
-            goto exit;
-        }
+            return STATUS_ACCESS_DENIED;
     }
 
-    MemfsFileNodeMapEnumerateDescendants(Memfs->FileNodeMap, FileNode,
-        MemfsFileNodeMapEnumerateFn, &Context);
+    NewParentNode = MemfsFileNodeMapGetParent(Memfs->FileNodeMap, NewFileName, &Result);
+    if (0 == NewParentNode)
+        return Result;
+
+    /* a directory cannot be moved below itself */
+    for (AncestorNode = NewParentNode; 0 != AncestorNode; AncestorNode = AncestorNode->Parent)
+        if (FileNode == AncestorNode)
+            return STATUS_INVALID_PARAMETER;
 
-    FileNameLen = (ULONG)wcslen(FileNode->FileName);
     NewFileNameLen = (ULONG)wcslen(NewFileName);
-    for (Index = 0; Context.Count > Index; Index++)
-    {
-        DescendantFileNode = Context.FileNodes[Index];
-        if (MEMFS_MAX_PATH <= wcslen(DescendantFileNode->FileName) - FileNameLen + NewFileNameLen)
-        {
-            Result = STATUS_OBJECT_NAME_INVALID;
-            goto exit;
-        }
-    }
+    DescendantLen = MemfsFileNodeTreeMaxLength(FileNode->Children);
+#if defined(MEMFS_NAMED_STREAMS)
+    if (DescendantLen < MemfsFileNodeTreeMaxLength(FileNode->Streams))
+        DescendantLen = MemfsFileNodeTreeMaxLength(FileNode->Streams);
+#endif
+    if (MEMFS_MAX_PATH <= NewFileNameLen + DescendantLen)
+        return STATUS_OBJECT_NAME_INVALID;
+
+    NewSuffix = NewFileName + NewFileNameLen;
+    while (NewFileName < NewSuffix && L'\\' != NewSuffix[-1])
+        NewSuffix--;
+    Result = MemfsNameIntern(Memfs->FileNodeMap, NewSuffix, (ULONG)wcslen(NewSuffix), &NewName);
+    if (!NT_SUCCESS(Result))
+        return Result;
 
-    if (0 != NewFileNode)
+    if (0 != NewFileNode && FileNode != NewFileNode)
     {
+#if defined(MEMFS_NAMED_STREAMS)
+        MEMFS_FILE_NODE_MAP_ENUM_CONTEXT Context = { 0 };
+        ULONG Index;
+
+        MemfsFileNodeMapEnumerateNamedStreams(Memfs->FileNodeMap, NewFileNode,
+            MemfsFileNodeMapEnumerateFn, &Context);
+        for (Index = 0; Context.Count > Index; Index++)
+            MemfsFileNodeMapRemove(Memfs->FileNodeMap, Context.FileNodes[Index]);
+        MemfsFileNodeMapEnumerateFree(&Context);
+#endif
+
         MemfsFileNodeReference(NewFileNode);
         MemfsFileNodeMapRemove(Memfs->FileNodeMap, NewFileNode);
-        MemfsFileNodeDereference(NewFileNode);
+        MemfsFileNodeDereference(Memfs->FileNodeMap, NewFileNode);
     }
 
-    for (Index = 0; Context.Count > Index; Index++)
-    {
-        DescendantFileNode = Context.FileNodes[Index];
-        MemfsFileNodeMapRemove(Memfs->FileNodeMap, DescendantFileNode);
-        memmove(DescendantFileNode->FileName + NewFileNameLen,
-            DescendantFileNode->FileName + FileNameLen,
-            (wcslen(DescendantFileNode->FileName) + 1 - FileNameLen) * sizeof(WCHAR));
-        memcpy(DescendantFileNode->FileName, NewFileName, NewFileNameLen * sizeof(WCHAR));
-        Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, DescendantFileNode, &Inserted);
-        if (!NT_SUCCESS(Result))
-        {
-            FspDebugLog(__FUNCTION__ ": cannot insert into FileNodeMap; aborting\n");
-            abort();
-        }
-        assert(Inserted);
-    }
-
-    Result = STATUS_SUCCESS;
+    MemfsFileNodeMapMove(Memfs->FileNodeMap, FileNode, NewParentNode, NewName);
 
-exit:
-    MemfsFileNodeMapEnumerateFree(&Context);
-
-    return Result;
+    return STATUS_SUCCESS;
 }
 
 static NTSTATUS GetSecurity(FSP_FILE_SYSTEM *FileSystem,
@@ -1314,17 +2024,11 @@ typedef struct _MEMFS_READ_DIRECTORY_CONTEXT
 static BOOLEAN AddDirInfo(MEMFS_FILE_NODE *FileNode, PWSTR FileName,
     PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
 {
-    UINT8 DirInfoBuf[sizeof(FSP_FSCTL_DIR_INFO) + sizeof FileNode->FileName];
+    UINT8 DirInfoBuf[sizeof(FSP_FSCTL_DIR_INFO) + MEMFS_MAX_PATH * sizeof(WCHAR)];
     FSP_FSCTL_DIR_INFO *DirInfo = (FSP_FSCTL_DIR_INFO *)DirInfoBuf;
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
 
     if (0 == FileName)
-    {
-        FspPathSuffix(FileNode->FileName, &Remain, &Suffix, Root);
-        FileName = Suffix;
-        FspPathCombine(FileNode->FileName, Suffix);
-    }
+        FileName = FileNode->Name->Buffer;
 
     memset(DirInfo->Padding, 0, sizeof DirInfo->Padding);
     DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + wcslen(FileName) * sizeof(WCHAR));
@@ -1350,19 +2054,18 @@ static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
     MEMFS_FILE_NODE *ParentNode;
     MEMFS_READ_DIRECTORY_CONTEXT Context;
-    NTSTATUS Result;
 
     Context.Buffer = Buffer;
     Context.Length = Length;
     Context.PBytesTransferred = PBytesTransferred;
 
-    if (L'\0' != FileNode->FileName[1])
+    if (Memfs->FileNodeMap->Root != FileNode)
     {
         /* if this is not the root directory add the dot entries */
 
-        ParentNode = MemfsFileNodeMapGetParent(Memfs->FileNodeMap, FileNode->FileName, &Result);
+        ParentNode = FileNode->Parent;
         if (0 == ParentNode)
-            return Result;
+            return STATUS_OBJECT_PATH_NOT_FOUND;
 
         if (0 == Marker)
         {
@@ -1533,13 +2236,12 @@ typedef struct _MEMFS_GET_STREAM_INFO_CONTEXT
 static BOOLEAN AddStreamInfo(MEMFS_FILE_NODE *FileNode,
     PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
 {
-    UINT8 StreamInfoBuf[sizeof(FSP_FSCTL_STREAM_INFO) + sizeof FileNode->FileName];
+    UINT8 StreamInfoBuf[sizeof(FSP_FSCTL_STREAM_INFO) + MEMFS_MAX_PATH * sizeof(WCHAR)];
     FSP_FSCTL_STREAM_INFO *StreamInfo = (FSP_FSCTL_STREAM_INFO *)StreamInfoBuf;
     PWSTR StreamName;
 
-    StreamName = wcschr(FileNode->FileName, L':');
-    if (0 != StreamName)
-        StreamName++;
+    if (0 != FileNode->MainFileNode)
+        StreamName = FileNode->Name->Buffer;
     else
         StreamName = L"";
 
@@ -1727,7 +2429,7 @@ NTSTATUS MemfsCreateFunnel(
      * Create root directory.
      */
 
-    Result = MemfsFileNodeCreate(L"\\", &RootNode);
+    Result = MemfsFileNodeCreate(Memfs->FileNodeMap, L"", 0, &RootNode);
     if (!NT_SUCCESS(Result))
     {
         MemfsDelete(Memfs);
@@ -1740,7 +2442,7 @@ NTSTATUS MemfsCreateFunnel(
     RootNode->FileSecurity = malloc(RootSecuritySize);
     if (0 == RootNode->FileSecurity)
     {
-        MemfsFileNodeDelete(RootNode);
+        MemfsFileNodeDelete(Memfs->FileNodeMap, RootNode);
         MemfsDelete(Memfs);
         LocalFree(RootSecurity);
         return STATUS_INSUFFICIENT_RESOURCES;
@@ -1748,10 +2450,10 @@ NTSTATUS MemfsCreateFunnel(
     RootNode->FileSecuritySize = RootSecuritySize;
     memcpy(RootNode->FileSecurity, RootSecurity, RootSecuritySize);
 
-    Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, RootNode, &Inserted);
+    Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, 0, RootNode, &Inserted);
     if (!NT_SUCCESS(Result))
     {
-        MemfsFileNodeDelete(RootNode);
+        MemfsFileNodeDelete(Memfs->FileNodeMap, RootNode);
         MemfsDelete(Memfs);
         LocalFree(RootSecurity);
         return Result;
@@ -0,0 +1,364 @@
+/**
+ * @file async-test.cpp
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <winfsp/winfsp.hpp>
+#include <process.h>
+#include <sddl.h>
+#include <strsafe.h>
+#include <utility>
+
+extern "C" {
+#include <tlib/testsuite.h>
+#include "winfsp-tests.h"
+}
+
+/*
+ * A small read-only file system with a root directory and a single file. Read and
+ * ReadDirectory return STATUS_PENDING and are completed from a worker thread through
+ * Fsp::FileSystem::Completion.
+ */
+class AsyncFileSystem : public Fsp::FileSystem
+{
+public:
+    enum
+    {
+        FileSize = 16 * 4096,
+    };
+    AsyncFileSystem() : _SecurityDescriptor(0), _PendingCount(0), _CompleteCount(0), _ErrorCount(0)
+    {
+        SetSectorSize(4096);
+        SetSectorsPerAllocationUnit(1);
+        SetVolumeSerialNumber(0x12345678);
+        SetFileInfoTimeout(0);
+        SetCasePreservedNames(TRUE);
+        SetUnicodeOnDisk(TRUE);
+        SetFileSystemName(L"async");
+        ConvertStringSecurityDescriptorToSecurityDescriptorW(
+            L"O:BAG:BAD:P(A;;FA;;;SY)(A;;FA;;;BA)(A;;FA;;;WD)", SDDL_REVISION_1,
+            &_SecurityDescriptor, 0);
+        for (ULONG I = 0; FileSize > I; I++)
+            _Data[I] = (UINT8)(I % 251);
+    }
+    ~AsyncFileSystem()
+    {
+        LocalFree(_SecurityDescriptor);
+    }
+    static UINT8 DataAt(UINT64 Offset)
+    {
+        return (UINT8)(Offset % 251);
+    }
+    VOID WaitIdle()
+    {
+        while (0 != _PendingCount)
+            Sleep(1);
+    }
+    LONG CompleteCount()
+    {
+        return _CompleteCount;
+    }
+    LONG ErrorCount()
+    {
+        return _ErrorCount;
+    }
+
+protected:
+    NTSTATUS GetVolumeInfo(
+        VOLUME_INFO *VolumeInfo)
+    {
+        VolumeInfo->TotalSize = FileSize;
+        VolumeInfo->FreeSize = 0;
+        VolumeInfo->VolumeLabelLength = 0;
+        return STATUS_SUCCESS;
+    }
+    NTSTATUS GetSecurityByName(
+        PWSTR FileName, PUINT32 PFileAttributes,
+        PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T *PSecurityDescriptorSize)
+    {
+        PVOID FileNode = Lookup(FileName);
+        if (0 == FileNode)
+            return STATUS_OBJECT_NAME_NOT_FOUND;
+        if (0 != PFileAttributes)
+            *PFileAttributes = &_Root == FileNode ?
+                FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_READONLY;
+        if (0 != PSecurityDescriptorSize)
+        {
+            SIZE_T Size = GetSecurityDescriptorLength(_SecurityDescriptor);
+            if (Size > *PSecurityDescriptorSize)
+            {
+                *PSecurityDescriptorSize = Size;
+                return STATUS_BUFFER_OVERFLOW;
+            }
+            *PSecurityDescriptorSize = Size;
+            if (0 != SecurityDescriptor)
+                memcpy(SecurityDescriptor, _SecurityDescriptor, Size);
+        }
+        return STATUS_SUCCESS;
+    }
+    NTSTATUS Open(
+        PWSTR FileName, UINT32 CreateOptions, UINT32 GrantedAccess,
+        FILE_CONTEXT *FileContext, OPEN_FILE_INFO *OpenFileInfo)
+    {
+        PVOID FileNode = Lookup(FileName);
+        if (0 == FileNode)
+            return STATUS_OBJECT_NAME_NOT_FOUND;
+        FileContext->FileNode = FileNode;
+        GetNodeInfo(FileNode, &OpenFileInfo->FileInfo);
+        return STATUS_SUCCESS;
+    }
+    NTSTATUS GetFileInfo(
+        const FILE_CONTEXT *FileContext,
+        FILE_INFO *FileInfo)
+    {
+        GetNodeInfo(FileContext->FileNode, FileInfo);
+        return STATUS_SUCCESS;
+    }
+    NTSTATUS Read(
+        const FILE_CONTEXT *FileContext, PVOID Buffer, UINT64 Offset, ULONG Length,
+        PULONG PBytesTransferred)
+    {
+        if (&_File != FileContext->FileNode)
+            return STATUS_INVALID_DEVICE_REQUEST;
+        ASYNC_REQUEST *Request = new ASYNC_REQUEST;
+        Request->Self = this;
+        Request->IsRead = TRUE;
+        Request->Buffer = Buffer;
+        Request->Offset = Offset;
+        Request->Length = Length;
+        return StartAsync(Request);
+    }
+    NTSTATUS ReadDirectory(
+        const FILE_CONTEXT *FileContext, PWSTR Pattern, PWSTR Marker,
+        PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
+    {
+        if (&_Root != FileContext->FileNode)
+            return STATUS_INVALID_DEVICE_REQUEST;
+        ASYNC_REQUEST *Request = new ASYNC_REQUEST;
+        Request->Self = this;
+        Request->IsRead = FALSE;
+        Request->Buffer = Buffer;
+        Request->Offset = 0;
+        Request->Length = Length;
+        /* Marker is not valid after we return STATUS_PENDING */
+        Request->HasMarker = 0 != Marker;
+        if (0 != Marker)
+            StringCbCopyW(Request->Marker, sizeof Request->Marker, Marker);
+        return StartAsync(Request);
+    }
+
+private:
+    struct ASYNC_REQUEST
+    {
+        AsyncFileSystem *Self;
+        Completion Pending;
+        BOOLEAN IsRead;
+        PVOID Buffer;
+        UINT64 Offset;
+        ULONG Length;
+        BOOLEAN HasMarker;
+        WCHAR Marker[MAX_PATH];
+    };
+    PVOID Lookup(PWSTR FileName)
+    {
+        if (0 == _wcsicmp(L"\\", FileName))
+            return &_Root;
+        if (0 == _wcsicmp(L"\\file0", FileName))
+            return &_File;
+        return 0;
+    }
+    VOID GetNodeInfo(PVOID FileNode, FILE_INFO *FileInfo)
+    {
+        memset(FileInfo, 0, sizeof *FileInfo);
+        if (&_Root == FileNode)
+            FileInfo->FileAttributes = FILE_ATTRIBUTE_DIRECTORY;
+        else
+        {
+            FileInfo->FileAttributes = FILE_ATTRIBUTE_READONLY;
+            FileInfo->AllocationSize = FileInfo->FileSize = FileSize;
+            FileInfo->IndexNumber = 1;
+        }
+    }
+    NTSTATUS StartAsync(ASYNC_REQUEST *Request)
+    {
+        Completion Async = BeginAsync();
+        if (!Async.IsPending())
+        {
+            delete Request;
+            InterlockedIncrement(&_ErrorCount);
+            return STATUS_INVALID_DEVICE_REQUEST;
+        }
+        Request->Pending = std::move(Async);
+        if (Async.IsPending() || !Request->Pending.IsPending())
+            InterlockedIncrement(&_ErrorCount);
+
+        InterlockedIncrement(&_PendingCount);
+        HANDLE Thread = (HANDLE)_beginthreadex(0, 0, CompleteAsync, Request, 0, 0);
+        if (0 != Thread)
+            CloseHandle(Thread);
+        else
+            /* completing before STATUS_PENDING is returned is allowed */
+            CompleteAsync(Request);
+
+        return STATUS_PENDING;
+    }
+    static unsigned __stdcall CompleteAsync(void *Request0)
+    {
+        ASYNC_REQUEST *Request = (ASYNC_REQUEST *)Request0;
+        AsyncFileSystem *Self = Request->Self;
+        ULONG BytesTransferred = 0;
+
+        /* let the dispatcher thread return STATUS_PENDING first */
+        Sleep(10);
+
+        if (Request->IsRead)
+        {
+            if (Request->Offset >= FileSize)
+                Request->Pending.CompleteRead(STATUS_END_OF_FILE, 0);
+            else
+            {
+                BytesTransferred = Request->Length;
+                if (BytesTransferred > FileSize - Request->Offset)
+                    BytesTransferred = (ULONG)(FileSize - Request->Offset);
+                memcpy(Request->Buffer, Self->_Data + Request->Offset, BytesTransferred);
+                Request->Pending.CompleteRead(STATUS_SUCCESS, BytesTransferred);
+            }
+        }
+        else
+        {
+            union
+            {
+                DIR_INFO V;
+                UINT8 B[sizeof(DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
+            } DirInfoBuf;
+            DIR_INFO *DirInfo = &DirInfoBuf.V;
+
+            if (!Request->HasMarker || 0 > _wcsicmp(Request->Marker, L"file0"))
+            {
+                memset(DirInfo, 0, sizeof *DirInfo);
+                DirInfo->Size = (UINT16)(sizeof(DIR_INFO) + 5 * sizeof(WCHAR));
+                Self->GetNodeInfo(&Self->_File, &DirInfo->FileInfo);
+                memcpy(DirInfo->FileNameBuf, L"file0", 5 * sizeof(WCHAR));
+                AddDirInfo(DirInfo, Request->Buffer, Request->Length, &BytesTransferred);
+            }
+            AddDirInfo(0, Request->Buffer, Request->Length, &BytesTransferred);
+            Request->Pending.CompleteReadDirectory(STATUS_SUCCESS, BytesTransferred);
+        }
+
+        if (Request->Pending.IsPending())
+            InterlockedIncrement(&Self->_ErrorCount);
+        InterlockedIncrement(&Self->_CompleteCount);
+
+        delete Request;
+        InterlockedDecrement(&Self->_PendingCount);
+
+        return 0;
+    }
+
+private:
+    PSECURITY_DESCRIPTOR _SecurityDescriptor;
+    UINT8 _Data[FileSize];
+    int _Root, _File;
+    LONG volatile _PendingCount, _CompleteCount, _ErrorCount;
+};
+
+static void async_dotest(void)
+{
+    AsyncFileSystem *FileSystem = new AsyncFileSystem;
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH];
+    WIN32_FIND_DATAW FindData;
+    PUINT8 Buffer;
+    DWORD BytesTransferred;
+    ULONG FileCount;
+    NTSTATUS Result;
+
+    Result = FileSystem->Mount(OptMountPoint);
+    ASSERT(NT_SUCCESS(Result));
+
+    Buffer = (PUINT8)_aligned_malloc(AsyncFileSystem::FileSize, 4096);
+    ASSERT(0 != Buffer);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"\\\\?\\GLOBALROOT%s\\file0",
+        FileSystem->FileSystemHandle()->VolumeName);
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ, FILE_SHARE_READ, 0,
+        OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    memset(Buffer, 0, AsyncFileSystem::FileSize);
+    Success = ReadFile(Handle, Buffer, 4096, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(4096 == BytesTransferred);
+    for (ULONG I = 0; BytesTransferred > I; I++)
+        ASSERT(AsyncFileSystem::DataAt(I) == Buffer[I]);
+
+    memset(Buffer, 0, AsyncFileSystem::FileSize);
+    ASSERT(8192 == SetFilePointer(Handle, 8192, 0, FILE_BEGIN));
+    Success = ReadFile(Handle, Buffer, AsyncFileSystem::FileSize, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(AsyncFileSystem::FileSize - 8192 == BytesTransferred);
+    for (ULONG I = 0; BytesTransferred > I; I++)
+        ASSERT(AsyncFileSystem::DataAt(8192 + I) == Buffer[I]);
+
+    Success = ReadFile(Handle, Buffer, 4096, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(0 == BytesTransferred);
+
+    CloseHandle(Handle);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"\\\\?\\GLOBALROOT%s\\*",
+        FileSystem->FileSystemHandle()->VolumeName);
+
+    FileCount = 0;
+    Handle = FindFirstFileW(FilePath, &FindData);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    do
+    {
+        ASSERT(0 == _wcsicmp(L"file0", FindData.cFileName));
+        ASSERT(AsyncFileSystem::FileSize == FindData.nFileSizeLow);
+        FileCount++;
+    } while (FindNextFileW(Handle, &FindData));
+    ASSERT(ERROR_NO_MORE_FILES == GetLastError());
+    FindClose(Handle);
+    ASSERT(1 == FileCount);
+
+    _aligned_free(Buffer);
+
+    FileSystem->WaitIdle();
+    ASSERT(0 < FileSystem->CompleteCount());
+    ASSERT(0 == FileSystem->ErrorCount());
+
+    FileSystem->Unmount();
+    delete FileSystem;
+}
+
+extern "C" void async_tests(void);
+
+void async_test(void)
+{
+    if (WinFspDiskTests)
+        async_dotest();
+}
+
+void async_tests(void)
+{
+    if (!WinFspDiskTests)
+        return;
+
+    TEST(async_test);
+}
@@ -314,9 +314,518 @@ static void dirbuf_fill_test(void)
         dirbuf_fill_dotest(seed + I, 10000);
 }
 
+static void dirbuf_sorted_dotest(ULONG Count, BOOLEAN Reverse)
+{
+    PVOID DirBuffer = 0;
+    NTSTATUS Result;
+    BOOLEAN Success;
+    union
+    {
+        UINT8 B[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
+        FSP_FSCTL_DIR_INFO D;
+    } DirInfoBuf;
+    FSP_FSCTL_DIR_INFO *DirInfo = &DirInfoBuf.D, *DirInfoEnd;
+    PUINT8 Buffer;
+    ULONG Length, BytesTransferred;
+    WCHAR CurrFileName[MAX_PATH], PrevFileName[MAX_PATH];
+    ULONG N;
+
+    Length = Count * FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof DirInfoBuf) + sizeof(UINT16);
+    Buffer = malloc(Length);
+    ASSERT(0 != Buffer);
+
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectoryBuffer(&DirBuffer, FALSE, &Result);
+    ASSERT(Success);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    for (ULONG I = 0; Count > I; I++)
+    {
+        memset(&DirInfoBuf, 0, sizeof DirInfoBuf);
+
+        N = wsprintfW(DirInfo->FileNameBuf, L"file%08lu", Reverse ? Count - I - 1 : I);
+        DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + N * sizeof(WCHAR));
+
+        Success = FspFileSystemFillDirectoryBuffer(&DirBuffer, DirInfo, &Result);
+        ASSERT(Success);
+        ASSERT(STATUS_SUCCESS == Result);
+    }
+
+    FspFileSystemReleaseDirectoryBuffer(&DirBuffer);
+
+    BytesTransferred = 0;
+    FspFileSystemReadDirectoryBuffer(&DirBuffer, 0, Buffer, Length, &BytesTransferred);
+
+    N = 0;
+    PrevFileName[0] = L'\0';
+    for (
+        DirInfo = (PVOID)Buffer, DirInfoEnd = (PVOID)(Buffer + BytesTransferred);
+        DirInfoEnd > DirInfo && 0 != DirInfo->Size;
+        DirInfo = (PVOID)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size)), N++)
+    {
+        memcpy(CurrFileName, DirInfo->FileNameBuf, DirInfo->Size - sizeof *DirInfo);
+        CurrFileName[(DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR)] = L'\0';
+
+        ASSERT(wcscmp(PrevFileName, CurrFileName) < 0);
+
+        memcpy(PrevFileName, CurrFileName, sizeof CurrFileName);
+    }
+    ASSERT(DirInfoEnd > DirInfo);
+    ASSERT(0 == DirInfo->Size);
+    ASSERT(N == Count);
+
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer);
+
+    free(Buffer);
+}
+
+static void dirbuf_sorted_test(void)
+{
+    dirbuf_sorted_dotest(1, FALSE);
+    dirbuf_sorted_dotest(2, FALSE);
+    dirbuf_sorted_dotest(2, TRUE);
+    dirbuf_sorted_dotest(1000, FALSE);
+    dirbuf_sorted_dotest(1000, TRUE);
+}
+
+static void dirbuf_perf_dotest(ULONG Count)
+{
+    PVOID DirBuffer = 0;
+    NTSTATUS Result;
+    BOOLEAN Success;
+    union
+    {
+        UINT8 B[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
+        FSP_FSCTL_DIR_INFO D;
+    } DirInfoBuf;
+    FSP_FSCTL_DIR_INFO *DirInfo = &DirInfoBuf.D;
+    ULONG N, Timestamp;
+
+    srand((unsigned)time(0));
+
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectoryBuffer(&DirBuffer, FALSE, &Result);
+    ASSERT(Success);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    for (ULONG I = 0; Count > I; I++)
+    {
+        memset(&DirInfoBuf, 0, sizeof DirInfoBuf);
+
+        /* common prefix, so that comparisons go past the precomputed keys */
+        N = wsprintfW(DirInfo->FileNameBuf, L"IMG_%08lx%08lx", rand(), I);
+        DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + N * sizeof(WCHAR));
+
+        Success = FspFileSystemFillDirectoryBuffer(&DirBuffer, DirInfo, &Result);
+        ASSERT(Success);
+        ASSERT(STATUS_SUCCESS == Result);
+    }
+
+    Timestamp = GetTickCount();
+    FspFileSystemReleaseDirectoryBuffer(&DirBuffer);
+    Timestamp = GetTickCount() - Timestamp;
+
+    FspDebugLog(__FUNCTION__ "(Count=%lu): sort %lums\n", Count, Timestamp);
+
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer);
+}
+
+static void dirbuf_perf_10k_test(void)
+{
+    dirbuf_perf_dotest(10000);
+}
+
+static void dirbuf_perf_100k_test(void)
+{
+    dirbuf_perf_dotest(100000);
+}
+
+static void dirbuf_perf_1m_test(void)
+{
+    dirbuf_perf_dotest(1000000);
+}
+
+static void dirbuf_streaming_dotest(ULONG Count, ULONG WindowSize, ULONG Length)
+{
+    PVOID DirBuffer = 0;
+    NTSTATUS Result;
+    union
+    {
+        UINT8 B[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
+        FSP_FSCTL_DIR_INFO D;
+    } DirInfoBuf;
+    FSP_FSCTL_DIR_INFO *DirInfo = &DirInfoBuf.D, *DirInfoEnd;
+    PUINT8 Buffer;
+    ULONG BytesTransferred;
+    WCHAR Marker[MAX_PATH], ExpectFileName[MAX_PATH];
+    BOOLEAN HaveMarker = FALSE, Eof = FALSE;
+    UINT64 Cookie;
+    ULONG N = 0, FillCount = 0, ReadCount = 0;
+
+    Buffer = malloc(Length);
+    ASSERT(0 != Buffer);
+
+    while (!Eof)
+    {
+        if (FspFileSystemAcquireStreamingDirectoryBuffer(&DirBuffer,
+            HaveMarker ? Marker : 0, WindowSize, &Cookie, &Result))
+        {
+            /* entries are produced in reverse order, so that the buffer must not sort them */
+            ASSERT(Count >= Cookie);
+            for (ULONG I = (ULONG)Cookie; Count > I; I++)
+            {
+                memset(&DirInfoBuf, 0, sizeof DirInfoBuf);
+                DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) +
+                    wsprintfW(DirInfo->FileNameBuf, L"file%08lu", Count - I) * sizeof(WCHAR));
+                if (!FspFileSystemFillStreamingDirectoryBuffer(&DirBuffer, DirInfo, I + 1, &Result))
+                    break;
+                FillCount++;
+            }
+            ASSERT(STATUS_SUCCESS == Result);
+
+            FspFileSystemReleaseDirectoryBuffer(&DirBuffer);
+        }
+        else
+            ASSERT(STATUS_SUCCESS == Result);
+
+        BytesTransferred = 0;
+        FspFileSystemReadDirectoryBuffer(&DirBuffer,
+            HaveMarker ? Marker : 0, Buffer, Length, &BytesTransferred);
+        ReadCount++;
+
+        for (
+            DirInfo = (PVOID)Buffer, DirInfoEnd = (PVOID)(Buffer + BytesTransferred);
+            DirInfoEnd > DirInfo;
+            DirInfo = (PVOID)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size)))
+        {
+            if (0 == DirInfo->Size)
+            {
+                Eof = TRUE;
+                break;
+            }
+
+            memcpy(Marker, DirInfo->FileNameBuf, DirInfo->Size - sizeof *DirInfo);
+            Marker[(DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR)] = L'\0';
+            HaveMarker = TRUE;
+
+            wsprintfW(ExpectFileName, L"file%08lu", Count - N);
+            ASSERT(0 == wcscmp(ExpectFileName, Marker));
+            N++;
+        }
+
+        DirInfo = &DirInfoBuf.D;
+    }
+
+    ASSERT(N == Count);
+    ASSERT(FillCount == Count);
+    if (Count * FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof(FSP_FSCTL_DIR_INFO) + 12 * sizeof(WCHAR)) > WindowSize)
+        ASSERT(1 < ReadCount);
+
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer);
+
+    free(Buffer);
+}
+
+static void dirbuf_streaming_test(void)
+{
+    dirbuf_streaming_dotest(0, 4096, 1024);
+    dirbuf_streaming_dotest(1, 4096, 1024);
+    dirbuf_streaming_dotest(1000, 4096, 1024);
+    dirbuf_streaming_dotest(1000, 4096, 16384);
+    dirbuf_streaming_dotest(10000, 65536, 4096);
+}
+
+static void dirbuf_streaming_marker_dotest(ULONG Count, BOOLEAN DeleteMarker)
+{
+    PVOID DirBuffer = 0;
+    NTSTATUS Result;
+    union
+    {
+        UINT8 B[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
+        FSP_FSCTL_DIR_INFO D;
+    } DirInfoBuf;
+    FSP_FSCTL_DIR_INFO *DirInfo = &DirInfoBuf.D, *DirInfoEnd;
+    UINT8 Buffer[1024];
+    ULONG BytesTransferred;
+    WCHAR Marker[MAX_PATH];
+    BOOLEAN HaveMarker = FALSE, Eof = FALSE;
+    PUINT8 Deleted, Seen;
+    UINT64 Cookie;
+    ULONG Round = 0;
+
+    Deleted = calloc(Count, 1);
+    Seen = calloc(Count, 1);
+    ASSERT(0 != Deleted && 0 != Seen);
+
+    while (!Eof)
+    {
+        ASSERT(2 * Count > Round);
+
+        if (HaveMarker && 0 == Round % 3)
+        {
+            /* the window no longer holds the marker (e.g. reset by another enumeration) */
+            FspFileSystemDeleteDirectoryBuffer(&DirBuffer);
+            if (DeleteMarker && 3 == Round)
+                Deleted[wcstoul(Marker + 4, 0, 10)] = 1;
+        }
+
+        if (FspFileSystemAcquireStreamingDirectoryBuffer(&DirBuffer,
+            HaveMarker ? Marker : 0, 4096, &Cookie, &Result))
+        {
+            ASSERT(Count >= Cookie);
+            for (ULONG I = (ULONG)Cookie; Count > I; I++)
+            {
+                if (Deleted[I])
+                    continue;
+                memset(&DirInfoBuf, 0, sizeof DirInfoBuf);
+                DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) +
+                    wsprintfW(DirInfo->FileNameBuf, L"file%08lu", I) * sizeof(WCHAR));
+                if (!FspFileSystemFillStreamingDirectoryBuffer(&DirBuffer, DirInfo, I + 1, &Result))
+                    break;
+            }
+            ASSERT(STATUS_SUCCESS == Result);
+
+            FspFileSystemReleaseDirectoryBuffer(&DirBuffer);
+        }
+        else
+            ASSERT(STATUS_SUCCESS == Result);
+
+        BytesTransferred = 0;
+        FspFileSystemReadDirectoryBuffer(&DirBuffer,
+            HaveMarker ? Marker : 0, Buffer, sizeof Buffer, &BytesTransferred);
+        Round++;
+
+        for (
+            DirInfo = (PVOID)Buffer, DirInfoEnd = (PVOID)(Buffer + BytesTransferred);
+            DirInfoEnd > DirInfo;
+            DirInfo = (PVOID)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size)))
+        {
+            if (0 == DirInfo->Size)
+            {
+                Eof = TRUE;
+                break;
+            }
+
+            memcpy(Marker, DirInfo->FileNameBuf, DirInfo->Size - sizeof *DirInfo);
+            Marker[(DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR)] = L'\0';
+            HaveMarker = TRUE;
+
+            Seen[wcstoul(Marker + 4, 0, 10)]++;
+        }
+
+        DirInfo = &DirInfoBuf.D;
+    }
+
+    /* a deleted marker restarts the listing: entries may be seen twice, but none are lost */
+    for (ULONG I = 0; Count > I; I++)
+        if (Deleted[I])
+            ASSERT(1 == Seen[I]);
+        else if (DeleteMarker)
+            ASSERT(1 <= Seen[I] && Seen[I] <= 2);
+        else
+            ASSERT(1 == Seen[I]);
+
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer);
+
+    free(Seen);
+    free(Deleted);
+}
+
+static void dirbuf_streaming_marker_test(void)
+{
+    dirbuf_streaming_marker_dotest(1000, FALSE);
+    dirbuf_streaming_marker_dotest(1000, TRUE);
+}
+
+static ULONG dirbuf_pattern_fill(PVOID *PDirBuffer, PWSTR Pattern, ULONG Count)
+{
+    NTSTATUS Result;
+    union
+    {
+        UINT8 B[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
+        FSP_FSCTL_DIR_INFO D;
+    } DirInfoBuf;
+    FSP_FSCTL_DIR_INFO *DirInfo = &DirInfoBuf.D;
+    BOOLEAN Success;
+
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectoryBufferEx(PDirBuffer, FALSE, Pattern, &Result);
+    ASSERT(STATUS_SUCCESS == Result);
+    if (!Success)
+        return 0;
+
+    for (ULONG I = Count; 0 < I; I--)
+    {
+        memset(&DirInfoBuf, 0, sizeof DirInfoBuf);
+        DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) +
+            wsprintfW(DirInfo->FileNameBuf, 0 == I % 2 ? L"file%04lu.log" : L"File%04lu.txt", I) *
+            sizeof(WCHAR));
+        Success = FspFileSystemFillDirectoryBuffer(PDirBuffer, DirInfo, &Result);
+        ASSERT(Success);
+        ASSERT(STATUS_SUCCESS == Result);
+    }
+
+    FspFileSystemReleaseDirectoryBuffer(PDirBuffer);
+
+    return Count;
+}
+
+static ULONG dirbuf_pattern_read(PVOID *PDirBuffer, PWSTR Suffix)
+{
+    PUINT8 Buffer;
+    ULONG Length = 1024, BytesTransferred;
+    FSP_FSCTL_DIR_INFO *DirInfo, *DirInfoEnd;
+    WCHAR Marker[MAX_PATH], PrevFileName[MAX_PATH];
+    BOOLEAN HaveMarker = FALSE, Eof = FALSE;
+    ULONG N = 0, SuffixLength = lstrlenW(Suffix), FileNameLength;
+
+    Buffer = malloc(Length);
+    ASSERT(0 != Buffer);
+
+    while (!Eof)
+    {
+        BytesTransferred = 0;
+        FspFileSystemReadDirectoryBuffer(PDirBuffer,
+            HaveMarker ? Marker : 0, Buffer, Length, &BytesTransferred);
+
+        for (
+            DirInfo = (PVOID)Buffer, DirInfoEnd = (PVOID)(Buffer + BytesTransferred);
+            DirInfoEnd > DirInfo;
+            DirInfo = (PVOID)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size)))
+        {
+            if (0 == DirInfo->Size)
+            {
+                Eof = TRUE;
+                break;
+            }
+
+            if (HaveMarker)
+                memcpy(PrevFileName, Marker, sizeof Marker);
+            FileNameLength = (DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR);
+            memcpy(Marker, DirInfo->FileNameBuf, FileNameLength * sizeof(WCHAR));
+            Marker[FileNameLength] = L'\0';
+
+            ASSERT(FileNameLength >= SuffixLength);
+            ASSERT(0 == wcscmp(Marker + FileNameLength - SuffixLength, Suffix));
+            if (HaveMarker)
+                ASSERT(0 > wcscmp(PrevFileName, Marker));
+            HaveMarker = TRUE;
+            N++;
+        }
+    }
+
+    free(Buffer);
+
+    return N;
+}
+
+static void dirbuf_pattern_test(void)
+{
+    PVOID DirBuffer = 0;
+
+    /* case insensitive: the FSD filters again using the handle's case sensitivity */
+    ASSERT(1000 == dirbuf_pattern_fill(&DirBuffer, L"*.LOG", 1000));
+    ASSERT(500 == dirbuf_pattern_read(&DirBuffer, L".log"));
+
+    /* same pattern: the buffer is not refilled */
+    ASSERT(0 == dirbuf_pattern_fill(&DirBuffer, L"*.log", 1000));
+    ASSERT(500 == dirbuf_pattern_read(&DirBuffer, L".log"));
+
+    /* different pattern: the buffer is refilled */
+    ASSERT(1000 == dirbuf_pattern_fill(&DirBuffer, L"FILE0??1.TXT", 1000));
+    ASSERT(100 == dirbuf_pattern_read(&DirBuffer, L"1.txt"));
+    ASSERT(1000 == dirbuf_pattern_fill(&DirBuffer, L"<.txt", 1000));
+    ASSERT(500 == dirbuf_pattern_read(&DirBuffer, L".txt"));
+
+    /* match all */
+    ASSERT(1000 == dirbuf_pattern_fill(&DirBuffer, L"*", 1000));
+    ASSERT(1000 == dirbuf_pattern_read(&DirBuffer, L""));
+    ASSERT(0 == dirbuf_pattern_fill(&DirBuffer, 0, 1000));
+    ASSERT(1000 == dirbuf_pattern_read(&DirBuffer, L""));
+
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer);
+}
+
+static void dirbuf_pattern_streaming_test(void)
+{
+    PVOID DirBuffer = 0;
+    NTSTATUS Result;
+    union
+    {
+        UINT8 B[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
+        FSP_FSCTL_DIR_INFO D;
+    } DirInfoBuf;
+    FSP_FSCTL_DIR_INFO *DirInfo = &DirInfoBuf.D, *DirInfoEnd;
+    UINT8 Buffer[1024];
+    ULONG BytesTransferred, Count = 10000;
+    WCHAR Marker[MAX_PATH];
+    BOOLEAN HaveMarker = FALSE, Eof = FALSE;
+    UINT64 Cookie;
+    ULONG N = 0;
+
+    while (!Eof)
+    {
+        if (FspFileSystemAcquireStreamingDirectoryBufferEx(&DirBuffer,
+            HaveMarker ? Marker : 0, L"*7", 4096, &Cookie, &Result))
+        {
+            ASSERT(Count >= Cookie);
+            for (ULONG I = (ULONG)Cookie; Count > I; I++)
+            {
+                memset(&DirInfoBuf, 0, sizeof DirInfoBuf);
+                DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) +
+                    wsprintfW(DirInfo->FileNameBuf, L"file%08lu", I) * sizeof(WCHAR));
+                if (!FspFileSystemFillStreamingDirectoryBuffer(&DirBuffer, DirInfo, I + 1, &Result))
+                    break;
+            }
+            ASSERT(STATUS_SUCCESS == Result);
+
+            FspFileSystemReleaseDirectoryBuffer(&DirBuffer);
+        }
+        else
+            ASSERT(STATUS_SUCCESS == Result);
+
+        BytesTransferred = 0;
+        FspFileSystemReadDirectoryBuffer(&DirBuffer,
+            HaveMarker ? Marker : 0, Buffer, sizeof Buffer, &BytesTransferred);
+
+        for (
+            DirInfo = (PVOID)Buffer, DirInfoEnd = (PVOID)(Buffer + BytesTransferred);
+            DirInfoEnd > DirInfo;
+            DirInfo = (PVOID)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size)))
+        {
+            if (0 == DirInfo->Size)
+            {
+                Eof = TRUE;
+                break;
+            }
+
+            memcpy(Marker, DirInfo->FileNameBuf, DirInfo->Size - sizeof *DirInfo);
+            Marker[(DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR)] = L'\0';
+            HaveMarker = TRUE;
+
+            ASSERT(N * 10 + 7 == wcstoul(Marker + 4, 0, 10));
+            N++;
+        }
+
+        DirInfo = &DirInfoBuf.D;
+    }
+
+    ASSERT(Count / 10 == N);
+
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer);
+}
+
 void dirbuf_tests(void)
 {
     TEST(dirbuf_empty_test);
     TEST(dirbuf_dots_test);
     TEST(dirbuf_fill_test);
+    TEST(dirbuf_sorted_test);
+    TEST(dirbuf_streaming_test);
+    TEST(dirbuf_streaming_marker_test);
+    TEST(dirbuf_pattern_test);
+    TEST(dirbuf_pattern_streaming_test);
+    TEST_OPT(dirbuf_perf_10k_test);
+    TEST_OPT(dirbuf_perf_100k_test);
+    TEST_OPT(dirbuf_perf_1m_test);
 }
@@ -0,0 +1,297 @@
+/**
+ * @file dispatcher-test.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <winfsp/winfsp.h>
+#include <tlib/testsuite.h>
+#include <time.h>
+
+#include "winfsp-tests.h"
+
+/*
+ * The dispatcher tests replace the FSD with a replay transact function. The replay
+ * transact function hands out a recorded stream of requests and checks the responses
+ * that the dispatcher sends back.
+ */
+static struct
+{
+    CRITICAL_SECTION Lock;
+    FSP_FSCTL_TRANSACT_REQ **Requests;
+    ULONG RequestCount, RequestIndex;
+    PUINT8 Responded;
+    ULONG ResponseCount, BogusResponseCount;
+    ULONG RoundTripCount, BatchRoundTripCount;
+    ULONG OperationDelay;
+    BOOLEAN DrainPool;
+    ULONG IdleRoundCount;
+} DispatcherReplay;
+
+static NTSTATUS dispatcher_replay_transact(FSP_FILE_SYSTEM *FileSystem,
+    PVOID ResponseBuf, SIZE_T ResponseBufSize,
+    PVOID RequestBuf, SIZE_T *PRequestBufSize,
+    BOOLEAN Batch)
+{
+    FSP_FSCTL_TRANSACT_RSP *Response, *NextResponse;
+    FSP_FSCTL_TRANSACT_REQ *Request, *RecordedRequest;
+    FSP_FILE_SYSTEM_DISPATCHER_STATISTICS Statistics;
+    PUINT8 BufferEnd;
+    ULONG Index;
+    NTSTATUS Result;
+
+    EnterCriticalSection(&DispatcherReplay.Lock);
+
+    Response = ResponseBuf;
+    BufferEnd = (PUINT8)ResponseBuf + ResponseBufSize;
+    for (;;)
+    {
+        NextResponse = FspFsctlTransactConsumeResponse(Response, BufferEnd);
+        if (0 == NextResponse)
+            break;
+
+        Index = (ULONG)(Response->Hint - 1);
+        if (DispatcherReplay.RequestCount > Index && !DispatcherReplay.Responded[Index] &&
+            DispatcherReplay.Requests[Index]->Kind == Response->Kind &&
+            STATUS_SUCCESS == Response->IoStatus.Status &&
+            DispatcherReplay.Requests[Index]->Size == Response->IoStatus.Information)
+        {
+            DispatcherReplay.Responded[Index] = 1;
+            DispatcherReplay.ResponseCount++;
+        }
+        else
+            DispatcherReplay.BogusResponseCount++;
+
+        Response = NextResponse;
+    }
+
+    if (0 == PRequestBufSize)
+    {
+        Result = STATUS_SUCCESS;
+        goto exit;
+    }
+
+    if (DispatcherReplay.RequestCount <= DispatcherReplay.RequestIndex)
+    {
+        if (DispatcherReplay.DrainPool && 10000 > DispatcherReplay.IdleRoundCount)
+        {
+            /* simulate transact timeouts until the adaptive threads have exited */
+            FspFileSystemGetDispatcherStatistics(FileSystem, &Statistics);
+            if (Statistics.ThreadCount > Statistics.ThreadCountMin)
+            {
+                DispatcherReplay.IdleRoundCount++;
+                LeaveCriticalSection(&DispatcherReplay.Lock);
+                Sleep(1);
+                *PRequestBufSize = 0;
+                return STATUS_SUCCESS;
+            }
+        }
+
+        /* end of recorded stream; stop the dispatcher */
+        *PRequestBufSize = 0;
+        Result = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    DispatcherReplay.RoundTripCount++;
+    if (Batch)
+        DispatcherReplay.BatchRoundTripCount++;
+
+    /* pack requests the same way that the FSD does */
+    Request = RequestBuf;
+    BufferEnd = (PUINT8)RequestBuf + *PRequestBufSize;
+    while (DispatcherReplay.RequestCount > DispatcherReplay.RequestIndex &&
+        FspFsctlTransactCanProduceRequest(Request, BufferEnd))
+    {
+        RecordedRequest = DispatcherReplay.Requests[DispatcherReplay.RequestIndex++];
+        memcpy(Request, RecordedRequest, RecordedRequest->Size);
+        Request = FspFsctlTransactProduceRequest(Request, RecordedRequest->Size);
+
+        if (!Batch)
+            break;
+    }
+
+    *PRequestBufSize = (PUINT8)Request - (PUINT8)RequestBuf;
+    Result = STATUS_SUCCESS;
+
+exit:
+    LeaveCriticalSection(&DispatcherReplay.Lock);
+
+    return Result;
+}
+
+static NTSTATUS dispatcher_replay_operation(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext = FspFileSystemGetOperationContext();
+
+    if (OperationContext->Request != Request || OperationContext->Response != Response)
+        return STATUS_INVALID_PARAMETER;
+
+    if (0 != DispatcherReplay.OperationDelay)
+        Sleep(DispatcherReplay.OperationDelay);
+
+    /* echo request size back; also touch the whole response buffer */
+    Response->IoStatus.Information = Request->Size;
+    memset(Response->Buffer, 0xaa, FSP_FSCTL_TRANSACT_RSP_BUFFER_SIZEMAX);
+
+    return STATUS_SUCCESS;
+}
+
+static void dispatcher_replay_dotest_ex(ULONG BatchCount, ULONG RequestCount,
+    ULONG ThreadCount, ULONG ThreadCountMax, ULONG OperationDelay)
+{
+    FSP_FSCTL_VOLUME_PARAMS VolumeParams = { 0 };
+    FSP_FILE_SYSTEM *FileSystem;
+    FSP_FSCTL_TRANSACT_REQ *Request;
+    static FSP_FILE_SYSTEM_LATENCY_HISTOGRAM Histogram;
+    FSP_FILE_SYSTEM_DISPATCHER_STATISTICS Statistics;
+    NTSTATUS Result;
+    ULONG Size;
+
+    memset(&DispatcherReplay, 0, sizeof DispatcherReplay);
+    InitializeCriticalSection(&DispatcherReplay.Lock);
+    DispatcherReplay.RequestCount = RequestCount;
+    DispatcherReplay.OperationDelay = OperationDelay;
+    DispatcherReplay.DrainPool = ThreadCount < ThreadCountMax;
+    DispatcherReplay.Requests = calloc(RequestCount, sizeof(FSP_FSCTL_TRANSACT_REQ *));
+    DispatcherReplay.Responded = calloc(RequestCount, 1);
+    ASSERT(0 != DispatcherReplay.Requests);
+    ASSERT(0 != DispatcherReplay.Responded);
+
+    for (ULONG I = 0; RequestCount > I; I++)
+    {
+        Size = sizeof(FSP_FSCTL_TRANSACT_REQ) + rand() % 1024;
+        Request = calloc(1, Size);
+        ASSERT(0 != Request);
+        Request->Size = (UINT16)Size;
+        Request->Kind = FspFsctlTransactQueryInformationKind;
+        Request->Hint = I + 1;
+        DispatcherReplay.Requests[I] = Request;
+    }
+
+    VolumeParams.SectorSize = 16384;
+    VolumeParams.VolumeSerialNumber = 0x12345678;
+    Result = FspFileSystemCreate(L"" FSP_FSCTL_DISK_DEVICE_NAME, &VolumeParams, 0, &FileSystem);
+    ASSERT(NT_SUCCESS(Result));
+
+    FspFileSystemSetOperation(FileSystem,
+        FspFsctlTransactQueryInformationKind, dispatcher_replay_operation);
+    FspFileSystemSetDispatcherBatchCount(FileSystem, BatchCount);
+    FspFileSystemSetTransact(FileSystem, dispatcher_replay_transact);
+    FspFileSystemSetDispatcherThreadCountMax(FileSystem, ThreadCountMax, 1);
+
+    Result = FspFileSystemStartDispatcher(FileSystem, ThreadCount);
+    ASSERT(NT_SUCCESS(Result));
+
+    FspFileSystemStopDispatcher(FileSystem);
+
+    FspFileSystemGetDispatcherResult(FileSystem, &Result);
+    ASSERT(STATUS_CANCELLED == Result);
+
+    Result = FspFileSystemGetDispatcherStatistics(FileSystem, &Statistics);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(0 == Statistics.ThreadCount);
+    ASSERT(0 == Statistics.BusyThreadCount);
+    ASSERT(Statistics.ThreadCountMin <= Statistics.ThreadCountPeak);
+    ASSERT(Statistics.ThreadCountMax >= Statistics.ThreadCountPeak);
+    if (DispatcherReplay.DrainPool)
+    {
+        /* slow operations saturate the minimum threads; the pool must grow and shrink back */
+        ASSERT(Statistics.ThreadCountMin < Statistics.ThreadCountPeak);
+        ASSERT(0 < Statistics.ThreadCreateCount);
+        ASSERT(Statistics.ThreadCreateCount ==
+            Statistics.ThreadExitCount + Statistics.ThreadCreateFailCount);
+    }
+    else
+    {
+        ASSERT(Statistics.ThreadCountMin == Statistics.ThreadCountPeak);
+        ASSERT(0 == Statistics.ThreadCreateCount);
+        ASSERT(0 == Statistics.ThreadExitCount);
+    }
+
+    Result = FspFileSystemGetLatencyHistogram(FileSystem,
+        FspFsctlTransactQueryInformationKind, &Histogram);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(RequestCount == Histogram.Count);
+    Result = FspFileSystemGetLatencyHistogram(FileSystem,
+        FspFsctlTransactReadKind, &Histogram);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(0 == Histogram.Count);
+
+    FspFileSystemDelete(FileSystem);
+
+    ASSERT(RequestCount == DispatcherReplay.RequestIndex);
+    ASSERT(RequestCount == DispatcherReplay.ResponseCount);
+    ASSERT(0 == DispatcherReplay.BogusResponseCount);
+    if (1 < BatchCount)
+    {
+        ASSERT(DispatcherReplay.RoundTripCount == DispatcherReplay.BatchRoundTripCount);
+        ASSERT(DispatcherReplay.RoundTripCount < RequestCount);
+    }
+    else
+    {
+        ASSERT(0 == DispatcherReplay.BatchRoundTripCount);
+        ASSERT(DispatcherReplay.RoundTripCount == RequestCount);
+    }
+
+    FspDebugLog(__FUNCTION__ "(BatchCount=%lu): %lu requests in %lu round-trips; "
+        "threads: min=%lu max=%lu peak=%lu created=%lu exited=%lu\n",
+        BatchCount, RequestCount, DispatcherReplay.RoundTripCount,
+        Statistics.ThreadCountMin, Statistics.ThreadCountMax, Statistics.ThreadCountPeak,
+        (ULONG)Statistics.ThreadCreateCount, (ULONG)Statistics.ThreadExitCount);
+
+    for (ULONG I = 0; RequestCount > I; I++)
+        free(DispatcherReplay.Requests[I]);
+    free(DispatcherReplay.Requests);
+    free(DispatcherReplay.Responded);
+    DeleteCriticalSection(&DispatcherReplay.Lock);
+}
+
+static void dispatcher_replay_dotest(ULONG BatchCount, ULONG RequestCount)
+{
+    dispatcher_replay_dotest_ex(BatchCount, RequestCount, 0, 0, 0);
+}
+
+static void dispatcher_replay_test(void)
+{
+    if (!WinFspDiskTests)
+        return;
+
+    srand((unsigned)time(0));
+
+    dispatcher_replay_dotest(0, 1000);
+    dispatcher_replay_dotest(1, 1000);
+    dispatcher_replay_dotest(4, 1000);
+    dispatcher_replay_dotest(16, 1000);
+    dispatcher_replay_dotest(64, 10000);
+}
+
+static void dispatcher_pool_test(void)
+{
+    if (!WinFspDiskTests)
+        return;
+
+    srand((unsigned)time(0));
+
+    dispatcher_replay_dotest_ex(0, 200, 2, 2, 10);
+    dispatcher_replay_dotest_ex(0, 200, 2, 8, 10);
+    dispatcher_replay_dotest_ex(0, 500, 2, 32, 20);
+}
+
+void dispatcher_tests(void)
+{
+    TEST(dispatcher_replay_test);
+    TEST(dispatcher_pool_test);
+}
@@ -0,0 +1,93 @@
+/**
+ * @file fuse-buf-test.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <fuse/fuse_common.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "winfsp-tests.h"
+
+static void fuse_buf_copy_test(void)
+{
+    char src0[] = "0123456789", src1[] = "abcdef", mem[32];
+    struct fuse_bufvec *srcv;
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(sizeof mem);
+    fuse_ssize_t bytes;
+
+    srcv = malloc(sizeof *srcv + sizeof(struct fuse_buf));
+    ASSERT(0 != srcv);
+    memset(srcv, 0, sizeof *srcv + sizeof(struct fuse_buf));
+    srcv->count = 2;
+    srcv->buf[0].size = 10;
+    srcv->buf[0].mem = src0;
+    srcv->buf[0].fd = -1;
+    srcv->buf[1].size = 6;
+    srcv->buf[1].mem = src1;
+    srcv->buf[1].fd = -1;
+    ASSERT(16 == fuse_buf_size(srcv));
+
+    /* gather two segments into one */
+    memset(mem, 0, sizeof mem);
+    dst.buf[0].mem = mem;
+    bytes = fuse_buf_copy(&dst, srcv, 0);
+    ASSERT(16 == bytes);
+    ASSERT(0 == memcmp(mem, "0123456789abcdef", 16));
+    ASSERT(16 == dst.off);
+    ASSERT(2 == srcv->idx);
+
+    /* destination smaller than the source; the copy stops and can be resumed */
+    srcv->idx = 0;
+    srcv->off = 0;
+    memset(mem, 0, sizeof mem);
+    dst = FUSE_BUFVEC_INIT(12);
+    dst.buf[0].mem = mem;
+    bytes = fuse_buf_copy(&dst, srcv, 0);
+    ASSERT(12 == bytes);
+    ASSERT(0 == memcmp(mem, "0123456789ab", 12));
+    ASSERT(1 == srcv->idx && 2 == srcv->off);
+    dst = FUSE_BUFVEC_INIT(12);
+    dst.buf[0].mem = mem + 12;
+    bytes = fuse_buf_copy(&dst, srcv, 0);
+    ASSERT(4 == bytes);
+    ASSERT(0 == memcmp(mem, "0123456789abcdef", 16));
+
+    free(srcv);
+}
+
+static void fuse_buf_copy_fd_test(void)
+{
+    char mem[16];
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(16);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(sizeof mem);
+    fuse_ssize_t bytes;
+
+    src.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    src.buf[0].fd = 0;
+    dst.buf[0].mem = mem;
+    bytes = fuse_buf_copy(&dst, &src, 0);
+
+    /* native environment: file descriptor buffers are not supported */
+    ASSERT(0 == fsp_fuse_env()->buf_pread);
+    ASSERT(-EINVAL == bytes);
+}
+
+void fuse_buf_tests(void)
+{
+    TEST(fuse_buf_copy_test);
+    TEST(fuse_buf_copy_fd_test);
+}
@@ -0,0 +1,185 @@
+/**
+ * @file fuse-cache-test.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <dll/fuse/fuse_cache.h>
+#include <tlib/testsuite.h>
+#include <errno.h>
+#include <string.h>
+#include <strsafe.h>
+
+#include "winfsp-tests.h"
+
+static int stub_getattr_count;
+static fuse_off_t stub_getattr_size;
+
+static int stub_getattr(const char *path, struct fuse_stat *stbuf)
+{
+    stub_getattr_count++;
+
+    if (0 == strcmp(path, "/file") || 0 == strcmp(path, "/dir"))
+    {
+        memset(stbuf, 0, sizeof *stbuf);
+        stbuf->st_mode = 0 == strcmp(path, "/dir") ? 0040755 : 0100644;
+        stbuf->st_size = stub_getattr_size;
+        return 0;
+    }
+
+    if (0 == strcmp(path, "/eio"))
+        return -EIO;
+
+    return -ENOENT;
+}
+
+static struct fuse_operations stub_ops;
+
+static void fuse_cache_disabled_test(void)
+{
+    struct fsp_fuse_cache cache;
+    struct fuse_stat stbuf;
+
+    fsp_fuse_cache_initialize(&cache, 0, 0, 0);
+    ASSERT(!fsp_fuse_cache_enabled(&cache));
+
+    stub_getattr_count = 0;
+    ASSERT(0 == fsp_fuse_cache_getattr(&cache, &stub_ops, "/file", &stbuf));
+    ASSERT(0 == fsp_fuse_cache_getattr(&cache, &stub_ops, "/file", &stbuf));
+    ASSERT(-ENOENT == fsp_fuse_cache_getattr(&cache, &stub_ops, "/missing", &stbuf));
+    ASSERT(3 == stub_getattr_count);
+    ASSERT(0 == cache.Count);
+
+    fsp_fuse_cache_finalize(&cache);
+}
+
+static void fuse_cache_attr_test(void)
+{
+    struct fsp_fuse_cache cache;
+    struct fuse_stat stbuf;
+
+    fsp_fuse_cache_initialize(&cache, 60000, 0, 0);
+    ASSERT(fsp_fuse_cache_enabled(&cache));
+
+    stub_getattr_count = 0;
+    stub_getattr_size = 42;
+    ASSERT(0 == fsp_fuse_cache_getattr(&cache, &stub_ops, "/file", &stbuf));
+    ASSERT(42 == stbuf.st_size);
+    stub_getattr_size = 43;
+    ASSERT(0 == fsp_fuse_cache_getattr(&cache, &stub_ops, "/file", &stbuf));
+    ASSERT(42 == stbuf.st_size);
+    ASSERT(1 == stub_getattr_count);
+    ASSERT(1 == cache.HitCount && 1 == cache.MissCount);
+
+    /* invalidation is case-insensitive */
+    fsp_fuse_cache_invalidate(&cache, "/FILE");
+    ASSERT(0 == fsp_fuse_cache_getattr(&cache, &stub_ops, "/file", &stbuf));
+    ASSERT(43 == stbuf.st_size);
+    ASSERT(2 == stub_getattr_count);
+
+    /* negative entries and errors are not cached */
+    ASSERT(-ENOENT == fsp_fuse_cache_getattr(&cache, &stub_ops, "/missing", &stbuf));
+    ASSERT(-ENOENT == fsp_fuse_cache_getattr(&cache, &stub_ops, "/missing", &stbuf));
+    ASSERT(-EIO == fsp_fuse_cache_getattr(&cache, &stub_ops, "/eio", &stbuf));
+    ASSERT(-EIO == fsp_fuse_cache_getattr(&cache, &stub_ops, "/eio", &stbuf));
+    ASSERT(6 == stub_getattr_count);
+
+    fsp_fuse_cache_invalidate_all(&cache);
+    ASSERT(0 == cache.Count);
+    ASSERT(0 == fsp_fuse_cache_getattr(&cache, &stub_ops, "/file", &stbuf));
+    ASSERT(7 == stub_getattr_count);
+
+    fsp_fuse_cache_finalize(&cache);
+}
+
+static void fuse_cache_negative_test(void)
+{
+    struct fsp_fuse_cache cache;
+    struct fuse_stat stbuf;
+
+    fsp_fuse_cache_initialize(&cache, 0, 60000, 0);
+
+    stub_getattr_count = 0;
+    ASSERT(-ENOENT == fsp_fuse_cache_getattr(&cache, &stub_ops, "/missing", &stbuf));
+    ASSERT(-ENOENT == fsp_fuse_cache_getattr(&cache, &stub_ops, "/missing", &stbuf));
+    ASSERT(1 == stub_getattr_count);
+    ASSERT(1 == cache.NegativeHitCount);
+
+    /* positive entries are not cached */
+    ASSERT(0 == fsp_fuse_cache_getattr(&cache, &stub_ops, "/file", &stbuf));
+    ASSERT(0 == fsp_fuse_cache_getattr(&cache, &stub_ops, "/file", &stbuf));
+    ASSERT(3 == stub_getattr_count);
+
+    /* a create invalidates the negative entry */
+    fsp_fuse_cache_invalidate(&cache, "/missing");
+    ASSERT(-ENOENT == fsp_fuse_cache_getattr(&cache, &stub_ops, "/missing", &stbuf));
+    ASSERT(4 == stub_getattr_count);
+
+    fsp_fuse_cache_finalize(&cache);
+}
+
+static void fuse_cache_expiration_test(void)
+{
+    struct fsp_fuse_cache cache;
+    struct fuse_stat stbuf;
+
+    fsp_fuse_cache_initialize(&cache, 100, 100, 0);
+
+    stub_getattr_count = 0;
+    ASSERT(0 == fsp_fuse_cache_getattr(&cache, &stub_ops, "/dir", &stbuf));
+    ASSERT(-ENOENT == fsp_fuse_cache_getattr(&cache, &stub_ops, "/missing", &stbuf));
+    ASSERT(0 == fsp_fuse_cache_getattr(&cache, &stub_ops, "/dir", &stbuf));
+    ASSERT(-ENOENT == fsp_fuse_cache_getattr(&cache, &stub_ops, "/missing", &stbuf));
+    ASSERT(2 == stub_getattr_count);
+
+    Sleep(300);
+
+    ASSERT(0 == fsp_fuse_cache_getattr(&cache, &stub_ops, "/dir", &stbuf));
+    ASSERT(-ENOENT == fsp_fuse_cache_getattr(&cache, &stub_ops, "/missing", &stbuf));
+    ASSERT(4 == stub_getattr_count);
+    ASSERT(2 == cache.Count);
+
+    fsp_fuse_cache_finalize(&cache);
+}
+
+static void fuse_cache_capacity_test(void)
+{
+    struct fsp_fuse_cache cache;
+    struct fuse_stat stbuf;
+    char path[32];
+
+    fsp_fuse_cache_initialize(&cache, 0, 60000, 16);
+
+    for (int i = 0; 1000 > i; i++)
+    {
+        StringCbPrintfA(path, sizeof path, "/missing%d", i);
+        ASSERT(-ENOENT == fsp_fuse_cache_getattr(&cache, &stub_ops, path, &stbuf));
+        ASSERT(16 >= cache.Count);
+    }
+    ASSERT(0 < cache.Count);
+
+    fsp_fuse_cache_finalize(&cache);
+    ASSERT(0 == cache.Count);
+}
+
+void fuse_cache_tests(void)
+{
+    stub_ops.getattr = stub_getattr;
+
+    TEST(fuse_cache_disabled_test);
+    TEST(fuse_cache_attr_test);
+    TEST(fuse_cache_negative_test);
+    TEST(fuse_cache_expiration_test);
+    TEST(fuse_cache_capacity_test);
+}
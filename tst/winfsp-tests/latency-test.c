@@ -0,0 +1,71 @@
+/**
+ * @file latency-test.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <winfsp/winfsp.h>
+#include <tlib/testsuite.h>
+
+#include "winfsp-tests.h"
+
+static void latency_histogram_test(void)
+{
+    static FSP_FILE_SYSTEM_LATENCY_HISTOGRAM Histogram;
+    UINT64 Value;
+
+    memset(&Histogram, 0, sizeof Histogram);
+    ASSERT(0 == FspFileSystemLatencyHistogramPercentile(&Histogram, 5000));
+
+    FspFileSystemLatencyHistogramRecord(&Histogram, 100);
+    ASSERT(1 == Histogram.Count);
+    ASSERT(100 == Histogram.Sum);
+    ASSERT(100 == Histogram.Max);
+    ASSERT(100 == FspFileSystemLatencyHistogramPercentile(&Histogram, 5000));
+    ASSERT(100 == FspFileSystemLatencyHistogramPercentile(&Histogram, 10000));
+
+    /* small values are recorded exactly */
+    memset(&Histogram, 0, sizeof Histogram);
+    for (ULONG I = 0; 8 > I; I++)
+        FspFileSystemLatencyHistogramRecord(&Histogram, I);
+    for (ULONG I = 0; 8 > I; I++)
+        ASSERT(1 == Histogram.Buckets[I]);
+    ASSERT(3 == FspFileSystemLatencyHistogramPercentile(&Histogram, 5000));
+    ASSERT(7 == FspFileSystemLatencyHistogramPercentile(&Histogram, 10000));
+
+    /* 1..1000000: percentiles are within the bucket relative error */
+    memset(&Histogram, 0, sizeof Histogram);
+    for (ULONG I = 1; 1000000 >= I; I++)
+        FspFileSystemLatencyHistogramRecord(&Histogram, I);
+    ASSERT(1000000 == Histogram.Count);
+    ASSERT(500000500000ULL == Histogram.Sum);
+    ASSERT(1000000 == Histogram.Max);
+    Value = FspFileSystemLatencyHistogramPercentile(&Histogram, 5000);
+    ASSERT(500000 <= Value && Value <= 500000 + 500000 / 8);
+    Value = FspFileSystemLatencyHistogramPercentile(&Histogram, 9900);
+    ASSERT(990000 <= Value && Value <= 1000000);
+    Value = FspFileSystemLatencyHistogramPercentile(&Histogram, 9990);
+    ASSERT(999000 <= Value && Value <= 1000000);
+
+    /* huge values go into the last bucket */
+    memset(&Histogram, 0, sizeof Histogram);
+    FspFileSystemLatencyHistogramRecord(&Histogram, (UINT64)-1);
+    ASSERT(1 == Histogram.Buckets[FSP_FILE_SYSTEM_LATENCY_BUCKET_COUNT - 1]);
+    ASSERT((UINT64)-1 == FspFileSystemLatencyHistogramPercentile(&Histogram, 9990));
+}
+
+void latency_tests(void)
+{
+    TEST(latency_histogram_test);
+}
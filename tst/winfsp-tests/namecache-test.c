@@ -0,0 +1,324 @@
+/**
+ * @file namecache-test.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <winfsp/winfsp.h>
+#include <tlib/testsuite.h>
+#include <shared/namecache.h>
+
+#include "winfsp-tests.h"
+
+#define ENTRIES(S, P)                   \
+    ((S) * FSP_NAME_CACHE_WAYS * FSP_NAME_CACHE_ENTRY_SIZE(P) / sizeof(UINT64))
+#define LOOKUP(C, P, N, O, T, I)        \
+    FspNameCacheLookup(C, P, (ULONG)wcslen(P), N, (ULONG)wcslen(N), O, T, I)
+#define INSERT(C, P, N, O, I, T, E)     \
+    FspNameCacheInsert(C, P, (ULONG)wcslen(P), N, (ULONG)wcslen(N), O, I, T, E, (C)->Generation)
+
+static const FSP_NAME_CACHE_OWNER NoOwner;
+static const FSP_NAME_CACHE_OWNER Owner1 = { { 1, 2, 3 } };
+static const FSP_NAME_CACHE_OWNER Owner2 = { { 1, 2, 4 } };
+
+static void namecache_lookup_test(void)
+{
+    FSP_NAME_CACHE Cache;
+    UINT64 Entries[ENTRIES(4, 0)];
+    WCHAR LongName[FSP_NAME_CACHE_NAME_MAX + 2];
+    ULONG Generation;
+
+    FspNameCacheInitialize(&Cache, 4, 0, FALSE, Entries);
+
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"file", &NoOwner, 10, 0));
+    ASSERT(INSERT(&Cache, L"\\dir", L"file", &NoOwner, 0, 10, 100));
+    ASSERT(LOOKUP(&Cache, L"\\dir", L"file", &NoOwner, 10, 0));
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"FILE", &NoOwner, 10, 0));
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"fil", &NoOwner, 10, 0));
+    ASSERT(!LOOKUP(&Cache, L"\\Dir", L"file", &NoOwner, 10, 0));
+    ASSERT(!LOOKUP(&Cache, L"", L"file", &NoOwner, 10, 0));
+    ASSERT(1 == Cache.HitCount && 5 == Cache.MissCount && 1 == Cache.InsertCount);
+
+    /* expiration */
+    ASSERT(LOOKUP(&Cache, L"\\dir", L"file", &NoOwner, 99, 0));
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"file", &NoOwner, 100, 0));
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"file", &NoOwner, 10, 0));
+    ASSERT(!INSERT(&Cache, L"\\dir", L"file", &NoOwner, 0, 100, 100));
+
+    /* name length limits */
+    for (ULONG I = 0; FSP_NAME_CACHE_NAME_MAX > I; I++)
+        LongName[I] = L'a' + I % 26;
+    LongName[FSP_NAME_CACHE_NAME_MAX] = L'\0';
+    ASSERT(INSERT(&Cache, L"\\dir", LongName, &NoOwner, 0, 10, 100));
+    ASSERT(LOOKUP(&Cache, L"\\dir", LongName, &NoOwner, 10, 0));
+    LongName[FSP_NAME_CACHE_NAME_MAX] = L'z';
+    LongName[FSP_NAME_CACHE_NAME_MAX + 1] = L'\0';
+    ASSERT(!INSERT(&Cache, L"\\dir", LongName, &NoOwner, 0, 10, 100));
+    ASSERT(!LOOKUP(&Cache, L"\\dir", LongName, &NoOwner, 10, 0));
+    ASSERT(!INSERT(&Cache, L"\\dir", L"", &NoOwner, 0, 10, 100));
+
+    /* an insertion that raced with an invalidation is rejected */
+    Generation = Cache.Generation;
+    FspNameCacheInvalidateAll(&Cache);
+    ASSERT(!FspNameCacheInsert(&Cache, L"\\dir", 4, L"file", 4, &NoOwner, 0, 10, 100, Generation));
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"file", &NoOwner, 10, 0));
+    ASSERT(FspNameCacheInsert(&Cache, L"\\dir", 4, L"file", 4, &NoOwner, 0, 10, 100, Cache.Generation));
+    ASSERT(LOOKUP(&Cache, L"\\dir", L"file", &NoOwner, 10, 0));
+}
+
+static void namecache_case_test(void)
+{
+    FSP_NAME_CACHE Cache;
+    UINT64 Entries[ENTRIES(4, 0)];
+
+    FspNameCacheInitialize(&Cache, 4, 0, TRUE, Entries);
+
+    ASSERT(INSERT(&Cache, L"\\Dir", L"File", &NoOwner, 0, 10, 100));
+    ASSERT(LOOKUP(&Cache, L"\\dir", L"FILE", &NoOwner, 10, 0));
+    ASSERT(LOOKUP(&Cache, L"\\DIR", L"file", &NoOwner, 10, 0));
+
+    /* non-ASCII names are compared exactly */
+    ASSERT(INSERT(&Cache, L"\\Dir", L"\x00e9t\x00e9", &NoOwner, 0, 10, 100));
+    ASSERT(LOOKUP(&Cache, L"\\dir", L"\x00e9T\x00e9", &NoOwner, 10, 0));
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"\x00c9t\x00e9", &NoOwner, 10, 0));
+
+    /* non-ASCII parents are never cached */
+    ASSERT(!INSERT(&Cache, L"\\\x00e9t\x00e9", L"file", &NoOwner, 0, 10, 100));
+    ASSERT(!LOOKUP(&Cache, L"\\\x00e9t\x00e9", L"file", &NoOwner, 10, 0));
+
+    /* ... and their invalidation invalidates everything */
+    FspNameCacheInvalidateParent(&Cache, L"\\\x00e9t\x00e9", 4);
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"file", &NoOwner, 10, 0));
+
+    FspNameCacheInitialize(&Cache, 4, 0, FALSE, Entries);
+    ASSERT(INSERT(&Cache, L"\\\x00e9t\x00e9", L"file", &NoOwner, 0, 10, 100));
+    ASSERT(LOOKUP(&Cache, L"\\\x00e9t\x00e9", L"file", &NoOwner, 10, 0));
+    ASSERT(!LOOKUP(&Cache, L"\\\x00c9t\x00e9", L"file", &NoOwner, 10, 0));
+}
+
+static void namecache_invalidate_test(void)
+{
+    FSP_NAME_CACHE Cache;
+    UINT64 Entries[ENTRIES(16, 0)];
+    UINT32 Generation;
+
+    FspNameCacheInitialize(&Cache, 16, 0, TRUE, Entries);
+
+    ASSERT(INSERT(&Cache, L"\\a", L"x", &NoOwner, 0, 10, 100));
+    ASSERT(INSERT(&Cache, L"\\a", L"y", &NoOwner, 0, 10, 100));
+    ASSERT(INSERT(&Cache, L"\\b", L"x", &NoOwner, 0, 10, 100));
+
+    Generation = Cache.Generation;
+    FspNameCacheInvalidateParent(&Cache, L"\\A", 2);
+    ASSERT(Generation != Cache.Generation);
+    ASSERT(!LOOKUP(&Cache, L"\\a", L"x", &NoOwner, 10, 0));
+    ASSERT(!LOOKUP(&Cache, L"\\a", L"y", &NoOwner, 10, 0));
+    ASSERT(LOOKUP(&Cache, L"\\b", L"x", &NoOwner, 10, 0));
+
+    FspNameCacheInvalidateAll(&Cache);
+    ASSERT(!LOOKUP(&Cache, L"\\b", L"x", &NoOwner, 10, 0));
+    ASSERT(2 == Cache.InvalidateCount);
+}
+
+static void namecache_replace_test(void)
+{
+    FSP_NAME_CACHE Cache;
+    UINT64 Entries[ENTRIES(1, 0)];
+    WCHAR Name[2] = L"a";
+    ULONG HitCount;
+
+    /* a single set; insertion replaces the entry that expires first */
+    FspNameCacheInitialize(&Cache, 1, 0, FALSE, Entries);
+
+    for (ULONG I = 0; FSP_NAME_CACHE_WAYS > I; I++)
+    {
+        Name[0] = L'a' + (WCHAR)I;
+        ASSERT(INSERT(&Cache, L"\\", Name, &NoOwner, 0, 10, 100 + I));
+    }
+    ASSERT(INSERT(&Cache, L"\\", L"z", &NoOwner, 0, 10, 200));
+    ASSERT(!LOOKUP(&Cache, L"\\", L"a", &NoOwner, 10, 0));
+    ASSERT(LOOKUP(&Cache, L"\\", L"b", &NoOwner, 10, 0));
+    ASSERT(LOOKUP(&Cache, L"\\", L"z", &NoOwner, 10, 0));
+
+    /* expired entries are replaced first */
+    ASSERT(INSERT(&Cache, L"\\", L"y", &NoOwner, 0, 150, 300));
+    ASSERT(LOOKUP(&Cache, L"\\", L"z", &NoOwner, 150, 0));
+    ASSERT(LOOKUP(&Cache, L"\\", L"y", &NoOwner, 150, 0));
+
+    /* reinsertion refreshes an existing entry */
+    ASSERT(INSERT(&Cache, L"\\", L"z", &NoOwner, 0, 150, 400));
+    ASSERT(LOOKUP(&Cache, L"\\", L"z", &NoOwner, 350, 0));
+    ASSERT(!LOOKUP(&Cache, L"\\", L"y", &NoOwner, 350, 0));
+
+    /* many names in a small cache: no false hits */
+    FspNameCacheInitialize(&Cache, 1, 0, FALSE, Entries);
+    for (ULONG I = 0; 26 > I; I++)
+    {
+        Name[0] = L'a' + (WCHAR)I;
+        ASSERT(INSERT(&Cache, L"\\", Name, &NoOwner, 0, 10, 100));
+    }
+    HitCount = 0;
+    for (ULONG I = 0; 26 > I; I++)
+    {
+        Name[0] = L'a' + (WCHAR)I;
+        HitCount += LOOKUP(&Cache, L"\\", Name, &NoOwner, 10, 0);
+    }
+    ASSERT(FSP_NAME_CACHE_WAYS == HitCount);
+}
+
+static void namecache_payload_test(void)
+{
+    FSP_NAME_CACHE Cache;
+    UINT64 Entries[ENTRIES(4, sizeof(FSP_FSCTL_FILE_INFO))];
+    FSP_FSCTL_FILE_INFO FileInfo, LookupInfo;
+    UINT32 Generation;
+
+    FspNameCacheInitialize(&Cache, 4, sizeof(FSP_FSCTL_FILE_INFO), FALSE, Entries);
+
+    memset(&FileInfo, 0, sizeof FileInfo);
+    FileInfo.FileAttributes = FILE_ATTRIBUTE_ARCHIVE;
+    FileInfo.FileSize = 42;
+    FileInfo.LastWriteTime = 0x1234;
+
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"file", &Owner1, 10, &LookupInfo));
+    ASSERT(INSERT(&Cache, L"\\dir", L"file", &Owner1, &FileInfo, 10, 100));
+    memset(&LookupInfo, 0, sizeof LookupInfo);
+    ASSERT(LOOKUP(&Cache, L"\\dir", L"file", &Owner1, 10, &LookupInfo));
+    ASSERT(0 == memcmp(&FileInfo, &LookupInfo, sizeof FileInfo));
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"FILE", &Owner1, 10, &LookupInfo));
+    ASSERT(!LOOKUP(&Cache, L"\\Dir", L"file", &Owner1, 10, &LookupInfo));
+    ASSERT(1 == Cache.HitCount && 3 == Cache.MissCount && 1 == Cache.InsertCount);
+
+    /* only the owner can look up an entry */
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"file", &Owner2, 10, &LookupInfo));
+    ASSERT(LOOKUP(&Cache, L"\\dir", L"file", &Owner1, 10, &LookupInfo));
+
+    /* reinsertion by another owner takes the entry over */
+    FileInfo.FileSize = 43;
+    ASSERT(INSERT(&Cache, L"\\dir", L"file", &Owner2, &FileInfo, 10, 100));
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"file", &Owner1, 10, &LookupInfo));
+    ASSERT(LOOKUP(&Cache, L"\\dir", L"file", &Owner2, 10, &LookupInfo));
+    ASSERT(43 == LookupInfo.FileSize);
+
+    /* expiration */
+    ASSERT(LOOKUP(&Cache, L"\\dir", L"file", &Owner2, 99, &LookupInfo));
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"file", &Owner2, 100, &LookupInfo));
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"file", &Owner2, 10, &LookupInfo));
+    ASSERT(!INSERT(&Cache, L"\\dir", L"file", &Owner2, &FileInfo, 100, 100));
+
+    /* an insertion that raced with an invalidation is rejected */
+    Generation = Cache.Generation;
+    FspNameCacheInvalidateName(&Cache, L"\\dir", 4, L"other", 5);
+    ASSERT(!FspNameCacheInsert(&Cache, L"\\dir", 4, L"file", 4, &Owner1, &FileInfo, 10, 100, Generation));
+    ASSERT(!LOOKUP(&Cache, L"\\dir", L"file", &Owner1, 10, &LookupInfo));
+    ASSERT(INSERT(&Cache, L"\\dir", L"file", &Owner1, &FileInfo, 10, 100));
+    ASSERT(LOOKUP(&Cache, L"\\dir", L"file", &Owner1, 10, &LookupInfo));
+}
+
+static void namecache_invalidate_name_test(void)
+{
+    FSP_NAME_CACHE Cache;
+    UINT64 Entries[ENTRIES(16, sizeof(FSP_FSCTL_FILE_INFO))];
+    FSP_FSCTL_FILE_INFO FileInfo, LookupInfo;
+
+    FspNameCacheInitialize(&Cache, 16, sizeof(FSP_FSCTL_FILE_INFO), TRUE, Entries);
+    memset(&FileInfo, 0, sizeof FileInfo);
+
+    ASSERT(INSERT(&Cache, L"\\a", L"x", &Owner1, &FileInfo, 10, 100));
+    ASSERT(INSERT(&Cache, L"\\a", L"y", &Owner1, &FileInfo, 10, 100));
+    ASSERT(INSERT(&Cache, L"\\b", L"x", &Owner1, &FileInfo, 10, 100));
+    ASSERT(LOOKUP(&Cache, L"\\A", L"X", &Owner1, 10, &LookupInfo));
+
+    /* a single name */
+    FspNameCacheInvalidateName(&Cache, L"\\A", 2, L"X", 1);
+    ASSERT(!LOOKUP(&Cache, L"\\a", L"x", &Owner1, 10, &LookupInfo));
+    ASSERT(LOOKUP(&Cache, L"\\a", L"y", &Owner1, 10, &LookupInfo));
+    ASSERT(LOOKUP(&Cache, L"\\b", L"x", &Owner1, 10, &LookupInfo));
+
+    /* a name that cannot be folded invalidates its parent */
+    FspNameCacheInvalidateName(&Cache, L"\\a", 2, L"\x00e9", 1);
+    ASSERT(!LOOKUP(&Cache, L"\\a", L"y", &Owner1, 10, &LookupInfo));
+    ASSERT(LOOKUP(&Cache, L"\\b", L"x", &Owner1, 10, &LookupInfo));
+
+    /* a parent that cannot be folded invalidates everything */
+    ASSERT(INSERT(&Cache, L"\\a", L"y", &Owner1, &FileInfo, 10, 100));
+    FspNameCacheInvalidateName(&Cache, L"\\\x00e9", 2, L"x", 1);
+    ASSERT(!LOOKUP(&Cache, L"\\a", L"y", &Owner1, 10, &LookupInfo));
+    ASSERT(!LOOKUP(&Cache, L"\\b", L"x", &Owner1, 10, &LookupInfo));
+
+    ASSERT(INSERT(&Cache, L"\\a", L"x", &Owner1, &FileInfo, 10, 100));
+    ASSERT(INSERT(&Cache, L"\\b", L"x", &Owner1, &FileInfo, 10, 100));
+    FspNameCacheInvalidateParent(&Cache, L"\\B", 2);
+    ASSERT(LOOKUP(&Cache, L"\\a", L"x", &Owner1, 10, &LookupInfo));
+    ASSERT(!LOOKUP(&Cache, L"\\b", L"x", &Owner1, 10, &LookupInfo));
+
+    FspNameCacheInvalidateAll(&Cache);
+    ASSERT(!LOOKUP(&Cache, L"\\a", L"x", &Owner1, 10, &LookupInfo));
+    ASSERT(5 == Cache.InvalidateCount);
+}
+
+static void namecache_replace_payload_test(void)
+{
+    FSP_NAME_CACHE Cache;
+    UINT64 Entries[ENTRIES(1, sizeof(FSP_FSCTL_FILE_INFO))];
+    FSP_FSCTL_FILE_INFO FileInfo, LookupInfo;
+    WCHAR Name[2] = L"a";
+    ULONG HitCount;
+
+    /* a single set; insertion replaces the entry that expires first */
+    FspNameCacheInitialize(&Cache, 1, sizeof(FSP_FSCTL_FILE_INFO), FALSE, Entries);
+    memset(&FileInfo, 0, sizeof FileInfo);
+
+    for (ULONG I = 0; FSP_NAME_CACHE_WAYS > I; I++)
+    {
+        Name[0] = L'a' + (WCHAR)I;
+        FileInfo.FileSize = I;
+        ASSERT(INSERT(&Cache, L"\\", Name, &Owner1, &FileInfo, 10, 100 + I));
+    }
+    ASSERT(INSERT(&Cache, L"\\", L"z", &Owner1, &FileInfo, 10, 200));
+    ASSERT(!LOOKUP(&Cache, L"\\", L"a", &Owner1, 10, &LookupInfo));
+    ASSERT(LOOKUP(&Cache, L"\\", L"b", &Owner1, 10, &LookupInfo));
+    ASSERT(1 == LookupInfo.FileSize);
+
+    /* many names in a small cache: no false hits */
+    FspNameCacheInitialize(&Cache, 1, sizeof(FSP_FSCTL_FILE_INFO), FALSE, Entries);
+    for (ULONG I = 0; 26 > I; I++)
+    {
+        Name[0] = L'a' + (WCHAR)I;
+        FileInfo.FileSize = I;
+        ASSERT(INSERT(&Cache, L"\\", Name, &Owner1, &FileInfo, 10, 100));
+    }
+    HitCount = 0;
+    for (ULONG I = 0; 26 > I; I++)
+    {
+        Name[0] = L'a' + (WCHAR)I;
+        if (LOOKUP(&Cache, L"\\", Name, &Owner1, 10, &LookupInfo))
+        {
+            ASSERT(I == LookupInfo.FileSize);
+            HitCount++;
+        }
+    }
+    ASSERT(FSP_NAME_CACHE_WAYS == HitCount);
+}
+
+void namecache_tests(void)
+{
+    TEST(namecache_lookup_test);
+    TEST(namecache_case_test);
+    TEST(namecache_invalidate_test);
+    TEST(namecache_replace_test);
+    TEST(namecache_payload_test);
+    TEST(namecache_invalidate_name_test);
+    TEST(namecache_replace_payload_test);
+}
@@ -0,0 +1,407 @@
+/**
+ * @file opguard-test.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <winfsp/winfsp.h>
+#include <dll/opguard.h>
+#include <tlib/testsuite.h>
+#include <strsafe.h>
+
+#include "winfsp-tests.h"
+
+static struct
+{
+    FSP_FILE_SYSTEM *FileSystem;
+    ULONG IterationCount;
+    volatile LONG SharedCount, ExclusiveCount;
+    volatile LONG SharedPeak, ViolationCount;
+} OpGuard;
+
+static DWORD WINAPI opguard_thread(PVOID Param)
+{
+    FSP_FSCTL_TRANSACT_REQ OpenRequest, RenameRequest, ReadRequest, *Request;
+    ULONG Seed = (ULONG)(UINT_PTR)Param;
+    LONG Count;
+
+    memset(&OpenRequest, 0, sizeof OpenRequest);
+    OpenRequest.Kind = FspFsctlTransactCreateKind;
+    OpenRequest.Req.Create.CreateOptions = FILE_OPEN << 24;
+    memset(&RenameRequest, 0, sizeof RenameRequest);
+    RenameRequest.Kind = FspFsctlTransactSetInformationKind;
+    RenameRequest.Req.SetInformation.FileInformationClass = 10/*FileRenameInformation*/;
+    memset(&ReadRequest, 0, sizeof ReadRequest);
+    ReadRequest.Kind = FspFsctlTransactReadKind;
+
+    for (ULONG I = 0; OpGuard.IterationCount > I; I++)
+    {
+        Seed = Seed * 1103515245 + 12345;
+        switch ((Seed >> 16) % 64)
+        {
+        case 0:
+            Request = &RenameRequest;
+            FspFileSystemOpEnter(OpGuard.FileSystem, Request, 0);
+            if (1 != InterlockedIncrement(&OpGuard.ExclusiveCount) || 0 != OpGuard.SharedCount)
+                InterlockedIncrement(&OpGuard.ViolationCount);
+            YieldProcessor();
+            InterlockedDecrement(&OpGuard.ExclusiveCount);
+            break;
+        case 1:
+            /* NONE operations are not guarded */
+            Request = &ReadRequest;
+            FspFileSystemOpEnter(OpGuard.FileSystem, Request, 0);
+            break;
+        default:
+            Request = &OpenRequest;
+            FspFileSystemOpEnter(OpGuard.FileSystem, Request, 0);
+            Count = InterlockedIncrement(&OpGuard.SharedCount);
+            if (0 != OpGuard.ExclusiveCount)
+                InterlockedIncrement(&OpGuard.ViolationCount);
+            if (Count > OpGuard.SharedPeak)
+                InterlockedExchange(&OpGuard.SharedPeak, Count);
+            YieldProcessor();
+            InterlockedDecrement(&OpGuard.SharedCount);
+            break;
+        }
+        FspFileSystemOpLeave(OpGuard.FileSystem, Request, 0);
+    }
+
+    return 0;
+}
+
+static void opguard_dotest(FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY GuardStrategy)
+{
+    FSP_FSCTL_VOLUME_PARAMS VolumeParams = { 0 };
+    HANDLE Threads[8];
+    NTSTATUS Result;
+
+    memset(&OpGuard, 0, sizeof OpGuard);
+    OpGuard.IterationCount = 20000;
+
+    VolumeParams.SectorSize = 16384;
+    VolumeParams.VolumeSerialNumber = 0x12345678;
+    Result = FspFileSystemCreate(L"" FSP_FSCTL_DISK_DEVICE_NAME, &VolumeParams, 0,
+        &OpGuard.FileSystem);
+    ASSERT(NT_SUCCESS(Result));
+
+    FspFileSystemSetOperationGuardStrategy(OpGuard.FileSystem, GuardStrategy);
+
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        Threads[I] = CreateThread(0, 0, opguard_thread, (PVOID)(UINT_PTR)(I + 1), 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        CloseHandle(Threads[I]);
+    }
+
+    ASSERT(0 == OpGuard.SharedCount);
+    ASSERT(0 == OpGuard.ExclusiveCount);
+    ASSERT(0 == OpGuard.ViolationCount);
+
+    FspDebugLog(__FUNCTION__ "(GuardStrategy=%d): shared peak=%ld\n",
+        (int)GuardStrategy, (LONG)OpGuard.SharedPeak);
+
+    FspFileSystemDelete(OpGuard.FileSystem);
+}
+
+typedef union
+{
+    FSP_FSCTL_TRANSACT_REQ V;
+    UINT8 B[sizeof(FSP_FSCTL_TRANSACT_REQ) + 256 * sizeof(WCHAR)];
+} OPGUARD_REQUEST;
+
+static FSP_FSCTL_TRANSACT_REQ *opguard_request(OPGUARD_REQUEST *RequestBuf,
+    UINT32 Kind, ULONG Option, PWSTR FileName, PWSTR NewFileName)
+{
+    FSP_FSCTL_TRANSACT_REQ *Request = &RequestBuf->V;
+
+    memset(RequestBuf, 0, sizeof *RequestBuf);
+    Request->Kind = Kind;
+    switch (Kind)
+    {
+    case FspFsctlTransactCreateKind:
+        Request->Req.Create.CreateOptions = Option << 24;
+        break;
+    case FspFsctlTransactCleanupKind:
+        Request->Req.Cleanup.Delete = 1;
+        break;
+    case FspFsctlTransactSetInformationKind:
+        Request->Req.SetInformation.FileInformationClass = Option;
+        break;
+    case FspFsctlTransactOverwriteKind:
+        Request->Req.Overwrite.UserContext = Option;
+        break;
+    }
+    if (0 != FileName)
+    {
+        Request->FileName.Size = (UINT16)((wcslen(FileName) + 1) * sizeof(WCHAR));
+        memcpy(Request->Buffer, FileName, Request->FileName.Size);
+    }
+    if (0 != NewFileName)
+    {
+        Request->Req.SetInformation.Info.Rename.NewFileName.Offset = Request->FileName.Size;
+        Request->Req.SetInformation.Info.Rename.NewFileName.Size =
+            (UINT16)((wcslen(NewFileName) + 1) * sizeof(WCHAR));
+        memcpy(Request->Buffer + Request->FileName.Size, NewFileName,
+            Request->Req.SetInformation.Info.Rename.NewFileName.Size);
+    }
+
+    return Request;
+}
+
+static BOOLEAN opguard_conflict(FSP_FSCTL_TRANSACT_REQ *Request1, FSP_FSCTL_TRANSACT_REQ *Request2)
+{
+    FSP_OPGUARD_STRIPE_MASK Mask1, Mask2;
+
+    FspOpGuardStripeMaskFromRequest(&Mask1, Request1);
+    FspOpGuardStripeMaskFromRequest(&Mask2, Request2);
+
+    return
+        0 != (Mask1.Exclusive & (Mask2.Shared | Mask2.Exclusive)) ||
+        0 != (Mask2.Exclusive & (Mask1.Shared | Mask1.Exclusive));
+}
+
+static void opguard_stripe_model_test(void)
+{
+    OPGUARD_REQUEST B1, B2;
+    FSP_OPGUARD_STRIPE_MASK Mask;
+
+    /* opens do not conflict with each other */
+    ASSERT(!opguard_conflict(
+        opguard_request(&B1, FspFsctlTransactCreateKind, FILE_OPEN, L"\\a\\x", 0),
+        opguard_request(&B2, FspFsctlTransactCreateKind, FILE_OPEN, L"\\a\\x", 0)));
+
+    /* a create conflicts with an open in the same directory */
+    ASSERT(opguard_conflict(
+        opguard_request(&B1, FspFsctlTransactCreateKind, FILE_CREATE, L"\\a\\x", 0),
+        opguard_request(&B2, FspFsctlTransactCreateKind, FILE_OPEN, L"\\a\\y", 0)));
+
+    /* directory names are case-insensitive */
+    ASSERT(opguard_conflict(
+        opguard_request(&B1, FspFsctlTransactCreateKind, FILE_CREATE, L"\\a\\x", 0),
+        opguard_request(&B2, FspFsctlTransactCreateKind, FILE_CREATE, L"\\A\\y", 0)));
+
+    /* a named stream is guarded like its main file */
+    ASSERT(opguard_conflict(
+        opguard_request(&B1, FspFsctlTransactCreateKind, FILE_CREATE, L"\\a\\x:s", 0),
+        opguard_request(&B2, FspFsctlTransactCreateKind, FILE_CREATE, L"\\a\\y", 0)));
+
+    /* creates in different directories do not conflict (these names do not collide) */
+    ASSERT(!opguard_conflict(
+        opguard_request(&B1, FspFsctlTransactCreateKind, FILE_CREATE, L"\\a\\x", 0),
+        opguard_request(&B2, FspFsctlTransactCreateKind, FILE_CREATE, L"\\b\\y", 0)));
+
+    /* a directory cannot be deleted or renamed while there is an operation below it */
+    ASSERT(opguard_conflict(
+        opguard_request(&B1, FspFsctlTransactCleanupKind, 0, L"\\a", 0),
+        opguard_request(&B2, FspFsctlTransactCreateKind, FILE_OPEN, L"\\a\\b\\c", 0)));
+    ASSERT(opguard_conflict(
+        opguard_request(&B1, FspFsctlTransactSetInformationKind, 10, L"\\a", L"\\b"),
+        opguard_request(&B2, FspFsctlTransactCreateKind, FILE_OPEN, L"\\a\\b\\c", 0)));
+    ASSERT(opguard_conflict(
+        opguard_request(&B1, FspFsctlTransactSetInformationKind, 10, L"\\b\\y", L"\\a\\x"),
+        opguard_request(&B2, FspFsctlTransactCreateKind, FILE_OPEN, L"\\a\\y", 0)));
+
+    /* a delete check conflicts with creates in the directory */
+    ASSERT(opguard_conflict(
+        opguard_request(&B1, FspFsctlTransactSetInformationKind, 13, L"\\a", 0),
+        opguard_request(&B2, FspFsctlTransactCreateKind, FILE_CREATE, L"\\a\\x", 0)));
+
+    /* directory queries conflict with all namespace changes, but not with opens */
+    ASSERT(opguard_conflict(
+        opguard_request(&B1, FspFsctlTransactQueryDirectoryKind, 0, 0, 0),
+        opguard_request(&B2, FspFsctlTransactCreateKind, FILE_CREATE, L"\\b\\y", 0)));
+    ASSERT(opguard_conflict(
+        opguard_request(&B1, FspFsctlTransactQueryDirectoryKind, 0, 0, 0),
+        opguard_request(&B2, FspFsctlTransactOverwriteKind, 42, 0, 0)));
+    ASSERT(!opguard_conflict(
+        opguard_request(&B1, FspFsctlTransactQueryDirectoryKind, 0, 0, 0),
+        opguard_request(&B2, FspFsctlTransactCreateKind, FILE_OPEN, L"\\b\\y", 0)));
+
+    /* read and write are not guarded */
+    FspOpGuardStripeMaskFromRequest(&Mask,
+        opguard_request(&B1, FspFsctlTransactReadKind, 0, 0, 0));
+    ASSERT(0 == Mask.Shared && 0 == Mask.Exclusive);
+
+    /* the root directory has no parent; opening it locks nothing but itself */
+    FspOpGuardStripeMaskFromRequest(&Mask,
+        opguard_request(&B1, FspFsctlTransactSetInformationKind, 13, L"\\", 0));
+    ASSERT(0 == Mask.Exclusive);
+    ASSERT(0 != Mask.Shared && 0 == (Mask.Shared & (Mask.Shared - 1)));
+}
+
+#define OPGUARD_DIRECTORY_COUNT         4
+static PWSTR OpGuardDirectories[OPGUARD_DIRECTORY_COUNT] =
+{
+    L"\\", L"\\a", L"\\b", L"\\a\\c"
+};
+static struct
+{
+    volatile LONG Readers[OPGUARD_DIRECTORY_COUNT], Writers[OPGUARD_DIRECTORY_COUNT];
+} OpGuardStriped;
+
+static VOID opguard_striped_read(ULONG Index)
+{
+    InterlockedIncrement(&OpGuardStriped.Readers[Index]);
+    if (0 != OpGuardStriped.Writers[Index])
+        InterlockedIncrement(&OpGuard.ViolationCount);
+}
+
+static VOID opguard_striped_write(ULONG Index)
+{
+    if (1 != InterlockedIncrement(&OpGuardStriped.Writers[Index]) ||
+        0 != OpGuardStriped.Readers[Index])
+        InterlockedIncrement(&OpGuard.ViolationCount);
+}
+
+static DWORD WINAPI opguard_striped_thread(PVOID Param)
+{
+    OPGUARD_REQUEST RequestBuf;
+    FSP_FSCTL_TRANSACT_REQ *Request;
+    WCHAR FileName[64];
+    ULONG Seed = (ULONG)(UINT_PTR)Param, Op, Index;
+
+    for (ULONG I = 0; OpGuard.IterationCount > I; I++)
+    {
+        Seed = Seed * 1103515245 + 12345;
+        Op = (Seed >> 16) % 16;
+        Index = (Seed >> 24) % OPGUARD_DIRECTORY_COUNT;
+        StringCbPrintfW(FileName, sizeof FileName, L"%s%sf%u",
+            OpGuardDirectories[Index], 0 == Index ? L"" : L"\\", (Seed >> 8) % 4);
+
+        if (0 == Op)
+        {
+            /* rename a directory between parents; nothing may happen below it */
+            Request = opguard_request(&RequestBuf, FspFsctlTransactSetInformationKind,
+                10, L"\\a\\c", L"\\b\\c");
+            FspFileSystemOpEnter(OpGuard.FileSystem, Request, 0);
+            opguard_striped_write(1);
+            opguard_striped_write(2);
+            opguard_striped_write(3);
+            YieldProcessor();
+            InterlockedDecrement(&OpGuardStriped.Writers[3]);
+            InterlockedDecrement(&OpGuardStriped.Writers[2]);
+            InterlockedDecrement(&OpGuardStriped.Writers[1]);
+        }
+        else if (1 == Op)
+        {
+            Request = opguard_request(&RequestBuf, FspFsctlTransactQueryDirectoryKind,
+                0, 0, 0);
+            FspFileSystemOpEnter(OpGuard.FileSystem, Request, 0);
+            opguard_striped_read(Index);
+            YieldProcessor();
+            InterlockedDecrement(&OpGuardStriped.Readers[Index]);
+        }
+        else if (8 > Op)
+        {
+            Request = opguard_request(&RequestBuf, FspFsctlTransactCreateKind,
+                FILE_CREATE, FileName, 0);
+            FspFileSystemOpEnter(OpGuard.FileSystem, Request, 0);
+            opguard_striped_write(Index);
+            if (3 == Index)
+                opguard_striped_read(1);
+            YieldProcessor();
+            if (3 == Index)
+                InterlockedDecrement(&OpGuardStriped.Readers[1]);
+            InterlockedDecrement(&OpGuardStriped.Writers[Index]);
+        }
+        else
+        {
+            Request = opguard_request(&RequestBuf, FspFsctlTransactCreateKind,
+                FILE_OPEN, FileName, 0);
+            FspFileSystemOpEnter(OpGuard.FileSystem, Request, 0);
+            opguard_striped_read(Index);
+            YieldProcessor();
+            InterlockedDecrement(&OpGuardStriped.Readers[Index]);
+        }
+        FspFileSystemOpLeave(OpGuard.FileSystem, Request, 0);
+    }
+
+    return 0;
+}
+
+static void opguard_striped_stress_test(void)
+{
+    FSP_FSCTL_VOLUME_PARAMS VolumeParams = { 0 };
+    HANDLE Threads[8];
+    NTSTATUS Result;
+
+    memset(&OpGuard, 0, sizeof OpGuard);
+    memset(&OpGuardStriped, 0, sizeof OpGuardStriped);
+    OpGuard.IterationCount = 20000;
+
+    VolumeParams.SectorSize = 16384;
+    VolumeParams.VolumeSerialNumber = 0x12345678;
+    Result = FspFileSystemCreate(L"" FSP_FSCTL_DISK_DEVICE_NAME, &VolumeParams, 0,
+        &OpGuard.FileSystem);
+    ASSERT(NT_SUCCESS(Result));
+
+    FspFileSystemSetOperationGuardStrategy(OpGuard.FileSystem,
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED);
+
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        Threads[I] = CreateThread(0, 0, opguard_striped_thread, (PVOID)(UINT_PTR)(I + 1), 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        CloseHandle(Threads[I]);
+    }
+
+    for (ULONG I = 0; OPGUARD_DIRECTORY_COUNT > I; I++)
+    {
+        ASSERT(0 == OpGuardStriped.Readers[I]);
+        ASSERT(0 == OpGuardStriped.Writers[I]);
+    }
+    ASSERT(0 == OpGuard.ViolationCount);
+
+    FspFileSystemDelete(OpGuard.FileSystem);
+}
+
+static void opguard_fine_test(void)
+{
+    opguard_dotest(FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE);
+}
+
+static void opguard_coarse_test(void)
+{
+    opguard_dotest(FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE);
+}
+
+static void opguard_epoch_test(void)
+{
+    opguard_dotest(FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_EPOCH);
+}
+
+static void opguard_striped_test(void)
+{
+    /* the requests carry no file names; the striped strategy must lock all stripes */
+    opguard_dotest(FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED);
+}
+
+void opguard_tests(void)
+{
+    TEST(opguard_fine_test);
+    TEST(opguard_coarse_test);
+    TEST(opguard_epoch_test);
+    TEST(opguard_striped_test);
+    TEST(opguard_stripe_model_test);
+    TEST(opguard_striped_stress_test);
+}
@@ -0,0 +1,261 @@
+/**
+ * @file pattern-test.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <winfsp/winfsp.h>
+#include <tlib/testsuite.h>
+#include <shared/pattern.h>
+
+#include "winfsp-tests.h"
+
+/*
+ * Reference matcher: a direct (backtracking) transcription of the FsRtlIsNameInExpression
+ * wildcard rules. The expression is assumed upcased when CaseInsensitive.
+ */
+static BOOLEAN pattern_ref_match(PWSTR Expr, PWSTR ExprEnd, PWSTR Name, PWSTR NameEnd,
+    PWSTR LastDot, BOOLEAN CaseInsensitive)
+{
+    WCHAR C;
+
+    if (ExprEnd == Expr)
+        return NameEnd == Name;
+
+    switch (*Expr)
+    {
+    case L'*':
+    case L'<':
+        for (PWSTR P = Name;; P++)
+        {
+            if (pattern_ref_match(Expr + 1, ExprEnd, P, NameEnd, LastDot, CaseInsensitive))
+                return TRUE;
+            if (NameEnd == P || (L'<' == *Expr && LastDot == P))
+                return FALSE;
+        }
+    case L'?':
+        return NameEnd != Name &&
+            pattern_ref_match(Expr + 1, ExprEnd, Name + 1, NameEnd, LastDot, CaseInsensitive);
+    case L'>':
+        if (NameEnd == Name || L'.' == *Name)
+            return pattern_ref_match(Expr + 1, ExprEnd, Name, NameEnd, LastDot, CaseInsensitive);
+        return pattern_ref_match(Expr + 1, ExprEnd, Name + 1, NameEnd, LastDot, CaseInsensitive);
+    case L'"':
+        if (NameEnd == Name)
+            return pattern_ref_match(Expr + 1, ExprEnd, Name, NameEnd, LastDot, CaseInsensitive);
+        return L'.' == *Name &&
+            pattern_ref_match(Expr + 1, ExprEnd, Name + 1, NameEnd, LastDot, CaseInsensitive);
+    default:
+        if (NameEnd == Name)
+            return FALSE;
+        C = *Name;
+        if (CaseInsensitive && L'a' <= C && C <= L'z')
+            C -= L'a' - L'A';
+        return *Expr == C &&
+            pattern_ref_match(Expr + 1, ExprEnd, Name + 1, NameEnd, LastDot, CaseInsensitive);
+    }
+}
+
+static BOOLEAN pattern_ref(PWSTR Expr, ULONG ExprLength, PWSTR Name, ULONG NameLength,
+    BOOLEAN CaseInsensitive)
+{
+    PWSTR LastDot = 0;
+
+    for (ULONG I = 0; NameLength > I; I++)
+        if (L'.' == Name[I])
+            LastDot = Name + I;
+
+    return pattern_ref_match(Expr, Expr + ExprLength, Name, Name + NameLength,
+        LastDot, CaseInsensitive);
+}
+
+/*
+ * System matcher: ntdll's RtlIsNameInExpression, which implements the same semantics as
+ * FsRtlIsNameInExpression. The expression is assumed upcased when CaseInsensitive.
+ * RtlIsNameInExpression does not accept empty names, which are therefore not compared.
+ */
+typedef BOOLEAN NTAPI RtlIsNameInExpression_t(
+    PUNICODE_STRING Expression, PUNICODE_STRING Name, BOOLEAN IgnoreCase, PWCH UpcaseTable);
+static RtlIsNameInExpression_t *pattern_sys_fn;
+
+static BOOLEAN pattern_sys(PWSTR Expr, ULONG ExprLength, PWSTR Name, ULONG NameLength,
+    BOOLEAN CaseInsensitive, PBOOLEAN PResult)
+{
+    UNICODE_STRING ExprString, NameString;
+
+    if (0 == pattern_sys_fn)
+        pattern_sys_fn = (RtlIsNameInExpression_t *)(UINT_PTR)
+            GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "RtlIsNameInExpression");
+    ASSERT(0 != pattern_sys_fn);
+
+    if (0 == NameLength)
+        return FALSE;
+
+    ExprString.Length = ExprString.MaximumLength = (USHORT)(ExprLength * sizeof(WCHAR));
+    ExprString.Buffer = Expr;
+    NameString.Length = NameString.MaximumLength = (USHORT)(NameLength * sizeof(WCHAR));
+    NameString.Buffer = Name;
+    *PResult = pattern_sys_fn(&ExprString, &NameString, CaseInsensitive, 0);
+
+    return TRUE;
+}
+
+static BOOLEAN pattern_match(PWSTR Expr, PWSTR Name, BOOLEAN CaseInsensitive)
+{
+    FSP_PATTERN Pattern;
+    ULONG ExprLength = (ULONG)wcslen(Expr), NameLength = (ULONG)wcslen(Name);
+    BOOLEAN Result, SysResult;
+
+    ASSERT(FspPatternCompile(&Pattern, Expr, ExprLength, CaseInsensitive, 0));
+    Result = FspPatternMatch(&Pattern, Name, NameLength);
+
+    /* the expected results below must agree with the system */
+    if (pattern_sys(Expr, ExprLength, Name, NameLength, CaseInsensitive, &SysResult))
+        ASSERT(SysResult == Result);
+
+    return Result;
+}
+
+static void pattern_compile_test(void)
+{
+    FSP_PATTERN Pattern;
+    WCHAR LongExpr[FSP_PATTERN_LENGTH_MAX + 2];
+
+    ASSERT(FspPatternCompile(&Pattern, L"ABC", 3, FALSE, 0));
+    ASSERT(FspPatternLiteral == Pattern.Kind && 3 == Pattern.Length);
+    ASSERT(FspPatternCompile(&Pattern, L"ABC*", 4, FALSE, 0));
+    ASSERT(FspPatternPrefix == Pattern.Kind && 3 == Pattern.Length);
+    ASSERT(FspPatternCompile(&Pattern, L"*", 1, FALSE, 0));
+    ASSERT(FspPatternPrefix == Pattern.Kind && 0 == Pattern.Length);
+    ASSERT(FspPatternCompile(&Pattern, L"*.TXT", 5, FALSE, 0));
+    ASSERT(FspPatternSuffix == Pattern.Kind && 4 == Pattern.Length);
+    ASSERT(FspPatternCompile(&Pattern, L"A*B", 3, FALSE, 0));
+    ASSERT(FspPatternGeneral == Pattern.Kind);
+    ASSERT(FspPatternCompile(&Pattern, L"**", 2, FALSE, 0));
+    ASSERT(FspPatternGeneral == Pattern.Kind);
+    ASSERT(FspPatternCompile(&Pattern, L"<.TXT", 5, FALSE, 0));
+    ASSERT(FspPatternGeneral == Pattern.Kind);
+
+    for (ULONG I = 0; FSP_PATTERN_LENGTH_MAX + 1 > I; I++)
+        LongExpr[I] = L'?';
+    LongExpr[FSP_PATTERN_LENGTH_MAX + 1] = L'\0';
+    ASSERT(FspPatternCompile(&Pattern, LongExpr, FSP_PATTERN_LENGTH_MAX, FALSE, 0));
+    ASSERT(!FspPatternCompile(&Pattern, LongExpr, FSP_PATTERN_LENGTH_MAX + 1, FALSE, 0));
+}
+
+static void pattern_match_test(void)
+{
+    /* fast paths */
+    ASSERT(pattern_match(L"FILE.TXT", L"file.txt", TRUE));
+    ASSERT(!pattern_match(L"FILE.TXT", L"file.txt", FALSE));
+    ASSERT(!pattern_match(L"FILE.TXT", L"FILE.TX", FALSE));
+    ASSERT(pattern_match(L"FILE*", L"File.txt", TRUE));
+    ASSERT(pattern_match(L"FILE*", L"FILE", FALSE));
+    ASSERT(!pattern_match(L"FILE*", L"FIL", FALSE));
+    ASSERT(pattern_match(L"*.TXT", L"a.b.txt", TRUE));
+    ASSERT(pattern_match(L"*.TXT", L".TXT", FALSE));
+    ASSERT(!pattern_match(L"*.TXT", L"a.txt.b", TRUE));
+    ASSERT(pattern_match(L"*", L"", FALSE));
+    ASSERT(pattern_match(L"", L"", FALSE));
+    ASSERT(!pattern_match(L"", L"a", FALSE));
+
+    /* general */
+    ASSERT(pattern_match(L"A*B", L"AB", FALSE));
+    ASSERT(pattern_match(L"A*B", L"AXXB", FALSE));
+    ASSERT(!pattern_match(L"A*B", L"AXXBC", FALSE));
+    ASSERT(pattern_match(L"A?C", L"ABC", FALSE));
+    ASSERT(!pattern_match(L"A?C", L"AC", FALSE));
+    ASSERT(pattern_match(L"*A*A*A*", L"XAXAXAX", FALSE));
+    ASSERT(!pattern_match(L"*A*A*A*", L"XAXAX", FALSE));
+
+    /* DOS_STAR: cannot consume the last dot */
+    ASSERT(pattern_match(L"<", L"abc", TRUE));
+    ASSERT(!pattern_match(L"<", L"a.b", TRUE));
+    ASSERT(pattern_match(L"<.B", L"a.b", TRUE));
+    ASSERT(pattern_match(L"<.C", L"a.b.c", TRUE));
+    ASSERT(!pattern_match(L"<.B", L"a.b.c", TRUE));
+    ASSERT(pattern_match(L"<\"*", L"a.b.c", TRUE));
+
+    /* DOS_QM: one character, or none at a dot or the end */
+    ASSERT(pattern_match(L">>>", L"ab", TRUE));
+    ASSERT(pattern_match(L">>>.TXT", L"ab.txt", TRUE));
+    ASSERT(!pattern_match(L">>.TXT", L"abc.txt", TRUE));
+    ASSERT(!pattern_match(L">", L".", TRUE));
+    ASSERT(pattern_match(L">.", L".", TRUE));
+
+    /* DOS_DOT: a dot, or nothing at the end */
+    ASSERT(pattern_match(L"ABC\"", L"abc", TRUE));
+    ASSERT(pattern_match(L"ABC\"", L"abc.", TRUE));
+    ASSERT(!pattern_match(L"ABC\"", L"abcd", TRUE));
+    ASSERT(pattern_match(L"ABC\"*", L"abc.txt", TRUE));
+}
+
+static WCHAR pattern_upcase(WCHAR C)
+{
+    return 0xe0 <= C && C <= 0xfe && 0xf7 != C ? C - 0x20 : C;
+}
+
+static void pattern_upcase_test(void)
+{
+    FSP_PATTERN Pattern;
+
+    ASSERT(FspPatternCompile(&Pattern, L"\x00c9T\x00c9*", 4, TRUE, pattern_upcase));
+    ASSERT(FspPatternMatch(&Pattern, L"\x00e9t\x00e9.txt", 7));
+    ASSERT(FspPatternCompile(&Pattern, L"\x00c9T\x00c9*", 4, TRUE, 0));
+    ASSERT(!FspPatternMatch(&Pattern, L"\x00e9t\x00e9.txt", 7));
+    ASSERT(FspPatternCompile(&Pattern, L"?\x00c9", 2, TRUE, pattern_upcase));
+    ASSERT(FspPatternMatch(&Pattern, L"a\x00e9", 2));
+    ASSERT(FspPatternCompile(&Pattern, L"?\x00c9", 2, FALSE, pattern_upcase));
+    ASSERT(!FspPatternMatch(&Pattern, L"a\x00e9", 2));
+}
+
+static void pattern_fuzz_test(void)
+{
+    static const WCHAR ExprChars[] = L"AB.*?<>\"";
+    static const WCHAR NameChars[] = L"aAbB.";
+    FSP_PATTERN Pattern;
+    WCHAR Expr[12], Name[16];
+    ULONG ExprLength, NameLength;
+    BOOLEAN CaseInsensitive, Result, SysResult;
+    UINT32 Seed = 42;
+
+#define RAND()                          (Seed = Seed * 1103515245 + 12345, (Seed >> 16) & 0x7fff)
+    for (ULONG Iter = 0; 200000 > Iter; Iter++)
+    {
+        CaseInsensitive = 0 != (Iter & 1);
+        ExprLength = RAND() % (sizeof Expr / sizeof Expr[0]);
+        for (ULONG I = 0; ExprLength > I; I++)
+            Expr[I] = ExprChars[RAND() % (sizeof ExprChars / sizeof ExprChars[0] - 1)];
+        NameLength = RAND() % (sizeof Name / sizeof Name[0]);
+        for (ULONG I = 0; NameLength > I; I++)
+            Name[I] = NameChars[RAND() % (sizeof NameChars / sizeof NameChars[0] - 1)];
+
+        ASSERT(FspPatternCompile(&Pattern, Expr, ExprLength, CaseInsensitive, 0));
+        Result = FspPatternMatch(&Pattern, Name, NameLength);
+
+        /* compare against the system first, so that the reference matcher is checked too */
+        if (pattern_sys(Expr, ExprLength, Name, NameLength, CaseInsensitive, &SysResult))
+            ASSERT(SysResult == Result);
+        ASSERT(pattern_ref(Expr, ExprLength, Name, NameLength, CaseInsensitive) == Result);
+    }
+#undef RAND
+}
+
+void pattern_tests(void)
+{
+    TEST(pattern_compile_test);
+    TEST(pattern_match_test);
+    TEST(pattern_upcase_test);
+    TEST(pattern_fuzz_test);
+}
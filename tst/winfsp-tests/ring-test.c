@@ -0,0 +1,154 @@
+/**
+ * @file ring-test.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <winfsp/winfsp.h>
+#include <tlib/testsuite.h>
+#include <shared/ring.h>
+
+#include "winfsp-tests.h"
+
+static void ring_alloc_test(void)
+{
+    FSP_RING Ring;
+    UINT32 BlockLength[16];
+    UINT32 Index, I0, I1, I2;
+
+    FspRingInitialize(&Ring, 16, BlockLength);
+
+    ASSERT(!FspRingAllocate(&Ring, 0, &Index));
+    ASSERT(!FspRingAllocate(&Ring, 17, &Index));
+
+    /* in-order allocation and release */
+    ASSERT(FspRingAllocate(&Ring, 4, &I0));
+    ASSERT(0 == I0);
+    ASSERT(FspRingAllocate(&Ring, 4, &I1));
+    ASSERT(4 == I1);
+    ASSERT(8 == Ring.Used);
+    FspRingRelease(&Ring, I0);
+    ASSERT(4 == Ring.Tail);
+    FspRingRelease(&Ring, I1);
+    ASSERT(0 == Ring.Used && 0 == Ring.Head && 0 == Ring.Tail);
+
+    /* full ring */
+    ASSERT(FspRingAllocate(&Ring, 16, &I0));
+    ASSERT(0 == I0);
+    ASSERT(!FspRingAllocate(&Ring, 1, &Index));
+    FspRingRelease(&Ring, I0);
+    ASSERT(0 == Ring.Used);
+
+    /* out-of-order release delays reuse */
+    ASSERT(FspRingAllocate(&Ring, 8, &I0));
+    ASSERT(FspRingAllocate(&Ring, 8, &I1));
+    ASSERT(8 == I1);
+    FspRingRelease(&Ring, I1);
+    ASSERT(16 == Ring.Used);
+    ASSERT(!FspRingAllocate(&Ring, 1, &Index));
+    FspRingRelease(&Ring, I0);
+    ASSERT(0 == Ring.Used && 0 == Ring.Head && 0 == Ring.Tail);
+
+    /* wrap around with a skip allocation at the end */
+    ASSERT(FspRingAllocate(&Ring, 6, &I0));
+    ASSERT(FspRingAllocate(&Ring, 6, &I1));
+    ASSERT(6 == I1);
+    FspRingRelease(&Ring, I0);
+    ASSERT(6 == Ring.Tail);
+    ASSERT(!FspRingAllocate(&Ring, 7, &Index));
+    ASSERT(FspRingAllocate(&Ring, 5, &I2));
+    ASSERT(0 == I2);
+    ASSERT(6 + 4 + 5 == Ring.Used);
+    ASSERT(!FspRingAllocate(&Ring, 2, &Index));
+    ASSERT(FspRingAllocate(&Ring, 1, &Index));
+    ASSERT(5 == Index);
+    ASSERT(16 == Ring.Used);
+    FspRingRelease(&Ring, I1);
+    ASSERT(0 == Ring.Tail);
+    ASSERT(6 == Ring.Used);
+    FspRingRelease(&Ring, Index);
+    FspRingRelease(&Ring, I2);
+    ASSERT(0 == Ring.Used && 0 == Ring.Head && 0 == Ring.Tail);
+}
+
+static void ring_fuzz_test(void)
+{
+    enum { BlockCount = 64, Rounds = 100000, LiveMax = 32 };
+    FSP_RING Ring;
+    static UINT32 BlockLength[BlockCount];
+    static BOOLEAN Occupied[BlockCount];
+    UINT32 LiveIndex[LiveMax], LiveBlocks[LiveMax], LiveCount = 0;
+    UINT32 Index, Blocks, Used;
+
+    srand(42);
+
+    FspRingInitialize(&Ring, BlockCount, BlockLength);
+    memset(Occupied, 0, sizeof Occupied);
+
+    for (ULONG R = 0; Rounds > R; R++)
+    {
+        if (LiveMax > LiveCount && 0 != rand() % 3)
+        {
+            Blocks = 1 + rand() % (BlockCount / 4);
+            if (FspRingAllocate(&Ring, Blocks, &Index))
+            {
+                ASSERT(Index + Blocks <= BlockCount);
+                for (UINT32 I = Index; Index + Blocks > I; I++)
+                {
+                    ASSERT(!Occupied[I]);
+                    Occupied[I] = TRUE;
+                }
+                LiveIndex[LiveCount] = Index;
+                LiveBlocks[LiveCount] = Blocks;
+                LiveCount++;
+            }
+            else
+                ASSERT(0 != LiveCount);
+        }
+        else if (0 != LiveCount)
+        {
+            UINT32 L = rand() % LiveCount;
+            FspRingRelease(&Ring, LiveIndex[L]);
+            for (UINT32 I = LiveIndex[L]; LiveIndex[L] + LiveBlocks[L] > I; I++)
+                Occupied[I] = FALSE;
+            LiveCount--;
+            LiveIndex[L] = LiveIndex[LiveCount];
+            LiveBlocks[L] = LiveBlocks[LiveCount];
+        }
+
+        /* the ring never accounts for fewer blocks than are actually live */
+        Used = 0;
+        for (UINT32 L = 0; LiveCount > L; L++)
+            Used += LiveBlocks[L];
+        ASSERT(Used <= Ring.Used);
+        ASSERT(Ring.Used <= BlockCount);
+        if (0 == LiveCount)
+            ASSERT(0 == Ring.Used && 0 == Ring.Head && 0 == Ring.Tail);
+    }
+
+    while (0 != LiveCount)
+    {
+        LiveCount--;
+        FspRingRelease(&Ring, LiveIndex[LiveCount]);
+    }
+    ASSERT(0 == Ring.Used);
+    ASSERT(FspRingAllocate(&Ring, BlockCount, &Index));
+    ASSERT(0 == Index);
+}
+
+void ring_tests(void)
+{
+    TEST(ring_alloc_test);
+    TEST(ring_fuzz_test);
+}
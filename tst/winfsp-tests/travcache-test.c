@@ -0,0 +1,162 @@
+/**
+ * @file travcache-test.c
+ *
+ * @copyright 2015-2017 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <winfsp/winfsp.h>
+#include <sddl.h>
+#include <tlib/testsuite.h>
+
+#include "winfsp-tests.h"
+
+static ULONG travcache_GetSecurityByNameCount;
+
+static NTSTATUS travcache_GetSecurityByName(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, PUINT32 PFileAttributes,
+    PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T *PSecurityDescriptorSize)
+{
+    PSECURITY_DESCRIPTOR Sd;
+    ULONG SdSize;
+    BOOLEAN Denied = 0 == wcscmp(FileName, L"\\a\\denied");
+    NTSTATUS Result;
+
+    travcache_GetSecurityByNameCount++;
+
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(
+        Denied ? L"O:BAG:BAD:P" : L"O:BAG:BAD:P(A;;FA;;;WD)", SDDL_REVISION_1, &Sd, &SdSize))
+        return FspNtStatusFromWin32(GetLastError());
+
+    if (0 != PFileAttributes)
+        *PFileAttributes = 0 != wcsstr(FileName, L"file") ?
+            FILE_ATTRIBUTE_NORMAL : FILE_ATTRIBUTE_DIRECTORY;
+
+    if (0 != PSecurityDescriptorSize)
+    {
+        if (SdSize > *PSecurityDescriptorSize)
+        {
+            *PSecurityDescriptorSize = SdSize;
+            Result = STATUS_BUFFER_OVERFLOW;
+            goto exit;
+        }
+        *PSecurityDescriptorSize = SdSize;
+        if (0 != SecurityDescriptor)
+            memcpy(SecurityDescriptor, Sd, SdSize);
+    }
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    LocalFree(Sd);
+
+    return Result;
+}
+
+static FSP_FILE_SYSTEM_INTERFACE travcache_Interface;
+
+static NTSTATUS travcache_AccessCheck(FSP_FILE_SYSTEM *FileSystem, HANDLE Token, PWSTR FileName)
+{
+    union
+    {
+        FSP_FSCTL_TRANSACT_REQ V;
+        UINT8 B[sizeof(FSP_FSCTL_TRANSACT_REQ) + 256 * sizeof(WCHAR)];
+    } RequestBuf;
+    FSP_FSCTL_TRANSACT_REQ *Request = &RequestBuf.V;
+    UINT32 GrantedAccess;
+
+    memset(&RequestBuf, 0, sizeof RequestBuf);
+    Request->Kind = FspFsctlTransactCreateKind;
+    Request->Req.Create.UserMode = 1;
+    Request->Req.Create.HasTraversePrivilege = 0;
+    Request->Req.Create.AccessToken = (UINT_PTR)Token;
+    Request->FileName.Size = (UINT16)((wcslen(FileName) + 1) * sizeof(WCHAR));
+    memcpy(Request->Buffer, FileName, Request->FileName.Size);
+
+    return FspAccessCheckEx(FileSystem, Request, FALSE, TRUE,
+        FILE_READ_DATA, &GrantedAccess, 0);
+}
+
+static void traverse_check_cache_test(void)
+{
+    FSP_FILE_SYSTEM FileSystem;
+    HANDLE ProcessToken, Token;
+    NTSTATUS Result;
+    BOOL Success;
+
+    Success = OpenProcessToken(GetCurrentProcess(), TOKEN_DUPLICATE | TOKEN_QUERY, &ProcessToken);
+    ASSERT(Success);
+    Success = DuplicateToken(ProcessToken, SecurityIdentification, &Token);
+    ASSERT(Success);
+    CloseHandle(ProcessToken);
+
+    memset(&FileSystem, 0, sizeof FileSystem);
+    travcache_Interface.GetSecurityByName = travcache_GetSecurityByName;
+    FileSystem.Interface = &travcache_Interface;
+
+    /* without a cache every check goes to the file system */
+    travcache_GetSecurityByNameCount = 0;
+    Result = travcache_AccessCheck(&FileSystem, Token, L"\\a\\b\\c\\file");
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(5 == travcache_GetSecurityByNameCount);
+    Result = travcache_AccessCheck(&FileSystem, Token, L"\\a\\b\\c\\file");
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(10 == travcache_GetSecurityByNameCount);
+
+    Result = FspFileSystemSetTraverseCheckCacheTimeout(&FileSystem, 60000);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(0 != FileSystem.TraverseCheckCache);
+
+    /* the first check fills the cache, the second one only looks up the file itself */
+    travcache_GetSecurityByNameCount = 0;
+    Result = travcache_AccessCheck(&FileSystem, Token, L"\\a\\b\\c\\file");
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(5 == travcache_GetSecurityByNameCount);
+    Result = travcache_AccessCheck(&FileSystem, Token, L"\\a\\b\\c\\file");
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(6 == travcache_GetSecurityByNameCount);
+
+    /* invalidating a directory discards it and its descendants, but not its ancestors */
+    FspFileSystemInvalidateTraverseCheckCache(&FileSystem, L"\\a\\b");
+    travcache_GetSecurityByNameCount = 0;
+    Result = travcache_AccessCheck(&FileSystem, Token, L"\\a\\b\\c\\file");
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(3 == travcache_GetSecurityByNameCount);
+
+    /* a denied traverse check is cached as well */
+    travcache_GetSecurityByNameCount = 0;
+    Result = travcache_AccessCheck(&FileSystem, Token, L"\\a\\denied\\file");
+    ASSERT(STATUS_ACCESS_DENIED == Result);
+    ASSERT(1 == travcache_GetSecurityByNameCount);
+    Result = travcache_AccessCheck(&FileSystem, Token, L"\\a\\denied\\d\\file");
+    ASSERT(STATUS_ACCESS_DENIED == Result);
+    ASSERT(1 == travcache_GetSecurityByNameCount);
+
+    /* invalidating everything */
+    FspFileSystemInvalidateTraverseCheckCache(&FileSystem, 0);
+    travcache_GetSecurityByNameCount = 0;
+    Result = travcache_AccessCheck(&FileSystem, Token, L"\\a\\b\\c\\file");
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(5 == travcache_GetSecurityByNameCount);
+
+    Result = FspFileSystemSetTraverseCheckCacheTimeout(&FileSystem, 0);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(0 == FileSystem.TraverseCheckCache);
+
+    CloseHandle(Token);
+}
+
+void traverse_check_cache_tests(void)
+{
+    TEST(traverse_check_cache_test);
+}
@@ -180,13 +180,23 @@ LONG WINAPI UnhandledExceptionHandler(struct _EXCEPTION_POINTERS *ExceptionInfo)
 int main(int argc, char *argv[])
 {
     TESTSUITE(fuse_opt_tests);
+    TESTSUITE(fuse_buf_tests);
+    TESTSUITE(fuse_cache_tests);
+    TESTSUITE(traverse_check_cache_tests);
     TESTSUITE(posix_tests);
     TESTSUITE(eventlog_tests);
     TESTSUITE(path_tests);
     TESTSUITE(dirbuf_tests);
     TESTSUITE(version_tests);
     TESTSUITE(mount_tests);
+    TESTSUITE(dispatcher_tests);
+    TESTSUITE(opguard_tests);
+    TESTSUITE(latency_tests);
+    TESTSUITE(ring_tests);
+    TESTSUITE(namecache_tests);
+    TESTSUITE(pattern_tests);
     TESTSUITE(timeout_tests);
+    TESTSUITE(async_tests);
     TESTSUITE(memfs_tests);
     TESTSUITE(create_tests);
     TESTSUITE(info_tests);